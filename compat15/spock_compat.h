@@ -16,6 +16,7 @@
 #include "access/heapam.h"
 #include "access/table.h"
 #include "access/tableam.h"
+#include "storage/shm_mq.h"
 #include "utils/varlena.h"
 
 #define WaitLatchOrSocket(latch, wakeEvents, sock, timeout) \
@@ -97,4 +98,7 @@
 
 #define getObjectDescription(object) getObjectDescription(object, false)
 
+#define shm_mq_sendv(mqh, iov, iovcnt, nowait) \
+	shm_mq_sendv(mqh, iov, iovcnt, nowait, true)
+
 #endif
@@ -81,6 +81,30 @@ CREATE FUNCTION spock.show_subscription_status(subscription_name name DEFAULT NU
     OUT forward_origins text[])
 RETURNS SETOF record STABLE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_show_subscription_status';
 
+CREATE FUNCTION spock.get_subscription_stats(
+    OUT sub_id oid, OUT worker_type text, OUT pid integer,
+    OUT inserts bigint, OUT updates bigint, OUT deletes bigint,
+    OUT transactions bigint, OUT bytes_received bigint,
+    OUT multi_insert_flushes bigint, OUT conflicts bigint, OUT errors bigint,
+    OUT batch_frames bigint, OUT compressed_frames bigint,
+    OUT multi_insert_messages bigint, OUT partial_updates bigint,
+    OUT partial_messages bigint,
+    OUT last_commit_time timestamptz, OUT last_remote_commit_time timestamptz)
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_subscription_stats';
+
+CREATE VIEW spock.stat_subscription AS
+    SELECT s.sub_name, st.*
+      FROM spock.get_subscription_stats() st
+      JOIN spock.subscription s ON s.sub_id = st.sub_id;
+
+CREATE FUNCTION spock.get_apply_timing(
+    OUT sub_id oid, OUT worker_type text, OUT pid integer, OUT phase text,
+    OUT calls bigint, OUT total_time double precision, OUT histogram bigint[])
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_apply_timing';
+
+CREATE FUNCTION spock.reset_apply_timing()
+RETURNS void VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_reset_apply_timing';
+
 CREATE TABLE spock.replication_set (
     set_id oid NOT NULL PRIMARY KEY,
     set_nodeid oid NOT NULL,
@@ -50,6 +50,8 @@
 
 #include "pgstat.h"
 
+#include "spock_apply_parallel.h"
+#include "spock_compress.h"
 #include "spock_executor.h"
 #include "spock_node.h"
 #include "spock_conflict.h"
@@ -69,6 +71,18 @@ static const struct config_enum_entry SpockConflictResolvers[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry SpockCompressionOptions[] = {
+	{"none", SPOCK_COMPRESSION_NONE, false},
+	{"off", SPOCK_COMPRESSION_NONE, true},
+#ifdef USE_LZ4
+	{"lz4", SPOCK_COMPRESSION_LZ4, false},
+#endif
+#ifdef USE_ZSTD
+	{"zstd", SPOCK_COMPRESSION_ZSTD, false},
+#endif
+	{NULL, 0, false}
+};
+
 /* copied fom guc.c */
 static const struct config_enum_entry server_message_level_options[] = {
 	{"debug", DEBUG2, true},
@@ -91,6 +105,20 @@ bool	spock_synchronous_commit = false;
 char   *spock_temp_directory = "";
 bool	spock_use_spi = false;
 bool	spock_batch_inserts = true;
+bool	spock_batch_updates = false;
+int		spock_apply_parallel_workers = 0;
+bool	spock_stream_transactions = false;
+bool	spock_multi_insert_messages = false;
+bool	spock_changed_columns_only = false;
+bool	spock_type_names = false;
+bool	spock_partial_messages = false;
+int		spock_receive_buffer_size = 16384;
+bool	spock_spool_received_changes = false;
+bool	spock_track_apply_timing = false;
+int		spock_message_batch_size = 0;
+int		spock_compression = SPOCK_COMPRESSION_NONE;
+int		spock_group_commit_size = 1;
+int		spock_group_commit_timeout = 100;
 static char *spock_temp_directory_config;
 
 void _PG_init(void);
@@ -565,6 +593,38 @@ spock_start_replication(PGconn *streamConn, const char *slot_name,
 	/* Tell the upstream that we want unbounded metadata cache size */
 	appendStringInfoString(&command, ", \"relmeta_cache_size\" '-1'");
 
+	/* Older upstreams ignore this and only send committed transactions */
+	if (spock_stream_transactions)
+		appendStringInfoString(&command, ", \"spock.streaming\" 'true'");
+
+	/* Older upstreams ignore this and send an INSERT for every row */
+	if (spock_multi_insert_messages)
+		appendStringInfoString(&command, ", \"spock.multi_insert\" 'true'");
+
+	/* Older upstreams ignore this and send all columns of updated rows */
+	if (spock_changed_columns_only)
+		appendStringInfoString(&command, ", \"spock.changed_columns_only\" 'true'");
+
+	/*
+	 * Older upstreams ignore this and send arrays and composites of
+	 * non-builtin types as text
+	 */
+	if (spock_type_names && !force_text_transfer)
+		appendStringInfoString(&command, ", \"spock.type_names\" 'true'");
+
+	/* Older upstreams ignore this and send large values in one message */
+	if (spock_partial_messages)
+		appendStringInfoString(&command, ", \"spock.partial_messages\" 'true'");
+
+	/* Older upstreams ignore this and send every message on its own */
+	if (spock_message_batch_size > 0)
+		appendStringInfo(&command, ", \"spock.batch_size\" '%d'",
+						 spock_message_batch_size * 1024);
+
+	if (spock_compression != SPOCK_COMPRESSION_NONE)
+		appendStringInfo(&command, ", \"spock.compression\" '%s'",
+						 spock_compression_name(spock_compression));
+
 	/* general info about the downstream */
 	appendStringInfo(&command, ", pg_version '%u'", PG_VERSION_NUM);
 	appendStringInfo(&command, ", spock_version '%s'", SPOCK_VERSION);
@@ -811,6 +871,132 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("spock.batch_updates",
+							 "Apply runs of updates and deletes in key order",
+							 NULL,
+							 &spock_batch_updates,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.apply_parallel_workers",
+							"Number of parallel workers used to apply changes of each subscription",
+							NULL,
+							&spock_apply_parallel_workers,
+							0, 0, SPOCK_PARALLEL_APPLY_MAX_WORKERS,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.receive_buffer_size",
+							"Memory used to buffer received changes which were not applied yet",
+							NULL,
+							&spock_receive_buffer_size,
+							16384, 64, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.spool_received_changes",
+							 "Keep received changes on disk until they are applied",
+							 NULL,
+							 &spock_spool_received_changes,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.track_apply_timing",
+							 "Collect histograms of the time spent in the phases of apply",
+							 NULL,
+							 &spock_track_apply_timing,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.group_commit_size",
+							"Maximum number of remote transactions applied in one local transaction",
+							NULL,
+							&spock_group_commit_size,
+							1, 1, 100000,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.group_commit_timeout",
+							"Maximum time a local transaction keeps applying remote transactions",
+							NULL,
+							&spock_group_commit_timeout,
+							100, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.message_batch_size",
+							"Ask the provider to send changes in batches of up to this size",
+							NULL,
+							&spock_message_batch_size,
+							0, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("spock.compression",
+							 "Ask the provider to compress the changes it sends with this method",
+							 NULL,
+							 &spock_compression,
+							 SPOCK_COMPRESSION_NONE,
+							 SpockCompressionOptions,
+							 PGC_SIGHUP, 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.stream_transactions",
+							 "Ask the provider to stream large transactions before they commit",
+							 NULL,
+							 &spock_stream_transactions,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.multi_insert_messages",
+							 "Ask the provider to send consecutive inserts into a table in one message",
+							 NULL,
+							 &spock_multi_insert_messages,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.changed_columns_only",
+							 "Ask the provider to leave out the unchanged columns of updated rows",
+							 NULL,
+							 &spock_changed_columns_only,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.type_names",
+							 "Ask the provider to send arrays and composites of non-builtin types in binary",
+							 NULL,
+							 &spock_type_names,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.partial_messages",
+							 "Ask the provider to send messages with large values in pieces",
+							 NULL,
+							 &spock_partial_messages,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
 	/*
 	 * We can't use the temp_tablespace safely for our dumps, because Pg's
 	 * crash recovery is very careful to delete only particularly formatted
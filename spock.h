@@ -41,6 +41,20 @@ extern bool spock_synchronous_commit;
 extern char *spock_temp_directory;
 extern bool spock_use_spi;
 extern bool spock_batch_inserts;
+extern bool spock_batch_updates;
+extern int spock_apply_parallel_workers;
+extern bool spock_stream_transactions;
+extern bool spock_multi_insert_messages;
+extern bool spock_changed_columns_only;
+extern bool spock_type_names;
+extern bool spock_partial_messages;
+extern int spock_receive_buffer_size;
+extern bool spock_spool_received_changes;
+extern bool spock_track_apply_timing;
+extern int spock_message_batch_size;
+extern int spock_compression;
+extern int spock_group_commit_size;
+extern int spock_group_commit_timeout;
 extern char *spock_extra_connection_options;
 
 extern char *shorten_hash(const char *str, int maxlen);
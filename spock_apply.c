@@ -69,6 +69,7 @@
 #include "spock_conflict.h"
 #include "spock_executor.h"
 #include "spock_node.h"
+#include "spock_proto_native.h"
 #include "spock_queue.h"
 #include "spock_relcache.h"
 #include "spock_repset.h"
@@ -77,11 +78,17 @@
 #include "spock_worker.h"
 #include "spock_apply.h"
 #include "spock_apply_heap.h"
+#include "spock_apply_parallel.h"
+#include "spock_apply_recv.h"
+#include "spock_apply_spool.h"
+#include "spock_apply_stream.h"
 #include "spock_apply_spi.h"
+#include "spock_compress.h"
 #include "spock.h"
 
 
 void spock_apply_main(Datum main_arg);
+void spock_apply_parallel_main(Datum main_arg);
 
 static bool			in_remote_transaction = false;
 static XLogRecPtr	remote_origin_lsn = InvalidXLogRecPtr;
@@ -107,6 +114,8 @@ typedef struct SpockApplyFunctions
 	spock_apply_can_mi_fn	can_multi_insert;
 	spock_apply_mi_add_tuple_fn	multi_insert_add_tuple;
 	spock_apply_mi_finish_fn	multi_insert_finish;
+	spock_apply_batch_add_fn	batch_add;
+	spock_apply_batch_finish_fn	batch_finish;
 } SpockApplyFunctions;
 
 static SpockApplyFunctions apply_api =
@@ -118,14 +127,44 @@ static SpockApplyFunctions apply_api =
 	.do_delete = spock_apply_heap_delete,
 	.can_multi_insert = spock_apply_heap_can_mi,
 	.multi_insert_add_tuple = spock_apply_heap_mi_add_tuple,
-	.multi_insert_finish = spock_apply_heap_mi_finish
+	.multi_insert_finish = spock_apply_heap_mi_finish,
+	.batch_add = spock_apply_heap_batch_add,
+	.batch_finish = spock_apply_heap_batch_finish
 };
 
+/* Number of applied messages after which we read from the upstream again. */
+#define RECEIVE_INTERVAL 64
+
 /* Number of tuples inserted after which we switch to multi-insert. */
 #define MIN_MULTI_INSERT_TUPLES 5
-static SpockRelation   *last_insert_rel = NULL;
-static int					last_insert_rel_cnt = 0;
-static bool					use_multi_insert = false;
+
+/* Number of relations which can have buffered inserts at the same time. */
+#define MAX_MULTI_INSERT_RELS 8
+
+/*
+ * Relations inserted into in the current transaction which use, or may
+ * start using, multi-insert. Keeping several of them means a transaction
+ * which alternates between a few tables still gets its inserts batched.
+ * The buffer of a relation is written out when it's full, before another
+ * change of the relation and before anything else which has to see the
+ * inserted rows.
+ */
+typedef struct MultiInsertRel
+{
+	SpockRelation  *rel;
+	int				ninserts;		/* inserts seen, or buffered */
+	bool			use_multi_insert;
+	bool			has_triggers;	/* rows inserted in the original order */
+} MultiInsertRel;
+
+static MultiInsertRel	multi_insert_rels[MAX_MULTI_INSERT_RELS];
+static int				n_multi_insert_rels = 0;
+
+/*
+ * Has a run of UPDATEs or DELETEs been handed to apply_api.batch_add since
+ * the last batch_finish()?
+ */
+static bool				batch_started = false;
 
 /*
  * A message counter for the xact, for debugging. We don't send
@@ -143,6 +182,9 @@ typedef struct SPKFlushPosition
 
 dlist_head lsn_mapping = DLIST_STATIC_INIT(lsn_mapping);
 
+#define IsParallelApplyWorker() \
+	(MySpockWorker->worker_type == SPOCK_WORKER_APPLY_PARALLEL)
+
 typedef struct ApplyExecState
 {
 	EState			   *estate;
@@ -161,9 +203,73 @@ struct ActionErrCallbackArg
 struct ActionErrCallbackArg errcallback_arg;
 static TransactionId remote_xid;
 
+/* Is the remote transaction being applied by the parallel workers? */
+static bool parallel_xact = false;
+
+/*
+ * Group commit state, remote transactions applied in the local transaction
+ * which is still open.
+ */
+static int			group_xacts = 0;
+static XLogRecPtr	group_end_lsn = InvalidXLogRecPtr;
+static TimestampTz	group_commit_time = 0;
+static TimestampTz	group_start = 0;
+
+/*
+ * Has the remote transaction being applied made changes in the local
+ * transaction yet, and has it run queued SQL?
+ */
+static bool			xact_has_changes = false;
+static bool			xact_ran_queued_sql = false;
+
+/*
+ * Transactions replayed from the spool which committed before this are
+ * already applied and are skipped.
+ */
+static XLogRecPtr	spool_skip_lsn = InvalidXLogRecPtr;
+static bool			spool_skipping = false;
+
+/* Snapshot shared by the changes of the remote transaction. */
+static Snapshot		apply_snapshot = NULL;
+
+/* Holds the decoded rows of a MULTI INSERT while they are applied. */
+static MemoryContext	multi_insert_context = NULL;
+
+/*
+ * Batch frame ('G' or 'Z') whose messages are being applied, see
+ * next_received_message(). The frame is kept until all its messages are.
+ * The messages of a compressed frame are decompressed into batch_buf.
+ */
+static StringInfoData	batch_frame;
+static int				batch_remaining = 0;
+static int				batch_msg_start = 0;
+static bool				batch_spooled = false;
+static StringInfo		batch_buf = NULL;
+
+/*
+ * Message sent in pieces ('P' frames) being put together, see
+ * next_received_message(). partial_ready is set once it's complete.
+ */
+static StringInfo		partial_buf = NULL;
+static bool				partial_ready = false;
+static bool				partial_spooled = false;
+
 static void multi_insert_finish(void);
+static void multi_insert_finish_rel(SpockRelation *rel);
+static void multi_insert_finish_before(SpockRelation *rel);
+static bool batch_change(SpockRelation *rel, char action,
+						 SpockTupleData *oldtup, SpockTupleData *newtup);
+static void batch_finish(void);
+static void begin_remote_xact(XLogRecPtr commit_lsn, TimestampTz commit_time);
+static void finish_remote_xact(XLogRecPtr end_lsn, TimestampTz commit_time);
+static bool group_commit_defer(XLogRecPtr end_lsn, TimestampTz commit_time);
+static bool group_commit_expired(void);
+static void group_commit_finish(void);
+static void apply_release_snapshot(void);
 
 static void handle_queued_message(HeapTuple msgtup, bool tx_just_started);
+static long apply_delay_remaining(StringInfo s);
+static bool spool_skip_applied(StringInfo s);
 static void handle_startup_param(const char *key, const char *value);
 static bool parse_bool_param(const char *key, const char *value);
 static void process_syncing_tables(XLogRecPtr end_lsn);
@@ -262,9 +368,14 @@ action_error_callback(void *arg)
 	pfree(si.data);
 }
 
+/*
+ * Make sure there's a local transaction to apply a change in.
+ */
 static bool
 ensure_transaction(void)
 {
+	xact_has_changes = true;
+
 	if (IsTransactionState())
 	{
 		if (CurrentMemoryContext != MessageContext)
@@ -285,9 +396,59 @@ ensure_transaction(void)
 	apply_api.on_begin();
 	MemoryContextSwitchTo(MessageContext);
 
+	/* Went away with the previous transaction, if that failed. */
+	apply_snapshot = NULL;
+
 	return true;
 }
 
+/*
+ * Make the snapshot for applying a change active.
+ *
+ * Taking a snapshot for every change is expensive, and the apply doesn't
+ * need a new one: rows are looked up with dirty snapshots, and a row written
+ * by an earlier change is made visible when it's found (see
+ * find_index_tuple_scan()). So one snapshot is taken for the changes of the
+ * remote transaction, except for relations with triggers, which could look
+ * at the data.
+ */
+static void
+apply_push_snapshot(void)
+{
+	if (apply_snapshot == NULL)
+		apply_snapshot = RegisterSnapshot(GetTransactionSnapshot());
+	else
+		apply_snapshot->curcid = GetCurrentCommandId(false);
+
+	PushActiveSnapshot(apply_snapshot);
+}
+
+/*
+ * Replace the active snapshot by a new one which sees all the earlier
+ * changes, for relations with triggers.
+ */
+static void
+apply_refresh_snapshot(void)
+{
+	PopActiveSnapshot();
+	CommandCounterIncrement();
+	apply_release_snapshot();
+	apply_push_snapshot();
+}
+
+/*
+ * Forget the snapshot, it must not be active anymore.
+ */
+static void
+apply_release_snapshot(void)
+{
+	if (apply_snapshot != NULL)
+	{
+		UnregisterSnapshot(apply_snapshot);
+		apply_snapshot = NULL;
+	}
+}
+
 static void
 handle_begin(StringInfo s)
 {
@@ -299,37 +460,44 @@ handle_begin(StringInfo s)
 
 	spock_read_begin(s, &commit_lsn, &commit_time, &remote_xid);
 
+	begin_remote_xact(commit_lsn, commit_time);
+}
+
+/*
+ * Set up the apply of a remote transaction, shared by plain and streamed
+ * transactions.
+ */
+static void
+begin_remote_xact(XLogRecPtr commit_lsn, TimestampTz commit_time)
+{
 	replorigin_session_origin_timestamp = commit_time;
 	replorigin_session_origin_lsn = commit_lsn;
 	remote_origin_id = InvalidRepOriginId;
 
 	VALGRIND_PRINTF("SPOCK_APPLY: begin %u\n", remote_xid);
 
-	/* don't want the overhead otherwise */
-	if (apply_delay > 0)
-	{
-		TimestampTz		current;
-		current = GetCurrentIntegerTimestamp();
-
-		/* ensure no weirdness due to clock drift */
-		if (current > replorigin_session_origin_timestamp)
-		{
-			long		sec;
-			int			usec;
+	in_remote_transaction = true;
+	xact_has_changes = false;
+	xact_ran_queued_sql = false;
 
-			current = TimestampTzPlusMilliseconds(current,
-												  -apply_delay);
+	pgstat_report_activity(STATE_RUNNING, NULL);
+}
 
-			TimestampDifference(current, replorigin_session_origin_timestamp,
-								&sec, &usec);
-			/* FIXME: deal with overflow? */
-			pg_usleep(usec + (sec * USECS_PER_SEC));
-		}
-	}
+/*
+ * Remember the local commit position of a remote transaction so the flush
+ * can be confirmed to the upstream once it's durable.
+ */
+void
+spock_apply_track_commit(XLogRecPtr local_end, XLogRecPtr remote_end)
+{
+	SPKFlushPosition *flushpos;
 
-	in_remote_transaction = true;
+	flushpos = (SPKFlushPosition *) MemoryContextAlloc(TopMemoryContext,
+												sizeof(SPKFlushPosition));
+	flushpos->local_end = local_end;
+	flushpos->remote_end = remote_end;
 
-	pgstat_report_activity(STATE_RUNNING, NULL);
+	dlist_push_tail(&lsn_mapping, &flushpos->node);
 }
 
 /*
@@ -347,30 +515,82 @@ handle_commit(StringInfo s)
 
 	spock_read_commit(s, &commit_lsn, &end_lsn, &commit_time);
 
+	finish_remote_xact(end_lsn, commit_time);
+}
+
+/*
+ * Remember when we last committed, for spock.stat_subscription.
+ */
+static void
+apply_stats_report_commit(TimestampTz remote_commit_time)
+{
+	SpockApplyStats *stats = MyApplyStats;
+
+	SPOCK_APPLY_STATS_BEGIN_WRITE(stats);
+	stats->last_commit_time = GetCurrentTimestamp();
+	stats->last_remote_commit_time = remote_commit_time;
+	SPOCK_APPLY_STATS_END_WRITE(stats);
+}
+
+/*
+ * Commit the local transaction applying a remote one and do the bookkeeping
+ * that follows it.
+ */
+static void
+finish_remote_xact(XLogRecPtr end_lsn, TimestampTz commit_time)
+{
+	instr_time	start;
+
 	Assert(commit_time == replorigin_session_origin_timestamp);
 
+	SPOCK_APPLY_STATS_ADD(n_commit, 1);
+
 	if (IsTransactionState())
 	{
-		SPKFlushPosition *flushpos;
-
+		batch_finish();
 		multi_insert_finish();
+		apply_release_snapshot();
+
+		/* Keep the local transaction open for the following ones? */
+		if (group_commit_defer(end_lsn, commit_time))
+		{
+			in_remote_transaction = false;
+
+			VALGRIND_PRINTF("SPOCK_APPLY: commit %u deferred\n", remote_xid);
+
+			xact_action_counter = 0;
+			remote_xid = InvalidTransactionId;
+			return;
+		}
 
 		apply_api.on_commit();
 
 		/* We need to write end_lsn to the commit record. */
 		replorigin_session_origin_lsn = end_lsn;
 
+		/* Parallel apply workers commit in the upstream commit order. */
+		if (IsParallelApplyWorker())
+			spock_apply_parallel_wait_for_turn();
+
+		SPOCK_APPLY_TIMING_START(start);
 		CommitTransactionCommand();
-		MemoryContextSwitchTo(TopMemoryContext);
+		SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_COMMIT, start);
+		group_xacts = 0;
+		apply_stats_report_commit(commit_time);
 
 		/* Track commit lsn  */
-		flushpos = (SPKFlushPosition *) palloc(sizeof(SPKFlushPosition));
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
+		if (IsParallelApplyWorker())
+			spock_apply_parallel_report_commit(XactLastCommitEnd);
+		else
+			spock_apply_track_commit(XactLastCommitEnd, end_lsn);
 
-		dlist_push_tail(&lsn_mapping, &flushpos->node);
 		MemoryContextSwitchTo(MessageContext);
 	}
+	else if (IsParallelApplyWorker())
+	{
+		spock_apply_parallel_wait_for_turn();
+		spock_apply_parallel_report_commit(InvalidXLogRecPtr);
+	}
 
 	/*
 	 * If the xact isn't from the immediate upstream, advance the slot of the
@@ -400,7 +620,7 @@ handle_commit(StringInfo s)
 	 * for the direct connection from X to Z. So don't do that.
 	 */
 	if (remote_origin_id != InvalidRepOriginId &&
-		remote_origin_id != replorigin_session_origin)
+		!spock_apply_origin_is_ours(remote_origin_id))
 	{
 		Relation replorigin_rel;
 		elog(DEBUG3, "advancing origin oid %u for forwarded row to %X/%X",
@@ -471,7 +691,9 @@ handle_commit(StringInfo s)
 	xact_action_counter = 0;
 	remote_xid = InvalidTransactionId;
 
-	process_syncing_tables(end_lsn);
+	/* Table synchronization is coordinated by the leader apply worker. */
+	if (!IsParallelApplyWorker())
+		process_syncing_tables(end_lsn);
 
 	/*
 	 * Ensure any pending signals/self-notifies are sent out.
@@ -487,6 +709,107 @@ handle_commit(StringInfo s)
 	pgstat_report_activity(STATE_IDLE, NULL);
 }
 
+/*
+ * Decide if the local transaction can be left open so that the following
+ * remote transactions are applied and committed together with it.
+ *
+ * This saves the commit overhead, WAL flush included, for workloads made of
+ * many small transactions. Transactions which need their own local commit,
+ * like forwarded ones or those replayed by table synchronization, are not
+ * grouped. Neither are any with a conflict resolution based on commit
+ * timestamps, as the grouped transactions all get the commit timestamp of
+ * the last one and conflicts would be resolved differently than on the
+ * other nodes.
+ */
+static bool
+group_commit_defer(XLogRecPtr end_lsn, TimestampTz commit_time)
+{
+	TimestampTz		now;
+
+	if (spock_group_commit_size <= 1 ||
+		xact_ran_queued_sql ||
+		IsParallelApplyWorker() ||
+		spock_apply_parallel_active() ||
+		apply_delay > 0 ||
+		spock_conflict_resolver == SPOCK_RESOLVE_LAST_UPDATE_WINS ||
+		spock_conflict_resolver == SPOCK_RESOLVE_FIRST_UPDATE_WINS ||
+		remote_origin_id != InvalidRepOriginId ||
+		MyApplyWorker->replay_stop_lsn != InvalidXLogRecPtr ||
+		MyApplyWorker->sync_pending ||
+		SyncingTables != NIL)
+		return false;
+
+	now = GetCurrentTimestamp();
+	if (group_xacts == 0)
+		group_start = now;
+
+	group_xacts++;
+	group_end_lsn = end_lsn;
+	group_commit_time = commit_time;
+
+	return group_xacts < spock_group_commit_size &&
+		!TimestampDifferenceExceeds(group_start, now,
+									spock_group_commit_timeout);
+}
+
+/*
+ * Has the open group of transactions reached spock.group_commit_timeout?
+ */
+static bool
+group_commit_expired(void)
+{
+	return group_xacts > 0 &&
+		TimestampDifferenceExceeds(group_start, GetCurrentTimestamp(),
+								   spock_group_commit_timeout);
+}
+
+/*
+ * Commit the remote transactions grouped in the local transaction, if any.
+ *
+ * This can happen at the start of another remote transaction, so the
+ * origin session state is restored afterwards.
+ */
+static void
+group_commit_finish(void)
+{
+	XLogRecPtr		save_lsn = replorigin_session_origin_lsn;
+	TimestampTz		save_timestamp = replorigin_session_origin_timestamp;
+	instr_time		start;
+
+	if (group_xacts == 0)
+		return;
+
+	Assert(IsTransactionState());
+
+	batch_finish();
+	multi_insert_finish();
+	apply_release_snapshot();
+
+	apply_api.on_commit();
+
+	replorigin_session_origin_lsn = group_end_lsn;
+	replorigin_session_origin_timestamp = group_commit_time;
+
+	SPOCK_APPLY_TIMING_START(start);
+	CommitTransactionCommand();
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_COMMIT, start);
+	group_xacts = 0;
+	apply_stats_report_commit(group_commit_time);
+
+	spock_apply_track_commit(XactLastCommitEnd, group_end_lsn);
+
+	MemoryContextSwitchTo(MessageContext);
+
+	replorigin_session_origin_lsn = save_lsn;
+	replorigin_session_origin_timestamp = save_timestamp;
+
+	if (!in_remote_transaction)
+	{
+		ProcessCompletedNotifies();
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+}
+
 /*
  * Handle ORIGIN message.
  */
@@ -495,6 +818,9 @@ handle_origin(StringInfo s)
 {
 	char		   *origin;
 
+	/* Forwarded transactions are committed on their own. */
+	group_commit_finish();
+
 	/*
 	 * ORIGIN message can only come inside remote transaction and before
 	 * any actual writes.
@@ -509,6 +835,119 @@ handle_origin(StringInfo s)
 	remote_origin_id = replorigin_by_name(origin, true);
 }
 
+/*
+ * Handle STREAM START message.
+ *
+ * The changes of a streamed transaction that follow are spooled to disk
+ * until we get the STREAM STOP.
+ */
+static void
+handle_stream_start(StringInfo s)
+{
+	TransactionId	xid;
+	bool			first_segment;
+
+	if (in_remote_transaction)
+		elog(ERROR, "STREAM START message sent out of order");
+
+	errcallback_arg.action_name = "STREAM START";
+
+	xid = spock_read_stream_start(s, &first_segment);
+	spock_apply_stream_start(xid, first_segment);
+}
+
+/*
+ * Handle STREAM STOP message.
+ */
+static void
+handle_stream_stop(StringInfo s)
+{
+	errcallback_arg.action_name = "STREAM STOP";
+
+	spock_apply_stream_stop();
+}
+
+/*
+ * Handle STREAM SUBXACT message, the changes that follow belong to the given
+ * subtransaction of the streamed transaction.
+ */
+static void
+handle_stream_subxact(StringInfo s)
+{
+	errcallback_arg.action_name = "STREAM SUBXACT";
+
+	spock_apply_stream_subxact(spock_read_stream_subxact(s));
+}
+
+/*
+ * Handle STREAM ABORT message, throw away the spooled changes of the
+ * aborted (sub)transaction.
+ */
+static void
+handle_stream_abort(StringInfo s)
+{
+	TransactionId	xid;
+	TransactionId	subxid;
+
+	errcallback_arg.action_name = "STREAM ABORT";
+
+	spock_read_stream_abort(s, &xid, &subxid);
+	spock_apply_stream_abort(xid, subxid);
+}
+
+/*
+ * Handle STREAM COMMIT message.
+ *
+ * Replays all the spooled changes of the streamed transaction in a single
+ * local transaction.
+ */
+static void
+handle_stream_commit(StringInfo s)
+{
+	XLogRecPtr		commit_lsn;
+	XLogRecPtr		end_lsn;
+	XLogRecPtr		origin_lsn;
+	TimestampTz		commit_time;
+	TransactionId	xid;
+	char		   *origin;
+	StringInfo		msg;
+
+	if (in_remote_transaction)
+		elog(ERROR, "STREAM COMMIT message sent out of order");
+
+	xact_action_counter = 1;
+	errcallback_arg.action_name = "STREAM COMMIT";
+
+	origin = spock_read_stream_commit(s, &xid, &commit_lsn, &end_lsn,
+									  &commit_time, &origin_lsn);
+
+	remote_xid = xid;
+	begin_remote_xact(commit_lsn, commit_time);
+
+	if (origin != NULL)
+	{
+		/* Forwarded transactions are committed on their own. */
+		group_commit_finish();
+
+		ensure_transaction();
+		remote_origin_lsn = origin_lsn;
+		remote_origin_id = replorigin_by_name(origin, true);
+	}
+
+	msg = spock_apply_stream_replay_begin(xid);
+	while (spock_apply_stream_replay_next(msg))
+	{
+		replication_handler(msg);
+		MemoryContextReset(MessageContext);
+	}
+	spock_apply_stream_replay_end();
+
+	errcallback_arg.action_name = "STREAM COMMIT";
+	xact_action_counter++;
+
+	finish_remote_xact(end_lsn, commit_time);
+}
+
 /*
  * Handle RELATION message.
  *
@@ -518,19 +957,88 @@ handle_origin(StringInfo s)
 static void
 handle_relation(StringInfo s)
 {
-	multi_insert_finish();
+	int			cursor = s->cursor;
+	uint32		remoteid;
+	int			i;
+
+	/*
+	 * The inserts buffered for the relation have to be written before its
+	 * definition changes, the other buffers can stay.
+	 */
+	(void) pq_getmsgbyte(s);	/* flags */
+	remoteid = pq_getmsgint(s, 4);
+	s->cursor = cursor;
+
+	batch_finish();
+
+	for (i = 0; i < n_multi_insert_rels; i++)
+	{
+		if (multi_insert_rels[i].rel->remoteid == remoteid)
+		{
+			multi_insert_finish_rel(multi_insert_rels[i].rel);
+			break;
+		}
+	}
 
 	(void) spock_read_rel(s);
 }
 
+/*
+ * Find the multi-insert tracking of the relation, start tracking it if it's
+ * not tracked yet.
+ *
+ * Buffered inserts of the other relations which must not be reordered
+ * against an insert into this one, because row triggers could see the
+ * difference, are written out first.
+ */
+static MultiInsertRel *
+multi_insert_get_rel(SpockRelation *rel)
+{
+	MultiInsertRel *mirel;
+	int				i;
+
+	for (i = n_multi_insert_rels - 1; i >= 0; i--)
+	{
+		mirel = &multi_insert_rels[i];
+
+		if (mirel->rel == rel)
+			continue;
+
+		if ((rel->hasTriggers || mirel->has_triggers) &&
+			mirel->use_multi_insert)
+			multi_insert_finish_rel(mirel->rel);
+	}
+
+	for (i = 0; i < n_multi_insert_rels; i++)
+	{
+		if (multi_insert_rels[i].rel == rel)
+			return &multi_insert_rels[i];
+	}
+
+	/* Make room by writing out the least recently added relation. */
+	if (n_multi_insert_rels == MAX_MULTI_INSERT_RELS)
+		multi_insert_finish_rel(multi_insert_rels[0].rel);
+
+	mirel = &multi_insert_rels[n_multi_insert_rels++];
+	mirel->rel = rel;
+	mirel->ninserts = 0;
+	mirel->use_multi_insert = false;
+	mirel->has_triggers = rel->hasTriggers;
+
+	return mirel;
+}
+
 static void
 handle_insert(StringInfo s)
 {
 	SpockTupleData	newtup;
 	SpockRelation  *rel;
+	bool				first_change = !xact_has_changes;
 	bool				started_tx = ensure_transaction();
 
-	PushActiveSnapshot(GetTransactionSnapshot());
+	batch_finish();
+
+	apply_push_snapshot();
 
 	errcallback_arg.action_name = "INSERT";
 	xact_action_counter++;
@@ -538,46 +1046,64 @@ handle_insert(StringInfo s)
 	rel = spock_read_insert(s, RowExclusiveLock, &newtup);
 	errcallback_arg.rel = rel;
 
+	/*
+	 * Queued SQL which comes first in the remote transaction is executed as
+	 * top level, which it can't be in a group of transactions.
+	 */
+	if (group_xacts > 0 && first_change &&
+		RelationGetRelid(rel->rel) == QueueRelid)
+	{
+		uint32		remoteid = rel->remoteid;
+
+		spock_relation_close(rel, NoLock);
+		PopActiveSnapshot();
+
+		group_commit_finish();
+
+		started_tx = ensure_transaction();
+		apply_push_snapshot();
+		rel = spock_relation_open(remoteid, RowExclusiveLock);
+		errcallback_arg.rel = rel;
+	}
+
 	/* If in list of relations which are being synchronized, skip. */
 	if (!should_apply_changes_for_rel(rel->nspname, rel->relname))
 	{
 		spock_relation_close(rel, NoLock);
 		PopActiveSnapshot();
-		CommandCounterIncrement();
 		return;
 	}
 
+	SPOCK_APPLY_STATS_ADD(n_insert, 1);
+
+	if (rel->hasTriggers)
+		apply_refresh_snapshot();
+
 	/* Handle multi_insert capabilities. */
-	if (use_multi_insert)
+	if (spock_batch_inserts &&
+		RelationGetRelid(rel->rel) != QueueRelid &&
+		apply_api.can_multi_insert &&
+		apply_api.can_multi_insert(rel))
 	{
-		if (rel != last_insert_rel)
-		{
-			multi_insert_finish();
-			/* Fall through to normal insert. */
-		}
-		else
+		MultiInsertRel *mirel = multi_insert_get_rel(rel);
+
+		if (mirel->use_multi_insert)
 		{
 			apply_api.multi_insert_add_tuple(rel, &newtup);
-			last_insert_rel_cnt++;
+			mirel->ninserts++;
+
+			spock_relation_close(rel, NoLock);
+			PopActiveSnapshot();
 			return;
 		}
-	}
-	else if (spock_batch_inserts &&
-			 RelationGetRelid(rel->rel) != QueueRelid &&
-			 apply_api.can_multi_insert &&
-			 apply_api.can_multi_insert(rel))
-	{
-		if (rel != last_insert_rel)
-		{
-			last_insert_rel = rel;
-			last_insert_rel_cnt = 0;
-		}
-		else if (last_insert_rel_cnt++ >= MIN_MULTI_INSERT_TUPLES)
+		else if (mirel->ninserts++ >= MIN_MULTI_INSERT_TUPLES)
 		{
-			use_multi_insert = true;
-			last_insert_rel_cnt = 0;
+			mirel->use_multi_insert = true;
+			mirel->ninserts = 0;
 		}
 	}
+	else
+		multi_insert_finish_before(rel);
 
 	/* Normal insert. */
 	apply_api.do_insert(rel, &newtup);
@@ -600,10 +1126,13 @@ handle_insert(StringInfo s)
 		spock_relation_close(rel, NoLock);
 
 		PopActiveSnapshot();
+		apply_release_snapshot();
 		CommandCounterIncrement();
 
 		apply_api.on_commit();
 
+		/* The transaction is committed on its own, see group_commit_defer(). */
+		xact_ran_queued_sql = true;
 		handle_queued_message(ht, started_tx);
 
 		heap_freetuple(ht);
@@ -624,30 +1153,227 @@ handle_insert(StringInfo s)
 	{
 		spock_relation_close(rel, NoLock);
 
-		PopActiveSnapshot();
-		CommandCounterIncrement();
+		PopActiveSnapshot();
+	}
+}
+
+/*
+ * Apply the rows of a MULTI INSERT, which the upstream sends instead of
+ * consecutive INSERTs into a relation. They go straight to the multi-insert
+ * buffer when the relation can use one.
+ */
+static void
+handle_multi_insert(StringInfo s)
+{
+	SpockMultiInsertData rows;
+	SpockTupleData	newtup;
+	SpockRelation  *rel;
+	MemoryContext	oldctx;
+	int				i;
+
+	ensure_transaction();
+
+	batch_finish();
+
+	apply_push_snapshot();
+
+	errcallback_arg.action_name = "INSERT";
+	xact_action_counter++;
+
+	/* The decoded rows are only needed until they are inserted. */
+	if (multi_insert_context == NULL)
+		multi_insert_context = AllocSetContextCreate(TopMemoryContext,
+													 "spock multi insert",
+													 ALLOCSET_DEFAULT_SIZES);
+	oldctx = MemoryContextSwitchTo(multi_insert_context);
+	rel = spock_read_multi_insert(s, RowExclusiveLock, &rows);
+	MemoryContextSwitchTo(oldctx);
+	errcallback_arg.rel = rel;
+
+	/* The upstream sends queued commands one by one. */
+	if (RelationGetRelid(rel->rel) == QueueRelid)
+		elog(ERROR, "unexpected MULTI INSERT into the queue table");
+
+	/* If in list of relations which are being synchronized, skip. */
+	if (!should_apply_changes_for_rel(rel->nspname, rel->relname))
+	{
+		spock_relation_close(rel, NoLock);
+		PopActiveSnapshot();
+		MemoryContextReset(multi_insert_context);
+		return;
+	}
+
+	SPOCK_APPLY_STATS_ADD(n_insert, rows.nrows);
+	SPOCK_APPLY_STATS_ADD(n_multi_insert_msg, 1);
+
+	if (rel->hasTriggers)
+		apply_refresh_snapshot();
+
+	newtup.natts = rows.natts;
+
+	if (spock_batch_inserts &&
+		apply_api.can_multi_insert &&
+		apply_api.can_multi_insert(rel))
+	{
+		MultiInsertRel *mirel = multi_insert_get_rel(rel);
+
+		/* No need to wait for more inserts, the batch is right here. */
+		if (!mirel->use_multi_insert)
+		{
+			mirel->use_multi_insert = true;
+			mirel->ninserts = 0;
+		}
+
+		for (i = 0; i < rows.nrows; i++)
+		{
+			newtup.values = rows.values + i * rows.natts;
+			newtup.nulls = rows.nulls + i * rows.natts;
+			newtup.changed = rows.changed + i * rows.natts;
+
+			apply_api.multi_insert_add_tuple(rel, &newtup);
+			mirel->ninserts++;
+		}
+	}
+	else
+	{
+		multi_insert_finish_before(rel);
+
+		for (i = 0; i < rows.nrows; i++)
+		{
+			newtup.values = rows.values + i * rows.natts;
+			newtup.nulls = rows.nulls + i * rows.natts;
+			newtup.changed = rows.changed + i * rows.natts;
+
+			apply_api.do_insert(rel, &newtup);
+		}
+	}
+
+	spock_relation_close(rel, NoLock);
+	PopActiveSnapshot();
+
+	MemoryContextReset(multi_insert_context);
+}
+
+/*
+ * Write out the inserts buffered for all relations.
+ */
+static void
+multi_insert_finish(void)
+{
+	while (n_multi_insert_rels > 0)
+		multi_insert_finish_rel(multi_insert_rels[0].rel);
+}
+
+/*
+ * Write out the buffered inserts which a change of the relation, other than
+ * a buffered insert, has to see or follow.
+ */
+static void
+multi_insert_finish_before(SpockRelation *rel)
+{
+	int			i;
+
+	for (i = n_multi_insert_rels - 1; i >= 0; i--)
+	{
+		MultiInsertRel *mirel = &multi_insert_rels[i];
+
+		if (mirel->rel == rel || rel->hasTriggers || mirel->has_triggers)
+			multi_insert_finish_rel(mirel->rel);
+	}
+}
+
+/*
+ * Write out the inserts buffered for the relation and stop tracking it.
+ *
+ * The relation is opened for that if the caller doesn't have it open.
+ */
+static void
+multi_insert_finish_rel(SpockRelation *rel)
+{
+	MultiInsertRel *mirel = NULL;
+	int				i;
+
+	for (i = 0; i < n_multi_insert_rels; i++)
+	{
+		if (multi_insert_rels[i].rel == rel)
+		{
+			mirel = &multi_insert_rels[i];
+			break;
+		}
+	}
+
+	if (mirel == NULL)
+		return;
+
+	if (mirel->use_multi_insert && mirel->ninserts)
+	{
+		const char *old_action = errcallback_arg.action_name;
+		SpockRelation *old_rel = errcallback_arg.rel;
+		bool		opened = false;
+
+		errcallback_arg.action_name = "multi INSERT";
+		errcallback_arg.rel = rel;
+
+		if (rel->rel == NULL)
+		{
+			rel = spock_relation_open(rel->remoteid, RowExclusiveLock);
+			opened = true;
+		}
+
+		apply_push_snapshot();
+		apply_api.multi_insert_finish(rel);
+		PopActiveSnapshot();
+
+		if (opened)
+			spock_relation_close(rel, NoLock);
+
+		errcallback_arg.rel = old_rel;
+		errcallback_arg.action_name = old_action;
+	}
+
+	n_multi_insert_rels--;
+	memmove(mirel, mirel + 1,
+			(n_multi_insert_rels - (mirel - multi_insert_rels)) *
+			sizeof(MultiInsertRel));
+}
+
+/*
+ * Hand an UPDATE or DELETE to the batch of changes, which is applied in the
+ * order of the replica identity once the run of changes of the same kind on
+ * the same relation ends.
+ *
+ * Returns false if the change has to be applied now, which the batch
+ * guarantees is in the right order.
+ */
+static bool
+batch_change(SpockRelation *rel, char action, SpockTupleData *oldtup,
+			 SpockTupleData *newtup)
+{
+	if (!spock_batch_updates || apply_api.batch_add == NULL)
+	{
+		batch_finish();
+		return false;
 	}
+
+	batch_started = true;
+
+	return apply_api.batch_add(rel, action, oldtup, newtup);
 }
 
+/*
+ * Apply the batched UPDATEs or DELETEs.
+ */
 static void
-multi_insert_finish(void)
+batch_finish(void)
 {
-	if (use_multi_insert && last_insert_rel_cnt)
-	{
-		const char *old_action = errcallback_arg.action_name;
-		SpockRelation *old_rel = errcallback_arg.rel;
-		errcallback_arg.action_name = "multi INSERT";
-		errcallback_arg.rel = last_insert_rel;
+	if (!batch_started)
+		return;
 
-		apply_api.multi_insert_finish(last_insert_rel);
-		spock_relation_close(last_insert_rel, NoLock);
-		use_multi_insert = false;
-		last_insert_rel = NULL;
-		last_insert_rel_cnt = 0;
+	apply_push_snapshot();
+	apply_api.batch_finish();
+	PopActiveSnapshot();
 
-		errcallback_arg.rel = old_rel;
-		errcallback_arg.action_name = old_action;
-	}
+	batch_started = false;
 }
 
 static void
@@ -663,20 +1389,49 @@ handle_update(StringInfo s)
 
 	ensure_transaction();
 
-	multi_insert_finish();
-
-	PushActiveSnapshot(GetTransactionSnapshot());
+	apply_push_snapshot();
 
 	rel = spock_read_update(s, RowExclusiveLock, &hasoldtup, &oldtup,
 								&newtup);
 	errcallback_arg.rel = rel;
 
+	multi_insert_finish_before(rel);
+
 	/* If in list of relations which are being synchronized, skip. */
 	if (!should_apply_changes_for_rel(rel->nspname, rel->relname))
 	{
 		spock_relation_close(rel, NoLock);
 		PopActiveSnapshot();
-		CommandCounterIncrement();
+		return;
+	}
+
+	SPOCK_APPLY_STATS_ADD(n_update, 1);
+
+	/*
+	 * Count the updates which leave out columns of the new row, with
+	 * spock.changed_columns_only the old row is sent along.
+	 */
+	if (hasoldtup)
+	{
+		int			i;
+
+		for (i = 0; i < rel->natts; i++)
+		{
+			if (!newtup.changed[rel->attmap[i]])
+			{
+				SPOCK_APPLY_STATS_ADD(n_update_unchanged, 1);
+				break;
+			}
+		}
+	}
+
+	if (rel->hasTriggers)
+		apply_refresh_snapshot();
+
+	if (batch_change(rel, 'U', hasoldtup ? &oldtup : &newtup, &newtup))
+	{
+		spock_relation_close(rel, NoLock);
+		PopActiveSnapshot();
 		return;
 	}
 
@@ -685,7 +1440,6 @@ handle_update(StringInfo s)
 	spock_relation_close(rel, NoLock);
 
 	PopActiveSnapshot();
-	CommandCounterIncrement();
 }
 
 static void
@@ -699,19 +1453,30 @@ handle_delete(StringInfo s)
 
 	ensure_transaction();
 
-	multi_insert_finish();
-
-	PushActiveSnapshot(GetTransactionSnapshot());
+	apply_push_snapshot();
 
 	rel = spock_read_delete(s, RowExclusiveLock, &oldtup);
 	errcallback_arg.rel = rel;
 
+	multi_insert_finish_before(rel);
+
 	/* If in list of relations which are being synchronized, skip. */
 	if (!should_apply_changes_for_rel(rel->nspname, rel->relname))
 	{
 		spock_relation_close(rel, NoLock);
 		PopActiveSnapshot();
-		CommandCounterIncrement();
+		return;
+	}
+
+	SPOCK_APPLY_STATS_ADD(n_delete, 1);
+
+	if (rel->hasTriggers)
+		apply_refresh_snapshot();
+
+	if (batch_change(rel, 'D', &oldtup, NULL))
+	{
+		spock_relation_close(rel, NoLock);
+		PopActiveSnapshot();
 		return;
 	}
 
@@ -720,7 +1485,6 @@ handle_delete(StringInfo s)
 	spock_relation_close(rel, NoLock);
 
 	PopActiveSnapshot();
-	CommandCounterIncrement();
 }
 
 inline static bool
@@ -801,6 +1565,35 @@ handle_startup_param(const char *key, const char *value)
 		elog(DEBUG1, "changeset origin forwarding enabled: %s", fwd ? "t" : "f");
 	}
 
+	if (strcmp(key, "streaming") == 0)
+	{
+		bool streaming = parse_bool_param(key, value);
+		elog(DEBUG1, "streaming of in-progress transactions enabled: %s",
+			 streaming ? "t" : "f");
+	}
+
+	if (strcmp(key, "batch_size") == 0)
+		elog(DEBUG1, "upstream batches messages up to %s bytes", value);
+
+	if (strcmp(key, "compression") == 0)
+		elog(DEBUG1, "upstream compression is %s", value);
+
+	if (strcmp(key, "multi_insert") == 0)
+		elog(DEBUG1, "upstream multi-row inserts %s",
+			 strcmp(value, "t") == 0 ? "enabled" : "disabled");
+
+	if (strcmp(key, "type_names") == 0)
+		elog(DEBUG1, "upstream %s embedded type names",
+			 strcmp(value, "t") == 0 ? "sends" : "doesn't send");
+
+	if (strcmp(key, "partial_messages") == 0)
+		elog(DEBUG1, "upstream partial messages %s",
+			 strcmp(value, "t") == 0 ? "enabled" : "disabled");
+
+	if (strcmp(key, "changed_columns_only") == 0)
+		elog(DEBUG1, "upstream sends %s of updated rows",
+			 strcmp(value, "t") == 0 ? "only the changed columns" : "all columns");
+
 	/*
 	 * We just ignore a bunch of parameters here because we specify what we
 	 * require when we send our params to the upstream. It's required to ERROR
@@ -1127,6 +1920,7 @@ static void
 replication_handler(StringInfo s)
 {
 	ErrorContextCallback errcallback;
+	int			msgstart = s->cursor;
 	char action = pq_getmsgbyte(s);
 
 	memset(&errcallback_arg, 0, sizeof(struct ActionErrCallbackArg));
@@ -1137,42 +1931,74 @@ replication_handler(StringInfo s)
 
 	Assert(CurrentMemoryContext == MessageContext);
 
-	switch (action)
+	/* Changes of a streamed transaction are spooled until it commits. */
+	if (spock_apply_stream_active() &&
+		(action == 'R' || action == 'I' || action == 'M' || action == 'U' ||
+		 action == 'D'))
+		spock_apply_stream_write(s->data + msgstart, s->len - msgstart);
+	else
 	{
-		/* BEGIN */
-		case 'B':
-			handle_begin(s);
-			break;
-		/* COMMIT */
-		case 'C':
-			handle_commit(s);
-			break;
-		/* ORIGIN */
-		case 'O':
-			handle_origin(s);
-			break;
-		/* RELATION */
-		case 'R':
-			handle_relation(s);
-			break;
-		/* INSERT */
-		case 'I':
-			handle_insert(s);
-			break;
-		/* UPDATE */
-		case 'U':
-			handle_update(s);
-			break;
-		/* DELETE */
-		case 'D':
-			handle_delete(s);
-			break;
-		/* STARTUP MESSAGE */
-		case 'S':
-			handle_startup(s);
-			break;
-		default:
-			elog(ERROR, "unknown action of type %c", action);
+		switch (action)
+		{
+			/* BEGIN */
+			case 'B':
+				handle_begin(s);
+				break;
+			/* COMMIT */
+			case 'C':
+				handle_commit(s);
+				break;
+			/* ORIGIN */
+			case 'O':
+				handle_origin(s);
+				break;
+			/* RELATION */
+			case 'R':
+				handle_relation(s);
+				break;
+			/* INSERT */
+			case 'I':
+				handle_insert(s);
+				break;
+			/* MULTI INSERT */
+			case 'M':
+				handle_multi_insert(s);
+				break;
+			/* UPDATE */
+			case 'U':
+				handle_update(s);
+				break;
+			/* DELETE */
+			case 'D':
+				handle_delete(s);
+				break;
+			/* STREAM START */
+			case 's':
+				handle_stream_start(s);
+				break;
+			/* STREAM STOP */
+			case 'E':
+				handle_stream_stop(s);
+				break;
+			/* STREAM SUBXACT */
+			case 'x':
+				handle_stream_subxact(s);
+				break;
+			/* STREAM ABORT */
+			case 'A':
+				handle_stream_abort(s);
+				break;
+			/* STREAM COMMIT */
+			case 'c':
+				handle_stream_commit(s);
+				break;
+			/* STARTUP MESSAGE */
+			case 'S':
+				handle_startup(s);
+				break;
+			default:
+				elog(ERROR, "unknown action of type %c", action);
+		}
 	}
 
 	Assert(CurrentMemoryContext == MessageContext);
@@ -1180,7 +2006,7 @@ replication_handler(StringInfo s)
 	if (error_context_stack == &errcallback)
 		error_context_stack = errcallback.previous;
 
-	if (action == 'C')
+	if (action == 'C' || action == 'c')
 	{
 		/*
 		 * We clobber MessageContext on commit. It doesn't matter much when we
@@ -1221,27 +2047,333 @@ get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 
 		*write = pos->remote_end;
 
-		if (pos->local_end <= local_flush)
+		if (pos->local_end <= local_flush)
+		{
+			*flush = pos->remote_end;
+			dlist_delete(iter.cur);
+			pfree(pos);
+		}
+		else
+		{
+			/*
+			 * Don't want to uselessly iterate over the rest of the list which
+			 * could potentially be long. Instead get the last element and
+			 * grab the write position from there.
+			 */
+			pos = dlist_tail_element(SPKFlushPosition, node,
+									 &lsn_mapping);
+			*write = pos->remote_end;
+			return false;
+		}
+	}
+
+	return dlist_is_empty(&lsn_mapping);
+}
+
+/*
+ * Pass the replication message either to the local apply or to the parallel
+ * apply workers.
+ */
+static void
+apply_dispatch(StringInfo s)
+{
+	char		action = s->data[s->cursor];
+
+	/* Streamed transactions are spooled and applied by us on commit. */
+	if (!spock_apply_parallel_active() || spock_apply_stream_active())
+	{
+		replication_handler(s);
+		return;
+	}
+
+	switch (action)
+	{
+		/* BEGIN */
+		case 'B':
+			/*
+			 * Table synchronization needs to know exactly what has been
+			 * applied, so only use the parallel workers when there is none
+			 * in progress.
+			 */
+			parallel_xact = (SyncingTables == NIL &&
+							 !MyApplyWorker->sync_pending);
+			if (parallel_xact)
+			{
+				spock_apply_parallel_begin(s);
+				in_remote_transaction = true;
+				return;
+			}
+
+			/* Everything sent to the workers must be applied first. */
+			spock_apply_parallel_drain();
+			break;
+		/* COMMIT */
+		case 'C':
+			if (parallel_xact)
+			{
+				spock_apply_parallel_commit(s);
+				parallel_xact = false;
+				in_remote_transaction = false;
+				MemoryContextReset(MessageContext);
+				return;
+			}
+			break;
+		/* ORIGIN, INSERT, MULTI INSERT, UPDATE, DELETE */
+		case 'O':
+		case 'I':
+		case 'M':
+		case 'U':
+		case 'D':
+			if (parallel_xact)
+			{
+				spock_apply_parallel_change(s);
+				return;
+			}
+			break;
+		/* RELATION */
+		case 'R':
+			/* Every worker needs to know about every relation. */
+			spock_apply_parallel_relation(s);
+			break;
+		/* STREAM COMMIT */
+		case 'c':
+			/* Preserve the commit order with the parallel workers. */
+			spock_apply_parallel_drain();
+			break;
+		default:
+			break;
+	}
+
+	replication_handler(s);
+}
+
+/*
+ * Is there anything received which has not been applied yet?
+ */
+static bool
+received_changes_pending(void)
+{
+	return batch_remaining > 0 || !spock_apply_recv_empty() ||
+		spock_apply_spool_replaying();
+}
+
+/*
+ * Add the piece of a partial message in the frame s to partial_buf and
+ * release the frame. Returns true if it was the last piece.
+ */
+static bool
+receive_partial_piece(StringInfo s, bool spooled)
+{
+	int			flags;
+	int			hint;
+	int			len;
+
+	(void) pq_getmsgbyte(s);	/* 'P' */
+	flags = pq_getmsgbyte(s);
+	hint = pq_getmsgint(s, 4);
+	len = s->len - s->cursor;
+
+	if (hint < 0)
+		elog(ERROR, "invalid partial message length hint %d", hint);
+
+	if (partial_buf == NULL)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		partial_buf = makeStringInfo();
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	if (partial_buf->len == 0)
+		partial_spooled = spooled;
+
+	/* Make room for the rest of the message at once. */
+	enlargeStringInfo(partial_buf, Max(hint, len));
+	appendBinaryStringInfo(partial_buf, s->data + s->cursor, len);
+
+	if (!spooled)
+		spock_apply_recv_release();
+
+	return (flags & SPOCK_PARTIAL_LAST) != 0;
+}
+
+/*
+ * Get the next received message to apply, with the 'w' header skipped.
+ * Returns false when there is none. spooled is set if the message comes
+ * from the spool.
+ *
+ * The messages of a batch frame are returned one at a time, so they are
+ * applied in a loop without going through the receive buffer for each.
+ */
+static bool
+next_received_message(StringInfo s, bool *spooled)
+{
+	int			len;
+
+	/* A message put together from pieces which was put back. */
+	if (partial_ready)
+	{
+		memset(s, 0, sizeof(StringInfoData));
+		s->data = partial_buf->data;
+		s->len = partial_buf->len;
+		s->maxlen = -1;
+		*spooled = partial_spooled;
+		return true;
+	}
+
+	if (batch_remaining == 0)
+	{
+		batch_frame.data = NULL;
+
+		for (;;)
+		{
+			/* What was spooled before a restart comes first. */
+			*spooled = spock_apply_spool_replay_next(s);
+
+			if (!*spooled && !spock_apply_recv_get(s))
+				return false;
+
+			/* Skip the 'w' header, it was looked at when received. */
+			(void) pq_getmsgbyte(s);
+			pq_getmsgint64(s); /* start_lsn */
+			pq_getmsgint64(s); /* end_lsn */
+			pq_getmsgint64(s); /* sendTime */
+
+			if (s->cursor >= s->len || s->data[s->cursor] != 'P')
+				break;
+
+			/*
+			 * A piece of a message with a large value. The pieces are
+			 * appended to partial_buf, sized from the hint the upstream
+			 * sends of how much of the message is still to come, until the
+			 * last one.
+			 */
+			if (!receive_partial_piece(s, *spooled))
+				continue;
+
+			SPOCK_APPLY_STATS_ADD(n_partial_message, 1);
+
+			partial_ready = true;
+			memset(s, 0, sizeof(StringInfoData));
+			s->data = partial_buf->data;
+			s->len = partial_buf->len;
+			s->maxlen = -1;
+			*spooled = partial_spooled;
+			return true;
+		}
+
+		if (s->cursor >= s->len ||
+			(s->data[s->cursor] != 'G' && s->data[s->cursor] != 'Z'))
+			return true;
+
+		if (pq_getmsgbyte(s) == 'Z')
+		{
+			SpockCompression	method = pq_getmsgbyte(s);
+			int					rawlen;
+
+			batch_remaining = pq_getmsgint(s, 4);
+			rawlen = pq_getmsgint(s, 4);
+			pq_getmsgint64(s); /* commit end_lsn, for the spool */
+
+			if (batch_buf == NULL)
+			{
+				MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+				batch_buf = makeStringInfo();
+				MemoryContextSwitchTo(oldctx);
+			}
+
+			spock_decompress(method, s->data + s->cursor, s->len - s->cursor,
+							 rawlen, batch_buf);
+
+			SPOCK_APPLY_STATS_ADD(n_compressed_frame, 1);
+
+			memset(s, 0, sizeof(StringInfoData));
+			s->data = batch_buf->data;
+			s->len = batch_buf->len;
+			s->maxlen = -1;
+		}
+		else
+			batch_remaining = pq_getmsgint(s, 4);
+
+		if (batch_remaining <= 0)
+			elog(ERROR, "invalid number of messages %d in batch",
+				 batch_remaining);
+
+		batch_frame = *s;
+		batch_spooled = *spooled;
+
+		SPOCK_APPLY_STATS_ADD(n_batch_frame, 1);
+	}
+
+	batch_msg_start = batch_frame.cursor;
+	len = pq_getmsgint(&batch_frame, 4);
+
+	memset(s, 0, sizeof(StringInfoData));
+	s->data = (char *) pq_getmsgbytes(&batch_frame, len);
+	s->len = len;
+	s->maxlen = -1;
+	s->cursor = 0;
+
+	batch_remaining--;
+	*spooled = batch_spooled;
+
+	return true;
+}
+
+/*
+ * Put the message returned by next_received_message() back, to get it again
+ * next time.
+ */
+static void
+unget_received_message(bool spooled)
+{
+	/* The message is kept in partial_buf until released. */
+	if (partial_ready)
+		return;
+
+	if (batch_frame.data != NULL)
+	{
+		batch_frame.cursor = batch_msg_start;
+		batch_remaining++;
+	}
+	else if (spooled)
+		spock_apply_spool_unget();
+	else
+		spock_apply_recv_unget();
+}
+
+/*
+ * Done with the message returned by next_received_message().
+ */
+static void
+release_received_message(void)
+{
+	/* Its pieces were released as they were received. */
+	if (partial_ready)
+	{
+		partial_ready = false;
+
+		/* Don't keep too much memory around after huge messages. */
+		if (partial_buf->maxlen > SPOCK_PARTIAL_FRAME_SIZE)
 		{
-			*flush = pos->remote_end;
-			dlist_delete(iter.cur);
-			pfree(pos);
+			MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+			pfree(partial_buf->data);
+			initStringInfo(partial_buf);
+			MemoryContextSwitchTo(oldctx);
 		}
 		else
-		{
-			/*
-			 * Don't want to uselessly iterate over the rest of the list which
-			 * could potentially be long. Instead get the last element and
-			 * grab the write position from there.
-			 */
-			pos = dlist_tail_element(SPKFlushPosition, node,
-									 &lsn_mapping);
-			*write = pos->remote_end;
-			return false;
-		}
+			resetStringInfo(partial_buf);
+		return;
 	}
 
-	return dlist_is_empty(&lsn_mapping);
+	/* The frame holds the rest of the batch. */
+	if (batch_remaining > 0)
+		return;
+
+	batch_frame.data = NULL;
+	spock_apply_recv_release();
 }
 
 /*
@@ -1266,15 +2398,33 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	if (recvpos < last_recvpos)
 		recvpos = last_recvpos;
 
-	if (get_flush_position(&writepos, &flushpos))
+	/* Pick up the transactions committed by the parallel apply workers. */
+	spock_apply_parallel_collect();
+
+	/*
+	 * The write position reports what we received, the flush position what
+	 * has been applied and flushed locally and the apply position what has
+	 * been applied.
+	 */
+	if (get_flush_position(&writepos, &flushpos) &&
+		!spock_apply_parallel_pending() && !received_changes_pending() &&
+		group_xacts == 0)
 	{
 		/*
-		 * No outstanding transactions to flush, we can report the latest
-		 * received position. This is important for synchronous replication.
+		 * No outstanding transactions to flush and nothing received is
+		 * waiting to be applied, we can report the latest received position.
+		 * This is important for synchronous replication.
 		 */
 		flushpos = writepos = recvpos;
 	}
 
+	/*
+	 * Transactions synced to the spool are applied from there after a
+	 * restart, the upstream doesn't have to keep them.
+	 */
+	if (flushpos < spock_apply_spool_durable_lsn())
+		flushpos = spock_apply_spool_durable_lsn();
+
 	if (writepos < last_writepos)
 		writepos = last_writepos;
 
@@ -1283,6 +2433,7 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 
 	/* if we've already reported everything we're good */
 	if (!force &&
+		recvpos == last_recvpos &&
 		writepos == last_writepos &&
 		flushpos == last_flushpos)
 		return true;
@@ -1330,14 +2481,119 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	return true;
 }
 
+/*
+ * Read everything the upstream has sent so far into the receive buffer.
+ *
+ * Keepalives are answered right away rather than after the changes received
+ * before them have been applied.
+ */
+static void
+receive_pending(XLogRecPtr *last_received)
+{
+	char	   *copybuf = NULL;
+	int			r;
+
+	PQconsumeInput(applyconn);
+
+	for (;;)
+	{
+		StringInfoData s;
+		int			c;
+
+		r = PQgetCopyData(applyconn, &copybuf, 1);
+
+		if (r == -1)
+		{
+			elog(ERROR, "data stream ended");
+		}
+		else if (r == -2)
+		{
+			elog(ERROR, "could not read COPY data: %s",
+				 PQerrorMessage(applyconn));
+		}
+		else if (r < 0)
+			elog(ERROR, "invalid COPY status %d", r);
+		else if (r == 0)
+		{
+			/* need to wait for new data */
+			break;
+		}
+
+		SPOCK_APPLY_STATS_ADD(bytes_received, r);
+
+		/*
+		 * We're using a StringInfo to wrap existing data here, as a
+		 * cursor. We init it manually to avoid a redundant allocation.
+		 */
+		memset(&s, 0, sizeof(StringInfoData));
+		s.data = copybuf;
+		s.len = r;
+		s.maxlen = -1;
+		s.cursor = 0;
+
+		c = pq_getmsgbyte(&s);
+
+		if (c == 'w')
+		{
+			XLogRecPtr	start_lsn;
+			XLogRecPtr	end_lsn;
+
+			start_lsn = pq_getmsgint64(&s);
+			end_lsn = pq_getmsgint64(&s);
+
+			if (*last_received < start_lsn)
+				*last_received = start_lsn;
+
+			if (*last_received < end_lsn)
+				*last_received = end_lsn;
+
+			spock_apply_spool_write(copybuf, r);
+
+			/* The buffer frees it once it's been applied. */
+			spock_apply_recv_put(copybuf, r);
+		}
+		else
+		{
+			if (c == 'k')
+			{
+				XLogRecPtr endpos;
+				bool reply_requested;
+
+				endpos = pq_getmsgint64(&s);
+				/* timestamp = */ pq_getmsgint64(&s);
+				reply_requested = pq_getmsgbyte(&s);
+
+				send_feedback(applyconn, endpos,
+							  GetCurrentTimestamp(),
+							  reply_requested);
+
+				if (*last_received < endpos)
+					*last_received = endpos;
+			}
+			/* other message types are purposefully ignored */
+
+			/* copybuf is malloc'd not palloc'd */
+			PQfreemem(copybuf);
+		}
+
+		copybuf = NULL;
+	}
+}
+
 /*
  * Apply main loop.
+ *
+ * Receiving and applying are decoupled by the receive buffer: we read what
+ * the upstream sent before applying the next message and then every
+ * RECEIVE_INTERVAL messages, so the upstream isn't held up by the apply as
+ * long as the buffer has room in memory or in its spill file.
  */
 void
 apply_work(PGconn *streamConn)
 {
 	int			fd;
-	char	   *copybuf = NULL;
+	int			napplied = 0;
+	long		delay_ms = 0;
 	XLogRecPtr	last_received = InvalidXLogRecPtr;
 
 	applyconn = streamConn;
@@ -1357,18 +2613,23 @@ apply_work(PGconn *streamConn)
 	while (!got_SIGTERM)
 	{
 		int			rc;
-		int			r;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 *
+		 * Don't sleep if there are received changes left to apply, unless
+		 * the next transaction is held back by apply_delay.
 		 */
 		rc = WaitLatchOrSocket(&MyProc->procLatch,
 							   WL_SOCKET_READABLE | WL_LATCH_SET |
 							   WL_TIMEOUT | WL_POSTMASTER_DEATH,
-							   fd, 1000L);
+							   fd,
+							   delay_ms > 0 ? Min(delay_ms, 1000L) :
+							   received_changes_pending() ? 0L : 1000L);
+		delay_ms = 0;
 
 		ResetLatch(&MyProc->procLatch);
 
@@ -1390,100 +2651,89 @@ apply_work(PGconn *streamConn)
 
 		for (;;)
 		{
+			StringInfoData s;
+			bool		spooled;
+
 			if (got_SIGTERM)
 				break;
 
 			/* We must not have fallen out of MessageContext by accident */
 			Assert(CurrentMemoryContext == MessageContext);
 
-			Assert(copybuf == NULL);
-			r = PQgetCopyData(applyconn, &copybuf, 1);
+			if ((batch_remaining == 0 && spock_apply_recv_empty()) ||
+				++napplied % RECEIVE_INTERVAL == 0)
+				receive_pending(&last_received);
 
-			if (r == -1)
+			if (!next_received_message(&s, &spooled))
 			{
-				elog(ERROR, "data stream ended");
+				/* need to wait for new data */
+				break;
 			}
-			else if (r == -2)
+
+			if (spooled && spool_skip_applied(&s))
 			{
-				elog(ERROR, "could not read COPY data: %s",
-					 PQerrorMessage(applyconn));
+				release_received_message();
+				continue;
 			}
-			else if (r < 0)
-				elog(ERROR, "invalid COPY status %d", r);
-			else if (r == 0)
+
+			/*
+			 * A delayed transaction stays in the receive buffer, which spills
+			 * to disk, until it's due. Meanwhile we keep receiving and
+			 * replying to the upstream. The transactions applied before it
+			 * are committed first rather than kept open for the delay, as
+			 * the delayed one counts as pending below.
+			 */
+			if (apply_delay > 0 &&
+				(delay_ms = apply_delay_remaining(&s)) > 0)
 			{
-				/* need to wait for new data */
+				unget_received_message(spooled);
+				group_commit_finish();
+				receive_pending(&last_received);
 				break;
 			}
-			else
-			{
-				int c;
-				StringInfoData s;
-
-				/*
-				 * We're using a StringInfo to wrap existing data here, as a
-				 * cursor. We init it manually to avoid a redundant allocation.
-				 */
-				memset(&s, 0, sizeof(StringInfoData));
-				s.data = copybuf;
-				s.len = r;
-				s.maxlen = -1;
-				s.cursor = 0;
-
-				c = pq_getmsgbyte(&s);
-
-				if (c == 'w')
-				{
-					XLogRecPtr	start_lsn;
-					XLogRecPtr	end_lsn;
-
-					start_lsn = pq_getmsgint64(&s);
-					end_lsn = pq_getmsgint64(&s);
-					pq_getmsgint64(&s); /* sendTime */
-
-					if (last_received < start_lsn)
-						last_received = start_lsn;
-
-					if (last_received < end_lsn)
-						last_received = end_lsn;
-
-					replication_handler(&s);
-				}
-				else if (c == 'k')
-				{
-					XLogRecPtr endpos;
-					bool reply_requested;
-
-					endpos = pq_getmsgint64(&s);
-					/* timestamp = */ pq_getmsgint64(&s);
-					reply_requested = pq_getmsgbyte(&s);
-
-					send_feedback(applyconn, endpos,
-								  GetCurrentTimestamp(),
-								  reply_requested);
 
-					if (last_received < endpos)
-						last_received = endpos;
-				}
-				/* other message types are purposefully ignored */
+			apply_dispatch(&s);
 
-				/* copybuf is malloc'd not palloc'd */
-				if (copybuf != NULL)
-				{
-					PQfreemem(copybuf);
-					copybuf = NULL;
-				}
-			}
+			release_received_message();
 
 			/* We must not have fallen out of MessageContext by accident */
 			Assert(CurrentMemoryContext == MessageContext);
 		}
 
+		/*
+		 * Don't keep grouped transactions waiting when there's nothing to do
+		 * or for longer than spock.group_commit_timeout, which is otherwise
+		 * only checked when a remote transaction commits.
+		 */
+		if (!in_remote_transaction &&
+			(!received_changes_pending() || group_commit_expired()))
+			group_commit_finish();
+
 		/* confirm all writes at once */
+		spock_apply_spool_sync();
 		send_feedback(applyconn, last_received, GetCurrentTimestamp(), false);
 
-		if (!in_remote_transaction)
+		if (!in_remote_transaction && !received_changes_pending())
+		{
+			/*
+			 * The spool isn't needed anymore once everything in it has been
+			 * applied and flushed locally. Streamed transactions which are
+			 * still open need their earlier segments replayed after a
+			 * restart.
+			 */
+			if (group_xacts == 0 && !spock_apply_parallel_pending() &&
+				dlist_is_empty(&lsn_mapping) && !spock_apply_stream_pending())
+				spock_apply_spool_trim();
+
+			/*
+			 * Everything received so far has to be applied before the table
+			 * synchronization can move on.
+			 */
+			if (MyApplyWorker->sync_pending || SyncingTables != NIL)
+				spock_apply_parallel_drain();
+
 			process_syncing_tables(last_received);
+		}
 		
 		/* We must not have switched out of MessageContext by mistake */
 		Assert(CurrentMemoryContext == MessageContext);
@@ -1502,6 +2752,116 @@ apply_work(PGconn *streamConn)
 	}
 }
 
+/*
+ * Number of milliseconds for which the transaction starting with the message
+ * has to be held back because of the apply_delay of the subscription, zero
+ * if it can be applied now or the message doesn't start a transaction.
+ */
+static long
+apply_delay_remaining(StringInfo s)
+{
+	StringInfoData	msg = *s;
+	TimestampTz		commit_time;
+	TimestampTz		due;
+	TimestampTz		now;
+	long			sec;
+	int				usec;
+
+	switch (pq_getmsgbyte(&msg))
+	{
+		/* BEGIN */
+		case 'B':
+			{
+				XLogRecPtr		commit_lsn;
+				TransactionId	xid;
+
+				spock_read_begin(&msg, &commit_lsn, &commit_time, &xid);
+				break;
+			}
+		/* STREAM COMMIT */
+		case 'c':
+			{
+				XLogRecPtr		commit_lsn;
+				XLogRecPtr		end_lsn;
+				XLogRecPtr		origin_lsn;
+				TransactionId	xid;
+
+				(void) spock_read_stream_commit(&msg, &xid, &commit_lsn,
+												&end_lsn, &commit_time,
+												&origin_lsn);
+				break;
+			}
+		default:
+			return 0;
+	}
+
+	due = TimestampTzPlusMilliseconds(commit_time, apply_delay);
+	now = GetCurrentTimestamp();
+
+	if (due <= now)
+		return 0;
+
+	TimestampDifference(now, due, &sec, &usec);
+
+	return sec * 1000L + (usec + 999) / 1000;
+}
+
+/*
+ * Check if the message replayed from the spool belongs to a transaction which
+ * was applied before the apply worker restarted.
+ */
+static bool
+spool_skip_applied(StringInfo s)
+{
+	StringInfoData	msg = *s;
+	char			action = pq_getmsgbyte(&msg);
+	XLogRecPtr		commit_lsn;
+	TimestampTz		commit_time;
+	TransactionId	xid;
+
+	if (spool_skipping)
+	{
+		if (action == 'C')
+			spool_skipping = false;
+
+		/* Relations are described only once per connection, keep them. */
+		return action != 'R';
+	}
+
+	switch (action)
+	{
+		/* BEGIN */
+		case 'B':
+			spock_read_begin(&msg, &commit_lsn, &commit_time, &xid);
+			if (commit_lsn < spool_skip_lsn)
+			{
+				spool_skipping = true;
+				return true;
+			}
+			break;
+		/* STREAM COMMIT */
+		case 'c':
+			{
+				XLogRecPtr		end_lsn;
+				XLogRecPtr		origin_lsn;
+
+				(void) spock_read_stream_commit(&msg, &xid, &commit_lsn,
+												&end_lsn, &commit_time,
+												&origin_lsn);
+				if (commit_lsn < spool_skip_lsn)
+				{
+					spock_apply_stream_abort(xid, xid);
+					return true;
+				}
+				break;
+			}
+		default:
+			break;
+	}
+
+	return false;
+}
+
 /*
  * Add context to the errors produced by spock_execute_sql_command().
  */
@@ -1874,29 +3234,13 @@ interval_to_timeoffset(const Interval *interval)
 	return span;
 }
 
-void
-spock_apply_main(Datum main_arg)
+/*
+ * Setup the apply API and session settings shared by the apply worker and
+ * its parallel workers.
+ */
+static void
+setup_apply_session(void)
 {
-	int				slot = DatumGetInt32(main_arg);
-	PGconn		   *streamConn;
-	RepOriginId		originid;
-	XLogRecPtr		origin_startpos;
-	MemoryContext	saved_ctx;
-	char		   *repsets;
-	char		   *origins;
-
-	/* Setup shmem. */
-	spock_worker_attach(slot, SPOCK_WORKER_APPLY);
-	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY);
-	MyApplyWorker = &MySpockWorker->worker.apply;
-
-	/* Establish signal handlers. */
-	pqsignal(SIGTERM, handle_sigterm);
-
-	/* Attach to dsm segment. */
-	Assert(CurrentResourceOwner == NULL);
-	CurrentResourceOwner = ResourceOwnerCreate(NULL, "spock apply");
-
 	/* Load correct apply API. */
 	if (spock_use_spi)
 	{
@@ -1914,6 +3258,8 @@ spock_apply_main(Datum main_arg)
 		apply_api.can_multi_insert = spock_apply_spi_can_mi;
 		apply_api.multi_insert_add_tuple = spock_apply_spi_mi_add_tuple;
 		apply_api.multi_insert_finish = spock_apply_spi_mi_finish;
+		apply_api.batch_add = NULL;
+		apply_api.batch_finish = NULL;
 	}
 
 	/* Setup synchronous commit according to the user's wishes */
@@ -1933,6 +3279,33 @@ spock_apply_main(Datum main_arg)
 	 */
 	SetConfigOption("check_function_bodies", "off",
 					PGC_INTERNAL, PGC_S_OVERRIDE);
+}
+
+void
+spock_apply_main(Datum main_arg)
+{
+	int				slot = DatumGetInt32(main_arg);
+	PGconn		   *streamConn;
+	RepOriginId		originid;
+	XLogRecPtr		origin_startpos;
+	MemoryContext	saved_ctx;
+	char		   *repsets;
+	char		   *origins;
+	int				nparallel = 0;
+
+	/* Setup shmem. */
+	spock_worker_attach(slot, SPOCK_WORKER_APPLY);
+	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY);
+	MyApplyWorker = &MySpockWorker->worker.apply;
+
+	/* Establish signal handlers. */
+	pqsignal(SIGTERM, handle_sigterm);
+
+	/* Attach to dsm segment. */
+	Assert(CurrentResourceOwner == NULL);
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "spock apply");
+
+	setup_apply_session();
 
 	/* Load the subscription. */
 	StartTransactionCommand();
@@ -1976,6 +3349,26 @@ spock_apply_main(Datum main_arg)
 	replorigin_session_origin = originid;
 	origin_startpos = replorigin_session_get_progress(false);
 
+	/*
+	 * Parallel apply workers replay into origins of their own. As they commit
+	 * in the upstream order, the furthest of all the origins is where the
+	 * replication continues from.
+	 */
+	if (apply_delay == 0)
+		nparallel = spock_apply_parallel_workers;
+	origin_startpos = Max(origin_startpos,
+						  spock_apply_parallel_init_origins(MySubscription->slot_name,
+															nparallel));
+
+	/*
+	 * Transactions in the spool are applied from there, the upstream only has
+	 * to send what comes after them.
+	 */
+	spool_skip_lsn = origin_startpos;
+	origin_startpos = Max(origin_startpos,
+						  spock_apply_spool_open(MySubscription->id,
+												 spock_spool_received_changes));
+
 	/* Start the replication. */
 	streamConn = spock_connect_replica(MySubscription->origin_if->dsn,
 										   MySubscription->name, NULL);
@@ -1996,6 +3389,9 @@ spock_apply_main(Datum main_arg)
 
 	CommitTransactionCommand();
 
+	if (nparallel > 0)
+		spock_apply_parallel_start(nparallel, QueueRelid);
+
 	/*
 	 * Do an initial leak check with reporting off; we don't want to see
 	 * these results, just the later output from ADDED leak checks.
@@ -2011,3 +3407,53 @@ spock_apply_main(Datum main_arg)
 	/* We should only get here if we received sigTERM */
 	proc_exit(0);
 }
+
+/*
+ * Entry point of the parallel apply worker.
+ *
+ * The worker receives messages of the transactions the leader apply worker
+ * sent to it and applies them the same way the leader does.
+ */
+void
+spock_apply_parallel_main(Datum main_arg)
+{
+	int				slot = DatumGetInt32(main_arg);
+	MemoryContext	saved_ctx;
+	StringInfoData	s;
+
+	/* Setup shmem. */
+	spock_worker_attach(slot, SPOCK_WORKER_APPLY_PARALLEL);
+
+	/* Establish signal handlers. */
+	pqsignal(SIGTERM, handle_sigterm);
+
+	Assert(CurrentResourceOwner == NULL);
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "spock apply parallel");
+
+	/* Attach to the leader, its apply worker info is shared with us. */
+	MyApplyWorker = spock_apply_parallel_attach(&MySpockWorker->worker.parallel);
+
+	setup_apply_session();
+
+	/* Load the subscription and setup our replication origin. */
+	StartTransactionCommand();
+	saved_ctx = MemoryContextSwitchTo(TopMemoryContext);
+	MySubscription = get_subscription(MySpockWorker->worker.parallel.apply.subid);
+	MemoryContextSwitchTo(saved_ctx);
+
+	QueueRelid = get_queue_table_oid();
+	(void) spock_apply_parallel_setup_origin(MySubscription->slot_name);
+	CommitTransactionCommand();
+
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(MessageContext);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	while (!got_SIGTERM && spock_apply_parallel_receive(&s))
+		replication_handler(&s);
+
+	proc_exit(0);
+}
@@ -31,4 +31,12 @@ typedef void (*spock_apply_mi_add_tuple_fn) (SpockRelation *rel,
 												 SpockTupleData *tup);
 typedef void (*spock_apply_mi_finish_fn) (SpockRelation *rel);
 
+typedef bool (*spock_apply_batch_add_fn) (SpockRelation *rel, char action,
+										  SpockTupleData *oldtup,
+										  SpockTupleData *newtup);
+typedef void (*spock_apply_batch_finish_fn) (void);
+
+extern void spock_apply_track_commit(XLogRecPtr local_end,
+									 XLogRecPtr remote_end);
+
 #endif /* SPOCK_APPLY_H */
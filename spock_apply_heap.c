@@ -51,6 +51,9 @@
 #include "tcop/utility.h"
 
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/int8.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
@@ -68,42 +71,177 @@
 #include "spock_sync.h"
 #include "spock_worker.h"
 #include "spock_apply_heap.h"
+#include "spock_apply_parallel.h"
 
 typedef struct ApplyExecState {
 	EState			   *estate;
 	EPQState			epqstate;
 	ResultRelInfo	   *resultRelInfo;
-	TupleTableSlot	   *slot;
+	TupleTableSlot	   *slot;		/* virtual, the remote tuple */
+	TupleTableSlot	   *localslot;
 } ApplyExecState;
 
-/* State related to bulk insert */
+/*
+ * Executor state of the relations changed by the current local transaction,
+ * kept so that it does not have to be built for every row.
+ */
+typedef struct ApplyExecStateEntry
+{
+	Oid					reloid;		/* hash key */
+	Relation			relation;	/* reference held while cached */
+	ApplyExecState	   *aestate;
+	bool				invalid;	/* relcache entry changed since */
+} ApplyExecStateEntry;
+
+/*
+ * State related to bulk insert, there is one for every relation with
+ * buffered tuples.
+ */
 typedef struct ApplyMIState
 {
 	SpockRelation  *rel;
+	Relation			relation;	/* reference held while buffering */
 	ApplyExecState	   *aestate;
 
-	CommandId			cid;
 	BulkInsertState		bistate;
 
 	TupleTableSlot	  **buffered_tuples;
 	int					maxbuffered_tuples;
 	int					nbuffered_tuples;
+	Size				nbuffered_bytes;
 } ApplyMIState;
 
+/* Flush the buffer of a relation once it holds this much tuple data. */
+#define MAX_BUFFERED_BYTES		65535
 
 #define TTS_TUP(slot) (((HeapTupleTableSlot *)slot)->tuple)
 
 
-static ApplyMIState *spkmistate = NULL;
+/* List of ApplyMIState, allocated in TopTransactionContext. */
+static List *spkmistates = NIL;
+
+/* An UPDATE or DELETE waiting in ApplyBatchState. */
+typedef struct ApplyBatchChange
+{
+	int				seq;		/* position in the run */
+	SpockTupleData	oldtup;
+	SpockTupleData	newtup;		/* not used for DELETE */
+} ApplyBatchChange;
+
+/*
+ * A run of UPDATEs or DELETEs of one relation, which are applied in the order
+ * of the replica identity using a single index scan.
+ */
+typedef struct ApplyBatchState
+{
+	SpockRelation  *rel;
+	char			action;		/* 'U' or 'D' */
+	bool			enabled;	/* false if the run can't be batched */
+
+	MemoryContext	cxt;		/* everything below lives here */
+	MemoryContext	tupcxt;		/* copies of the tuples */
+
+	Relation		relation;	/* reference held while batching */
+	ApplyExecState *aestate;
+	SpockReplIdxScan *scan;
+
+	ApplyBatchChange *changes;
+	int				nchanges;
+	Size			nbytes;
+} ApplyBatchState;
+
+#define MAX_BATCH_CHANGES		1000
+#define MAX_BATCH_BYTES			(1024 * 1024)
+
+static ApplyBatchState *spkbatchstate = NULL;
+
+static HTAB *ApplyExecStateHash = NULL;
+static bool apply_exec_callbacks_registered = false;
+
+static void finish_apply_exec_state(ApplyExecState *aestate);
+static void apply_update_tuple(SpockRelation *rel, ApplyExecState *aestate,
+							   SpockTupleData *oldtup, SpockTupleData *newtup,
+							   bool found, Oid replident_idx_id);
+static void apply_delete_tuple(SpockRelation *rel, ApplyExecState *aestate,
+							   SpockTupleData *oldtup, bool found,
+							   Oid replident_idx_id);
+
+static void
+apply_exec_state_invalidate_callback(Datum arg, Oid reloid)
+{
+	ApplyExecStateEntry *entry;
+
+	if (ApplyExecStateHash == NULL)
+		return;
+
+	if (reloid != InvalidOid)
+	{
+		entry = hash_search(ApplyExecStateHash, (void *) &reloid,
+							HASH_FIND, NULL);
+		if (entry != NULL)
+			entry->invalid = true;
+	}
+	else
+	{
+		HASH_SEQ_STATUS status;
+
+		hash_seq_init(&status, ApplyExecStateHash);
+		while ((entry = (ApplyExecStateEntry *) hash_seq_search(&status)) != NULL)
+			entry->invalid = true;
+	}
+}
+
+/*
+ * The cache lives in TopTransactionContext, forget it if the transaction
+ * failed.
+ */
+static void
+apply_exec_state_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+	{
+		ApplyExecStateHash = NULL;
+		spkmistates = NIL;
+		spkbatchstate = NULL;
+	}
+}
 
 void
 spock_apply_heap_begin(void)
 {
+	if (!apply_exec_callbacks_registered)
+	{
+		CacheRegisterRelcacheCallback(apply_exec_state_invalidate_callback,
+									  (Datum) 0);
+		RegisterXactCallback(apply_exec_state_xact_callback, NULL);
+		apply_exec_callbacks_registered = true;
+	}
 }
 
+/*
+ * Release the executor state cached by the transaction.
+ *
+ * This has to happen before the commit, and also before anything from the
+ * queue is executed as that may want to alter the relations.
+ */
 void
 spock_apply_heap_commit(void)
 {
+	HASH_SEQ_STATUS			status;
+	ApplyExecStateEntry	   *entry;
+
+	if (ApplyExecStateHash == NULL)
+		return;
+
+	hash_seq_init(&status, ApplyExecStateHash);
+	while ((entry = (ApplyExecStateEntry *) hash_seq_search(&status)) != NULL)
+	{
+		finish_apply_exec_state(entry->aestate);
+		table_close(entry->relation, NoLock);
+	}
+
+	hash_destroy(ApplyExecStateHash);
+	ApplyExecStateHash = NULL;
 }
 
 
@@ -114,6 +252,9 @@ UserTableUpdateOpenIndexes(ResultRelInfo *relinfo, EState *estate, TupleTableSlo
 
 	if (relinfo->ri_NumIndices > 0)
 	{
+		instr_time	start;
+
+		SPOCK_APPLY_TIMING_START(start);
 		recheckIndexes = ExecInsertIndexTuples(
 #if PG_VERSION_NUM >= 140000
 											   relinfo,
@@ -125,6 +266,7 @@ UserTableUpdateOpenIndexes(ResultRelInfo *relinfo, EState *estate, TupleTableSlo
 #endif
 											   , false, NULL, NIL
 											   );
+		SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_INDEX_UPDATE, start);
 
 		/* FIXME: recheck the indexes */
 		if (recheckIndexes != NIL)
@@ -252,14 +394,22 @@ init_apply_exec_state(SpockRelation *rel)
 	aestate->estate->es_result_relation_info = aestate->resultRelInfo;
 #endif
 
-	aestate->slot = ExecInitExtraTupleSlot(aestate->estate);
-	ExecSetSlotDescriptor(aestate->slot, RelationGetDescr(rel->rel));
+	/*
+	 * The remote tuple is stored as the decoded values, only the table AM
+	 * forms the tuple it stores.
+	 */
+	aestate->slot = ExecAllocTableSlot(&aestate->estate->es_tupleTable,
+									   RelationGetDescr(rel->rel),
+									   &TTSOpsVirtual);
+	aestate->localslot = table_slot_create(rel->rel,
+										   &aestate->estate->es_tupleTable);
 
 	if (aestate->resultRelInfo->ri_TrigDesc)
 		EvalPlanQualInit(&aestate->epqstate, aestate->estate, NULL, NIL, -1);
 
-	/* Prepare to catch AFTER triggers. */
-	AfterTriggerBeginQuery();
+	ExecOpenIndices(aestate->resultRelInfo
+					, false
+					);
 
 	return aestate;
 }
@@ -271,9 +421,6 @@ finish_apply_exec_state(ApplyExecState *aestate)
 	/* Close indexes */
 	ExecCloseIndices(aestate->resultRelInfo);
 
-	/* Handle queued AFTER triggers. */
-	AfterTriggerEndQuery(aestate->estate);
-
 	/* Terminate EPQ execution if active. */
 	if (aestate->resultRelInfo->ri_TrigDesc)
 		EvalPlanQualEnd(&aestate->epqstate);
@@ -287,63 +434,180 @@ finish_apply_exec_state(ApplyExecState *aestate)
 }
 
 /*
- * Handle insert via low level api.
+ * Get the executor state for applying a row to the relation.
+ *
+ * The state is built on first use in a transaction and reused for the
+ * following rows, until the relation changes or the transaction commits.
  */
-void
-spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
+static ApplyExecState *
+get_apply_exec_state(SpockRelation *rel)
 {
-	ApplyExecState	   *aestate;
-	Oid					conflicts_idx_id;
-	TupleTableSlot	   *localslot;
-	HeapTuple			remotetuple;
-	HeapTuple			applytuple;
-	SpockConflictResolution resolution;
-	List			   *recheckIndexes = NIL;
-	MemoryContext		oldctx;
-	bool				has_before_triggers = false;
+	ApplyExecStateEntry *entry;
+	ApplyExecState *aestate;
+	Oid				reloid = RelationGetRelid(rel->rel);
+	bool			found;
 
-	/* Initialize the executor state. */
-	aestate = init_apply_exec_state(rel);
-	localslot = table_slot_create(rel->rel, &aestate->estate->es_tupleTable);
+	if (ApplyExecStateHash == NULL)
+	{
+		HASHCTL		ctl;
 
-	ExecOpenIndices(aestate->resultRelInfo
-					, false
-					);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(ApplyExecStateEntry);
+		ctl.hcxt = TopTransactionContext;
 
-	/*
-	 * Check for existing tuple with same key in any unique index containing
-	 * only normal columns. This doesn't just check the replica identity index,
-	 * but it'll prefer it and use it first.
-	 */
-	conflicts_idx_id = spock_tuple_find_conflict(aestate->resultRelInfo,
-													 newtup,
-													 localslot);
+		ApplyExecStateHash = hash_create("spock apply executor state", 16,
+										 &ctl,
+										 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
 
-	/* Process and store remote tuple in the slot */
-	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
-	fill_missing_defaults(rel, aestate->estate, newtup);
-	remotetuple = heap_form_tuple(RelationGetDescr(rel->rel),
-								  newtup->values, newtup->nulls);
-	MemoryContextSwitchTo(oldctx);
-	ExecStoreHeapTuple(remotetuple, aestate->slot, true);
+	entry = hash_search(ApplyExecStateHash, (void *) &reloid, HASH_ENTER,
+						&found);
 
-	if (aestate->resultRelInfo->ri_TrigDesc &&
-		aestate->resultRelInfo->ri_TrigDesc->trig_insert_before_row)
+	if (found && (entry->invalid ||
+				  entry->aestate->resultRelInfo->ri_RelationDesc != rel->rel))
 	{
-		has_before_triggers = true;
+		finish_apply_exec_state(entry->aestate);
+		table_close(entry->relation, NoLock);
+		found = false;
+	}
+
+	if (!found)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopTransactionContext);
+
+		entry->relation = NULL;
+		entry->aestate = NULL;
+		entry->invalid = false;
+
+		/*
+		 * The caller doesn't keep the relation open between the rows, but
+		 * the executor state refers to it. The lock is held until the end
+		 * of the transaction anyway.
+		 */
+		entry->relation = table_open(reloid, NoLock);
+
+		aestate = init_apply_exec_state(rel);
+		entry->aestate = aestate;
+
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	aestate = entry->aestate;
+
+	/* Finding the local row may increment the command counter, see below. */
+	aestate->estate->es_output_cid = GetCurrentCommandId(true);
+
+	/* Prepare to catch AFTER triggers. */
+	AfterTriggerBeginQuery();
+
+	return aestate;
+}
+
+/*
+ * Done with the row, fire the AFTER triggers and release what the row used.
+ */
+static void
+release_apply_exec_state(ApplyExecState *aestate)
+{
+	instr_time	start;
+
+	/* Handle queued AFTER triggers. */
+	SPOCK_APPLY_TIMING_START(start);
+	AfterTriggerEndQuery(aestate->estate);
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+	ExecClearTuple(aestate->slot);
+	ExecClearTuple(aestate->localslot);
+	ResetPerTupleExprContext(aestate->estate);
+}
+
+/*
+ * Store the values of the remote tuple in aestate->slot.
+ */
+static void
+store_remote_tuple(ApplyExecState *aestate, SpockTupleData *tup)
+{
+	TupleTableSlot *slot = aestate->slot;
+	int				natts = slot->tts_tupleDescriptor->natts;
+
+	ExecClearTuple(slot);
+	memcpy(slot->tts_values, tup->values, natts * sizeof(Datum));
+	memcpy(slot->tts_isnull, tup->nulls, natts * sizeof(bool));
+	ExecStoreVirtualTuple(slot);
+}
 
-		if (!ExecBRInsertTriggers(aestate->estate,
-								  aestate->resultRelInfo,
-								  aestate->slot))
+/*
+ * Store the local tuple in aestate->localslot, modified by the changed
+ * columns of the remote tuple, in aestate->slot.
+ *
+ * If oldtup is given, the columns it carries are used for the columns the
+ * remote tuple didn't change instead of the local ones, so that the result
+ * is the remote row even when the local row was changed in the meantime.
+ */
+static void
+store_remote_update(ApplyExecState *aestate, SpockTupleData *oldtup,
+					SpockTupleData *tup)
+{
+	TupleTableSlot *slot = aestate->slot;
+	TupleTableSlot *localslot = aestate->localslot;
+	int				natts = slot->tts_tupleDescriptor->natts;
+	int				i;
+
+	slot_getallattrs(localslot);
+
+	ExecClearTuple(slot);
+	for (i = 0; i < natts; i++)
+	{
+		if (tup->changed[i])
 		{
-			finish_apply_exec_state(aestate);
-			return;
+			slot->tts_values[i] = tup->values[i];
+			slot->tts_isnull[i] = tup->nulls[i];
+		}
+		else if (oldtup != NULL && oldtup->changed[i])
+		{
+			slot->tts_values[i] = oldtup->values[i];
+			slot->tts_isnull[i] = oldtup->nulls[i];
+		}
+		else
+		{
+			slot->tts_values[i] = localslot->tts_values[i];
+			slot->tts_isnull[i] = localslot->tts_isnull[i];
 		}
-
 	}
+	ExecStoreVirtualTuple(slot);
+}
 
-	/* trigger might have changed tuple */
-	remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
+/*
+ * Form a heap tuple of the remote tuple in aestate->slot, which conflict
+ * resolution and reporting work with.
+ */
+static HeapTuple
+remote_heap_tuple(ApplyExecState *aestate)
+{
+	MemoryContext	oldctx;
+	HeapTuple		tuple;
+
+	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
+	tuple = ExecCopySlotHeapTuple(aestate->slot);
+	MemoryContextSwitchTo(oldctx);
+
+	return tuple;
+}
+
+/*
+ * Insert the remote tuple stored in aestate->slot.
+ *
+ * If conflicts_idx_id is valid, the local tuple in aestate->localslot has the
+ * same key in that index and the conflict is resolved instead.
+ */
+static void
+apply_insert_tuple(SpockRelation *rel, ApplyExecState *aestate,
+				   Oid conflicts_idx_id, bool has_before_triggers)
+{
+	TupleTableSlot	   *localslot = aestate->localslot;
+	List			   *recheckIndexes = NIL;
+	instr_time			start;
 
 	/* Did we find matching key in any candidate-key index? */
 	if (OidIsValid(conflicts_idx_id))
@@ -353,6 +617,12 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 		RepOriginId			local_origin;
 		bool				apply;
 		bool				local_origin_found;
+		HeapTuple			remotetuple;
+		HeapTuple			applytuple;
+		SpockConflictResolution resolution;
+
+		/* trigger might have changed tuple */
+		remotetuple = remote_heap_tuple(aestate);
 
 		local_origin_found = get_tuple_origin(TTS_TUP(localslot), &xmin,
 											  &local_origin, &local_ts);
@@ -374,27 +644,26 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 			bool update_indexes;
 
 			if (applytuple != remotetuple)
-				ExecStoreHeapTuple(applytuple, aestate->slot, false);
+				ExecForceStoreHeapTuple(applytuple, aestate->slot, false);
 
 			if (aestate->resultRelInfo->ri_TrigDesc &&
 				aestate->resultRelInfo->ri_TrigDesc->trig_update_before_row)
 			{
-				if (!ExecBRUpdateTriggers(aestate->estate,
-										  &aestate->epqstate,
-										  aestate->resultRelInfo,
-										  &(TTS_TUP(localslot)->t_self),
-										  NULL,
-										  aestate->slot))
-				{
-					finish_apply_exec_state(aestate);
+				bool		doupdate;
+
+				SPOCK_APPLY_TIMING_START(start);
+				doupdate = ExecBRUpdateTriggers(aestate->estate,
+												&aestate->epqstate,
+												aestate->resultRelInfo,
+												&(TTS_TUP(localslot)->t_self),
+												NULL,
+												aestate->slot);
+				SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+				if (!doupdate)
 					return;
-				}
-
 			}
 
-			/* trigger might have changed tuple */
-			remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
-
 			/* Check the constraints of the tuple */
 			if (rel->rel->rd_att->constr)
 				ExecConstraints(aestate->resultRelInfo, aestate->slot,
@@ -431,12 +700,66 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 		ExecARInsertTriggers(aestate->estate, aestate->resultRelInfo,
 							 aestate->slot, recheckIndexes);
 	}
+}
 
-	finish_apply_exec_state(aestate);
+/*
+ * Handle insert via low level api.
+ */
+void
+spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
+{
+	ApplyExecState	   *aestate;
+	Oid					conflicts_idx_id;
+	TupleTableSlot	   *localslot;
+	MemoryContext		oldctx;
+	bool				has_before_triggers = false;
+	instr_time			start;
 
-	CommandCounterIncrement();
-}
+	aestate = get_apply_exec_state(rel);
+	localslot = aestate->localslot;
+
+	/*
+	 * Check for existing tuple with same key in any unique index containing
+	 * only normal columns. This doesn't just check the replica identity index,
+	 * but it'll prefer it and use it first.
+	 */
+	conflicts_idx_id = spock_tuple_find_conflict(rel, aestate->resultRelInfo,
+													 newtup,
+													 localslot);
+
+	/* Finding the local tuple may have incremented the command counter. */
+	aestate->estate->es_output_cid = GetCurrentCommandId(true);
+
+	/* Process and store remote tuple in the slot */
+	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
+	fill_missing_defaults(rel, aestate->estate, newtup);
+	MemoryContextSwitchTo(oldctx);
+	store_remote_tuple(aestate, newtup);
+
+	if (aestate->resultRelInfo->ri_TrigDesc &&
+		aestate->resultRelInfo->ri_TrigDesc->trig_insert_before_row)
+	{
+		bool		doinsert;
 
+		has_before_triggers = true;
+
+		SPOCK_APPLY_TIMING_START(start);
+		doinsert = ExecBRInsertTriggers(aestate->estate,
+										aestate->resultRelInfo,
+										aestate->slot);
+		SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+		if (!doinsert)
+		{
+			release_apply_exec_state(aestate);
+			return;
+		}
+	}
+
+	apply_insert_tuple(rel, aestate, conflicts_idx_id, has_before_triggers);
+
+	release_apply_exec_state(aestate);
+}
 
 /*
  * Handle update via low level api.
@@ -447,20 +770,38 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 {
 	ApplyExecState	   *aestate;
 	bool				found;
-	TupleTableSlot	   *localslot;
+	Oid					replident_idx_id;
+
+	aestate = get_apply_exec_state(rel);
+
+	/* Search for existing tuple with same key */
+	found = spock_tuple_find_replidx(rel, aestate->resultRelInfo, oldtup,
+										 aestate->localslot, &replident_idx_id);
+
+	apply_update_tuple(rel, aestate, oldtup, newtup, found, replident_idx_id);
+
+	/* Cleanup. */
+	release_apply_exec_state(aestate);
+}
+
+/*
+ * Update the local tuple stored in aestate->localslot, if found, to the
+ * remote tuple.
+ */
+static void
+apply_update_tuple(SpockRelation *rel, ApplyExecState *aestate,
+				   SpockTupleData *oldtup, SpockTupleData *newtup,
+				   bool found, Oid replident_idx_id)
+{
+	TupleTableSlot	   *localslot = aestate->localslot;
 	HeapTuple			remotetuple;
 	List			   *recheckIndexes = NIL;
 	MemoryContext		oldctx;
-	Oid					replident_idx_id;
 	bool				has_before_triggers = false;
+	instr_time			start;
 
-	/* Initialize the executor state. */
-	aestate = init_apply_exec_state(rel);
-	localslot = table_slot_create(rel->rel, &aestate->estate->es_tupleTable);
-
-	/* Search for existing tuple with same key */
-	found = spock_tuple_find_replidx(aestate->resultRelInfo, oldtup, localslot,
-										 &replident_idx_id);
+	/* Finding the local tuple may have incremented the command counter. */
+	aestate->estate->es_output_cid = GetCurrentCommandId(true);
 
 	/*
 	 * Tuple found, update the local tuple.
@@ -474,51 +815,60 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 		TimestampTz		local_ts;
 		RepOriginId		local_origin;
 		bool			local_origin_found;
+		bool			conflict;
 		bool			apply;
 		HeapTuple		applytuple;
 
-		/* Process and store remote tuple in the slot */
+		local_origin_found = get_tuple_origin(TTS_TUP(localslot), &xmin,
+											  &local_origin, &local_ts);
+
+		/*
+		 * If the local tuple was previously updated by different transaction
+		 * on different server, consider this to be conflict and resolve it.
+		 * Rows written by the parallel apply workers of this subscription
+		 * came from the same server.
+		 */
+		conflict = local_origin_found &&
+			xmin != GetTopTransactionId() &&
+			!spock_apply_origin_is_ours(local_origin);
+
+		/*
+		 * Process and store remote tuple in the slot. In a conflict, the
+		 * columns the remote update didn't change are taken from the old
+		 * remote tuple, so that the local changes aren't reported and kept
+		 * as part of the remote tuple.
+		 */
 		oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
 		fill_missing_defaults(rel, aestate->estate, newtup);
-		remotetuple = heap_modify_tuple(TTS_TUP(localslot),
-										RelationGetDescr(rel->rel),
-										newtup->values,
-										newtup->nulls,
-										newtup->changed);
 		MemoryContextSwitchTo(oldctx);
-		ExecStoreHeapTuple(remotetuple, aestate->slot, true);
+		store_remote_update(aestate, conflict ? oldtup : NULL, newtup);
 
 		if (aestate->resultRelInfo->ri_TrigDesc &&
 			aestate->resultRelInfo->ri_TrigDesc->trig_update_before_row)
 		{
+			bool		doupdate;
+
 			has_before_triggers = true;
 
-			if (!ExecBRUpdateTriggers(aestate->estate,
-									  &aestate->epqstate,
-									  aestate->resultRelInfo,
-									  &(TTS_TUP(localslot)->t_self),
-									  NULL, aestate->slot))
-			{
-				finish_apply_exec_state(aestate);
+			SPOCK_APPLY_TIMING_START(start);
+			doupdate = ExecBRUpdateTriggers(aestate->estate,
+											&aestate->epqstate,
+											aestate->resultRelInfo,
+											&(TTS_TUP(localslot)->t_self),
+											NULL, aestate->slot);
+			SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+			if (!doupdate)
 				return;
-			}
 		}
 
-		/* trigger might have changed tuple */
-		remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
-		local_origin_found = get_tuple_origin(TTS_TUP(localslot), &xmin,
-											  &local_origin, &local_ts);
-
-		/*
-		 * If the local tuple was previously updated by different transaction
-		 * on different server, consider this to be conflict and resolve it.
-		 */
-		if (local_origin_found &&
-			xmin != GetTopTransactionId() &&
-			local_origin != replorigin_session_origin)
+		if (conflict)
 		{
 			SpockConflictResolution resolution;
 
+			/* trigger might have changed tuple */
+			remotetuple = remote_heap_tuple(aestate);
+
 			apply = try_resolve_conflict(rel->rel, TTS_TUP(localslot),
 										 remotetuple, &applytuple,
 										 &resolution);
@@ -531,13 +881,10 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 									  has_before_triggers);
 
 			if (applytuple != remotetuple)
-				ExecStoreHeapTuple(applytuple, aestate->slot, false);
+				ExecForceStoreHeapTuple(applytuple, aestate->slot, false);
 		}
 		else
-		{
 			apply = true;
-			applytuple = remotetuple;
-		}
 
 		if (apply)
 		{
@@ -553,15 +900,10 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 									  aestate->estate->es_snapshot,
 									  &update_indexes);
 			if (update_indexes)
-			{
-				ExecOpenIndices(aestate->resultRelInfo
-								, false
-							   );
 				recheckIndexes = UserTableUpdateOpenIndexes(aestate->resultRelInfo,
 															aestate->estate,
 															aestate->slot,
 															true);
-			}
 
 			/* AFTER ROW UPDATE Triggers */
 			ExecARUpdateTriggers(aestate->estate, aestate->resultRelInfo,
@@ -585,11 +927,6 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 								  InvalidRepOriginId, (TimestampTz)0,
 								  replident_idx_id, has_before_triggers);
 	}
-
-	/* Cleanup. */
-	finish_apply_exec_state(aestate);
-
-	CommandCounterIncrement();
 }
 
 /*
@@ -599,33 +936,53 @@ void
 spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 {
 	ApplyExecState	   *aestate;
-	TupleTableSlot	   *localslot;
+	bool				found;
 	Oid					replident_idx_id;
+
+	aestate = get_apply_exec_state(rel);
+
+	found = spock_tuple_find_replidx(rel, aestate->resultRelInfo, oldtup,
+									 aestate->localslot, &replident_idx_id);
+
+	apply_delete_tuple(rel, aestate, oldtup, found, replident_idx_id);
+
+	/* Cleanup. */
+	release_apply_exec_state(aestate);
+}
+
+/*
+ * Delete the local tuple stored in aestate->localslot, if found.
+ */
+static void
+apply_delete_tuple(SpockRelation *rel, ApplyExecState *aestate,
+				   SpockTupleData *oldtup, bool found, Oid replident_idx_id)
+{
+	TupleTableSlot	   *localslot = aestate->localslot;
 	bool				has_before_triggers = false;
+	instr_time			start;
 
-	/* Initialize the executor state. */
-	aestate = init_apply_exec_state(rel);
-	localslot = table_slot_create(rel->rel, &aestate->estate->es_tupleTable);
+	/* Finding the local tuple may have incremented the command counter. */
+	aestate->estate->es_output_cid = GetCurrentCommandId(true);
 
-	if (spock_tuple_find_replidx(aestate->resultRelInfo, oldtup, localslot,
-									 &replident_idx_id))
+	if (found)
 	{
 		if (aestate->resultRelInfo->ri_TrigDesc &&
 			aestate->resultRelInfo->ri_TrigDesc->trig_delete_before_row)
 		{
-			bool dodelete = ExecBRDeleteTriggers(aestate->estate,
-												 &aestate->epqstate,
-												 aestate->resultRelInfo,
-												 &(TTS_TUP(localslot)->t_self),
-												 NULL);
+			bool		dodelete;
+
+			SPOCK_APPLY_TIMING_START(start);
+			dodelete = ExecBRDeleteTriggers(aestate->estate,
+											&aestate->epqstate,
+											aestate->resultRelInfo,
+											&(TTS_TUP(localslot)->t_self),
+											NULL);
+			SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
 
 			has_before_triggers = true;
 
 			if (!dodelete)		/* "do nothing" */
-			{
-				finish_apply_exec_state(aestate);
 				return;
-			}
 		}
 
 		/* Tuple found, delete it. */
@@ -646,55 +1003,322 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 								  InvalidRepOriginId, (TimestampTz)0,
 								  replident_idx_id, has_before_triggers);
 	}
+}
 
-	/* Cleanup. */
-	finish_apply_exec_state(aestate);
+/*
+ * Set up the batching of a run of changes of the relation.
+ *
+ * The rows are applied in another order than they were changed upstream,
+ * which must not be visible: there may be no row triggers and, for UPDATEs,
+ * no unique index other than the replica identity, which could be violated
+ * in between.
+ */
+static ApplyBatchState *
+spock_apply_heap_batch_start(SpockRelation *rel, char action)
+{
+	MemoryContext	cxt;
+	MemoryContext	oldctx;
+	ApplyBatchState *bstate;
+	ResultRelInfo  *resultRelInfo;
+	int				i;
 
-	CommandCounterIncrement();
+	cxt = AllocSetContextCreate(TopTransactionContext,
+								"spock apply batch",
+								ALLOCSET_DEFAULT_SIZES);
+	oldctx = MemoryContextSwitchTo(cxt);
+
+	bstate = palloc0(sizeof(ApplyBatchState));
+	bstate->rel = rel;
+	bstate->action = action;
+	bstate->cxt = cxt;
+
+	bstate->enabled = !rel->hasTriggers &&
+		OidIsValid(RelationGetReplicaIndex(rel->rel));
+
+	if (bstate->enabled)
+	{
+		bstate->tupcxt = AllocSetContextCreate(cxt,
+											   "spock apply batch tuples",
+											   ALLOCSET_DEFAULT_SIZES);
+
+		/* The caller doesn't keep the relation open between the changes. */
+		bstate->relation = table_open(RelationGetRelid(rel->rel), NoLock);
+
+		bstate->aestate = init_apply_exec_state(rel);
+		MemoryContextSwitchTo(cxt);
+		resultRelInfo = bstate->aestate->resultRelInfo;
+
+		bstate->scan = spock_replidx_scan_begin(rel, resultRelInfo);
+
+		if (!spock_replidx_scan_sortable(bstate->scan))
+			bstate->enabled = false;
+
+		for (i = 0; action == 'U' && i < resultRelInfo->ri_NumIndices; i++)
+		{
+			if (resultRelInfo->ri_IndexRelationInfo[i]->ii_Unique &&
+				RelationGetRelid(resultRelInfo->ri_IndexRelationDescs[i]) !=
+				spock_replidx_scan_index(bstate->scan))
+				bstate->enabled = false;
+		}
+
+		bstate->changes = palloc(MAX_BATCH_CHANGES * sizeof(ApplyBatchChange));
+	}
+
+	MemoryContextSwitchTo(oldctx);
+
+	return bstate;
+}
+
+static int
+batch_change_cmp(const void *a, const void *b, void *arg)
+{
+	const ApplyBatchChange *ca = (const ApplyBatchChange *) a;
+	const ApplyBatchChange *cb = (const ApplyBatchChange *) b;
+	int			cmp;
+
+	cmp = spock_replidx_scan_compare((SpockReplIdxScan *) arg,
+									 (SpockTupleData *) &ca->oldtup,
+									 (SpockTupleData *) &cb->oldtup);
+	if (cmp != 0)
+		return cmp;
+
+	/* Changes of the same row stay in their order. */
+	return ca->seq - cb->seq;
+}
+
+/* Apply the changes collected so far. */
+static void
+spock_apply_heap_batch_flush(ApplyBatchState *bstate)
+{
+	SpockRelation  *rel = bstate->rel;
+	ApplyExecState *aestate = bstate->aestate;
+	Oid				replident_idx_id;
+	MemoryContext	oldctx;
+	bool			opened = false;
+	int				i;
+	instr_time		start;
+
+	if (bstate->nchanges == 0)
+		return;
+
+	/* The relation may have been closed after the last change. */
+	if (rel->rel == NULL)
+	{
+		rel = spock_relation_open(rel->remoteid, NoLock);
+		opened = true;
+	}
+
+	/* Visit the index and lock the rows in the order of the key. */
+	oldctx = MemoryContextSwitchTo(bstate->cxt);
+	qsort_arg(bstate->changes, bstate->nchanges, sizeof(ApplyBatchChange),
+			  batch_change_cmp, bstate->scan);
+	MemoryContextSwitchTo(oldctx);
+
+	replident_idx_id = spock_replidx_scan_index(bstate->scan);
+
+	AfterTriggerBeginQuery();
+
+	for (i = 0; i < bstate->nchanges; i++)
+	{
+		ApplyBatchChange *change = &bstate->changes[i];
+		bool		found;
+
+		found = spock_replidx_scan_find(bstate->scan, &change->oldtup,
+										aestate->localslot);
+
+		if (bstate->action == 'U')
+			apply_update_tuple(rel, aestate, &change->oldtup,
+							   &change->newtup, found, replident_idx_id);
+		else
+			apply_delete_tuple(rel, aestate, &change->oldtup, found,
+							   replident_idx_id);
+
+		ExecClearTuple(aestate->slot);
+		ExecClearTuple(aestate->localslot);
+		ResetPerTupleExprContext(aestate->estate);
+	}
+
+	SPOCK_APPLY_TIMING_START(start);
+	AfterTriggerEndQuery(aestate->estate);
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+	if (opened)
+		spock_relation_close(rel, NoLock);
+
+	bstate->nchanges = 0;
+	bstate->nbytes = 0;
+	MemoryContextReset(bstate->tupcxt);
+}
+
+/* Copy a tuple of the relation into the current memory context. */
+static Size
+batch_copy_tuple(SpockTupleData *dst, SpockTupleData *src, TupleDesc desc)
+{
+	Size		size = 0;
+	int			i;
+
+	dst->natts = src->natts;
+	dst->values = palloc(src->natts * sizeof(Datum));
+	dst->nulls = palloc(src->natts * sizeof(bool));
+	memcpy(dst->nulls, src->nulls, src->natts * sizeof(bool));
+	if (src->changed)
+	{
+		dst->changed = palloc(src->natts * sizeof(bool));
+		memcpy(dst->changed, src->changed, src->natts * sizeof(bool));
+	}
+	else
+		dst->changed = NULL;
+
+	for (i = 0; i < src->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+
+		if (src->nulls[i])
+		{
+			dst->values[i] = (Datum) 0;
+			continue;
+		}
+
+		dst->values[i] = datumCopy(src->values[i], att->attbyval,
+								   att->attlen);
+		if (!att->attbyval)
+			size += datumGetSize(src->values[i], att->attbyval, att->attlen);
+	}
+
+	return size + src->natts * (sizeof(Datum) + 2 * sizeof(bool));
 }
 
+/*
+ * Add an UPDATE or DELETE to the run of changes of the relation.
+ *
+ * Returns false if the change can't be batched, the changes added before it
+ * have been applied then and the caller applies it the usual way.
+ */
+bool
+spock_apply_heap_batch_add(SpockRelation *rel, char action,
+						   SpockTupleData *oldtup, SpockTupleData *newtup)
+{
+	ApplyBatchState *bstate = spkbatchstate;
+	ApplyBatchChange *change;
+	MemoryContext	oldctx;
+	TupleDesc		desc;
+
+	if (bstate && (bstate->rel != rel || bstate->action != action))
+	{
+		spock_apply_heap_batch_finish();
+		bstate = NULL;
+	}
+
+	if (bstate == NULL)
+		spkbatchstate = bstate = spock_apply_heap_batch_start(rel, action);
+
+	if (!bstate->enabled)
+		return false;
+
+	/* An update of the key could be applied before the row gets the key. */
+	if (action == 'U' && oldtup != newtup &&
+		!spock_replidx_scan_same_key(bstate->scan, oldtup, newtup))
+	{
+		spock_apply_heap_batch_flush(bstate);
+		return false;
+	}
+
+	if (bstate->nchanges >= MAX_BATCH_CHANGES ||
+		bstate->nbytes >= MAX_BATCH_BYTES)
+		spock_apply_heap_batch_flush(bstate);
+
+	desc = RelationGetDescr(rel->rel);
+	change = &bstate->changes[bstate->nchanges];
+	change->seq = bstate->nchanges;
+
+	oldctx = MemoryContextSwitchTo(bstate->tupcxt);
+	bstate->nbytes += batch_copy_tuple(&change->oldtup, oldtup, desc);
+	if (action == 'U')
+	{
+		if (oldtup == newtup)
+			change->newtup = change->oldtup;
+		else
+			bstate->nbytes += batch_copy_tuple(&change->newtup, newtup, desc);
+	}
+	MemoryContextSwitchTo(oldctx);
+
+	bstate->nchanges++;
+
+	return true;
+}
+
+/*
+ * Apply the batched changes, if any, and forget the batch.
+ */
+void
+spock_apply_heap_batch_finish(void)
+{
+	ApplyBatchState *bstate = spkbatchstate;
+
+	if (bstate == NULL)
+		return;
+
+	if (bstate->enabled)
+		spock_apply_heap_batch_flush(bstate);
+
+	if (bstate->scan)
+		spock_replidx_scan_end(bstate->scan);
+	if (bstate->aestate)
+		finish_apply_exec_state(bstate->aestate);
+	if (bstate->relation)
+		table_close(bstate->relation, NoLock);
+
+	spkbatchstate = NULL;
+	MemoryContextDelete(bstate->cxt);
+}
 
 bool
 spock_apply_heap_can_mi(SpockRelation *rel)
 {
-	/* Multi insert is only supported when conflicts result in errors. */
-	return spock_conflict_resolver == SPOCK_RESOLVE_ERROR;
+	/* Conflicts are looked for when the buffered tuples are written. */
+	return true;
 }
 
 /*
- * MultiInsert initialization.
+ * Find the MultiInsert state of the relation, initialize it if there is none.
  */
-static void
+static ApplyMIState *
 spock_apply_heap_mi_start(SpockRelation *rel)
 {
 	MemoryContext	oldctx;
+	ApplyMIState   *mistate;
 	ApplyExecState *aestate;
 	ResultRelInfo  *resultRelInfo;
 	TupleDesc		desc;
 	bool			volatile_defexprs = false;
+	ListCell	   *lc;
 
-	if (spkmistate && spkmistate->rel == rel)
-		return;
+	foreach (lc, spkmistates)
+	{
+		mistate = (ApplyMIState *) lfirst(lc);
 
-	if (spkmistate && spkmistate->rel != rel)
-		spock_apply_heap_mi_finish(spkmistate->rel);
+		if (mistate->rel == rel)
+			return mistate;
+	}
 
 	oldctx = MemoryContextSwitchTo(TopTransactionContext);
 
 	/* Initialize new MultiInsert state. */
-	spkmistate = palloc0(sizeof(ApplyMIState));
+	mistate = palloc0(sizeof(ApplyMIState));
+
+	mistate->rel = rel;
 
-	spkmistate->rel = rel;
+	/*
+	 * The caller doesn't keep the relation open between the inserts, but the
+	 * executor state refers to it.
+	 */
+	mistate->relation = table_open(RelationGetRelid(rel->rel), NoLock);
 
 	/* Initialize the executor state. */
-	spkmistate->aestate = aestate = init_apply_exec_state(rel);
+	mistate->aestate = aestate = init_apply_exec_state(rel);
 	MemoryContextSwitchTo(TopTransactionContext);
 	resultRelInfo = aestate->resultRelInfo;
 
-	ExecOpenIndices(resultRelInfo
-					, false
-					);
-
 	/* Check if table has any volatile default expressions. */
 	desc = RelationGetDescr(rel->rel);
 	if (desc->natts != rel->natts)
@@ -731,44 +1355,156 @@ spock_apply_heap_mi_start(SpockRelation *rel)
 		  resultRelInfo->ri_TrigDesc->trig_insert_instead_row)) ||
 		volatile_defexprs)
 	{
-		spkmistate->maxbuffered_tuples = 1;
+		mistate->maxbuffered_tuples = 1;
 	}
 	else
 	{
-		spkmistate->maxbuffered_tuples = 1000;
+		mistate->maxbuffered_tuples = 1000;
 	}
 
-	spkmistate->cid = GetCurrentCommandId(true);
-	spkmistate->bistate = GetBulkInsertState();
+	mistate->bistate = GetBulkInsertState();
 
 	/* Make the space for buffer. */
-	spkmistate->buffered_tuples = palloc0(spkmistate->maxbuffered_tuples * sizeof(TupleTableSlot *));
-	spkmistate->nbuffered_tuples = 0;
+	mistate->buffered_tuples = palloc0(mistate->maxbuffered_tuples * sizeof(TupleTableSlot *));
+	mistate->nbuffered_tuples = 0;
+	mistate->nbuffered_bytes = 0;
+
+	spkmistates = lappend(spkmistates, mistate);
 
 	MemoryContextSwitchTo(oldctx);
+
+	return mistate;
+}
+
+/*
+ * Look for existing tuples with the same key as the buffered ones.
+ *
+ * The buffer is reordered so that the tuples without conflict come first,
+ * keeping their order, and the number of those is returned.
+ */
+static int
+spock_apply_heap_mi_find_conflicts(ApplyMIState *mistate)
+{
+	ApplyExecState *aestate = mistate->aestate;
+	TupleTableSlot **slots = mistate->buffered_tuples;
+	TupleTableSlot **conflicting;
+	int				nconflicting = 0;
+	int				nclean = 0;
+	int				i;
+
+	conflicting = palloc(mistate->nbuffered_tuples * sizeof(TupleTableSlot *));
+
+	for (i = 0; i < mistate->nbuffered_tuples; i++)
+	{
+		SpockTupleData	tup;
+
+		slot_getallattrs(slots[i]);
+		tup.natts = slots[i]->tts_tupleDescriptor->natts;
+		tup.values = slots[i]->tts_values;
+		tup.nulls = slots[i]->tts_isnull;
+		tup.changed = NULL;
+
+		if (OidIsValid(spock_tuple_find_conflict(mistate->rel,
+												 aestate->resultRelInfo,
+												 &tup, aestate->localslot)))
+			conflicting[nconflicting++] = slots[i];
+		else
+			slots[nclean++] = slots[i];
+
+		ExecClearTuple(aestate->localslot);
+	}
+
+	memcpy(slots + nclean, conflicting,
+		   nconflicting * sizeof(TupleTableSlot *));
+	pfree(conflicting);
+
+	return nclean;
+}
+
+/*
+ * Apply a buffered tuple which conflicts with an existing one, the same way
+ * a single INSERT is applied.
+ */
+static void
+spock_apply_heap_mi_resolve(ApplyMIState *mistate, TupleTableSlot *slot)
+{
+	ApplyExecState *aestate = mistate->aestate;
+	TriggerDesc	   *trigdesc = aestate->resultRelInfo->ri_TrigDesc;
+	SpockTupleData	tup;
+	Oid				conflicts_idx_id;
+
+	slot_getallattrs(slot);
+	tup.natts = slot->tts_tupleDescriptor->natts;
+	tup.values = slot->tts_values;
+	tup.nulls = slot->tts_isnull;
+	tup.changed = NULL;
+
+	/* Find the local tuple again, it may have been one we just inserted. */
+	conflicts_idx_id = spock_tuple_find_conflict(mistate->rel,
+												 aestate->resultRelInfo,
+												 &tup, aestate->localslot);
+
+	/*
+	 * The lookup, and the tuples resolved before this one, may have
+	 * incremented the command counter since the flush started.
+	 */
+	aestate->estate->es_output_cid = GetCurrentCommandId(true);
+
+	ExecCopySlot(aestate->slot, slot);
+
+	apply_insert_tuple(mistate->rel, aestate, conflicts_idx_id,
+					   trigdesc != NULL && trigdesc->trig_insert_before_row);
+
+	ExecClearTuple(aestate->slot);
+	ExecClearTuple(aestate->localslot);
+
+	/* Make the changes visible to the following conflict checks. */
+	CommandCounterIncrement();
 }
 
 /* Write the buffered tuples. */
 static void
-spock_apply_heap_mi_flush(void)
+spock_apply_heap_mi_flush(ApplyMIState *mistate)
 {
 	MemoryContext	oldctx;
 	ResultRelInfo  *resultRelInfo;
+	int				nclean;
 	int				i;
+	instr_time		start;
 
-	if (!spkmistate || spkmistate->nbuffered_tuples == 0)
+	if (mistate->nbuffered_tuples == 0)
 		return;
 
-	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(spkmistate->aestate->estate));
-	heap_multi_insert(spkmistate->rel->rel,
-					  spkmistate->buffered_tuples,
-					  spkmistate->nbuffered_tuples,
-					  spkmistate->cid,
-					  0, /* hi_options */
-					  spkmistate->bistate);
+	SPOCK_APPLY_STATS_ADD(n_multi_insert_flush, 1);
+
+	/*
+	 * Other changes may have been applied since the tuples were buffered,
+	 * so the command id and AFTER trigger query level are set up here.
+	 */
+	mistate->aestate->estate->es_output_cid = GetCurrentCommandId(true);
+	AfterTriggerBeginQuery();
+
+	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(mistate->aestate->estate));
+
+	/*
+	 * Unless conflicts just result in errors, the tuples which conflict are
+	 * applied one by one after the others were written together.
+	 */
+	if (spock_conflict_resolver != SPOCK_RESOLVE_ERROR)
+		nclean = spock_apply_heap_mi_find_conflicts(mistate);
+	else
+		nclean = mistate->nbuffered_tuples;
+
+	if (nclean > 0)
+		heap_multi_insert(mistate->relation,
+						  mistate->buffered_tuples,
+						  nclean,
+						  mistate->aestate->estate->es_output_cid,
+						  0, /* hi_options */
+						  mistate->bistate);
 	MemoryContextSwitchTo(oldctx);
 
-	resultRelInfo = spkmistate->aestate->resultRelInfo;
+	resultRelInfo = mistate->aestate->resultRelInfo;
 
 	/*
 	 * If there are any indexes, update them for all the inserted tuples, and
@@ -776,24 +1512,26 @@ spock_apply_heap_mi_flush(void)
 	 */
 	if (resultRelInfo->ri_NumIndices > 0)
 	{
-		for (i = 0; i < spkmistate->nbuffered_tuples; i++)
+		for (i = 0; i < nclean; i++)
 		{
 			List	   *recheckIndexes = NIL;
 
+			SPOCK_APPLY_TIMING_START(start);
 			recheckIndexes =
 				ExecInsertIndexTuples(
 #if PG_VERSION_NUM >= 140000
 									  resultRelInfo,
 #endif
-									  spkmistate->buffered_tuples[i],
-									  spkmistate->aestate->estate
+									  mistate->buffered_tuples[i],
+									  mistate->aestate->estate
 #if PG_VERSION_NUM >= 140000
 									  , false
 #endif
                                                                           , false, NULL, NIL
 									 );
-			ExecARInsertTriggers(spkmistate->aestate->estate, resultRelInfo,
-								 spkmistate->buffered_tuples[i],
+			SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_INDEX_UPDATE, start);
+			ExecARInsertTriggers(mistate->aestate->estate, resultRelInfo,
+								 mistate->buffered_tuples[i],
 								 recheckIndexes);
 			list_free(recheckIndexes);
 		}
@@ -806,15 +1544,30 @@ spock_apply_heap_mi_flush(void)
 	else if (resultRelInfo->ri_TrigDesc != NULL &&
 			 resultRelInfo->ri_TrigDesc->trig_insert_after_row)
 	{
-		for (i = 0; i < spkmistate->nbuffered_tuples; i++)
+		for (i = 0; i < nclean; i++)
 		{
-			ExecARInsertTriggers(spkmistate->aestate->estate, resultRelInfo,
-								 spkmistate->buffered_tuples[i],
+			ExecARInsertTriggers(mistate->aestate->estate, resultRelInfo,
+								 mistate->buffered_tuples[i],
 								 NIL);
 		}
 	}
 
-	spkmistate->nbuffered_tuples = 0;
+	if (nclean < mistate->nbuffered_tuples)
+	{
+		/* The inserted tuples have to be visible to the conflict checks. */
+		CommandCounterIncrement();
+
+		for (i = nclean; i < mistate->nbuffered_tuples; i++)
+			spock_apply_heap_mi_resolve(mistate, mistate->buffered_tuples[i]);
+	}
+
+	/* Handle queued AFTER triggers. */
+	SPOCK_APPLY_TIMING_START(start);
+	AfterTriggerEndQuery(mistate->aestate->estate);
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+	mistate->nbuffered_tuples = 0;
+	mistate->nbuffered_bytes = 0;
 }
 
 /* Add tuple to the MultiInsert. */
@@ -823,22 +1576,24 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 								  SpockTupleData *tup)
 {
 	MemoryContext	oldctx;
+	ApplyMIState   *mistate;
 	ApplyExecState *aestate;
-	HeapTuple		remotetuple;
 	TupleTableSlot *slot;
+	instr_time		start;
 
-	spock_apply_heap_mi_start(rel);
+	mistate = spock_apply_heap_mi_start(rel);
 
 	/*
 	 * If sufficient work is pending, process that first
 	 */
-	if (spkmistate->nbuffered_tuples >= spkmistate->maxbuffered_tuples)
-		spock_apply_heap_mi_flush();
+	if (mistate->nbuffered_tuples >= mistate->maxbuffered_tuples ||
+		mistate->nbuffered_bytes >= MAX_BUFFERED_BYTES)
+		spock_apply_heap_mi_flush(mistate);
 
 	/* Process and store remote tuple in the slot */
-	aestate = spkmistate->aestate;
+	aestate = mistate->aestate;
 
-	if (spkmistate->nbuffered_tuples == 0)
+	if (mistate->nbuffered_tuples == 0)
 	{
 		/*
 		 * Reset the per-tuple exprcontext. We can only do this if the
@@ -850,19 +1605,22 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 
 	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
 	fill_missing_defaults(rel, aestate->estate, tup);
-	remotetuple = heap_form_tuple(RelationGetDescr(rel->rel),
-								  tup->values, tup->nulls);
 	MemoryContextSwitchTo(TopTransactionContext);
 	slot = aestate->slot;
-	/* Store the tuple in slot, but make sure it's not freed. */
-	ExecStoreHeapTuple(remotetuple, slot, false);
+	store_remote_tuple(aestate, tup);
 
 	if (aestate->resultRelInfo->ri_TrigDesc &&
 		aestate->resultRelInfo->ri_TrigDesc->trig_insert_before_row)
 	{
-		if (!ExecBRInsertTriggers(aestate->estate,
-								 aestate->resultRelInfo,
-								 slot))
+		bool		doinsert;
+
+		SPOCK_APPLY_TIMING_START(start);
+		doinsert = ExecBRInsertTriggers(aestate->estate,
+										aestate->resultRelInfo,
+										slot);
+		SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_TRIGGERS, start);
+
+		if (!doinsert)
 		{
 			MemoryContextSwitchTo(oldctx);
 			return;
@@ -874,35 +1632,54 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 		ExecConstraints(aestate->resultRelInfo, slot,
 						aestate->estate);
 
-	if (spkmistate->buffered_tuples[spkmistate->nbuffered_tuples] == NULL)
-		spkmistate->buffered_tuples[spkmistate->nbuffered_tuples] = table_slot_create(rel->rel, NULL);
+	if (mistate->buffered_tuples[mistate->nbuffered_tuples] == NULL)
+		mistate->buffered_tuples[mistate->nbuffered_tuples] = table_slot_create(rel->rel, NULL);
 	else
-		ExecClearTuple(spkmistate->buffered_tuples[spkmistate->nbuffered_tuples]);
-	ExecCopySlot(spkmistate->buffered_tuples[spkmistate->nbuffered_tuples], slot);
-	spkmistate->nbuffered_tuples++;
+		ExecClearTuple(mistate->buffered_tuples[mistate->nbuffered_tuples]);
+	/* The buffered slot forms the tuple from the values. */
+	ExecCopySlot(mistate->buffered_tuples[mistate->nbuffered_tuples], slot);
+	mistate->nbuffered_tuples++;
+	mistate->nbuffered_bytes += heap_compute_data_size(slot->tts_tupleDescriptor,
+													   slot->tts_values,
+													   slot->tts_isnull);
 	MemoryContextSwitchTo(oldctx);
 }
 
+/*
+ * Write the buffered tuples of the relation and release its MultiInsert
+ * state. The buffers of other relations are kept.
+ */
 void
 spock_apply_heap_mi_finish(SpockRelation *rel)
 {
-	if (!spkmistate)
-		return;
+	ApplyMIState   *mistate = NULL;
+	ListCell	   *lc;
 
-	Assert(spkmistate->rel == rel);
+	foreach (lc, spkmistates)
+	{
+		if (((ApplyMIState *) lfirst(lc))->rel == rel)
+		{
+			mistate = (ApplyMIState *) lfirst(lc);
+			break;
+		}
+	}
+
+	if (!mistate)
+		return;
 
-	spock_apply_heap_mi_flush();
+	spock_apply_heap_mi_flush(mistate);
 
-	FreeBulkInsertState(spkmistate->bistate);
+	FreeBulkInsertState(mistate->bistate);
 
-	finish_apply_exec_state(spkmistate->aestate);
+	finish_apply_exec_state(mistate->aestate);
+	table_close(mistate->relation, NoLock);
 
-	for (int i = 0; i < spkmistate->maxbuffered_tuples; i++)
-		if (spkmistate->buffered_tuples[i])
-			ExecDropSingleTupleTableSlot(spkmistate->buffered_tuples[i]);
+	for (int i = 0; i < mistate->maxbuffered_tuples; i++)
+		if (mistate->buffered_tuples[i])
+			ExecDropSingleTupleTableSlot(mistate->buffered_tuples[i]);
 
-	pfree(spkmistate->buffered_tuples);
-	pfree(spkmistate);
+	spkmistates = list_delete_ptr(spkmistates, mistate);
 
-	spkmistate = NULL;
+	pfree(mistate->buffered_tuples);
+	pfree(mistate);
 }
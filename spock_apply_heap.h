@@ -31,4 +31,9 @@ void spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 									   SpockTupleData *tup);
 void spock_apply_heap_mi_finish(SpockRelation *rel);
 
+bool spock_apply_heap_batch_add(SpockRelation *rel, char action,
+								SpockTupleData *oldtup,
+								SpockTupleData *newtup);
+void spock_apply_heap_batch_finish(void);
+
 #endif /* SPOCK_APPLY_HEAP_H */
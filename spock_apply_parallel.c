@@ -0,0 +1,1068 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_parallel.c
+ * 		spock parallel apply logic
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * The apply worker of a subscription (the leader) can hand the transactions
+ * it receives over to a set of parallel apply workers. The leader still
+ * reads the whole replication stream but it only looks at the replica
+ * identity of each change and forwards the protocol messages unchanged to
+ * one of the workers through a shared memory queue.
+ *
+ * Every transaction gets a sequence number in the upstream commit order and
+ * the workers commit strictly in that order, so the downstream never sees
+ * the transactions in a different order than the upstream did. The leader
+ * remembers which transaction last touched each replica identity value and
+ * when a later transaction running on a different worker touches the same
+ * value, the worker is told to wait until the earlier one has committed
+ * before applying the change. Relations where the replica identity is not
+ * enough to tell which rows a change conflicts with are tracked as a whole
+ * and changes which may have side effects beyond the row (queued SQL,
+ * replica triggers) wait for everything before them.
+ *
+ * Each worker replays into a replication origin of its own as origins can't
+ * be shared between backends. Since the commits are ordered, the furthest
+ * of the subscription origins is where the replication restarts from.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/genam.h"
+#include "access/xact.h"
+
+#include "libpq/pqformat.h"
+
+#include "lib/ilist.h"
+
+#include "port/atomics.h"
+
+#include "replication/origin.h"
+
+#include "storage/condition_variable.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/timestamp.h"
+
+#include "spock_apply.h"
+#include "spock_apply_parallel.h"
+#include "spock_proto_native.h"
+#include "spock_relcache.h"
+#include "spock_worker.h"
+#include "spock.h"
+
+#define SPOCK_PARALLEL_MAGIC		0x53504b50
+#define SPOCK_PARALLEL_QUEUE_SIZE	(1024 * 1024)
+
+/* Table of contents keys, queues use the keys 1 to nworkers. */
+#define SPOCK_PARALLEL_KEY_SHARED	0
+
+/* Messages sent by the leader to the workers. */
+#define PARALLEL_MSG_XACT			'T'	/* transaction sequence number */
+#define PARALLEL_MSG_WAIT			'W'	/* wait for sequence number */
+#define PARALLEL_MSG_DATA			'M'	/* replication protocol message */
+
+/* Forget about committed transactions once the dependency table is this big. */
+#define DEPENDENCY_PRUNE_SIZE		65536
+
+typedef struct SpockParallelWorkerState
+{
+	/* Local commit LSN of the last transaction the worker committed. */
+	pg_atomic_uint64	local_end;
+} SpockParallelWorkerState;
+
+typedef struct SpockParallelShared
+{
+	PGPROC	   *leader;
+	int			leader_slot;
+	uint16		leader_generation;
+	int			nworkers;
+
+	/* Sequence number of the last committed transaction. */
+	pg_atomic_uint64	committed_seq;
+	ConditionVariable	commit_cv;
+
+	SpockParallelWorkerState workers[FLEXIBLE_ARRAY_MEMBER];
+} SpockParallelShared;
+
+/* Leader's info about a worker. */
+typedef struct ParallelWorkerInfo
+{
+	int				slot;
+	uint16			generation;
+	shm_mq_handle  *mqh;
+	uint64			last_seq;	/* Last transaction sent to the worker. */
+} ParallelWorkerInfo;
+
+/* Transaction sent to a worker which did not commit yet. */
+typedef struct ParallelXact
+{
+	dlist_node	node;
+	uint64		seq;
+	int			worker;
+	XLogRecPtr	remote_end;
+} ParallelXact;
+
+typedef struct DependencyKey
+{
+	uint32		relid;
+	uint32		hash;
+} DependencyKey;
+
+typedef struct DependencyEntry
+{
+	DependencyKey key;
+	uint64		seq;		/* Last transaction which touched the key. */
+	int			worker;		/* Worker that transaction was sent to. */
+} DependencyEntry;
+
+static dsm_segment *ParallelSegment = NULL;
+static SpockParallelShared *ParallelShared = NULL;
+
+/* Leader state. */
+static int			nparallel = 0;
+static ParallelWorkerInfo *parallel_workers = NULL;
+static Oid			parallel_queue_relid = InvalidOid;
+static HTAB		   *dependency_hash = NULL;
+static dlist_head	pending_xacts = DLIST_STATIC_INIT(pending_xacts);
+static uint64		next_seq = 1;
+static TimestampTz	last_inval_check = 0;
+
+/* State of the transaction the leader is currently sending. */
+static uint64		current_seq = 0;
+static int			current_worker = -1;
+static uint64		current_wait_seq = 0;
+static bool			current_barrier = false;
+
+/* Worker state. */
+static SpockParallelWorkerState *MyParallelState = NULL;
+static shm_mq_handle *worker_mqh = NULL;
+static uint64		worker_seq = 0;
+
+/* All replication origins the subscription replays into. */
+static RepOriginId	subscription_origins[SPOCK_PARALLEL_APPLY_MAX_WORKERS + 1];
+static int			nsubscription_origins = 0;
+
+static void
+parallel_origin_name(char *buf, Size size, const char *slot_name, int index)
+{
+	snprintf(buf, size, "%s_p%d", slot_name, index + 1);
+}
+
+/*
+ * Wait for the parallel workers of a previous apply worker of the
+ * subscription to exit.
+ *
+ * They may still be committing the transactions that were queued for them
+ * so their progress is not final until they are gone.
+ */
+static void
+wait_for_old_workers(Oid subid)
+{
+	for (;;)
+	{
+		bool		found = false;
+		int			rc;
+		int			i;
+
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
+		for (i = 0; i < SpockCtx->total_workers; i++)
+		{
+			SpockWorker *w = &SpockCtx->workers[i];
+
+			if (w->worker_type == SPOCK_WORKER_APPLY_PARALLEL &&
+				w->dboid == MyDatabaseId &&
+				w->worker.parallel.apply.subid == subid &&
+				spock_worker_running(w))
+			{
+				found = true;
+				break;
+			}
+		}
+		LWLockRelease(SpockCtx->lock);
+
+		if (!found)
+			break;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 100L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(&MyProc->procLatch);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Find (and create if needed) the replication origins of the parallel
+ * workers.
+ *
+ * Returns the furthest progress of them, InvalidXLogRecPtr if there is none.
+ * Origins of workers beyond nworkers are kept as they may be ahead of the
+ * others if the number of workers was lowered.
+ */
+XLogRecPtr
+spock_apply_parallel_init_origins(const char *slot_name, int nworkers)
+{
+	XLogRecPtr	startpos = InvalidXLogRecPtr;
+	RepOriginId	originid;
+	int			i;
+
+	Assert(IsTransactionState());
+
+	if (MySpockWorker->worker_type == SPOCK_WORKER_APPLY)
+		wait_for_old_workers(MyApplyWorker->subid);
+
+	nsubscription_origins = 0;
+
+	originid = replorigin_by_name(slot_name, true);
+	if (originid != InvalidRepOriginId)
+		subscription_origins[nsubscription_origins++] = originid;
+
+	for (i = 0; i < SPOCK_PARALLEL_APPLY_MAX_WORKERS; i++)
+	{
+		char		name[NAMEDATALEN + 16];
+
+		parallel_origin_name(name, sizeof(name), slot_name, i);
+		originid = replorigin_by_name(name, true);
+
+		if (originid == InvalidRepOriginId && i < nworkers)
+			originid = replorigin_create(name);
+
+		if (originid == InvalidRepOriginId)
+			continue;
+
+		subscription_origins[nsubscription_origins++] = originid;
+		startpos = Max(startpos, replorigin_get_progress(originid, false));
+	}
+
+	return startpos;
+}
+
+/*
+ * Drop the replication origins of the parallel workers.
+ */
+void
+spock_apply_parallel_drop_origins(const char *slot_name)
+{
+	int			i;
+
+	for (i = 0; i < SPOCK_PARALLEL_APPLY_MAX_WORKERS; i++)
+	{
+		char		name[NAMEDATALEN + 16];
+
+		parallel_origin_name(name, sizeof(name), slot_name, i);
+		replorigin_drop_by_name(name, true, false);
+	}
+}
+
+/*
+ * Is the origin one of those the subscription replays into?
+ */
+bool
+spock_apply_origin_is_ours(RepOriginId origin)
+{
+	int			i;
+
+	if (origin == replorigin_session_origin)
+		return true;
+
+	for (i = 0; i < nsubscription_origins; i++)
+	{
+		if (subscription_origins[i] == origin)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check that all the parallel workers are still running, error out if not.
+ */
+static void
+check_workers_alive(void)
+{
+	int			i;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < nparallel; i++)
+	{
+		SpockWorker *w = spock_get_worker(parallel_workers[i].slot);
+
+		if (w->generation != parallel_workers[i].generation ||
+			!spock_worker_running(w))
+		{
+			LWLockRelease(SpockCtx->lock);
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("spock parallel apply worker %d exited unexpectedly",
+							i)));
+		}
+	}
+	LWLockRelease(SpockCtx->lock);
+}
+
+/*
+ * Wait for the workers to make progress.
+ */
+static void
+leader_wait(void)
+{
+	int			rc;
+
+	rc = WaitLatch(&MyProc->procLatch,
+				   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 100L);
+
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	ResetLatch(&MyProc->procLatch);
+
+	CHECK_FOR_INTERRUPTS();
+
+	if (got_SIGTERM)
+		proc_exit(0);
+
+	check_workers_alive();
+}
+
+/*
+ * Start the parallel apply workers.
+ */
+void
+spock_apply_parallel_start(int nworkers, Oid queue_relid)
+{
+	shm_toc_estimator e;
+	shm_toc	   *toc;
+	Size		sharedsize;
+	Size		segsize;
+	HASHCTL		ctl;
+	MemoryContext oldctx;
+	int			i;
+
+	Assert(nworkers > 0 && nworkers <= SPOCK_PARALLEL_APPLY_MAX_WORKERS);
+	Assert(!IsTransactionState());
+
+	sharedsize = add_size(offsetof(SpockParallelShared, workers),
+						  mul_size(nworkers, sizeof(SpockParallelWorkerState)));
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, sharedsize);
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, SPOCK_PARALLEL_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, nworkers + 1);
+	segsize = shm_toc_estimate(&e);
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+	ParallelSegment = dsm_create(segsize, 0);
+	dsm_pin_mapping(ParallelSegment);
+	toc = shm_toc_create(SPOCK_PARALLEL_MAGIC,
+						 dsm_segment_address(ParallelSegment), segsize);
+
+	ParallelShared = shm_toc_allocate(toc, sharedsize);
+	ParallelShared->leader = MyProc;
+	ParallelShared->leader_slot = MySpockWorker - &SpockCtx->workers[0];
+	ParallelShared->leader_generation = MySpockWorker->generation;
+	ParallelShared->nworkers = nworkers;
+	pg_atomic_init_u64(&ParallelShared->committed_seq, 0);
+	ConditionVariableInit(&ParallelShared->commit_cv);
+	for (i = 0; i < nworkers; i++)
+		pg_atomic_init_u64(&ParallelShared->workers[i].local_end,
+						   InvalidXLogRecPtr);
+	shm_toc_insert(toc, SPOCK_PARALLEL_KEY_SHARED, ParallelShared);
+
+	parallel_workers = palloc0(nworkers * sizeof(ParallelWorkerInfo));
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, SPOCK_PARALLEL_QUEUE_SIZE),
+						   SPOCK_PARALLEL_QUEUE_SIZE);
+		shm_toc_insert(toc, i + 1, mq);
+		shm_mq_set_sender(mq, MyProc);
+		parallel_workers[i].mqh = shm_mq_attach(mq, ParallelSegment, NULL);
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(DependencyKey);
+	ctl.entrysize = sizeof(DependencyEntry);
+	ctl.hcxt = TopMemoryContext;
+	dependency_hash = hash_create("spock parallel apply dependencies", 1024,
+								  &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	MemoryContextSwitchTo(oldctx);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		SpockWorker	worker;
+		int			slot;
+
+		memset(&worker, 0, sizeof(SpockWorker));
+		worker.worker_type = SPOCK_WORKER_APPLY_PARALLEL;
+		worker.dboid = MySpockWorker->dboid;
+		worker.worker.parallel.apply.subid = MyApplyWorker->subid;
+		worker.worker.parallel.apply.sync_pending = false;
+		worker.worker.parallel.apply.replay_stop_lsn = InvalidXLogRecPtr;
+		worker.worker.parallel.dsm = dsm_segment_handle(ParallelSegment);
+		worker.worker.parallel.index = i;
+
+		slot = spock_worker_register(&worker);
+
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
+		parallel_workers[i].slot = slot;
+		parallel_workers[i].generation = spock_get_worker(slot)->generation;
+		LWLockRelease(SpockCtx->lock);
+	}
+
+	nparallel = nworkers;
+	parallel_queue_relid = queue_relid;
+
+	/* All of them must have attached, otherwise bail out now. */
+	check_workers_alive();
+
+	elog(LOG, "started %d parallel apply workers for subscription %s",
+		 nworkers, MySubscription->name);
+}
+
+/*
+ * Are the parallel apply workers running?
+ */
+bool
+spock_apply_parallel_active(void)
+{
+	return nparallel > 0;
+}
+
+/*
+ * Send a message to a worker, waiting for space in its queue if needed.
+ */
+static void
+parallel_send(int worker, char msgtype, const char *data, Size len)
+{
+	shm_mq_iovec iov[2];
+	shm_mq_result res;
+
+	iov[0].data = &msgtype;
+	iov[0].len = 1;
+	iov[1].data = data;
+	iov[1].len = len;
+
+	for (;;)
+	{
+		res = shm_mq_sendv(parallel_workers[worker].mqh, iov, 2, true);
+
+		if (res == SHM_MQ_SUCCESS)
+			return;
+
+		if (res == SHM_MQ_DETACHED)
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("spock parallel apply worker %d exited unexpectedly",
+							worker)));
+
+		/* The queue is full, let the workers catch up. */
+		leader_wait();
+		spock_apply_parallel_collect();
+	}
+}
+
+static void
+parallel_send_seq(int worker, char msgtype, uint64 seq)
+{
+	parallel_send(worker, msgtype, (char *) &seq, sizeof(uint64));
+}
+
+static void
+parallel_send_message(int worker, StringInfo s)
+{
+	parallel_send(worker, PARALLEL_MSG_DATA, s->data + s->cursor,
+				  s->len - s->cursor);
+}
+
+/*
+ * Make the current transaction wait for the given one to commit before
+ * applying the following changes.
+ */
+static void
+parallel_wait_for(uint64 seq)
+{
+	if (seq <= current_wait_seq)
+		return;
+
+	if (seq > pg_atomic_read_u64(&ParallelShared->committed_seq))
+		parallel_send_seq(current_worker, PARALLEL_MSG_WAIT, seq);
+
+	current_wait_seq = seq;
+}
+
+/*
+ * Note that the current transaction touches given key.
+ */
+static void
+parallel_add_dependency(uint32 relid, uint32 hash)
+{
+	DependencyKey	key;
+	DependencyEntry *entry;
+	bool			found;
+
+	key.relid = relid;
+	key.hash = hash;
+
+	entry = hash_search(dependency_hash, &key, HASH_ENTER, &found);
+
+	/*
+	 * Transactions sent to the same worker are applied one after another so
+	 * they don't need to wait for each other.
+	 */
+	if (found && entry->worker != current_worker)
+		parallel_wait_for(entry->seq);
+
+	entry->seq = current_seq;
+	entry->worker = current_worker;
+}
+
+/*
+ * Forget keys of transactions that are already committed.
+ */
+static void
+parallel_prune_dependencies(void)
+{
+	HASH_SEQ_STATUS status;
+	DependencyEntry *entry;
+	uint64		committed;
+
+	if (hash_get_num_entries(dependency_hash) < DEPENDENCY_PRUNE_SIZE)
+		return;
+
+	committed = pg_atomic_read_u64(&ParallelShared->committed_seq);
+
+	hash_seq_init(&status, dependency_hash);
+	while ((entry = (DependencyEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->seq <= committed)
+			hash_search(dependency_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Decide how to track dependencies of changes to the relation.
+ */
+static SpockRelParallelMode
+relation_parallel_mode(SpockRelation *rel)
+{
+	MemoryContext	oldctx;
+	List		   *indexes;
+	ListCell	   *lc;
+	Oid				replidx;
+	bool			haskey = false;
+	int				i;
+
+	if (rel->parallel_mode != SPOCK_PARALLEL_UNKNOWN &&
+		OidIsValid(rel->reloid))
+		return rel->parallel_mode;
+
+	oldctx = CurrentMemoryContext;
+	StartTransactionCommand();
+
+	rel = spock_relation_open(rel->remoteid, AccessShareLock);
+
+	for (i = 0; i < rel->natts; i++)
+		haskey |= rel->attidkey[i];
+
+	if (rel->reloid == parallel_queue_relid || rel->hasTriggers)
+	{
+		/*
+		 * Queued SQL and triggers can do anything, run them only once
+		 * everything before them is committed.
+		 */
+		rel->parallel_mode = SPOCK_PARALLEL_BARRIER;
+	}
+	else if (!haskey)
+		rel->parallel_mode = SPOCK_PARALLEL_RELATION;
+	else
+	{
+		/*
+		 * Rows with different replica identity can still conflict on other
+		 * unique indexes or exclusion constraints, in which case we can't
+		 * tell which changes are independent.
+		 */
+		rel->parallel_mode = SPOCK_PARALLEL_KEY;
+		replidx = RelationGetReplicaIndex(rel->rel);
+		indexes = RelationGetIndexList(rel->rel);
+		foreach (lc, indexes)
+		{
+			Oid			idxoid = lfirst_oid(lc);
+			Relation	idxrel;
+			bool		unique;
+
+			if (idxoid == replidx)
+				continue;
+
+			idxrel = index_open(idxoid, AccessShareLock);
+			unique = idxrel->rd_index->indisunique ||
+				idxrel->rd_index->indisexclusion;
+			index_close(idxrel, AccessShareLock);
+
+			if (unique)
+			{
+				rel->parallel_mode = SPOCK_PARALLEL_RELATION;
+				break;
+			}
+		}
+		list_free(indexes);
+	}
+
+	spock_relation_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(oldctx);
+
+	return rel->parallel_mode;
+}
+
+/*
+ * Pick a worker for a new transaction and send it the BEGIN message.
+ */
+void
+spock_apply_parallel_begin(StringInfo s)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+	uint64		committed;
+	int			worker = -1;
+	int			i;
+
+	Assert(current_worker < 0);
+
+	/*
+	 * The leader doesn't run transactions on its own most of the time so
+	 * make sure it notices changes to the local relations.
+	 */
+	if (TimestampDifferenceExceeds(last_inval_check, now, 1000))
+	{
+		MemoryContext	oldctx = CurrentMemoryContext;
+
+		StartTransactionCommand();
+		CommitTransactionCommand();
+		MemoryContextSwitchTo(oldctx);
+		last_inval_check = now;
+	}
+
+	spock_apply_parallel_collect();
+	committed = pg_atomic_read_u64(&ParallelShared->committed_seq);
+
+	/* Prefer an idle worker, otherwise the one with the oldest work. */
+	for (i = 0; i < nparallel; i++)
+	{
+		if (parallel_workers[i].last_seq <= committed)
+		{
+			worker = i;
+			break;
+		}
+
+		if (worker < 0 ||
+			parallel_workers[i].last_seq < parallel_workers[worker].last_seq)
+			worker = i;
+	}
+
+	current_worker = worker;
+	current_seq = next_seq++;
+	current_wait_seq = committed;
+	current_barrier = false;
+	parallel_workers[worker].last_seq = current_seq;
+
+	parallel_send_seq(worker, PARALLEL_MSG_XACT, current_seq);
+	parallel_send_message(worker, s);
+}
+
+/*
+ * Send ORIGIN, INSERT, UPDATE or DELETE of the current transaction.
+ */
+void
+spock_apply_parallel_change(StringInfo s)
+{
+	StringInfoData	copy = *s;
+	char			action = pq_getmsgbyte(&copy);
+
+	Assert(current_worker >= 0);
+
+	if (action != 'O')
+	{
+		SpockRelation  *rel;
+		SpockRelParallelMode mode;
+		uint32		   *keys;
+		int				nkeys;
+		SpockRelParallelMode prev_mode;
+		bool			haskey;
+		int				i;
+
+		haskey = spock_read_change_keys(&copy, action, &rel, &keys, &nkeys);
+		prev_mode = rel->parallel_mode;
+		mode = relation_parallel_mode(rel);
+
+		/*
+		 * Changes that are tracked differently than the earlier ones to the
+		 * same relation can't be matched against them, wait for everything.
+		 */
+		if ((prev_mode != SPOCK_PARALLEL_UNKNOWN && prev_mode != mode) ||
+			(mode == SPOCK_PARALLEL_KEY && !haskey))
+			mode = SPOCK_PARALLEL_BARRIER;
+
+		switch (mode)
+		{
+			case SPOCK_PARALLEL_BARRIER:
+				parallel_wait_for(current_seq - 1);
+				current_barrier = true;
+				break;
+			case SPOCK_PARALLEL_RELATION:
+				/* Relation as a whole is tracked under key 0. */
+				keys[0] = 0;
+				nkeys = 1;
+				/* fall through */
+			case SPOCK_PARALLEL_KEY:
+				for (i = 0; i < nkeys; i++)
+					parallel_add_dependency(rel->remoteid, keys[i]);
+				break;
+			default:
+				elog(ERROR, "unexpected parallel mode %d", mode);
+		}
+		pfree(keys);
+	}
+
+	parallel_send_message(current_worker, s);
+}
+
+/*
+ * Send COMMIT of the current transaction.
+ */
+void
+spock_apply_parallel_commit(StringInfo s)
+{
+	StringInfoData	copy = *s;
+	XLogRecPtr		commit_lsn;
+	XLogRecPtr		end_lsn;
+	TimestampTz		commit_time;
+	ParallelXact   *xact;
+
+	Assert(current_worker >= 0);
+
+	(void) pq_getmsgbyte(&copy);
+	spock_read_commit(&copy, &commit_lsn, &end_lsn, &commit_time);
+
+	parallel_send_message(current_worker, s);
+
+	xact = MemoryContextAlloc(TopMemoryContext, sizeof(ParallelXact));
+	xact->seq = current_seq;
+	xact->worker = current_worker;
+	xact->remote_end = end_lsn;
+	dlist_push_tail(&pending_xacts, &xact->node);
+
+	current_worker = -1;
+
+	/* Nothing may overtake a barrier transaction. */
+	if (current_barrier)
+		spock_apply_parallel_drain();
+
+	parallel_prune_dependencies();
+}
+
+/*
+ * Send RELATION message to all the workers.
+ */
+void
+spock_apply_parallel_relation(StringInfo s)
+{
+	int			i;
+
+	/*
+	 * The relation may now be tracked by different columns than in the
+	 * transactions sent before.
+	 */
+	if (current_worker >= 0)
+	{
+		parallel_wait_for(current_seq - 1);
+		current_barrier = true;
+	}
+
+	for (i = 0; i < nparallel; i++)
+		parallel_send_message(i, s);
+}
+
+/*
+ * Record the flush positions of transactions the workers committed.
+ */
+void
+spock_apply_parallel_collect(void)
+{
+	dlist_mutable_iter iter;
+	uint64		committed;
+
+	if (nparallel == 0)
+		return;
+
+	committed = pg_atomic_read_u64(&ParallelShared->committed_seq);
+	pg_read_barrier();
+
+	dlist_foreach_modify(iter, &pending_xacts)
+	{
+		ParallelXact   *xact = dlist_container(ParallelXact, node, iter.cur);
+		XLogRecPtr		local_end;
+
+		if (xact->seq > committed)
+			break;
+
+		/*
+		 * The worker may have committed more transactions since, which
+		 * only makes the local position we wait for flushing later.
+		 */
+		local_end = pg_atomic_read_u64(&ParallelShared->workers[xact->worker].local_end);
+		spock_apply_track_commit(local_end, xact->remote_end);
+
+		dlist_delete(iter.cur);
+		pfree(xact);
+	}
+}
+
+/*
+ * Wait until all the transactions sent to workers are committed.
+ */
+void
+spock_apply_parallel_drain(void)
+{
+	if (nparallel == 0)
+		return;
+
+	Assert(current_worker < 0);
+
+	for (;;)
+	{
+		spock_apply_parallel_collect();
+
+		if (dlist_is_empty(&pending_xacts))
+			break;
+
+		leader_wait();
+	}
+}
+
+/*
+ * Are there transactions sent to workers which are not committed yet?
+ */
+bool
+spock_apply_parallel_pending(void)
+{
+	return !dlist_is_empty(&pending_xacts);
+}
+
+/*
+ * Attach the parallel worker to the segment created by the leader.
+ *
+ * Returns the leader's apply worker info.
+ */
+SpockApplyWorker *
+spock_apply_parallel_attach(SpockParallelApplyWorker *worker)
+{
+	MemoryContext	oldctx;
+	shm_toc		   *toc;
+	shm_mq		   *mq;
+	SpockWorker	   *leader;
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+	ParallelSegment = dsm_attach(worker->dsm);
+	if (ParallelSegment == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment for parallel apply")));
+	dsm_pin_mapping(ParallelSegment);
+
+	toc = shm_toc_attach(SPOCK_PARALLEL_MAGIC,
+						 dsm_segment_address(ParallelSegment));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("invalid magic number in dynamic shared memory segment for parallel apply")));
+
+	ParallelShared = shm_toc_lookup(toc, SPOCK_PARALLEL_KEY_SHARED, false);
+	MyParallelState = &ParallelShared->workers[worker->index];
+
+	mq = shm_toc_lookup(toc, worker->index + 1, false);
+	shm_mq_set_receiver(mq, MyProc);
+	worker_mqh = shm_mq_attach(mq, ParallelSegment, NULL);
+
+	MemoryContextSwitchTo(oldctx);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	leader = spock_get_worker(ParallelShared->leader_slot);
+	LWLockRelease(SpockCtx->lock);
+
+	return &leader->worker.apply;
+}
+
+/*
+ * Setup the replication origin of the parallel worker.
+ */
+RepOriginId
+spock_apply_parallel_setup_origin(const char *slot_name)
+{
+	char		name[NAMEDATALEN + 16];
+	RepOriginId	originid;
+
+	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY_PARALLEL);
+
+	(void) spock_apply_parallel_init_origins(slot_name, 0);
+
+	parallel_origin_name(name, sizeof(name), slot_name,
+						 MySpockWorker->worker.parallel.index);
+	originid = replorigin_by_name(name, false);
+	elog(DEBUG2, "setting up replication origin %s (oid %u)",
+		 name, originid);
+	replorigin_session_setup(originid);
+	replorigin_session_origin = originid;
+
+	return originid;
+}
+
+static bool
+parallel_leader_alive(void)
+{
+	SpockWorker *leader;
+	bool		alive;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	leader = spock_get_worker(ParallelShared->leader_slot);
+	alive = leader->proc == ParallelShared->leader &&
+		leader->generation == ParallelShared->leader_generation;
+	LWLockRelease(SpockCtx->lock);
+
+	return alive;
+}
+
+/*
+ * Wait until the transaction with given sequence number is committed.
+ */
+static void
+parallel_wait_committed(uint64 seq)
+{
+	while (pg_atomic_read_u64(&ParallelShared->committed_seq) < seq)
+	{
+		if (ConditionVariableTimedSleep(&ParallelShared->commit_cv, 1000L,
+										PG_WAIT_EXTENSION))
+		{
+			if (got_SIGTERM || !parallel_leader_alive())
+				proc_exit(0);
+		}
+	}
+	ConditionVariableCancelSleep();
+}
+
+/*
+ * Receive next replication protocol message from the leader.
+ *
+ * Returns false when the worker should exit.
+ */
+bool
+spock_apply_parallel_receive(StringInfo s)
+{
+	for (;;)
+	{
+		shm_mq_result	res;
+		Size			len;
+		void		   *data;
+		int				rc;
+
+		res = shm_mq_receive(worker_mqh, &len, &data, true);
+
+		if (res == SHM_MQ_DETACHED)
+			return false;
+
+		if (res == SHM_MQ_SUCCESS)
+		{
+			char	   *msg = data;
+			uint64		seq;
+
+			switch (msg[0])
+			{
+				case PARALLEL_MSG_XACT:
+					memcpy(&worker_seq, msg + 1, sizeof(uint64));
+					continue;
+				case PARALLEL_MSG_WAIT:
+					memcpy(&seq, msg + 1, sizeof(uint64));
+					parallel_wait_committed(seq);
+					continue;
+				case PARALLEL_MSG_DATA:
+					memset(s, 0, sizeof(StringInfoData));
+					s->data = msg + 1;
+					s->len = len - 1;
+					s->maxlen = -1;
+					s->cursor = 0;
+					return true;
+				default:
+					elog(ERROR, "unknown parallel apply message type %c",
+						 msg[0]);
+			}
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 1000L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(&MyProc->procLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_SIGTERM)
+			return false;
+
+		if ((rc & WL_TIMEOUT) && !parallel_leader_alive())
+			return false;
+	}
+}
+
+/*
+ * Wait until all the transactions before the current one are committed.
+ */
+void
+spock_apply_parallel_wait_for_turn(void)
+{
+	parallel_wait_committed(worker_seq - 1);
+}
+
+/*
+ * Let the leader and the other workers know the current transaction is
+ * committed.
+ */
+void
+spock_apply_parallel_report_commit(XLogRecPtr local_end)
+{
+	Assert(pg_atomic_read_u64(&ParallelShared->committed_seq) == worker_seq - 1);
+
+	if (local_end != InvalidXLogRecPtr)
+		pg_atomic_write_u64(&MyParallelState->local_end, local_end);
+	pg_write_barrier();
+	pg_atomic_write_u64(&ParallelShared->committed_seq, worker_seq);
+
+	ConditionVariableBroadcast(&ParallelShared->commit_cv);
+	SetLatch(&ParallelShared->leader->procLatch);
+}
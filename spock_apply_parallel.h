@@ -0,0 +1,45 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_parallel.h
+ * 		spock parallel apply functions
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_PARALLEL_H
+#define SPOCK_APPLY_PARALLEL_H
+
+#include "lib/stringinfo.h"
+#include "replication/origin.h"
+
+#include "spock_worker.h"
+
+#define SPOCK_PARALLEL_APPLY_MAX_WORKERS 32
+
+/* Leader side. */
+extern XLogRecPtr spock_apply_parallel_init_origins(const char *slot_name,
+													int nworkers);
+extern void spock_apply_parallel_start(int nworkers, Oid queue_relid);
+extern bool spock_apply_parallel_active(void);
+extern void spock_apply_parallel_begin(StringInfo s);
+extern void spock_apply_parallel_change(StringInfo s);
+extern void spock_apply_parallel_commit(StringInfo s);
+extern void spock_apply_parallel_relation(StringInfo s);
+extern void spock_apply_parallel_collect(void);
+extern void spock_apply_parallel_drain(void);
+extern bool spock_apply_parallel_pending(void);
+
+/* Worker side. */
+extern SpockApplyWorker *spock_apply_parallel_attach(SpockParallelApplyWorker *worker);
+extern RepOriginId spock_apply_parallel_setup_origin(const char *slot_name);
+extern bool spock_apply_parallel_receive(StringInfo s);
+extern void spock_apply_parallel_wait_for_turn(void);
+extern void spock_apply_parallel_report_commit(XLogRecPtr local_end);
+
+extern void spock_apply_parallel_drop_origins(const char *slot_name);
+extern bool spock_apply_origin_is_ours(RepOriginId origin);
+
+#endif /* SPOCK_APPLY_PARALLEL_H */
@@ -0,0 +1,334 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_recv.c
+ * 		spock receive buffer of the apply worker
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * The apply worker reads the replication stream ahead of what it has
+ * applied and keeps the messages here, so that the upstream can keep
+ * sending while a slow change is being applied. The messages are kept in
+ * memory as returned by libpq, up to spock.receive_buffer_size. Beyond that
+ * they are spilled to a temporary file, which is then read back in order
+ * once the messages in memory have been applied. It's a PostgreSQL temporary
+ * file, so it's removed when the worker exits and at server start after a
+ * crash.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "libpq-fe.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "storage/fd.h"
+
+#include "utils/memutils.h"
+
+#include "spock_apply_recv.h"
+#include "spock.h"
+
+#define RECV_INITIAL_SLOTS		1024
+#define RECV_SPILL_BUFFER_SIZE	(64 * 1024)
+
+typedef struct RecvMessage
+{
+	char	   *data;			/* allocated by libpq */
+	int			len;
+} RecvMessage;
+
+/* Circular array of the messages kept in memory. */
+static RecvMessage *recv_slots = NULL;
+static int	recv_nslots = 0;
+static int	recv_head = 0;		/* next message to apply */
+static int	recv_count = 0;
+static Size	recv_bytes = 0;
+
+/* Message returned by spock_apply_recv_get() which is being applied. */
+static char *recv_current = NULL;
+static int	recv_current_len = 0;
+
+/* Spill file state. */
+static File recv_spill_file = -1;
+static off_t recv_spill_size = 0;	/* data written to the file */
+static off_t recv_spill_read = 0;	/* data read from the file */
+static StringInfo recv_spill_wbuf = NULL;
+static StringInfo recv_spill_rbuf = NULL;
+static int	recv_spill_rpos = 0;
+static StringInfo recv_spill_msg = NULL;
+static bool recv_spill_unget = false;	/* return recv_spill_msg again */
+
+/*
+ * Are there messages in the spill file (or its write buffer)?
+ */
+static bool
+recv_spilling(void)
+{
+	return recv_spill_wbuf != NULL &&
+		(recv_spill_read < recv_spill_size || recv_spill_wbuf->len > 0 ||
+		 recv_spill_rpos < recv_spill_rbuf->len);
+}
+
+static void
+recv_spill_open(void)
+{
+	MemoryContext	oldctx;
+
+	/* Kept across transactions, deleted when closed at exit. */
+	recv_spill_file = OpenTemporaryFile(true);
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+	recv_spill_wbuf = makeStringInfo();
+	recv_spill_rbuf = makeStringInfo();
+	recv_spill_msg = makeStringInfo();
+	MemoryContextSwitchTo(oldctx);
+
+	elog(DEBUG1, "apply is behind, spilling received changes to \"%s\"",
+		 FilePathName(recv_spill_file));
+}
+
+static void
+recv_spill_flush(void)
+{
+	if (recv_spill_wbuf->len == 0)
+		return;
+
+	if (FileWrite(recv_spill_file, recv_spill_wbuf->data, recv_spill_wbuf->len,
+				  recv_spill_size, PG_WAIT_EXTENSION) != recv_spill_wbuf->len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to receive spill file \"%s\": %m",
+						FilePathName(recv_spill_file))));
+
+	recv_spill_size += recv_spill_wbuf->len;
+	resetStringInfo(recv_spill_wbuf);
+}
+
+static void
+recv_spill_write(const char *data, int len)
+{
+	int32		msglen = len;
+
+	if (recv_spill_file < 0)
+		recv_spill_open();
+
+	appendBinaryStringInfo(recv_spill_wbuf, (char *) &msglen, sizeof(int32));
+	appendBinaryStringInfo(recv_spill_wbuf, data, len);
+
+	if (recv_spill_wbuf->len >= RECV_SPILL_BUFFER_SIZE)
+		recv_spill_flush();
+}
+
+static void
+recv_spill_read_bytes(char *dst, int len)
+{
+	while (len > 0)
+	{
+		int		avail = recv_spill_rbuf->len - recv_spill_rpos;
+		int		n;
+
+		if (avail == 0)
+		{
+			int		nread;
+
+			/* Make sure everything written so far can be read. */
+			if (recv_spill_read >= recv_spill_size)
+				recv_spill_flush();
+
+			resetStringInfo(recv_spill_rbuf);
+			enlargeStringInfo(recv_spill_rbuf, RECV_SPILL_BUFFER_SIZE);
+			nread = FileRead(recv_spill_file, recv_spill_rbuf->data,
+							 RECV_SPILL_BUFFER_SIZE, recv_spill_read,
+							 PG_WAIT_EXTENSION);
+			if (nread < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read from receive spill file \"%s\": %m",
+								FilePathName(recv_spill_file))));
+			if (nread == 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of receive spill file \"%s\"",
+								FilePathName(recv_spill_file))));
+
+			recv_spill_rbuf->len = nread;
+			recv_spill_rpos = 0;
+			recv_spill_read += nread;
+			avail = nread;
+		}
+
+		n = Min(avail, len);
+		memcpy(dst, recv_spill_rbuf->data + recv_spill_rpos, n);
+		recv_spill_rpos += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+/*
+ * Add a message received from the upstream, the buffer takes over the libpq
+ * allocated data.
+ */
+void
+spock_apply_recv_put(char *data, int len)
+{
+	/*
+	 * Once we started spilling, everything has to go to the file until it's
+	 * been read back, to keep the order.
+	 */
+	if (recv_spilling() ||
+		(recv_count > 0 &&
+		 recv_bytes + len > (Size) spock_receive_buffer_size * 1024))
+	{
+		recv_spill_write(data, len);
+		PQfreemem(data);
+		return;
+	}
+
+	if (recv_count == recv_nslots)
+	{
+		RecvMessage *slots;
+		int			nslots = Max(recv_nslots * 2, RECV_INITIAL_SLOTS);
+		int			i;
+
+		slots = MemoryContextAlloc(TopMemoryContext,
+								   nslots * sizeof(RecvMessage));
+		for (i = 0; i < recv_count; i++)
+			slots[i] = recv_slots[(recv_head + i) % recv_nslots];
+
+		if (recv_slots)
+			pfree(recv_slots);
+		recv_slots = slots;
+		recv_nslots = nslots;
+		recv_head = 0;
+	}
+
+	recv_slots[(recv_head + recv_count) % recv_nslots].data = data;
+	recv_slots[(recv_head + recv_count) % recv_nslots].len = len;
+	recv_count++;
+	recv_bytes += len;
+}
+
+/*
+ * Get the oldest message which was not applied yet.
+ *
+ * The data is valid until spock_apply_recv_release() is called. Returns false
+ * if there are no messages.
+ */
+bool
+spock_apply_recv_get(StringInfo s)
+{
+	Assert(recv_current == NULL);
+
+	memset(s, 0, sizeof(StringInfoData));
+
+	/* A message read from the spill file was put back, it's the oldest. */
+	if (recv_spill_unget)
+	{
+		recv_spill_unget = false;
+
+		s->data = recv_spill_msg->data;
+		s->len = recv_spill_msg->len;
+		s->maxlen = -1;
+
+		return true;
+	}
+
+	if (recv_count > 0)
+	{
+		RecvMessage *msg = &recv_slots[recv_head];
+
+		/*
+		 * We're using a StringInfo to wrap existing data here, as a cursor.
+		 */
+		s->data = recv_current = msg->data;
+		s->len = recv_current_len = msg->len;
+		s->maxlen = -1;
+
+		recv_head = (recv_head + 1) % recv_nslots;
+		recv_count--;
+		recv_bytes -= msg->len;
+
+		return true;
+	}
+
+	if (recv_spilling())
+	{
+		int32		len;
+
+		recv_spill_read_bytes((char *) &len, sizeof(int32));
+		resetStringInfo(recv_spill_msg);
+		enlargeStringInfo(recv_spill_msg, len);
+		recv_spill_read_bytes(recv_spill_msg->data, len);
+		recv_spill_msg->len = len;
+		recv_spill_msg->data[len] = '\0';
+
+		/* Start over once everything spilled has been read back. */
+		if (!recv_spilling())
+		{
+			if (FileTruncate(recv_spill_file, 0, PG_WAIT_EXTENSION) < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not truncate receive spill file \"%s\": %m",
+								FilePathName(recv_spill_file))));
+			recv_spill_size = recv_spill_read = 0;
+			resetStringInfo(recv_spill_rbuf);
+			recv_spill_rpos = 0;
+		}
+
+		s->data = recv_spill_msg->data;
+		s->len = recv_spill_msg->len;
+		s->maxlen = -1;
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Free the message returned by spock_apply_recv_get().
+ */
+void
+spock_apply_recv_release(void)
+{
+	/* copybuf is malloc'd not palloc'd */
+	if (recv_current != NULL)
+	{
+		PQfreemem(recv_current);
+		recv_current = NULL;
+	}
+}
+
+/*
+ * Put the message returned by spock_apply_recv_get() back, so that the next
+ * call returns it again. Used to look at a message before deciding to apply
+ * it.
+ */
+void
+spock_apply_recv_unget(void)
+{
+	if (recv_current != NULL)
+	{
+		/* There's room, the slot was just vacated. */
+		Assert(recv_count < recv_nslots);
+
+		recv_head = (recv_head + recv_nslots - 1) % recv_nslots;
+		recv_slots[recv_head].data = recv_current;
+		recv_slots[recv_head].len = recv_current_len;
+		recv_count++;
+		recv_bytes += recv_current_len;
+		recv_current = NULL;
+	}
+	else
+		recv_spill_unget = true;
+}
+
+bool
+spock_apply_recv_empty(void)
+{
+	return recv_count == 0 && !recv_spilling() && !recv_spill_unget;
+}
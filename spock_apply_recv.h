@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_recv.h
+ * 		spock receive buffer of the apply worker
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_RECV_H
+#define SPOCK_APPLY_RECV_H
+
+#include "lib/stringinfo.h"
+
+extern void spock_apply_recv_put(char *data, int len);
+extern bool spock_apply_recv_get(StringInfo s);
+extern void spock_apply_recv_release(void);
+extern void spock_apply_recv_unget(void);
+extern bool spock_apply_recv_empty(void);
+
+#endif /* SPOCK_APPLY_RECV_H */
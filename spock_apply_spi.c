@@ -532,11 +532,13 @@ spock_proccess_copy(spock_copyState *spkcstate)
 void
 spock_apply_spi_mi_finish(SpockRelation *rel)
 {
-	if (!spkcstate)
+	/*
+	 * Only one COPY runs at a time, the rows of another relation were
+	 * written when it started.
+	 */
+	if (!spkcstate || spkcstate->rel != rel)
 		return;
 
-	Assert(spkcstate->rel == rel);
-
 	spock_proccess_copy(spkcstate);
 
 	if (spkcstate->copy_stmt)
@@ -0,0 +1,648 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_spool.c
+ * 		spock durable spool of received changes
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * With spock.spool_received_changes, the apply worker writes every message
+ * it receives to a file in the pg_spock directory of the data directory
+ * before applying it, and syncs the file once complete transactions have
+ * been written. Transactions which are in the file and synced can be
+ * confirmed to the upstream as flushed, so the upstream can recycle its WAL
+ * sooner, and when the apply worker restarts, for example after an error,
+ * it replays them from the file instead of having the upstream decode them
+ * again. Only what comes after the last spooled transaction is requested
+ * from the upstream.
+ *
+ * Every message is stored with its length and a CRC, a torn write at the end
+ * of the file is detected when the file is opened and cut off together with
+ * the incomplete transaction before it. The file is emptied once everything
+ * in it has been applied and flushed locally.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pgstat.h"
+
+#include "access/xact.h"
+
+#include "libpq/pqformat.h"
+
+#include "port/pg_crc32c.h"
+
+#include "storage/fd.h"
+
+#include "utils/memutils.h"
+
+#include "spock_apply_spool.h"
+#include "spock_proto_native.h"
+
+#define SPOOL_DIR			"pg_spock"
+#define SPOOL_BUFFER_SIZE	(64 * 1024)
+
+/*
+ * Emptying the file costs a sync, so keep applied transactions in it until
+ * there's this much of them. They are skipped when replayed.
+ */
+#define SPOOL_TRIM_SIZE		(16 * 1024 * 1024)
+
+typedef struct SpoolRecordHeader
+{
+	int32		len;
+	pg_crc32c	crc;
+} SpoolRecordHeader;
+
+static char spool_path[MAXPGPATH];
+static File spool_file = -1;
+static bool spool_writing = false;	/* spooling received messages */
+static off_t spool_size = 0;		/* data written to the file */
+static off_t spool_commit_end = 0;	/* end of the last commit spooled */
+static StringInfo spool_wbuf = NULL;
+
+/* Upstream position of the last commit spooled and of the last synced. */
+static XLogRecPtr spool_written_lsn = InvalidXLogRecPtr;
+static XLogRecPtr spool_durable_lsn = InvalidXLogRecPtr;
+
+/* Replay state. */
+static off_t replay_end = 0;		/* messages before this are replayed */
+static off_t replay_pos = 0;		/* next message to replay */
+static off_t replay_read = 0;		/* data read from the file */
+static StringInfo replay_rbuf = NULL;
+static int	replay_rpos = 0;
+static StringInfo replay_msg = NULL;
+static bool replay_unget = false;	/* return replay_msg again */
+
+/*
+ * Spools of the subscriptions dropped by the current transaction, removed
+ * once it commits.
+ */
+typedef struct SpoolPendingDrop
+{
+	Oid			subid;
+	int			nestlevel;		/* subtransaction which dropped it */
+} SpoolPendingDrop;
+
+static List *spool_pending_drops = NIL;
+static bool spool_xact_callbacks_registered = false;
+
+static void
+spool_flush(void)
+{
+	if (spool_wbuf->len == 0)
+		return;
+
+	if (FileWrite(spool_file, spool_wbuf->data, spool_wbuf->len, spool_size,
+				  PG_WAIT_EXTENSION) != spool_wbuf->len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to spool file \"%s\": %m",
+						spool_path)));
+
+	spool_size += spool_wbuf->len;
+	resetStringInfo(spool_wbuf);
+}
+
+static void
+spool_sync_file(void)
+{
+	if (FileSync(spool_file, PG_WAIT_EXTENSION) != 0)
+		ereport(data_sync_elevel(ERROR),
+				(errcode_for_file_access(),
+				 errmsg("could not fsync spool file \"%s\": %m",
+						spool_path)));
+}
+
+static void
+spool_truncate(off_t size)
+{
+	if (FileTruncate(spool_file, size, PG_WAIT_EXTENSION) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not truncate spool file \"%s\": %m",
+						spool_path)));
+	spool_sync_file();
+
+	spool_size = spool_commit_end = size;
+}
+
+static void
+spool_read_bytes(char *dst, int len)
+{
+	while (len > 0)
+	{
+		int		avail = replay_rbuf->len - replay_rpos;
+		int		n;
+
+		if (avail == 0)
+		{
+			int		nread;
+
+			resetStringInfo(replay_rbuf);
+			enlargeStringInfo(replay_rbuf, SPOOL_BUFFER_SIZE);
+			nread = FileRead(spool_file, replay_rbuf->data, SPOOL_BUFFER_SIZE,
+							 replay_read, PG_WAIT_EXTENSION);
+			if (nread < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read from spool file \"%s\": %m",
+								spool_path)));
+			if (nread == 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of spool file \"%s\"",
+								spool_path)));
+
+			replay_rbuf->len = nread;
+			replay_rpos = 0;
+			replay_read += nread;
+			avail = nread;
+		}
+
+		n = Min(avail, len);
+		memcpy(dst, replay_rbuf->data + replay_rpos, n);
+		replay_rpos += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+static void
+spool_replay_rewind(void)
+{
+	resetStringInfo(replay_rbuf);
+	replay_rpos = 0;
+	replay_read = 0;
+	replay_pos = 0;
+}
+
+/*
+ * If the message, or the last message of a batch, is a COMMIT or a STREAM
+ * COMMIT, return the end of the transaction in the upstream WAL,
+ * InvalidXLogRecPtr otherwise.
+ */
+static XLogRecPtr
+spool_commit_lsn(const char *data, int len)
+{
+	StringInfoData	s;
+	XLogRecPtr		commit_lsn;
+	XLogRecPtr		end_lsn;
+	TimestampTz		committime;
+
+	/* Skip the 'w' header. */
+	if (len <= (int) (1 + 3 * sizeof(int64)))
+		return InvalidXLogRecPtr;
+
+	memset(&s, 0, sizeof(StringInfoData));
+	s.data = (char *) data;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 1 + 3 * sizeof(int64);
+
+	/*
+	 * The upstream ends a batch frame after every commit. A compressed batch
+	 * says where the transaction it commits ends, if it does, so it doesn't
+	 * have to be decompressed here.
+	 */
+	if (s.data[s.cursor] == 'Z')
+	{
+		(void) pq_getmsgbyte(&s);	/* 'Z' */
+		(void) pq_getmsgbyte(&s);	/* method */
+		(void) pq_getmsgint(&s, 4);	/* number of messages */
+		(void) pq_getmsgint(&s, 4);	/* uncompressed length */
+		return pq_getmsgint64(&s);
+	}
+
+	if (s.data[s.cursor] == 'G')
+	{
+		int			nmsgs;
+
+		(void) pq_getmsgbyte(&s);
+		nmsgs = pq_getmsgint(&s, 4);
+
+		if (nmsgs <= 0)
+			return InvalidXLogRecPtr;
+
+		/* Skip to the last message. */
+		while (--nmsgs > 0)
+			(void) pq_getmsgbytes(&s, pq_getmsgint(&s, 4));
+		(void) pq_getmsgint(&s, 4);
+	}
+
+	switch (pq_getmsgbyte(&s))
+	{
+		/* COMMIT */
+		case 'C':
+			spock_read_commit(&s, &commit_lsn, &end_lsn, &committime);
+			return end_lsn;
+		/* STREAM COMMIT */
+		case 'c':
+			{
+				TransactionId	xid;
+				XLogRecPtr		origin_lsn;
+				char		   *origin;
+
+				origin = spock_read_stream_commit(&s, &xid, &commit_lsn,
+												  &end_lsn, &committime,
+												  &origin_lsn);
+				if (origin)
+					pfree(origin);
+				return end_lsn;
+			}
+		default:
+			return InvalidXLogRecPtr;
+	}
+}
+
+/*
+ * Find the end of the last complete transaction in the file, everything
+ * after it is thrown away. The upstream sends the rest again.
+ */
+static void
+spool_scan(void)
+{
+	off_t		filesize = FileSize(spool_file);
+	off_t		offset = 0;
+
+	if (filesize < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not determine size of spool file \"%s\": %m",
+						spool_path)));
+
+	spool_replay_rewind();
+	spool_commit_end = 0;
+	spool_written_lsn = InvalidXLogRecPtr;
+
+	while (offset + (off_t) sizeof(SpoolRecordHeader) <= filesize)
+	{
+		SpoolRecordHeader	hdr;
+		pg_crc32c			crc;
+		XLogRecPtr			lsn;
+
+		spool_read_bytes((char *) &hdr, sizeof(SpoolRecordHeader));
+		if (hdr.len <= 0 || hdr.len >= MaxAllocSize ||
+			offset + (off_t) sizeof(SpoolRecordHeader) + hdr.len > filesize)
+			break;
+
+		resetStringInfo(replay_msg);
+		enlargeStringInfo(replay_msg, hdr.len);
+		spool_read_bytes(replay_msg->data, hdr.len);
+		replay_msg->len = hdr.len;
+		replay_msg->data[hdr.len] = '\0';
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, replay_msg->data, hdr.len);
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, hdr.crc))
+			break;
+
+		offset += sizeof(SpoolRecordHeader) + hdr.len;
+
+		lsn = spool_commit_lsn(replay_msg->data, replay_msg->len);
+		if (lsn != InvalidXLogRecPtr)
+		{
+			spool_commit_end = offset;
+			spool_written_lsn = lsn;
+		}
+	}
+
+	if (spool_commit_end < filesize)
+	{
+		elog(DEBUG1, "discarding %lld bytes of incomplete transaction at the end of spool file \"%s\"",
+			 (long long) (filesize - spool_commit_end), spool_path);
+		spool_truncate(spool_commit_end);
+	}
+	else
+		spool_size = spool_commit_end;
+
+	spool_replay_rewind();
+}
+
+/*
+ * Open the spool of the subscription and prepare the replay of what's in
+ * it. Returns the upstream position up to which the upstream doesn't have to
+ * send the changes again, or InvalidXLogRecPtr.
+ *
+ * When spooling is disabled, a spool left behind is still replayed, as it
+ * may have been confirmed to the upstream already, but no new messages are
+ * added to it.
+ */
+XLogRecPtr
+spock_apply_spool_open(Oid subid, bool enabled)
+{
+	MemoryContext	oldctx;
+
+	Assert(spool_file < 0);
+
+	snprintf(spool_path, MAXPGPATH, "%s/spool-%u", SPOOL_DIR, subid);
+
+	if (!enabled)
+	{
+		struct stat st;
+
+		if (stat(spool_path, &st) != 0)
+		{
+			if (errno != ENOENT)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not stat file \"%s\": %m",
+								spool_path)));
+			return InvalidXLogRecPtr;
+		}
+	}
+	else if (MakePGDirectory(SPOOL_DIR) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						SPOOL_DIR)));
+
+	spool_file = PathNameOpenFile(spool_path, O_RDWR | O_CREAT | PG_BINARY);
+	if (spool_file < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open spool file \"%s\": %m",
+						spool_path)));
+
+	/* Make sure the file itself survives a crash. */
+	fsync_fname(spool_path, false);
+	fsync_fname(SPOOL_DIR, true);
+
+	if (spool_wbuf == NULL)
+	{
+		oldctx = MemoryContextSwitchTo(TopMemoryContext);
+		spool_wbuf = makeStringInfo();
+		replay_rbuf = makeStringInfo();
+		replay_msg = makeStringInfo();
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	spool_writing = enabled;
+	spool_scan();
+
+	spool_durable_lsn = spool_written_lsn;
+	replay_end = spool_size;
+
+	if (replay_end > 0)
+		elog(LOG, "replaying %lld bytes of spooled changes up to %X/%X",
+			 (long long) replay_end,
+			 (uint32) (spool_durable_lsn >> 32), (uint32) spool_durable_lsn);
+	else if (!spool_writing)
+		spock_apply_spool_trim();
+
+	return spool_durable_lsn;
+}
+
+/*
+ * Add a message received from the upstream to the spool.
+ */
+void
+spock_apply_spool_write(const char *data, int len)
+{
+	SpoolRecordHeader	hdr;
+	XLogRecPtr			lsn;
+
+	if (!spool_writing)
+		return;
+
+	hdr.len = len;
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, data, len);
+	FIN_CRC32C(hdr.crc);
+
+	appendBinaryStringInfo(spool_wbuf, (char *) &hdr, sizeof(SpoolRecordHeader));
+	appendBinaryStringInfo(spool_wbuf, data, len);
+
+	lsn = spool_commit_lsn(data, len);
+	if (lsn != InvalidXLogRecPtr)
+	{
+		spool_commit_end = spool_size + spool_wbuf->len;
+		spool_written_lsn = lsn;
+	}
+
+	if (spool_wbuf->len >= SPOOL_BUFFER_SIZE)
+		spool_flush();
+}
+
+/*
+ * Make the spooled transactions durable.
+ */
+void
+spock_apply_spool_sync(void)
+{
+	if (!spool_writing || spool_written_lsn == spool_durable_lsn)
+		return;
+
+	spool_flush();
+	spool_sync_file();
+
+	spool_durable_lsn = spool_written_lsn;
+}
+
+/*
+ * Upstream position up to which the received transactions are on disk,
+ * InvalidXLogRecPtr if there is no spool.
+ */
+XLogRecPtr
+spock_apply_spool_durable_lsn(void)
+{
+	return spool_durable_lsn;
+}
+
+/*
+ * Are there spooled messages left to replay?
+ */
+bool
+spock_apply_spool_replaying(void)
+{
+	return replay_unget || replay_pos < replay_end;
+}
+
+/*
+ * Get the next message to replay from the spool.
+ *
+ * The data is valid until the next call. Returns false once everything
+ * spooled before the apply worker started has been replayed.
+ */
+bool
+spock_apply_spool_replay_next(StringInfo s)
+{
+	memset(s, 0, sizeof(StringInfoData));
+
+	if (replay_unget)
+		replay_unget = false;
+	else
+	{
+		SpoolRecordHeader	hdr;
+
+		if (replay_pos >= replay_end)
+			return false;
+
+		spool_read_bytes((char *) &hdr, sizeof(SpoolRecordHeader));
+		resetStringInfo(replay_msg);
+		enlargeStringInfo(replay_msg, hdr.len);
+		spool_read_bytes(replay_msg->data, hdr.len);
+		replay_msg->len = hdr.len;
+		replay_msg->data[hdr.len] = '\0';
+
+		replay_pos += sizeof(SpoolRecordHeader) + hdr.len;
+
+		if (replay_pos >= replay_end)
+			elog(DEBUG1, "finished replaying spooled changes");
+	}
+
+	s->data = replay_msg->data;
+	s->len = replay_msg->len;
+	s->maxlen = -1;
+
+	return true;
+}
+
+/*
+ * Put the message returned by spock_apply_spool_replay_next() back.
+ */
+void
+spock_apply_spool_unget(void)
+{
+	replay_unget = true;
+}
+
+/*
+ * Throw away the spooled changes, called when everything received has been
+ * applied and flushed locally. The file is only emptied when it ends with a
+ * complete transaction, the rest of a transaction being received must not
+ * end up at its start.
+ */
+void
+spock_apply_spool_trim(void)
+{
+	if (spool_file < 0 || spock_apply_spool_replaying())
+		return;
+
+	if (spool_writing &&
+		(spool_size + spool_wbuf->len != spool_commit_end ||
+		 spool_commit_end < SPOOL_TRIM_SIZE))
+		return;
+
+	resetStringInfo(spool_wbuf);
+	spool_truncate(0);
+	spool_replay_rewind();
+	replay_end = 0;
+
+	/* Don't keep too much memory around after huge messages. */
+	if (replay_msg->maxlen > SPOOL_BUFFER_SIZE)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		pfree(replay_msg->data);
+		initStringInfo(replay_msg);
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	/* The spool isn't used anymore. */
+	if (!spool_writing)
+	{
+		FileClose(spool_file);
+		spool_file = -1;
+		spool_durable_lsn = spool_written_lsn = InvalidXLogRecPtr;
+
+		if (unlink(spool_path) < 0 && errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", spool_path)));
+	}
+}
+
+static void
+spool_drop_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+			if (spool_pending_drops != NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has dropped a subscription")));
+			break;
+		case XACT_EVENT_COMMIT:
+			foreach(lc, spool_pending_drops)
+			{
+				SpoolPendingDrop *drop = (SpoolPendingDrop *) lfirst(lc);
+				char		path[MAXPGPATH];
+
+				snprintf(path, MAXPGPATH, "%s/spool-%u", SPOOL_DIR,
+						 drop->subid);
+
+				if (unlink(path) < 0 && errno != ENOENT)
+					ereport(WARNING,
+							(errcode_for_file_access(),
+							 errmsg("could not remove file \"%s\": %m",
+									path)));
+			}
+			spool_pending_drops = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+			spool_pending_drops = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+spool_drop_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							SubTransactionId parentSubid, void *arg)
+{
+	int			nestlevel = GetCurrentTransactionNestLevel();
+	ListCell   *lc;
+
+	foreach(lc, spool_pending_drops)
+	{
+		SpoolPendingDrop *drop = (SpoolPendingDrop *) lfirst(lc);
+
+		if (drop->nestlevel < nestlevel)
+			continue;
+
+		if (event == SUBXACT_EVENT_COMMIT_SUB)
+			drop->nestlevel = nestlevel - 1;
+		else if (event == SUBXACT_EVENT_ABORT_SUB)
+			spool_pending_drops = foreach_delete_current(spool_pending_drops,
+														 lc);
+	}
+}
+
+/*
+ * Remove the spool of a subscription dropped by the current transaction
+ * once it commits. The spool must stay if the drop is rolled back, it may
+ * hold changes confirmed to the upstream already.
+ */
+void
+spock_apply_spool_drop(Oid subid)
+{
+	MemoryContext	oldctx;
+	SpoolPendingDrop *drop;
+
+	if (!spool_xact_callbacks_registered)
+	{
+		RegisterXactCallback(spool_drop_xact_callback, NULL);
+		RegisterSubXactCallback(spool_drop_subxact_callback, NULL);
+		spool_xact_callbacks_registered = true;
+	}
+
+	oldctx = MemoryContextSwitchTo(TopTransactionContext);
+
+	drop = palloc(sizeof(SpoolPendingDrop));
+	drop->subid = subid;
+	drop->nestlevel = GetCurrentTransactionNestLevel();
+	spool_pending_drops = lappend(spool_pending_drops, drop);
+
+	MemoryContextSwitchTo(oldctx);
+}
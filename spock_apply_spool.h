@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_spool.h
+ * 		spock durable spool of received changes
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_SPOOL_H
+#define SPOCK_APPLY_SPOOL_H
+
+#include "access/xlogdefs.h"
+#include "lib/stringinfo.h"
+
+extern XLogRecPtr spock_apply_spool_open(Oid subid, bool enabled);
+extern void spock_apply_spool_write(const char *data, int len);
+extern void spock_apply_spool_sync(void);
+extern XLogRecPtr spock_apply_spool_durable_lsn(void);
+extern void spock_apply_spool_trim(void);
+extern void spock_apply_spool_drop(Oid subid);
+
+extern bool spock_apply_spool_replaying(void);
+extern bool spock_apply_spool_replay_next(StringInfo s);
+extern void spock_apply_spool_unget(void);
+
+#endif /* SPOCK_APPLY_SPOOL_H */
@@ -0,0 +1,427 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_stream.c
+ * 		spock spooling of streamed transactions
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * When the upstream streams a large transaction before it has committed,
+ * the changes arrive in several segments, each enclosed in STREAM START and
+ * STREAM STOP messages, possibly interleaved with other transactions. We
+ * can't apply them until we know the transaction committed, so the changes
+ * are written to a temporary file per streamed transaction and replayed
+ * from there once the STREAM COMMIT arrives. The file is thrown away on
+ * STREAM ABORT, or cut back to where the subtransaction started when only a
+ * subtransaction aborted.
+ *
+ * The files are temporary files which are removed when closed and on
+ * restart. That's fine since the upstream streams the whole transaction
+ * again after reconnecting.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pgstat.h"
+
+#include "storage/fd.h"
+
+#include "utils/memutils.h"
+
+#include "spock_apply_stream.h"
+
+#define STREAM_BUFFER_SIZE		(64 * 1024)
+
+typedef struct SpockStreamSubXact
+{
+	TransactionId	xid;
+	off_t			offset;		/* Where its first change is in the file */
+} SpockStreamSubXact;
+
+typedef struct SpockStreamXact
+{
+	TransactionId	xid;
+	File			file;
+	off_t			size;		/* Amount of data written to the file */
+	List		   *subxacts;	/* List of SpockStreamSubXact */
+} SpockStreamXact;
+
+/* Streamed transactions which have not finished yet. */
+static List *stream_xacts = NIL;
+
+/* Transaction of the currently open stream segment, if any. */
+static SpockStreamXact *current_stream = NULL;
+
+/*
+ * Buffers writes of the current stream segment and reads of the transaction
+ * being replayed, so that we don't do a system call for every message.
+ */
+static StringInfo stream_buf = NULL;
+
+/* Replay state. */
+static SpockStreamXact *replay_stream = NULL;
+static off_t replay_offset = 0;
+static int replay_buf_pos = 0;
+static StringInfo replay_msg = NULL;
+
+static SpockStreamXact *
+stream_xact_find(TransactionId xid)
+{
+	ListCell   *lc;
+
+	foreach (lc, stream_xacts)
+	{
+		SpockStreamXact *sx = (SpockStreamXact *) lfirst(lc);
+
+		if (sx->xid == xid)
+			return sx;
+	}
+
+	return NULL;
+}
+
+static void
+stream_xact_discard(SpockStreamXact *sx)
+{
+	if (sx == current_stream)
+	{
+		current_stream = NULL;
+		resetStringInfo(stream_buf);
+	}
+
+	FileClose(sx->file);
+	list_free_deep(sx->subxacts);
+	stream_xacts = list_delete_ptr(stream_xacts, sx);
+	pfree(sx);
+}
+
+/*
+ * Write out the buffered changes of the current stream segment.
+ */
+static void
+stream_flush(void)
+{
+	SpockStreamXact *sx = current_stream;
+
+	if (stream_buf->len == 0)
+		return;
+
+	if (FileWrite(sx->file, stream_buf->data, stream_buf->len, sx->size,
+				  PG_WAIT_EXTENSION) != stream_buf->len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to spool file of streamed transaction %u: %m",
+						sx->xid)));
+
+	sx->size += stream_buf->len;
+	resetStringInfo(stream_buf);
+}
+
+/*
+ * Start a new segment of changes of a streamed transaction.
+ */
+void
+spock_apply_stream_start(TransactionId xid, bool first_segment)
+{
+	SpockStreamXact *sx;
+
+	if (current_stream != NULL)
+		elog(ERROR, "stream of transaction %u started while transaction %u is being streamed",
+			 xid, current_stream->xid);
+
+	if (stream_buf == NULL)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		stream_buf = makeStringInfo();
+		replay_msg = makeStringInfo();
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	sx = stream_xact_find(xid);
+
+	if (first_segment)
+	{
+		MemoryContext	oldctx;
+
+		/* Leftover from before the upstream decided to restart the stream. */
+		if (sx != NULL)
+			stream_xact_discard(sx);
+
+		oldctx = MemoryContextSwitchTo(TopMemoryContext);
+		sx = palloc0(sizeof(SpockStreamXact));
+		sx->xid = xid;
+		sx->file = OpenTemporaryFile(true);
+		sx->size = 0;
+		stream_xacts = lappend(stream_xacts, sx);
+		MemoryContextSwitchTo(oldctx);
+	}
+	else if (sx == NULL)
+		elog(ERROR, "received changes of unknown streamed transaction %u", xid);
+
+	resetStringInfo(stream_buf);
+	current_stream = sx;
+}
+
+/*
+ * End the current stream segment.
+ */
+void
+spock_apply_stream_stop(void)
+{
+	if (current_stream == NULL)
+		elog(ERROR, "STREAM STOP message sent out of order");
+
+	stream_flush();
+	current_stream = NULL;
+}
+
+bool
+spock_apply_stream_active(void)
+{
+	return current_stream != NULL;
+}
+
+/*
+ * Are there streamed transactions which have not finished yet?
+ */
+bool
+spock_apply_stream_pending(void)
+{
+	return stream_xacts != NIL;
+}
+
+/*
+ * The following changes belong to the given subtransaction, remember where
+ * it started so it can be rolled back.
+ */
+void
+spock_apply_stream_subxact(TransactionId subxid)
+{
+	SpockStreamXact	   *sx = current_stream;
+	SpockStreamSubXact *sub;
+	MemoryContext		oldctx;
+	ListCell		   *lc;
+
+	if (sx == NULL)
+		elog(ERROR, "STREAM SUBXACT message sent out of order");
+
+	if (subxid == sx->xid)
+		return;
+
+	foreach (lc, sx->subxacts)
+	{
+		sub = (SpockStreamSubXact *) lfirst(lc);
+
+		if (sub->xid == subxid)
+			return;
+	}
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+	sub = palloc(sizeof(SpockStreamSubXact));
+	sub->xid = subxid;
+	sub->offset = sx->size + stream_buf->len;
+	sx->subxacts = lappend(sx->subxacts, sub);
+	MemoryContextSwitchTo(oldctx);
+}
+
+/*
+ * Spool a protocol message of the current stream segment.
+ */
+void
+spock_apply_stream_write(const char *data, int len)
+{
+	int32		msglen = len;
+
+	Assert(current_stream != NULL);
+
+	appendBinaryStringInfo(stream_buf, (char *) &msglen, sizeof(int32));
+	appendBinaryStringInfo(stream_buf, data, len);
+
+	if (stream_buf->len >= STREAM_BUFFER_SIZE)
+		stream_flush();
+}
+
+/*
+ * Throw away the changes of an aborted streamed transaction or of its
+ * aborted subtransaction.
+ */
+void
+spock_apply_stream_abort(TransactionId xid, TransactionId subxid)
+{
+	SpockStreamXact	   *sx = stream_xact_find(xid);
+	SpockStreamSubXact *sub = NULL;
+	List			   *remaining = NIL;
+	MemoryContext		oldctx;
+	ListCell		   *lc;
+
+	/* Nothing has been streamed for it, nothing to do. */
+	if (sx == NULL)
+		return;
+
+	if (xid == subxid)
+	{
+		stream_xact_discard(sx);
+		return;
+	}
+
+	foreach (lc, sx->subxacts)
+	{
+		sub = (SpockStreamSubXact *) lfirst(lc);
+
+		if (sub->xid == subxid)
+			break;
+		sub = NULL;
+	}
+
+	/* No changes were streamed for the subtransaction. */
+	if (sub == NULL)
+		return;
+
+	if (sx == current_stream)
+		stream_flush();
+
+	if (FileTruncate(sx->file, sub->offset, PG_WAIT_EXTENSION) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not truncate spool file of streamed transaction %u: %m",
+						sx->xid)));
+	sx->size = sub->offset;
+
+	/*
+	 * Subtransactions which started after the aborted one are its children
+	 * and are gone as well.
+	 */
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+	foreach (lc, sx->subxacts)
+	{
+		SpockStreamSubXact *s = (SpockStreamSubXact *) lfirst(lc);
+
+		if (s->offset < sx->size)
+			remaining = lappend(remaining, s);
+		else
+			pfree(s);
+	}
+	list_free(sx->subxacts);
+	sx->subxacts = remaining;
+	MemoryContextSwitchTo(oldctx);
+}
+
+/*
+ * Read len bytes of the transaction being replayed.
+ */
+static void
+stream_read(char *dst, int len)
+{
+	while (len > 0)
+	{
+		int		avail = stream_buf->len - replay_buf_pos;
+		int		n;
+
+		if (avail == 0)
+		{
+			int		nread;
+
+			resetStringInfo(stream_buf);
+			enlargeStringInfo(stream_buf, STREAM_BUFFER_SIZE);
+			nread = FileRead(replay_stream->file, stream_buf->data,
+							 STREAM_BUFFER_SIZE, replay_offset,
+							 PG_WAIT_EXTENSION);
+			if (nread < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read from spool file of streamed transaction %u: %m",
+								replay_stream->xid)));
+			if (nread == 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of spool file of streamed transaction %u",
+								replay_stream->xid)));
+
+			stream_buf->len = nread;
+			replay_buf_pos = 0;
+			replay_offset += nread;
+			avail = nread;
+		}
+
+		n = Min(avail, len);
+		memcpy(dst, stream_buf->data + replay_buf_pos, n);
+		replay_buf_pos += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+/*
+ * Start replaying the changes of a committed streamed transaction. Returns
+ * the buffer to pass to spock_apply_stream_replay_next().
+ */
+StringInfo
+spock_apply_stream_replay_begin(TransactionId xid)
+{
+	SpockStreamXact *sx;
+
+	if (current_stream != NULL)
+		elog(ERROR, "STREAM COMMIT message sent out of order");
+
+	sx = stream_xact_find(xid);
+	if (sx == NULL)
+		elog(ERROR, "received commit of unknown streamed transaction %u", xid);
+
+	replay_stream = sx;
+	replay_offset = 0;
+	replay_buf_pos = 0;
+	resetStringInfo(stream_buf);
+
+	return replay_msg;
+}
+
+/*
+ * Read the next spooled message into msg, returns false when there are no
+ * more messages.
+ */
+bool
+spock_apply_stream_replay_next(StringInfo msg)
+{
+	int32		len;
+
+	Assert(replay_stream != NULL);
+
+	if (replay_offset >= replay_stream->size &&
+		replay_buf_pos >= stream_buf->len)
+		return false;
+
+	stream_read((char *) &len, sizeof(int32));
+
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, len);
+	stream_read(msg->data, len);
+	msg->len = len;
+	msg->data[len] = '\0';
+
+	return true;
+}
+
+/*
+ * Finish the replay and remove the spool file.
+ */
+void
+spock_apply_stream_replay_end(void)
+{
+	Assert(replay_stream != NULL);
+
+	stream_xact_discard(replay_stream);
+	replay_stream = NULL;
+
+	/* Don't keep too much memory around after huge messages. */
+	if (replay_msg->maxlen > STREAM_BUFFER_SIZE)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		pfree(replay_msg->data);
+		initStringInfo(replay_msg);
+		MemoryContextSwitchTo(oldctx);
+	}
+}
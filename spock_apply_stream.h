@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_stream.h
+ * 		spock spooling of streamed transactions
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_STREAM_H
+#define SPOCK_APPLY_STREAM_H
+
+#include "lib/stringinfo.h"
+
+extern void spock_apply_stream_start(TransactionId xid, bool first_segment);
+extern void spock_apply_stream_stop(void);
+extern bool spock_apply_stream_active(void);
+extern bool spock_apply_stream_pending(void);
+extern void spock_apply_stream_subxact(TransactionId subxid);
+extern void spock_apply_stream_write(const char *data, int len);
+extern void spock_apply_stream_abort(TransactionId xid, TransactionId subxid);
+
+extern StringInfo spock_apply_stream_replay_begin(TransactionId xid);
+extern bool spock_apply_stream_replay_next(StringInfo msg);
+extern void spock_apply_stream_replay_end(void);
+
+#endif /* SPOCK_APPLY_STREAM_H */
@@ -0,0 +1,200 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_compress.c
+ * 		spock compression of the replication stream
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * The subscriber can ask the provider to compress the batch frames it sends
+ * with LZ4 or zstd, whichever PostgreSQL was built with. The provider uses
+ * the method if it was built with it as well and tells the subscriber in its
+ * startup message, otherwise it sends the batches uncompressed.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "spock_compress.h"
+
+/* Favour speed, the stream is compressed on the fly. */
+#define SPOCK_ZSTD_LEVEL	1
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+#endif
+
+/*
+ * Look up a compression method by name. Returns SPOCK_COMPRESSION_NONE when
+ * this build doesn't support it.
+ */
+SpockCompression
+spock_compression_by_name(const char *name)
+{
+#ifdef USE_LZ4
+	if (pg_strcasecmp(name, "lz4") == 0)
+		return SPOCK_COMPRESSION_LZ4;
+#endif
+#ifdef USE_ZSTD
+	if (pg_strcasecmp(name, "zstd") == 0)
+		return SPOCK_COMPRESSION_ZSTD;
+#endif
+
+	return SPOCK_COMPRESSION_NONE;
+}
+
+const char *
+spock_compression_name(SpockCompression method)
+{
+	switch (method)
+	{
+		case SPOCK_COMPRESSION_NONE:
+			return "none";
+		case SPOCK_COMPRESSION_LZ4:
+			return "lz4";
+		case SPOCK_COMPRESSION_ZSTD:
+			return "zstd";
+	}
+
+	return "unknown";
+}
+
+/*
+ * Append the compressed src to dst. Returns false, with dst unchanged, if
+ * the data didn't get smaller.
+ */
+bool
+spock_compress(SpockCompression method, const char *src, int len,
+			   StringInfo dst)
+{
+	int			clen = 0;
+
+	switch (method)
+	{
+		case SPOCK_COMPRESSION_NONE:
+			return false;
+
+		case SPOCK_COMPRESSION_LZ4:
+#ifdef USE_LZ4
+			enlargeStringInfo(dst, LZ4_compressBound(len));
+			clen = LZ4_compress_default(src, dst->data + dst->len, len,
+										dst->maxlen - dst->len - 1);
+			if (clen <= 0)
+				return false;
+			break;
+#else
+			elog(ERROR, "LZ4 compression is not supported by this build");
+#endif
+
+		case SPOCK_COMPRESSION_ZSTD:
+#ifdef USE_ZSTD
+			{
+				size_t		ret;
+
+				if (zstd_cctx == NULL)
+				{
+					zstd_cctx = ZSTD_createCCtx();
+					if (zstd_cctx == NULL)
+						ereport(ERROR,
+								(errcode(ERRCODE_OUT_OF_MEMORY),
+								 errmsg("out of memory")));
+				}
+
+				enlargeStringInfo(dst, ZSTD_compressBound(len));
+				ret = ZSTD_compressCCtx(zstd_cctx, dst->data + dst->len,
+										dst->maxlen - dst->len - 1,
+										src, len, SPOCK_ZSTD_LEVEL);
+				if (ZSTD_isError(ret))
+					return false;
+				clen = (int) ret;
+				break;
+			}
+#else
+			elog(ERROR, "zstd compression is not supported by this build");
+#endif
+	}
+
+	if (clen >= len)
+		return false;
+
+	dst->len += clen;
+	dst->data[dst->len] = '\0';
+
+	return true;
+}
+
+/*
+ * Decompress len bytes of src, which must give exactly rawlen bytes, into
+ * dst, replacing its contents.
+ */
+void
+spock_decompress(SpockCompression method, const char *src, int len,
+				 int rawlen, StringInfo dst)
+{
+	int			dlen = -1;
+
+	if (rawlen <= 0 || rawlen >= MaxAllocSize)
+		elog(ERROR, "invalid length %d of compressed data", rawlen);
+
+	resetStringInfo(dst);
+	enlargeStringInfo(dst, rawlen);
+
+	switch (method)
+	{
+		case SPOCK_COMPRESSION_NONE:
+			break;
+
+		case SPOCK_COMPRESSION_LZ4:
+#ifdef USE_LZ4
+			dlen = LZ4_decompress_safe(src, dst->data, len, rawlen);
+			break;
+#else
+			elog(ERROR, "LZ4 compression is not supported by this build");
+#endif
+
+		case SPOCK_COMPRESSION_ZSTD:
+#ifdef USE_ZSTD
+			{
+				size_t		ret;
+
+				if (zstd_dctx == NULL)
+				{
+					zstd_dctx = ZSTD_createDCtx();
+					if (zstd_dctx == NULL)
+						ereport(ERROR,
+								(errcode(ERRCODE_OUT_OF_MEMORY),
+								 errmsg("out of memory")));
+				}
+
+				ret = ZSTD_decompressDCtx(zstd_dctx, dst->data, rawlen,
+										  src, len);
+				if (!ZSTD_isError(ret))
+					dlen = (int) ret;
+				break;
+			}
+#else
+			elog(ERROR, "zstd compression is not supported by this build");
+#endif
+
+		default:
+			elog(ERROR, "unknown compression method %d", (int) method);
+	}
+
+	if (dlen != rawlen)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not decompress %s compressed data",
+						spock_compression_name(method))));
+
+	dst->len = rawlen;
+	dst->data[rawlen] = '\0';
+}
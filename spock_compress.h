@@ -0,0 +1,38 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_compress.h
+ * 		spock compression of the replication stream
+ *
+ * Copyright (c) 2021-2022, OSCG Partners, LLC
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_COMPRESS_H
+#define SPOCK_COMPRESS_H
+
+#include "lib/stringinfo.h"
+
+/* The values go over the wire, don't renumber. */
+typedef enum SpockCompression
+{
+	SPOCK_COMPRESSION_NONE = 0,
+	SPOCK_COMPRESSION_LZ4 = 1,
+	SPOCK_COMPRESSION_ZSTD = 2
+} SpockCompression;
+
+/* Batches smaller than this are not worth compressing. */
+#define SPOCK_COMPRESS_MIN_SIZE		256
+
+/* Batch size used for compression when the client didn't ask for one. */
+#define SPOCK_COMPRESS_BATCH_SIZE	(64 * 1024)
+
+extern SpockCompression spock_compression_by_name(const char *name);
+extern const char *spock_compression_name(SpockCompression method);
+extern bool spock_compress(SpockCompression method, const char *src, int len,
+						   StringInfo dst);
+extern void spock_decompress(SpockCompression method, const char *src,
+							 int len, int rawlen, StringInfo dst);
+
+#endif /* SPOCK_COMPRESS_H */
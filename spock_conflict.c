@@ -16,11 +16,14 @@
 #include "miscadmin.h"
 
 #include "access/commit_ts.h"
+#include "access/genam.h"
 #include "access/heapam.h"
 #include "access/htup_details.h"
+#include "access/sysattr.h"
 #include "access/transam.h"
 #include "access/xact.h"
 
+#include "catalog/pg_am.h"
 #include "catalog/pg_type.h"
 
 #include "executor/executor.h"
@@ -35,14 +38,32 @@
 
 #include "utils/builtins.h"
 #include "utils/datetime.h"
+#include "utils/datum.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/sortsupport.h"
 #include "utils/syscache.h"
 #include "utils/typcache.h"
 
 #include "spock_conflict.h"
 #include "spock_proto_native.h"
+#include "spock_worker.h"
+
+/*
+ * Scan of the REPLICA IDENTITY index used for several lookups.
+ */
+struct SpockReplIdxScan
+{
+	SpockRelation  *rel;
+	ResultRelInfo  *relinfo;
+	Oid				idxoid;
+	Relation		idxrel;
+	IndexScanDesc	scan;
+	SnapshotData	snap;		/* dirty snapshot of the scan */
+	SortSupport		ssup;		/* key comparison, set up when first needed */
+};
 
 int		spock_conflict_resolver = SPOCK_RESOLVE_APPLY_REMOTE;
 int		spock_conflict_log_level = LOG;
@@ -51,22 +72,30 @@ static void tuple_to_stringinfo(StringInfo s, TupleDesc tupdesc,
 	HeapTuple tuple);
 
 /*
- * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
- * is setup to match 'rel' (*NOT* idxrel!).
- *
- * Returns whether any column in the passed tuple contains a NULL for an
- * indexed field.
+ * Get the scan key template for a search in the index 'idxrel' of the
+ * relation, the lookups of the equality operators are done only the first
+ * time the index is used.
  */
-static bool
-build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, SpockTupleData *tup)
+static SpockIndexScanKey *
+get_index_scan_key(SpockRelation *rel, Relation idxrel)
 {
-	int			attoff;
-	Datum		indclassDatum;
-	Datum		indkeyDatum;
-	bool		isnull;
-	oidvector  *opclass;
-	int2vector  *indkey;
-	bool		hasnulls = false;
+	SpockIndexScanKey *ik;
+	MemoryContext	oldctx;
+	ListCell	   *lc;
+	int				attoff;
+	Datum			indclassDatum;
+	Datum			indkeyDatum;
+	bool			isnull;
+	oidvector	   *opclass;
+	int2vector	   *indkey;
+
+	foreach (lc, rel->idxscankeys)
+	{
+		ik = (SpockIndexScanKey *) lfirst(lc);
+
+		if (ik->indexoid == RelationGetRelid(idxrel))
+			return ik;
+	}
 
 	indclassDatum = SysCacheGetAttr(INDEXRELID, idxrel->rd_indextuple,
 									Anum_pg_index_indclass, &isnull);
@@ -78,19 +107,19 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, SpockTupleData
 	Assert(!isnull);
 	indkey = (int2vector *) DatumGetPointer(indkeyDatum);
 
-	/*
-	 * Examine each indexed attribute to ensure the passed tuple's matching
-	 * value isn't NULL and we have an equality operator for it.
-	 */
-	for (attoff = 0; attoff < IndexRelationGetNumberOfKeyAttributes(idxrel);
-		 attoff++)
+	oldctx = MemoryContextSwitchTo(CacheMemoryContext);
+
+	ik = palloc0(sizeof(SpockIndexScanKey));
+	ik->indexoid = RelationGetRelid(idxrel);
+	ik->nkeys = IndexRelationGetNumberOfKeyAttributes(idxrel);
+
+	/* Make sure we have an equality operator for each indexed attribute. */
+	for (attoff = 0; attoff < ik->nkeys; attoff++)
 	{
 		Oid			operator;
 		Oid			opfamily;
-		RegProcedure regop;
-		int			pkattno = attoff + 1;
 		int			mainattno = indkey->values[attoff];
-		Oid			atttype = attnumTypeId(rel, mainattno);
+		Oid			atttype = attnumTypeId(rel->rel, mainattno);
 		Oid			optype = get_opclass_input_type(opclass->values[attoff]);
 
 		opfamily = get_opclass_family(opclass->values[attoff]);
@@ -104,16 +133,47 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, SpockTupleData
 				 "could not lookup equality operator for type %u, optype %u in opfamily %u",
 				 atttype, optype, opfamily);
 
-		regop = get_opcode(operator);
+		ik->attnums[attoff] = mainattno;
+		ik->collations[attoff] = idxrel->rd_indcollation[attoff];
+		fmgr_info_cxt(get_opcode(operator), &ik->eqfuncs[attoff],
+					  CacheMemoryContext);
+	}
 
-		/* FIXME: convert type? */
-		ScanKeyInit(&skey[attoff],
-					pkattno,
-					BTEqualStrategyNumber,
-					regop,
-					tup->values[mainattno - 1]);
+	rel->idxscankeys = lappend(rel->idxscankeys, ik);
 
-		skey[attoff].sk_collation = idxrel->rd_indcollation[attoff];
+	MemoryContextSwitchTo(oldctx);
+
+	return ik;
+}
+
+/*
+ * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
+ * is setup to match 'rel' (*NOT* idxrel!).
+ *
+ * Returns whether any column in the passed tuple contains a NULL for an
+ * indexed field.
+ */
+static bool
+build_index_scan_key(ScanKey skey, SpockRelation *rel, Relation idxrel,
+					 SpockTupleData *tup)
+{
+	SpockIndexScanKey *ik = get_index_scan_key(rel, idxrel);
+	int			attoff;
+	bool		hasnulls = false;
+
+	for (attoff = 0; attoff < ik->nkeys; attoff++)
+	{
+		int			mainattno = ik->attnums[attoff];
+
+		/* FIXME: convert type? */
+		ScanKeyEntryInitializeWithInfo(&skey[attoff],
+									   0,
+									   attoff + 1,
+									   BTEqualStrategyNumber,
+									   InvalidOid,
+									   ik->collations[attoff],
+									   &ik->eqfuncs[attoff],
+									   tup->values[mainattno - 1]);
 
 		if (tup->nulls[mainattno - 1])
 		{
@@ -126,33 +186,27 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, SpockTupleData
 }
 
 /*
- * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel'.
+ * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel', using
+ * an index scan started with the dirty snapshot 'snap'. The scan can be used
+ * for any number of searches.
  *
  * If a matching tuple is found lock it with lockmode, fill the slot with its
  * contents and return true, false is returned otherwise.
  */
 static bool
-find_index_tuple(ScanKey skey, Relation rel, Relation idxrel,
-				 LockTupleMode lockmode, TupleTableSlot *slot)
+find_index_tuple_scan(IndexScanDesc scan, SnapshotData *snap, ScanKey skey,
+					  Relation rel, Relation idxrel, LockTupleMode lockmode,
+					  TupleTableSlot *slot)
 {
 	bool		found;
-	IndexScanDesc scan;
-	SnapshotData snap;
 	TransactionId xwait;
-
-	/*
-	 * We need SnapshotDirty because we're doing uniqueness lookups that must
-	 * consider rows added/updated by concurrent transactions, just like a
-	 * normal UNIQUE check does.
-	 */
-	InitDirtySnapshot(snap);
-	scan = index_beginscan(rel, idxrel, &snap,
-						   IndexRelationGetNumberOfKeyAttributes(idxrel),
-						   0);
+	instr_time	start;
 
 retry:
 	found = false;
 
+	SPOCK_APPLY_TIMING_START(start);
+
 	index_rescan(scan, skey, IndexRelationGetNumberOfKeyAttributes(idxrel),
 				 NULL, 0);
 
@@ -160,18 +214,25 @@ retry:
 	{
 		found = true;
 		ExecMaterializeSlot(slot);
+	}
 
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_INDEX_LOOKUP, start);
+
+	if (found)
+	{
 		/*
 		 * Did any concurrent txn affect the tuple? (See
 		 * HeapTupleSatisfiesDirty for how we get this).
 		 */
-		xwait = TransactionIdIsValid(snap.xmin) ?
-			snap.xmin : snap.xmax;
+		xwait = TransactionIdIsValid(snap->xmin) ?
+			snap->xmin : snap->xmax;
 
 		if (TransactionIdIsValid(xwait))
 		{
 			/* Wait for the specified transaction to commit or abort */
+			SPOCK_APPLY_TIMING_START(start);
 			XactLockTableWait(xwait, NULL, NULL, XLTW_None);
+			SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_LOCK_WAIT, start);
 			goto retry;
 		}
 	}
@@ -181,9 +242,23 @@ retry:
 	{
 		TM_FailureData tmfd;
 		TM_Result res;
+		bool		isnull;
+
+		/*
+		 * The apply doesn't increment the command counter after every change.
+		 * If the tuple was written by an earlier change of this transaction,
+		 * make that visible now, the tuple can't be locked or changed
+		 * otherwise.
+		 */
+		xwait = DatumGetTransactionId(slot_getsysattr(slot,
+													  MinTransactionIdAttributeNumber,
+													  &isnull));
+		if (TransactionIdIsCurrentTransactionId(xwait))
+			CommandCounterIncrement();
 
 		PushActiveSnapshot(GetLatestSnapshot());
 
+		SPOCK_APPLY_TIMING_START(start);
 		res = table_tuple_lock(rel, &(slot->tts_tid), GetLatestSnapshot(),
 							   slot,
 							   GetCurrentCommandId(false),
@@ -191,6 +266,7 @@ retry:
 							   LockWaitBlock,
 							   0 /* don't follow updates */ ,
 							   &tmfd);
+		SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_LOCK_WAIT, start);
 
 		PopActiveSnapshot();
 
@@ -217,25 +293,50 @@ retry:
 		}
 	}
 
+	return found;
+}
+
+/*
+ * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel'.
+ *
+ * If a matching tuple is found lock it with lockmode, fill the slot with its
+ * contents and return true, false is returned otherwise.
+ */
+static bool
+find_index_tuple(ScanKey skey, Relation rel, Relation idxrel,
+				 LockTupleMode lockmode, TupleTableSlot *slot)
+{
+	bool		found;
+	IndexScanDesc scan;
+	SnapshotData snap;
+
+	/*
+	 * We need SnapshotDirty because we're doing uniqueness lookups that must
+	 * consider rows added/updated by concurrent transactions, just like a
+	 * normal UNIQUE check does.
+	 */
+	InitDirtySnapshot(snap);
+	scan = index_beginscan(rel, idxrel, &snap,
+						   IndexRelationGetNumberOfKeyAttributes(idxrel),
+						   0);
+
+	found = find_index_tuple_scan(scan, &snap, skey, rel, idxrel, lockmode,
+								  slot);
+
 	index_endscan(scan);
 
 	return found;
 }
 
 /*
- * Find tuple using REPLICA IDENTITY index and output it in 'oldslot'
- * if found.
- *
- * The index oid is also output.
+ * Start a scan of the REPLICA IDENTITY index which can look up any number of
+ * tuples with spock_replidx_scan_find().
  */
-bool
-spock_tuple_find_replidx(ResultRelInfo *relinfo, SpockTupleData *tuple,
-							 TupleTableSlot *oldslot, Oid *idxrelid)
+SpockReplIdxScan *
+spock_replidx_scan_begin(SpockRelation *rel, ResultRelInfo *relinfo)
 {
+	SpockReplIdxScan *scan;
 	Oid				idxoid;
-	Relation		idxrel;
-	ScanKeyData		index_key[INDEX_MAX_KEYS];
-	bool			found;
 
 	/* Open REPLICA IDENTITY index.*/
 	idxoid = RelationGetReplicaIndex(relinfo->ri_RelationDesc);
@@ -247,18 +348,176 @@ spock_tuple_find_replidx(ResultRelInfo *relinfo, SpockTupleData *tuple,
 						RelationGetRelid(relinfo->ri_RelationDesc)),
 				 errhint("The REPLICA IDENTITY index is usually the PRIMARY KEY. See the PostgreSQL docs for ALTER TABLE ... REPLICA IDENTITY")));
 	}
-	*idxrelid = idxoid;
-	idxrel = index_open(idxoid, RowExclusiveLock);
 
-	/* Build scan key for just opened index*/
-	build_index_scan_key(index_key, relinfo->ri_RelationDesc, idxrel, tuple);
+	scan = palloc0(sizeof(SpockReplIdxScan));
+	scan->rel = rel;
+	scan->relinfo = relinfo;
+	scan->idxoid = idxoid;
+	scan->idxrel = index_open(idxoid, RowExclusiveLock);
+
+	/*
+	 * We need SnapshotDirty because we're doing uniqueness lookups that must
+	 * consider rows added/updated by concurrent transactions, just like a
+	 * normal UNIQUE check does.
+	 */
+	InitDirtySnapshot(scan->snap);
+	scan->scan = index_beginscan(relinfo->ri_RelationDesc, scan->idxrel,
+								 &scan->snap,
+								 IndexRelationGetNumberOfKeyAttributes(scan->idxrel),
+								 0);
+
+	return scan;
+}
+
+/*
+ * Find the tuple with the same replica identity as 'tuple', lock it and
+ * output it in 'oldslot' if found.
+ */
+bool
+spock_replidx_scan_find(SpockReplIdxScan *scan, SpockTupleData *tuple,
+						TupleTableSlot *oldslot)
+{
+	ScanKeyData		index_key[INDEX_MAX_KEYS];
+
+	/* Build scan key for the index */
+	build_index_scan_key(index_key, scan->rel, scan->idxrel, tuple);
 
 	/* Try to find the row and store any matching row in 'oldslot'. */
-	found = find_index_tuple(index_key, relinfo->ri_RelationDesc, idxrel,
-							 LockTupleExclusive, oldslot);
+	return find_index_tuple_scan(scan->scan, &scan->snap, index_key,
+								 scan->relinfo->ri_RelationDesc, scan->idxrel,
+								 LockTupleExclusive, oldslot);
+}
+
+/*
+ * Compare the replica identity of two tuples in the order of the index.
+ *
+ * The index has to be a btree, see spock_replidx_scan_sortable().
+ */
+int
+spock_replidx_scan_compare(SpockReplIdxScan *scan, SpockTupleData *a,
+						   SpockTupleData *b)
+{
+	SpockIndexScanKey *ik = get_index_scan_key(scan->rel, scan->idxrel);
+	int			attoff;
+
+	if (scan->ssup == NULL)
+	{
+		scan->ssup = palloc0(ik->nkeys * sizeof(SortSupportData));
+
+		for (attoff = 0; attoff < ik->nkeys; attoff++)
+		{
+			SortSupport	ssup = &scan->ssup[attoff];
+
+			ssup->ssup_cxt = CurrentMemoryContext;
+			ssup->ssup_collation = ik->collations[attoff];
+			ssup->ssup_nulls_first = false;
+			ssup->ssup_attno = attoff + 1;
+			ssup->abbreviate = false;
+
+			PrepareSortSupportFromIndexRel(scan->idxrel, BTLessStrategyNumber,
+										   ssup);
+		}
+	}
+
+	for (attoff = 0; attoff < ik->nkeys; attoff++)
+	{
+		int			attno = ik->attnums[attoff];
+		int			cmp;
+
+		cmp = ApplySortComparator(a->values[attno - 1], a->nulls[attno - 1],
+								  b->values[attno - 1], b->nulls[attno - 1],
+								  &scan->ssup[attoff]);
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Can spock_replidx_scan_compare() be used for the scan?
+ */
+bool
+spock_replidx_scan_sortable(SpockReplIdxScan *scan)
+{
+	return scan->idxrel->rd_rel->relam == BTREE_AM_OID;
+}
+
+/*
+ * Does the tuple have the same replica identity as the old one?
+ *
+ * This is a binary comparison, so it can report a difference for equal
+ * values with a different representation.
+ */
+bool
+spock_replidx_scan_same_key(SpockReplIdxScan *scan, SpockTupleData *oldtup,
+							SpockTupleData *newtup)
+{
+	SpockIndexScanKey *ik = get_index_scan_key(scan->rel, scan->idxrel);
+	TupleDesc	desc = RelationGetDescr(scan->relinfo->ri_RelationDesc);
+	int			attoff;
+
+	for (attoff = 0; attoff < ik->nkeys; attoff++)
+	{
+		int			attno = ik->attnums[attoff];
+		Form_pg_attribute att = TupleDescAttr(desc, attno - 1);
+
+		/* Unchanged columns keep the old value. */
+		if (newtup->changed && !newtup->changed[attno - 1])
+			continue;
+
+		if (oldtup->nulls[attno - 1] != newtup->nulls[attno - 1])
+			return false;
+
+		if (!oldtup->nulls[attno - 1] &&
+			!datumIsEqual(oldtup->values[attno - 1],
+						  newtup->values[attno - 1],
+						  att->attbyval, att->attlen))
+			return false;
+	}
+
+	return true;
+}
+
+Oid
+spock_replidx_scan_index(SpockReplIdxScan *scan)
+{
+	return scan->idxoid;
+}
+
+void
+spock_replidx_scan_end(SpockReplIdxScan *scan)
+{
+	index_endscan(scan->scan);
 
 	/* Don't release lock until commit. */
-	index_close(idxrel, NoLock);
+	index_close(scan->idxrel, NoLock);
+
+	if (scan->ssup)
+		pfree(scan->ssup);
+	pfree(scan);
+}
+
+/*
+ * Find tuple using REPLICA IDENTITY index and output it in 'oldslot'
+ * if found.
+ *
+ * The index oid is also output.
+ */
+bool
+spock_tuple_find_replidx(SpockRelation *rel, ResultRelInfo *relinfo,
+							 SpockTupleData *tuple, TupleTableSlot *oldslot,
+							 Oid *idxrelid)
+{
+	SpockReplIdxScan *scan;
+	bool			found;
+
+	scan = spock_replidx_scan_begin(rel, relinfo);
+	*idxrelid = scan->idxoid;
+
+	found = spock_replidx_scan_find(scan, tuple, oldslot);
+
+	spock_replidx_scan_end(scan);
 
 	return found;
 }
@@ -280,8 +539,8 @@ spock_tuple_find_replidx(ResultRelInfo *relinfo, SpockTupleData *tuple,
  * inconsistency may arise.
  */
 Oid
-spock_tuple_find_conflict(ResultRelInfo *relinfo, SpockTupleData *tuple,
-							  TupleTableSlot *outslot)
+spock_tuple_find_conflict(SpockRelation *rel, ResultRelInfo *relinfo,
+							  SpockTupleData *tuple, TupleTableSlot *outslot)
 {
 	Oid				conflict_idx = InvalidOid;
 	ScanKeyData		index_key[INDEX_MAX_KEYS];
@@ -302,7 +561,7 @@ spock_tuple_find_conflict(ResultRelInfo *relinfo, SpockTupleData *tuple,
 	{
 		ScanKeyData	index_key[INDEX_MAX_KEYS];
 		Relation	idxrel = index_open(replidxoid, RowExclusiveLock);
-		build_index_scan_key(index_key, relinfo->ri_RelationDesc, idxrel, tuple);
+		build_index_scan_key(index_key, rel, idxrel, tuple);
 		found = find_index_tuple(index_key, relinfo->ri_RelationDesc, idxrel,
 							 LockTupleExclusive, outslot);
 		index_close(idxrel, NoLock);
@@ -356,8 +615,7 @@ spock_tuple_find_conflict(ResultRelInfo *relinfo, SpockTupleData *tuple,
 		if (RelationGetRelid(idxrel) == replidxoid)
 			continue;
 
-		if (build_index_scan_key(index_key, relinfo->ri_RelationDesc,
-								 idxrel, tuple))
+		if (build_index_scan_key(index_key, rel, idxrel, tuple))
 			continue;
 
 		/* Try to find conflicting row and store in 'outslot' */
@@ -612,6 +870,8 @@ spock_report_conflict(SpockConflictType conflict_type,
 	const char *idxname = "(unknown)";
 	const char *qualrelname;
 
+	SPOCK_APPLY_STATS_ADD(n_conflict, 1);
+
 	memset(local_tup_ts_str, 0, MAXDATELEN);
 	if (found_local_origin)
 		strcpy(local_tup_ts_str,
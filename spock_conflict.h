@@ -47,12 +47,30 @@ typedef enum SpockConflictType
 	CONFLICT_DELETE_DELETE
 } SpockConflictType;
 
-extern bool spock_tuple_find_replidx(ResultRelInfo *relinfo,
+typedef struct SpockReplIdxScan SpockReplIdxScan;
+
+extern SpockReplIdxScan *spock_replidx_scan_begin(SpockRelation *rel,
+												  ResultRelInfo *relinfo);
+extern bool spock_replidx_scan_find(SpockReplIdxScan *scan,
+									SpockTupleData *tuple,
+									TupleTableSlot *oldslot);
+extern bool spock_replidx_scan_sortable(SpockReplIdxScan *scan);
+extern int spock_replidx_scan_compare(SpockReplIdxScan *scan,
+									  SpockTupleData *a, SpockTupleData *b);
+extern bool spock_replidx_scan_same_key(SpockReplIdxScan *scan,
+										SpockTupleData *oldtup,
+										SpockTupleData *newtup);
+extern Oid spock_replidx_scan_index(SpockReplIdxScan *scan);
+extern void spock_replidx_scan_end(SpockReplIdxScan *scan);
+
+extern bool spock_tuple_find_replidx(SpockRelation *rel,
+										 ResultRelInfo *relinfo,
 										 SpockTupleData *tuple,
 										 TupleTableSlot *oldslot,
 										 Oid *idxrelid);
 
-extern Oid spock_tuple_find_conflict(ResultRelInfo *relinfo,
+extern Oid spock_tuple_find_conflict(SpockRelation *rel,
+										 ResultRelInfo *relinfo,
 										 SpockTupleData *tuple,
 										 TupleTableSlot *oldslot);
 
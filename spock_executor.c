@@ -29,6 +29,7 @@
 
 #include "executor/executor.h"
 
+#include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
 
 #include "optimizer/optimizer.h"
@@ -99,10 +100,9 @@ prepare_per_tuple_econtext(EState *estate, TupleDesc tupdesc)
 	return econtext;
 }
 
-ExprState *
-spock_prepare_row_filter(Node *row_filter)
+static Expr *
+coerce_row_filter(Node *row_filter)
 {
-	ExprState  *exprstate;
 	Expr	   *expr;
 	Oid			exprtype;
 
@@ -121,10 +121,37 @@ spock_prepare_row_filter(Node *row_filter)
 				 errmsg("cannot cast the row_filter to boolean"),
 			   errhint("You will need to rewrite the row_filter.")));
 
+	return expr;
+}
+
+ExprState *
+spock_prepare_row_filter(Node *row_filter)
+{
+	Expr	   *expr = coerce_row_filter(row_filter);
+
+	expr = expression_planner(expr);
+
+	return ExecInitExpr(expr, NULL);
+}
+
+/*
+ * Prepare a single expression which is true only if all the row filters
+ * are true.
+ */
+ExprState *
+spock_prepare_row_filters(List *row_filters)
+{
+	List	   *exprs = NIL;
+	ListCell   *lc;
+	Expr	   *expr;
+
+	foreach (lc, row_filters)
+		exprs = lappend(exprs, coerce_row_filter((Node *) lfirst(lc)));
+
+	expr = make_ands_explicit(exprs);
 	expr = expression_planner(expr);
-	exprstate = ExecInitExpr(expr, NULL);
 
-	return exprstate;
+	return ExecInitExpr(expr, NULL);
 }
 
 static void
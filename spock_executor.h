@@ -19,6 +19,7 @@ extern List *spock_truncated_tables;
 extern EState *create_estate_for_relation(Relation rel, bool forwrite);
 extern ExprContext *prepare_per_tuple_econtext(EState *estate, TupleDesc tupdesc);
 extern ExprState *spock_prepare_row_filter(Node *row_filter);
+extern ExprState *spock_prepare_row_filters(List *row_filters);
 
 extern void spock_executor_init(void);
 
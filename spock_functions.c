@@ -69,6 +69,8 @@
 
 #include "pgstat.h"
 
+#include "spock_apply_parallel.h"
+#include "spock_apply_spool.h"
 #include "spock_dependency.h"
 #include "spock_node.h"
 #include "spock_executor.h"
@@ -104,6 +106,9 @@ PG_FUNCTION_INFO_V1(spock_alter_subscription_resynchronize_table);
 
 PG_FUNCTION_INFO_V1(spock_show_subscription_table);
 PG_FUNCTION_INFO_V1(spock_show_subscription_status);
+PG_FUNCTION_INFO_V1(spock_get_subscription_stats);
+PG_FUNCTION_INFO_V1(spock_get_apply_timing);
+PG_FUNCTION_INFO_V1(spock_reset_apply_timing);
 
 PG_FUNCTION_INFO_V1(spock_wait_for_subscription_sync_complete);
 PG_FUNCTION_INFO_V1(spock_wait_for_table_sync_complete);
@@ -634,6 +639,8 @@ spock_drop_subscription(PG_FUNCTION_ARGS)
 
 		/* Drop the origin tracking locally. */
 		replorigin_drop_by_name(sub->slot_name, true, false);
+		spock_apply_parallel_drop_origins(sub->slot_name);
+		spock_apply_spool_drop(sub->id);
 	}
 
 	PG_RETURN_BOOL(sub != NULL);
@@ -1116,6 +1123,239 @@ spock_show_subscription_status(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/*
+ * Show the statistics of the apply workers of this database.
+ */
+Datum
+spock_get_subscription_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * The lock only keeps the slots from being reused while we look at them,
+	 * the workers update their statistics without it.
+	 */
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *worker = &SpockCtx->workers[i];
+		SpockApplyStats		stats;
+		Datum	values[18];
+		bool	nulls[18];
+
+		if (worker->dboid != MyDatabaseId ||
+			worker->worker_type == SPOCK_WORKER_NONE ||
+			worker->worker_type == SPOCK_WORKER_MANAGER)
+			continue;
+
+		spock_apply_stats_read(&worker->worker.apply, &stats);
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(worker->worker.apply.subid);
+		values[1] = CStringGetTextDatum(spock_worker_type_name(worker->worker_type));
+		if (worker->proc != NULL)
+			values[2] = Int32GetDatum(worker->proc->pid);
+		else
+			nulls[2] = true;
+		values[3] = Int64GetDatum(stats.n_insert);
+		values[4] = Int64GetDatum(stats.n_update);
+		values[5] = Int64GetDatum(stats.n_delete);
+		values[6] = Int64GetDatum(stats.n_commit);
+		values[7] = Int64GetDatum(stats.bytes_received);
+		values[8] = Int64GetDatum(stats.n_multi_insert_flush);
+		values[9] = Int64GetDatum(stats.n_conflict);
+		values[10] = Int64GetDatum(stats.n_error);
+		values[11] = Int64GetDatum(stats.n_batch_frame);
+		values[12] = Int64GetDatum(stats.n_compressed_frame);
+		values[13] = Int64GetDatum(stats.n_multi_insert_msg);
+		values[14] = Int64GetDatum(stats.n_update_unchanged);
+		values[15] = Int64GetDatum(stats.n_partial_message);
+		if (stats.last_commit_time != 0)
+		{
+			values[16] = TimestampTzGetDatum(stats.last_commit_time);
+			values[17] = TimestampTzGetDatum(stats.last_remote_commit_time);
+		}
+		else
+		{
+			nulls[16] = true;
+			nulls[17] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(SpockCtx->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Show the histograms of the time the apply workers of this database spent
+ * in each phase of apply, since the last reset.
+ */
+Datum
+spock_get_apply_timing(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *worker = &SpockCtx->workers[i];
+		SpockApplyStats		stats;
+		int					phase;
+
+		if (worker->dboid != MyDatabaseId ||
+			worker->worker_type == SPOCK_WORKER_NONE ||
+			worker->worker_type == SPOCK_WORKER_MANAGER)
+			continue;
+
+		spock_apply_stats_read(&worker->worker.apply, &stats);
+
+		for (phase = 0; phase < SPOCK_APPLY_NUM_PHASES; phase++)
+		{
+			SpockApplyPhaseTiming *timing = &stats.timing[phase];
+			SpockApplyPhaseTiming *base = &worker->worker.apply.timing_reset[phase];
+			Datum	buckets[SPOCK_APPLY_TIMING_BUCKETS];
+			Datum	values[7];
+			bool	nulls[7];
+			int		b;
+
+			if (timing->count == base->count)
+				continue;
+
+			for (b = 0; b < SPOCK_APPLY_TIMING_BUCKETS; b++)
+				buckets[b] = Int64GetDatum(timing->buckets[b] - base->buckets[b]);
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[0] = ObjectIdGetDatum(worker->worker.apply.subid);
+			values[1] = CStringGetTextDatum(spock_worker_type_name(worker->worker_type));
+			if (worker->proc != NULL)
+				values[2] = Int32GetDatum(worker->proc->pid);
+			else
+				nulls[2] = true;
+			values[3] = CStringGetTextDatum(spock_apply_phase_name(phase));
+			values[4] = Int64GetDatum(timing->count - base->count);
+			values[5] = Float8GetDatum((timing->total_us - base->total_us) / 1000.0);
+			values[6] = PointerGetDatum(construct_array(buckets,
+														SPOCK_APPLY_TIMING_BUCKETS,
+														INT8OID, sizeof(int64),
+														FLOAT8PASSBYVAL, 'd'));
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	LWLockRelease(SpockCtx->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Start the apply timing histograms of the workers of this database over.
+ *
+ * The workers update the histograms without locking, so rather than zeroing
+ * them we remember their values, which spock_get_apply_timing() subtracts.
+ */
+Datum
+spock_reset_apply_timing(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *worker = &SpockCtx->workers[i];
+		SpockApplyStats		stats;
+
+		if (worker->dboid != MyDatabaseId ||
+			worker->worker_type == SPOCK_WORKER_NONE ||
+			worker->worker_type == SPOCK_WORKER_MANAGER)
+			continue;
+
+		spock_apply_stats_read(&worker->worker.apply, &stats);
+		memcpy(worker->worker.apply.timing_reset, stats.timing,
+			   sizeof(stats.timing));
+	}
+
+	LWLockRelease(SpockCtx->lock);
+
+	PG_RETURN_VOID();
+}
+
 /*
  * Create new replication set.
  */
@@ -21,6 +21,7 @@
 #include "miscadmin.h"
 
 #include "spock.h"
+#include "spock_compress.h"
 #include "spock_output_config.h"
 #include "spock_output_proto.h"
 #include "spock_repset.h"
@@ -69,7 +70,14 @@ enum {
 	PARAM_SPOCK_REPLICATE_ONLY_TABLE,
 	PARAM_HOOKS_SETUP_FUNCTION,
 	PARAM_PG_VERSION,
-	PARAM_NO_TXINFO
+	PARAM_NO_TXINFO,
+	PARAM_SPOCK_STREAMING,
+	PARAM_SPOCK_BATCH_SIZE,
+	PARAM_SPOCK_COMPRESSION,
+	PARAM_SPOCK_MULTI_INSERT,
+	PARAM_SPOCK_CHANGED_COLUMNS_ONLY,
+	PARAM_SPOCK_TYPE_NAMES,
+	PARAM_SPOCK_PARTIAL_MESSAGES
 } OutputPluginParamKey;
 
 typedef struct {
@@ -99,6 +107,13 @@ static OutputPluginParam param_lookup[] = {
 	{"hooks.setup_function", PARAM_HOOKS_SETUP_FUNCTION},
 	{"pg_version", PARAM_PG_VERSION},
 	{"no_txinfo", PARAM_NO_TXINFO},
+	{"spock.streaming", PARAM_SPOCK_STREAMING},
+	{"spock.batch_size", PARAM_SPOCK_BATCH_SIZE},
+	{"spock.compression", PARAM_SPOCK_COMPRESSION},
+	{"spock.multi_insert", PARAM_SPOCK_MULTI_INSERT},
+	{"spock.changed_columns_only", PARAM_SPOCK_CHANGED_COLUMNS_ONLY},
+	{"spock.type_names", PARAM_SPOCK_TYPE_NAMES},
+	{"spock.partial_messages", PARAM_SPOCK_PARTIAL_MESSAGES},
 	{NULL, PARAM_UNRECOGNISED}
 };
 
@@ -281,6 +296,41 @@ process_parameters_v1(List *options, SpockOutputData *data)
 				data->client_no_txinfo = DatumGetBool(val);
 				break;
 
+			case PARAM_SPOCK_STREAMING:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_streaming = DatumGetBool(val);
+				break;
+
+			case PARAM_SPOCK_BATCH_SIZE:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_UINT32);
+				data->client_batch_size = DatumGetUInt32(val);
+				break;
+
+			case PARAM_SPOCK_COMPRESSION:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_STRING);
+				data->client_compression = DatumGetCString(val);
+				break;
+
+			case PARAM_SPOCK_MULTI_INSERT:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_multi_insert = DatumGetBool(val);
+				break;
+
+			case PARAM_SPOCK_CHANGED_COLUMNS_ONLY:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_changed_columns_only = DatumGetBool(val);
+				break;
+
+			case PARAM_SPOCK_TYPE_NAMES:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_type_names = DatumGetBool(val);
+				break;
+
+			case PARAM_SPOCK_PARTIAL_MESSAGES:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_partial_messages = DatumGetBool(val);
+				break;
+
 			/* Backwards compat. */
 			case PARAM_HOOKS_SETUP_FUNCTION:
 				break;
@@ -537,6 +587,15 @@ prepare_startup_message(SpockOutputData *data)
 			PG_VERSION_NUM/100);
 
 	l = add_startup_msg_b(l, "no_txinfo", data->client_no_txinfo);
+	l = add_startup_msg_b(l, "streaming", data->streaming);
+	l = add_startup_msg_i(l, "batch_size", data->batch_size);
+	l = add_startup_msg_s(l, "compression",
+			(char *) spock_compression_name(data->compression));
+	l = add_startup_msg_b(l, "multi_insert", data->insert_batch != NULL);
+	l = add_startup_msg_b(l, "changed_columns_only",
+			data->changed_columns_only);
+	l = add_startup_msg_b(l, "type_names", data->send_type_names);
+	l = add_startup_msg_b(l, "partial_messages", data->partial_messages);
 
 	return l;
 }
@@ -30,12 +30,16 @@
 #include "utils/snapmgr.h"
 #include "replication/origin.h"
 
+#include "libpq/pqformat.h"
+
 #include "spock_output_plugin.h"
 #include "spock.h"
+#include "spock_compress.h"
 #include "spock_output_config.h"
 #include "spock_executor.h"
 #include "spock_node.h"
 #include "spock_output_proto.h"
+#include "spock_proto_native.h"
 #include "spock_queue.h"
 #include "spock_repset.h"
 
@@ -61,6 +65,24 @@ static bool pg_decode_origin_filter(LogicalDecodingContext *ctx,
 						RepOriginId origin_id);
 #endif
 
+#if PG_VERSION_NUM >= 140000
+static void pg_decode_stream_start(LogicalDecodingContext *ctx,
+					   ReorderBufferTXN *txn);
+static void pg_decode_stream_stop(LogicalDecodingContext *ctx,
+					  ReorderBufferTXN *txn);
+static void pg_decode_stream_abort(LogicalDecodingContext *ctx,
+					   ReorderBufferTXN *txn, XLogRecPtr abort_lsn);
+static void pg_decode_stream_commit(LogicalDecodingContext *ctx,
+					    ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+static void pg_decode_stream_change(LogicalDecodingContext *ctx,
+					    ReorderBufferTXN *txn, Relation relation,
+					    ReorderBufferChange *change);
+#endif
+
+static void spock_prepare_write(LogicalDecodingContext *ctx, bool last_write);
+static void spock_write(LogicalDecodingContext *ctx, bool last_write);
+static void spock_flush_batch(LogicalDecodingContext *ctx);
+static void spock_flush_inserts(LogicalDecodingContext *ctx);
 static void send_startup_message(LogicalDecodingContext *ctx,
 		SpockOutputData *data, bool last_message);
 
@@ -73,6 +95,8 @@ typedef struct SPKRelMetaCacheEntry
 	bool is_cached;
 	/* Entry is valid and not due to be purged */
 	bool is_valid;
+	/* How to write tuples of the relation, built on first use */
+	SpockTupleEncoder *encoder;
 } SPKRelMetaCacheEntry;
 
 #define RELMETACACHE_INITIAL_SIZE 128
@@ -85,6 +109,8 @@ static SPKRelMetaCacheEntry *relmetacache_get_relation(SpockOutputData *data,
 													   Relation rel);
 static void relmetacache_flush(void);
 static void relmetacache_prune(void);
+static void relmetacache_uncache_all(void);
+static void relmetacache_remove(SPKRelMetaCacheEntry *hentry);
 
 static void spkReorderBufferCleanSerializedTXNs(const char *slotname);
 
@@ -102,6 +128,13 @@ _PG_output_plugin_init(OutputPluginCallbacks *cb)
 	cb->filter_by_origin_cb = pg_decode_origin_filter;
 #endif
 	cb->shutdown_cb = pg_decode_shutdown;
+#if PG_VERSION_NUM >= 140000
+	cb->stream_start_cb = pg_decode_stream_start;
+	cb->stream_stop_cb = pg_decode_stream_stop;
+	cb->stream_abort_cb = pg_decode_stream_abort;
+	cb->stream_commit_cb = pg_decode_stream_commit;
+	cb->stream_change_cb = pg_decode_stream_change;
+#endif
 }
 
 static bool
@@ -176,6 +209,7 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt,
 	data->allow_internal_basetypes = false;
 	data->allow_binary_basetypes = false;
 
+	data->ctx = ctx;
 
 	ctx->output_plugin_private = data;
 
@@ -353,6 +387,12 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt,
 			data->client_binary_basetypes_major_version == PG_VERSION_NUM / 100)
 		{
 			data->allow_binary_basetypes = true;
+
+			/*
+			 * Arrays and composites of non-builtin types can then use
+			 * send/recv as well if the client maps their embedded type oids.
+			 */
+			data->send_type_names = data->client_want_type_names;
 		}
 
 		/*
@@ -366,12 +406,59 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt,
 		else
 			data->forward_changeset_origins = true;
 
+#if PG_VERSION_NUM >= 140000
+		/*
+		 * Stream large in-progress transactions only if the client asked for
+		 * it and the protocol can carry them.
+		 */
+		data->streaming = data->client_want_streaming &&
+			data->api->write_stream_start != NULL && ctx->streaming;
+#endif
+
+		/*
+		 * Only the native protocol has batch frames, partial messages and
+		 * unchanged columns other than toasted ones. Compression works on
+		 * batches, so it enables them if the client didn't ask for them.
+		 */
+		if (opt->output_type == OUTPUT_PLUGIN_BINARY_OUTPUT)
+		{
+			data->changed_columns_only = data->client_want_changed_columns_only;
+			data->partial_messages = data->client_want_partial_messages;
+
+			if (data->client_compression != NULL)
+				data->compression =
+					spock_compression_by_name(data->client_compression);
+
+			if (data->client_batch_size > 0)
+				data->batch_size = Min(data->client_batch_size,
+									   MaxAllocSize / 2);
+			else if (data->compression != SPOCK_COMPRESSION_NONE)
+				data->batch_size = SPOCK_COMPRESS_BATCH_SIZE;
+		}
+
+		if (data->client_want_multi_insert &&
+			data->api->write_multi_insert != NULL)
+			data->insert_batch = spock_insert_batch_create(ctx->context);
+
+		if (data->batch_size > 0)
+		{
+			oldctx = MemoryContextSwitchTo(ctx->context);
+			data->batch = makeStringInfo();
+			if (data->compression != SPOCK_COMPRESSION_NONE)
+				data->compress_buf = makeStringInfo();
+			MemoryContextSwitchTo(oldctx);
+		}
+
 		if (started_tx)
 			CommitTransactionCommand();
 
 		relmetacache_init(ctx->context);
 	}
 
+#if PG_VERSION_NUM >= 140000
+	ctx->streaming = data->streaming;
+#endif
+
 	/* So we can identify the process type in Valgrind logs */
 	VALGRIND_PRINTF("SPOCK: spock worker output_plugin\n");
 	/* For incremental leak checking */
@@ -402,8 +489,8 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 	send_replication_origin &= txn->origin_id != InvalidRepOriginId;
 #endif
 
-	OutputPluginPrepareWrite(ctx, !send_replication_origin);
-	data->api->write_begin(ctx->out, data, txn);
+	spock_prepare_write(ctx, !send_replication_origin);
+	data->api->write_begin(data->out, data, txn);
 
 #ifdef HAVE_REPLICATION_ORIGINS
 	if (send_replication_origin)
@@ -411,8 +498,8 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 		char *origin;
 
 		/* Message boundary */
-		OutputPluginWrite(ctx, false);
-		OutputPluginPrepareWrite(ctx, true);
+		spock_write(ctx, false);
+		spock_prepare_write(ctx, true);
 
 		/*
 		 * XXX: which behaviour we want here?
@@ -425,11 +512,11 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 		 */
 		if (data->api->write_origin &&
 			replorigin_by_oid(txn->origin_id, true, &origin))
-			data->api->write_origin(ctx->out, origin, txn->origin_lsn);
+			data->api->write_origin(data->out, origin, txn->origin_lsn);
 	}
 #endif
 
-	OutputPluginWrite(ctx, true);
+	spock_write(ctx, true);
 
 	Assert(CurrentMemoryContext == data->context);
 	MemoryContextSwitchTo(old_ctx);
@@ -447,9 +534,15 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 
 	old_ctx = MemoryContextSwitchTo(data->context);
 
-	OutputPluginPrepareWrite(ctx, true);
-	data->api->write_commit(ctx->out, data, txn, commit_lsn);
-	OutputPluginWrite(ctx, true);
+	spock_flush_inserts(ctx);
+
+	data->batch_commit_lsn = txn->end_lsn;
+	spock_prepare_write(ctx, true);
+	data->api->write_commit(data->out, data, txn, commit_lsn);
+	spock_write(ctx, true);
+
+	/* A commit always ends a batch, the client relies on that. */
+	spock_flush_batch(ctx);
 
 	/*
 	 * Now is a good time to get rid of invalidated relation
@@ -465,12 +558,34 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	VALGRIND_DO_ADDED_LEAK_CHECK;
 }
 
+/*
+ * Build the executor state for evaluating the row filters of a table. It's
+ * kept with the replication info of the table until that is invalidated, so
+ * it lives in CacheMemoryContext and uses its own copy of the descriptor.
+ */
+static void
+prepare_row_filter_state(SpockTableRepInfo *tblinfo, Relation relation)
+{
+	MemoryContext	oldctx = MemoryContextSwitchTo(CacheMemoryContext);
+	EState		   *estate;
+	TupleDesc		tupdesc;
+
+	estate = create_estate_for_relation(relation, false);
+
+	MemoryContextSwitchTo(estate->es_query_cxt);
+	tupdesc = CreateTupleDescCopy(RelationGetDescr(relation));
+	tblinfo->rf_econtext = prepare_per_tuple_econtext(estate, tupdesc);
+	tblinfo->rf_exprstate = spock_prepare_row_filters(tblinfo->row_filter);
+	tblinfo->rf_estate = estate;
+
+	MemoryContextSwitchTo(oldctx);
+}
+
 static bool
 spock_change_filter(SpockOutputData *data, Relation relation,
 						ReorderBufferChange *change, Bitmapset **att_list)
 {
 	SpockTableRepInfo *tblinfo;
-	ListCell	   *lc;
 
 	if (data->replicate_only_table)
 	{
@@ -597,15 +712,12 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 			return false; /* shut compiler up */
 	}
 
-	/*
-	 * Proccess row filters.
-	 * XXX: we could probably cache some of the executor stuff.
-	 */
+	/* Proccess row filters. */
 	if (list_length(tblinfo->row_filter) > 0)
 	{
-		EState		   *estate;
 		ExprContext	   *econtext;
-		TupleDesc		tupdesc = RelationGetDescr(relation);
+		Datum			res;
+		bool			isnull;
 		HeapTuple		oldtup = change->data.tp.oldtuple ?
 			&change->data.tp.oldtuple->tuple : NULL;
 		HeapTuple		newtup = change->data.tp.newtuple ?
@@ -618,35 +730,24 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 			return false;
 		}
 
-		PushActiveSnapshot(GetTransactionSnapshot());
+		if (tblinfo->rf_estate == NULL)
+			prepare_row_filter_state(tblinfo, relation);
 
-		estate = create_estate_for_relation(relation, false);
-		econtext = prepare_per_tuple_econtext(estate, tupdesc);
+		PushActiveSnapshot(GetTransactionSnapshot());
 
+		econtext = tblinfo->rf_econtext;
 		ExecStoreHeapTuple(newtup ? newtup : oldtup, econtext->ecxt_scantuple, false);
 
-		/* Next try the row_filters if there are any. */
-		foreach (lc, tblinfo->row_filter)
-		{
-			Node	   *row_filter = (Node *) lfirst(lc);
-			ExprState  *exprstate = spock_prepare_row_filter(row_filter);
-			Datum		res;
-			bool		isnull;
-
-			res = ExecEvalExpr(exprstate, econtext, &isnull, NULL);
-
-			/* NULL is same as false for our use. */
-			if (isnull)
-				return false;
+		res = ExecEvalExpr(tblinfo->rf_exprstate, econtext, &isnull, NULL);
 
-			if (!DatumGetBool(res))
-				return false;
-		}
-
-		ExecDropSingleTupleTableSlot(econtext->ecxt_scantuple);
-		FreeExecutorState(estate);
+		ExecClearTuple(econtext->ecxt_scantuple);
+		ResetExprContext(econtext);
 
 		PopActiveSnapshot();
+
+		/* NULL is same as false for our use. */
+		if (isnull || !DatumGetBool(res))
+			return false;
 	}
 
 	/* Make sure caller is aware of any attribute filter. */
@@ -682,45 +783,81 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 		SPKRelMetaCacheEntry *cached_relmeta;
 		cached_relmeta = relmetacache_get_relation(data, relation);
 
+		/* The buffered inserts go with the metadata the client has. */
+		if (!cached_relmeta->is_cached || cached_relmeta->encoder == NULL)
+			spock_flush_inserts(ctx);
+
 		if (!cached_relmeta->is_cached)
 		{
-			OutputPluginPrepareWrite(ctx, false);
-			data->api->write_rel(ctx->out, data, relation, att_list);
-			OutputPluginWrite(ctx, false);
+			spock_prepare_write(ctx, false);
+			data->api->write_rel(data->out, data, relation, att_list);
+			spock_write(ctx, false);
 			cached_relmeta->is_cached = true;
 		}
+
+		if (cached_relmeta->encoder == NULL)
+			cached_relmeta->encoder =
+				spock_tuple_encoder_create(data, relation, att_list,
+										   RelMetaCacheContext);
+		data->tuple_encoder = cached_relmeta->encoder;
 	}
 
+	/* Only consecutive inserts into the same relation go together. */
+	if (data->insert_batch != NULL && data->insert_batch->nrows > 0 &&
+		(change->action != REORDER_BUFFER_CHANGE_INSERT ||
+		 data->insert_batch->relid != RelationGetRelid(relation)))
+		spock_flush_inserts(ctx);
+
 	/* Send the data */
 	switch (change->action)
 	{
 		case REORDER_BUFFER_CHANGE_INSERT:
-			OutputPluginPrepareWrite(ctx, true);
-			data->api->write_insert(ctx->out, data, relation,
+			/*
+			 * The subscriber handles queued commands one by one, they are
+			 * never batched.
+			 */
+			if (data->insert_batch != NULL && data->tuple_encoder != NULL &&
+				RelationGetRelid(relation) != get_queue_table_oid())
+			{
+				if (spock_insert_batch_add(data->insert_batch, data, relation,
+										   &change->data.tp.newtuple->tuple))
+				{
+					if (data->insert_batch->nrows >= SPOCK_INSERT_BATCH_MAX_ROWS ||
+						data->insert_batch->size >= SPOCK_INSERT_BATCH_MAX_SIZE)
+						spock_flush_inserts(ctx);
+					break;
+				}
+
+				/* Can't be batched, keep the order. */
+				spock_flush_inserts(ctx);
+			}
+
+			spock_prepare_write(ctx, true);
+			data->api->write_insert(data->out, data, relation,
 									&change->data.tp.newtuple->tuple,
 									att_list);
-			OutputPluginWrite(ctx, true);
+			spock_write(ctx, true);
 			break;
 		case REORDER_BUFFER_CHANGE_UPDATE:
 			{
 				HeapTuple oldtuple = change->data.tp.oldtuple ?
 					&change->data.tp.oldtuple->tuple : NULL;
 
-				OutputPluginPrepareWrite(ctx, true);
-				data->api->write_update(ctx->out, data, relation, oldtuple,
+				spock_prepare_write(ctx, true);
+				data->api->write_update(data->out, data, relation, oldtuple,
 										&change->data.tp.newtuple->tuple,
 										att_list);
-				OutputPluginWrite(ctx, true);
+				spock_write(ctx, true);
 				break;
 			}
 		case REORDER_BUFFER_CHANGE_DELETE:
 			if (change->data.tp.oldtuple)
 			{
-				OutputPluginPrepareWrite(ctx, true);
-				data->api->write_delete(ctx->out, data, relation,
+				spock_prepare_write(ctx, true);
+				data->api->write_delete(data->out, data, relation,
 										&change->data.tp.oldtuple->tuple,
 										att_list);
-				OutputPluginWrite(ctx, true);
+				spock_write(ctx, true);
 			}
 			else
 				elog(DEBUG1, "didn't send DELETE change because of missing oldtuple");
@@ -729,6 +866,8 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 			Assert(false);
 	}
 
+	data->tuple_encoder = NULL;
+
 	/* Cleanup */
 	Assert(CurrentMemoryContext == data->context);
 	MemoryContextSwitchTo(old);
@@ -762,6 +901,410 @@ pg_decode_origin_filter(LogicalDecodingContext *ctx,
 }
 #endif
 
+#if PG_VERSION_NUM >= 140000
+/*
+ * STREAM START callback
+ *
+ * The client spools the changes of a streamed transaction and applies them,
+ * relation metadata included, only once the transaction commits. So every
+ * stream segment has to carry its own relation metadata and the client
+ * can't be assumed to know any of it after the segment.
+ */
+static void
+pg_decode_stream_start(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	if (!startup_message_sent)
+		send_startup_message(ctx, data, false /* can't be last message */);
+
+	relmetacache_uncache_all();
+	data->stream_subxid = txn->xid;
+
+	spock_prepare_write(ctx, true);
+	data->api->write_stream_start(data->out, data, txn->xid,
+								  !rbtxn_is_streamed(txn));
+	spock_write(ctx, true);
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+}
+
+/*
+ * STREAM STOP callback
+ */
+static void
+pg_decode_stream_stop(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	spock_flush_inserts(ctx);
+
+	spock_prepare_write(ctx, true);
+	data->api->write_stream_stop(data->out, data);
+	spock_write(ctx, true);
+	spock_flush_batch(ctx);
+
+	relmetacache_uncache_all();
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+}
+
+/*
+ * STREAM ABORT callback, for both the toplevel transaction and its
+ * subtransactions.
+ */
+static void
+pg_decode_stream_abort(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					   XLogRecPtr abort_lsn)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	ReorderBufferTXN *toptxn = txn->toptxn ? txn->toptxn : txn;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	spock_prepare_write(ctx, true);
+	data->api->write_stream_abort(data->out, data, toptxn->xid, txn->xid);
+	spock_write(ctx, true);
+	spock_flush_batch(ctx);
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+}
+
+/*
+ * STREAM COMMIT callback
+ */
+static void
+pg_decode_stream_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						XLogRecPtr commit_lsn)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	char	   *origin = NULL;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	if (!startup_message_sent)
+		send_startup_message(ctx, data, false /* can't be last message */);
+
+	/* If the record didn't originate locally, send origin info */
+	if (data->forward_changeset_origins &&
+		txn->origin_id != InvalidRepOriginId &&
+		!replorigin_by_oid(txn->origin_id, true, &origin))
+		origin = NULL;
+
+	data->batch_commit_lsn = txn->end_lsn;
+	spock_prepare_write(ctx, true);
+	data->api->write_stream_commit(data->out, data, txn, commit_lsn, origin);
+	spock_write(ctx, true);
+	spock_flush_batch(ctx);
+
+	/*
+	 * The client has now applied the relation metadata spooled with the
+	 * transaction, which may not be the latest we sent.
+	 */
+	relmetacache_uncache_all();
+	relmetacache_prune();
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+
+	VALGRIND_DO_ADDED_LEAK_CHECK;
+}
+
+/*
+ * STREAM CHANGE callback
+ *
+ * Same as the plain change except that the client needs to know which
+ * subtransaction the change belongs to.
+ */
+static void
+pg_decode_stream_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						Relation relation, ReorderBufferChange *change)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+
+	if (change->txn->xid != data->stream_subxid)
+	{
+		spock_flush_inserts(ctx);
+
+		spock_prepare_write(ctx, true);
+		data->api->write_stream_subxact(data->out, data, change->txn->xid);
+		spock_write(ctx, true);
+
+		data->stream_subxid = change->txn->xid;
+	}
+
+	pg_decode_change(ctx, txn, relation, change);
+}
+#endif
+
+/*
+ * Start writing a protocol message to data->out.
+ *
+ * Normally every message gets its own CopyData frame. When the client asked
+ * for batches the message is instead added to the current batch, which is
+ * sent as a single 'G' frame once it reaches batch_size or when
+ * spock_flush_batch() is called. The frame is made of the number of
+ * messages followed by each message preceded by its length. That saves the
+ * frame header and the round through the walsender and the client's
+ * receive loop for every one of the mostly small messages.
+ */
+static void
+spock_prepare_write(LogicalDecodingContext *ctx, bool last_write)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+
+	if (data->batch_size == 0)
+	{
+		OutputPluginPrepareWrite(ctx, last_write);
+		data->out = ctx->out;
+		data->msg_start = ctx->out->len;
+		return;
+	}
+
+	/* Room for the length, filled in by spock_write(). */
+	data->batch_msg_start = data->batch->len;
+	enlargeStringInfo(data->batch, sizeof(uint32));
+	data->batch->len += sizeof(uint32);
+	data->out = data->batch;
+	data->msg_start = data->batch->len;
+}
+
+/*
+ * Finish the message started by spock_prepare_write().
+ */
+static void
+spock_write(LogicalDecodingContext *ctx, bool last_write)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	uint32		len;
+
+	data->out = NULL;
+
+	/* The rest of a message sent in pieces goes in the last 'P' frame. */
+	if (data->partial_active)
+	{
+		data->partial_active = false;
+
+		if (data->batch_size == 0)
+		{
+			len = pg_hton32(ctx->out->len - data->msg_start);
+			ctx->out->data[data->partial_hdr_pos + 1] = SPOCK_PARTIAL_LAST;
+			memcpy(ctx->out->data + data->partial_hdr_pos + 2, &len,
+				   sizeof(uint32));
+			OutputPluginWrite(ctx, last_write);
+			return;
+		}
+
+		OutputPluginPrepareWrite(ctx, last_write);
+		pq_sendbyte(ctx->out, 'P');
+		pq_sendbyte(ctx->out, SPOCK_PARTIAL_LAST);
+		pq_sendint32(ctx->out, data->batch->len);
+		appendBinaryStringInfo(ctx->out, data->batch->data, data->batch->len);
+		OutputPluginWrite(ctx, last_write);
+		resetStringInfo(data->batch);
+		return;
+	}
+
+	if (data->batch_size == 0)
+	{
+		OutputPluginWrite(ctx, last_write);
+		return;
+	}
+
+	len = pg_hton32(data->batch->len - data->batch_msg_start - sizeof(uint32));
+	memcpy(data->batch->data + data->batch_msg_start, &len, sizeof(uint32));
+	data->batch_count++;
+
+	if (data->batch->len >= data->batch_size)
+		spock_flush_batch(ctx);
+}
+
+/*
+ * Append the len bytes of a large value to the message being written, which
+ * must be the last thing written to data->out.
+ *
+ * When the client supports partial messages, what has been written of the
+ * message and the value are sent right away in 'P' frames of about
+ * SPOCK_PARTIAL_FRAME_SIZE instead, so the value isn't copied into an
+ * output buffer as a whole. The message continues in data->out and the rest
+ * of it is sent by spock_write() in the last frame. Each frame says how many
+ * bytes of the message at least follow, for the client to allocate the
+ * message once. Partial messages are never batched or compressed.
+ */
+void
+spock_write_large(SpockOutputData *data, const char *bytes, int len)
+{
+	LogicalDecodingContext *ctx = data->ctx;
+	StringInfo	out = data->out;
+	char	   *piece;
+	int			piecelen;
+	bool		prepared;
+
+	Assert(data->partial_messages);
+
+	/* What was written of the message since it or its last piece started */
+	piecelen = out->len - data->msg_start;
+	piece = palloc(piecelen);
+	memcpy(piece, out->data + data->msg_start, piecelen);
+
+	if (data->batch_size > 0)
+	{
+		/* Send the messages batched before this one first. */
+		data->batch->len = data->partial_active ? 0 : data->batch_msg_start;
+		spock_flush_batch(ctx);
+		resetStringInfo(data->batch);
+		prepared = false;
+	}
+	else
+	{
+		/* The frame of the message is prepared already, reuse it. */
+		ctx->out->len = data->partial_active ?
+			data->partial_hdr_pos : data->msg_start;
+		prepared = true;
+	}
+
+	do
+	{
+		int			chunk = Min(len, SPOCK_PARTIAL_FRAME_SIZE);
+
+		if (!prepared)
+			OutputPluginPrepareWrite(ctx, false);
+		prepared = false;
+
+		pq_sendbyte(ctx->out, 'P');
+		pq_sendbyte(ctx->out, 0);
+		pq_sendint32(ctx->out, piecelen + len);
+		appendBinaryStringInfo(ctx->out, piece, piecelen);
+		appendBinaryStringInfo(ctx->out, bytes, chunk);
+		OutputPluginWrite(ctx, false);
+
+		piecelen = 0;
+		bytes += chunk;
+		len -= chunk;
+	} while (len > 0);
+
+	pfree(piece);
+
+	/*
+	 * The rest of the message goes to a new piece, which spock_write() sends
+	 * with the last flag and its length filled in.
+	 */
+	if (data->batch_size > 0)
+		data->msg_start = 0;
+	else
+	{
+		OutputPluginPrepareWrite(ctx, false);
+		data->partial_hdr_pos = ctx->out->len;
+		pq_sendbyte(ctx->out, 'P');
+		pq_sendbyte(ctx->out, 0);
+		pq_sendint32(ctx->out, 0);
+		data->msg_start = ctx->out->len;
+	}
+
+	data->partial_active = true;
+}
+
+/*
+ * Send the inserts collected for a MULTI INSERT message, if any.
+ */
+static void
+spock_flush_inserts(LogicalDecodingContext *ctx)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+
+	if (data->insert_batch == NULL || data->insert_batch->nrows == 0)
+		return;
+
+	spock_prepare_write(ctx, true);
+	data->api->write_multi_insert(data->out, data, data->insert_batch);
+	spock_write(ctx, true);
+}
+
+/*
+ * Send the batched messages, if any.
+ */
+static void
+spock_flush_batch(LogicalDecodingContext *ctx)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	bool		compressed = false;
+
+	if (data->batch_count == 0)
+		return;
+
+	OutputPluginPrepareWrite(ctx, true);
+
+	/*
+	 * A compressed batch is sent as a 'Z' frame: the compression method, the
+	 * number of messages, the uncompressed length, the end of the
+	 * transaction committed by the last message or InvalidXLogRecPtr, and
+	 * the compressed messages.
+	 */
+	if (data->compression != SPOCK_COMPRESSION_NONE &&
+		data->batch->len >= SPOCK_COMPRESS_MIN_SIZE)
+	{
+		resetStringInfo(data->compress_buf);
+		compressed = spock_compress(data->compression, data->batch->data,
+									data->batch->len, data->compress_buf);
+		if (compressed)
+		{
+			pq_sendbyte(ctx->out, 'Z');
+			pq_sendbyte(ctx->out, data->compression);
+			pq_sendint32(ctx->out, data->batch_count);
+			pq_sendint32(ctx->out, data->batch->len);
+			pq_sendint64(ctx->out, data->batch_commit_lsn);
+			appendBinaryStringInfo(ctx->out, data->compress_buf->data,
+								   data->compress_buf->len);
+		}
+	}
+
+	/* Not compressed, or it didn't get smaller. */
+	if (!compressed)
+	{
+		pq_sendbyte(ctx->out, 'G');
+		pq_sendint32(ctx->out, data->batch_count);
+		appendBinaryStringInfo(ctx->out, data->batch->data, data->batch->len);
+	}
+
+	OutputPluginWrite(ctx, true);
+
+	data->batch_count = 0;
+	data->batch_commit_lsn = InvalidXLogRecPtr;
+
+	/* Don't keep too much memory around after huge messages. */
+	if (data->batch->maxlen > 2 * data->batch_size)
+	{
+		MemoryContext	oldctx;
+
+		oldctx = MemoryContextSwitchTo(GetMemoryChunkContext(data->batch->data));
+		pfree(data->batch->data);
+		initStringInfo(data->batch);
+		if (data->compress_buf != NULL)
+		{
+			pfree(data->compress_buf->data);
+			initStringInfo(data->compress_buf);
+		}
+		MemoryContextSwitchTo(oldctx);
+	}
+	else
+		resetStringInfo(data->batch);
+}
+
 static void
 send_startup_message(LogicalDecodingContext *ctx,
 		SpockOutputData *data, bool last_message)
@@ -779,9 +1322,9 @@ send_startup_message(LogicalDecodingContext *ctx,
 	 * not.
 	 */
 
-	OutputPluginPrepareWrite(ctx, last_message);
-	data->api->write_startup_message(ctx->out, msg);
-	OutputPluginWrite(ctx, last_message);
+	spock_prepare_write(ctx, last_message);
+	data->api->write_startup_message(data->out, msg);
+	spock_write(ctx, last_message);
 
 	list_free_deep(msg);
 
@@ -917,6 +1460,9 @@ relmetacache_get_relation(struct SpockOutputData *data,
 	if (!found || !hentry->is_valid)
 	{
 		Assert(hentry->relid = RelationGetRelid(rel));
+		if (found && hentry->encoder != NULL)
+			spock_tuple_encoder_free(hentry->encoder);
+		hentry->encoder = NULL;
 		hentry->is_cached = false;
 		/* Only used for lazy purging of invalidations */
 		hentry->is_valid = true;
@@ -946,12 +1492,7 @@ relmetacache_flush(void)
 		hash_seq_init(&status, RelMetaCache);
 
 		while ((hentry = (struct SPKRelMetaCacheEntry*) hash_seq_search(&status)) != NULL)
-		{
-			if (hash_search(RelMetaCache,
-							(void *) &hentry->relid,
-							HASH_REMOVE, NULL) == NULL)
-				elog(ERROR, "hash table corrupted");
-		}
+			relmetacache_remove(hentry);
 	}
 }
 
@@ -979,17 +1520,43 @@ relmetacache_prune(void)
 	while ((hentry = (struct SPKRelMetaCacheEntry*) hash_seq_search(&status)) != NULL)
 	{
 		if (!hentry->is_valid)
-		{
-			if (hash_search(RelMetaCache,
-							(void *) &hentry->relid,
-							HASH_REMOVE, NULL) == NULL)
-				elog(ERROR, "hash table corrupted");
-		}
+			relmetacache_remove(hentry);
 	}
 
 	InvalidRelMetaCacheCnt = 0;
 }
 
+/*
+ * Remove an entry from the relation metadata cache.
+ */
+static void
+relmetacache_remove(SPKRelMetaCacheEntry *hentry)
+{
+	if (hentry->encoder != NULL)
+		spock_tuple_encoder_free(hentry->encoder);
+
+	if (hash_search(RelMetaCache,
+					(void *) &hentry->relid,
+					HASH_REMOVE, NULL) == NULL)
+		elog(ERROR, "hash table corrupted");
+}
+
+/*
+ * Make the client get the relation metadata again the next time each
+ * relation is used.
+ */
+static void
+relmetacache_uncache_all(void)
+{
+	HASH_SEQ_STATUS status;
+	struct SPKRelMetaCacheEntry *hentry;
+
+	hash_seq_init(&status, RelMetaCache);
+
+	while ((hentry = (struct SPKRelMetaCacheEntry*) hash_seq_search(&status)) != NULL)
+		hentry->is_cached = false;
+}
+
 /*
  * Clone of ReorderBufferCleanSerializedTXNs; see
  * https://www.postgresql.org/message-id/CAMsr+YHdX=XECbZshDZ2CZNWGTyw-taYBnzqVfx4JzM4ExP5xg@mail.gmail.com
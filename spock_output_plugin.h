@@ -12,6 +12,8 @@
 #ifndef SPOCK_OUTPUT_PLUGIN_H
 #define SPOCK_OUTPUT_PLUGIN_H
 
+#include "access/xlogdefs.h"
+#include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 
@@ -33,6 +35,59 @@ typedef struct SpockOutputData
 	bool		allow_binary_basetypes;
 	bool		forward_changeset_origins;
 	int			field_datum_encoding;
+	bool		streaming;
+	bool		changed_columns_only;	/* Unchanged columns of updates are
+										 * sent as such */
+	bool		send_type_names;	/* Relation metadata names the types
+									 * embedded in binary values */
+	bool		partial_messages;	/* Large values are sent in pieces */
+
+	/* Subtransaction the last streamed change belonged to */
+	TransactionId stream_subxid;
+
+	/* Tuple encoder of the relation whose change is being written */
+	struct SpockTupleEncoder *tuple_encoder;
+
+	/* Buffer the message being written goes to, see spock_prepare_write() */
+	StringInfo	out;
+	int			msg_start;		/* where the message starts in out */
+
+	/* The decoding context, for spock_write_large() */
+	struct LogicalDecodingContext *ctx;
+
+	/*
+	 * Set once part of the message being written was sent in 'P' frames by
+	 * spock_write_large(). With no batches, partial_hdr_pos is where the
+	 * header of the frame with the rest of the message is in out.
+	 */
+	bool		partial_active;
+	int			partial_hdr_pos;
+
+	/*
+	 * Messages waiting to be sent in one batch frame, when the client asked
+	 * for batches of up to batch_size bytes.
+	 */
+	int			batch_size;
+	StringInfo	batch;
+	int			batch_count;
+	int			batch_msg_start;
+
+	/*
+	 * Consecutive inserts into a relation waiting to be sent in one MULTI
+	 * INSERT message, when the client supports it.
+	 */
+	struct SpockInsertBatch *insert_batch;
+
+	/* Compression of the batch frames, a SpockCompression */
+	int			compression;
+	StringInfo	compress_buf;
+
+	/*
+	 * End of the transaction committed by the last message of the batch,
+	 * sent in compressed frames so the client doesn't have to decompress
+	 * them to find commits.
+	 */
+	XLogRecPtr	batch_commit_lsn;
 
 	/*
 	 * client info
@@ -63,6 +118,13 @@ typedef struct SpockOutputData
 	bool		client_binary_intdatetimes_set;
 	bool		client_binary_intdatetimes;
 	bool		client_no_txinfo;
+	bool		client_want_streaming;
+	uint32		client_batch_size;
+	const char *client_compression;
+	bool		client_want_multi_insert;
+	bool		client_want_changed_columns_only;
+	bool		client_want_type_names;
+	bool		client_want_partial_messages;
 
 	/* List of origin names */
     List	   *forward_origins;
@@ -71,4 +133,7 @@ typedef struct SpockOutputData
 	RangeVar   *replicate_only_table;
 } SpockOutputData;
 
+extern void spock_write_large(SpockOutputData *data, const char *bytes,
+							  int len);
+
 #endif /* SPOCK_OUTPUT_PLUGIN_H */
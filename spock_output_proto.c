@@ -29,8 +29,14 @@ spock_init_api(SpockProtoType typ)
 		res->write_commit = spock_json_write_commit;
 		res->write_origin = NULL;
 		res->write_insert = spock_json_write_insert;
+		res->write_multi_insert = NULL;
 		res->write_update = spock_json_write_update;
 		res->write_delete = spock_json_write_delete;
+		res->write_stream_start = NULL;
+		res->write_stream_stop = NULL;
+		res->write_stream_subxact = NULL;
+		res->write_stream_abort = NULL;
+		res->write_stream_commit = NULL;
 		res->write_startup_message = json_write_startup_message;
 	}
 	else
@@ -40,8 +46,14 @@ spock_init_api(SpockProtoType typ)
 		res->write_commit = spock_write_commit;
 		res->write_origin = spock_write_origin;
 		res->write_insert = spock_write_insert;
+		res->write_multi_insert = spock_write_multi_insert;
 		res->write_update = spock_write_update;
 		res->write_delete = spock_write_delete;
+		res->write_stream_start = spock_write_stream_start;
+		res->write_stream_stop = spock_write_stream_stop;
+		res->write_stream_subxact = spock_write_stream_subxact;
+		res->write_stream_abort = spock_write_stream_abort;
+		res->write_stream_commit = spock_write_stream_commit;
 		res->write_startup_message = write_startup_message;
 	}
 
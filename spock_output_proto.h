@@ -69,6 +69,9 @@ typedef void (*spock_write_origin_fn) (StringInfo out, const char *origin,
 typedef void (*spock_write_insert_fn) (StringInfo out, SpockOutputData * data,
 										   Relation rel, HeapTuple newtuple,
 										   Bitmapset *att_list);
+typedef void (*spock_write_multi_insert_fn) (StringInfo out,
+												 SpockOutputData * data,
+												 struct SpockInsertBatch *batch);
 typedef void (*spock_write_update_fn) (StringInfo out, SpockOutputData * data,
 											Relation rel, HeapTuple oldtuple,
 											HeapTuple newtuple,
@@ -77,6 +80,25 @@ typedef void (*spock_write_delete_fn) (StringInfo out, SpockOutputData * data,
 										   Relation rel, HeapTuple oldtuple,
 										   Bitmapset *att_list);
 
+typedef void (*spock_write_stream_start_fn) (StringInfo out,
+											 SpockOutputData * data,
+											 TransactionId xid,
+											 bool first_segment);
+typedef void (*spock_write_stream_stop_fn) (StringInfo out,
+											SpockOutputData * data);
+typedef void (*spock_write_stream_subxact_fn) (StringInfo out,
+											   SpockOutputData * data,
+											   TransactionId subxid);
+typedef void (*spock_write_stream_abort_fn) (StringInfo out,
+											 SpockOutputData * data,
+											 TransactionId xid,
+											 TransactionId subxid);
+typedef void (*spock_write_stream_commit_fn) (StringInfo out,
+											  SpockOutputData * data,
+											  ReorderBufferTXN *txn,
+											  XLogRecPtr commit_lsn,
+											  const char *origin);
+
 typedef void (*write_startup_message_fn) (StringInfo out, List *msg);
 
 typedef struct SpockProtoAPI
@@ -86,8 +108,16 @@ typedef struct SpockProtoAPI
 	spock_write_commit_fn write_commit;
 	spock_write_origin_fn write_origin;
 	spock_write_insert_fn write_insert;
+	/* Inserts of several rows in one message, NULL if not supported. */
+	spock_write_multi_insert_fn write_multi_insert;
 	spock_write_update_fn write_update;
 	spock_write_delete_fn write_delete;
+	/* Streaming of in-progress transactions, NULL if not supported. */
+	spock_write_stream_start_fn write_stream_start;
+	spock_write_stream_stop_fn write_stream_stop;
+	spock_write_stream_subxact_fn write_stream_subxact;
+	spock_write_stream_abort_fn write_stream_abort;
+	spock_write_stream_commit_fn write_stream_commit;
 	write_startup_message_fn write_startup_message;
 } SpockProtoAPI;
 
@@ -11,36 +11,68 @@
  */
 #include "postgres.h"
 
+#include "miscadmin.h"
+
 #include "access/sysattr.h"
 #include "access/detoast.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
+#include "common/hashfn.h"
 #include "libpq/pqformat.h"
 #include "nodes/parsenodes.h"
 #include "replication/reorderbuffer.h"
+#include "utils/array.h"
+#include "utils/datum.h"
+#include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
+#include "utils/typcache.h"
 
 #include "spock_output_plugin.h"
 #include "spock_output_proto.h"
 #include "spock_proto_native.h"
+#include "spock_worker.h"
 
 #define IS_REPLICA_IDENTITY 1
 
-static void spock_write_attrs(StringInfo out, Relation rel,
-								  Bitmapset *att_list);
+#define STREAM_COMMIT_HAS_ORIGIN 1
+
+/*
+ * Column of a SpockInsertBatch: a null bitmap with a bit per row and the
+ * values of the rows which are not null, one after another.
+ */
+typedef struct SpockInsertBatchColumn
+{
+	char		transfer_type;
+	int32		width;			/* Size of every value, -1 if they're sent
+								 * with their length */
+	StringInfoData nulls;
+	StringInfoData values;
+} SpockInsertBatchColumn;
+
+static void spock_write_attrs(StringInfo out, SpockOutputData *data,
+								  Relation rel, Bitmapset *att_list);
 static void spock_write_tuple(StringInfo out, SpockOutputData *data,
 								  Relation rel, HeapTuple tuple,
-								  Bitmapset *att_list);
+								  HeapTuple oldtuple, Bitmapset *att_list);
 static char decide_datum_transfer(Form_pg_attribute att,
 								  Form_pg_type typclass,
 								  bool allow_internal_basetypes,
-								  bool allow_binary_basetypes);
+								  bool allow_binary_basetypes,
+								  bool send_type_names);
+static bool collect_embedded_types(Oid typid, List **typids);
 
 static void spock_read_attrs(StringInfo in, char ***attrnames,
+								  bool **attidkey, List ***atttypes,
 								  int *nattrnames);
 static void spock_read_tuple(StringInfo in, SpockRelation *rel,
-					  SpockTupleData *tuple);
+					  int tupbuf, SpockTupleData *tuple);
+static Datum spock_decode_datum(SpockRelation *rel, int remote_attno,
+								Form_pg_attribute att, char kind,
+								const char *data, int len);
 
 /*
  * Write functions
@@ -83,7 +115,7 @@ spock_write_rel(StringInfo out, SpockOutputData *data, Relation rel,
 	pq_sendbytes(out, relname, relnamelen);
 
 	/* send the attribute info */
-	spock_write_attrs(out, rel, att_list);
+	spock_write_attrs(out, data, rel, att_list);
 
 	pfree(nspname);
 }
@@ -92,7 +124,8 @@ spock_write_rel(StringInfo out, SpockOutputData *data, Relation rel,
  * Write relation attributes to the outputstream.
  */
 static void
-spock_write_attrs(StringInfo out, Relation rel, Bitmapset *att_list)
+spock_write_attrs(StringInfo out, SpockOutputData *data, Relation rel,
+				  Bitmapset *att_list)
 {
 	TupleDesc	desc;
 	int			i;
@@ -148,6 +181,71 @@ spock_write_attrs(StringInfo out, Relation rel, Bitmapset *att_list)
 		len = strlen(attname) + 1;
 		pq_sendint(out, len, 2);
 		pq_sendbytes(out, attname, len); /* data */
+
+		/*
+		 * Name the non-builtin types whose OIDs are embedded in the binary
+		 * values of the column, so the client can map them to its own.
+		 */
+		if (data->send_type_names)
+		{
+			List	   *typids = NIL;
+			ListCell   *lc;
+			StringInfoData block;
+
+			initStringInfo(&block);
+
+			if (collect_embedded_types(att->atttypid, &typids))
+			{
+				foreach (lc, typids)
+				{
+					Oid			typid = lfirst_oid(lc);
+					HeapTuple	typtup;
+					Form_pg_type typclass;
+					char	   *nspname;
+					uint8		nspnamelen;
+					uint8		typnamelen;
+
+					if (typid < FirstNormalObjectId)
+						continue;
+
+					typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+					if (!HeapTupleIsValid(typtup))
+						elog(ERROR, "cache lookup failed for type %u", typid);
+					typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+					nspname = get_namespace_name(typclass->typnamespace);
+					if (nspname == NULL)
+						elog(ERROR, "cache lookup failed for namespace %u",
+							 typclass->typnamespace);
+					nspnamelen = strlen(nspname) + 1;
+					typnamelen = strlen(NameStr(typclass->typname)) + 1;
+
+					pq_sendint(&block, typid, 4);
+					pq_sendbyte(&block, nspnamelen);
+					pq_sendbytes(&block, nspname, nspnamelen);
+					pq_sendbyte(&block, typnamelen);
+					pq_sendbytes(&block, NameStr(typclass->typname),
+								 typnamelen);
+
+					pfree(nspname);
+					ReleaseSysCache(typtup);
+				}
+			}
+
+			if (block.len > PG_UINT16_MAX)
+				elog(ERROR, "too many types embedded in column \"%s\" of relation \"%s\"",
+					 attname, RelationGetRelationName(rel));
+
+			if (block.len > 0)
+			{
+				pq_sendbyte(out, 'T');		/* embedded types block follows */
+				pq_sendint(out, block.len, 2);
+				pq_sendbytes(out, block.data, block.len);
+			}
+
+			pfree(block.data);
+			list_free(typids);
+		}
 	}
 
 	bms_free(idattrs);
@@ -219,6 +317,117 @@ spock_write_origin(StringInfo out, const char *origin,
 	pq_sendbytes(out, origin, len);
 }
 
+/*
+ * Write STREAM START to the output stream.
+ */
+void
+spock_write_stream_start(StringInfo out, SpockOutputData *data,
+						 TransactionId xid, bool first_segment)
+{
+	uint8	flags = 0;
+
+	pq_sendbyte(out, 's');		/* STREAM START */
+
+	/* send the flags field its self */
+	pq_sendbyte(out, flags);
+
+	/* fixed fields */
+	pq_sendint(out, xid, 4);
+	pq_sendbyte(out, first_segment ? 1 : 0);
+}
+
+/*
+ * Write STREAM STOP to the output stream.
+ */
+void
+spock_write_stream_stop(StringInfo out, SpockOutputData *data)
+{
+	uint8	flags = 0;
+
+	pq_sendbyte(out, 'E');		/* STREAM STOP */
+
+	/* send the flags field its self */
+	pq_sendbyte(out, flags);
+}
+
+/*
+ * Write STREAM SUBXACT to the output stream, the following changes belong
+ * to the given subtransaction.
+ */
+void
+spock_write_stream_subxact(StringInfo out, SpockOutputData *data,
+						   TransactionId subxid)
+{
+	uint8	flags = 0;
+
+	pq_sendbyte(out, 'x');		/* STREAM SUBXACT */
+
+	/* send the flags field its self */
+	pq_sendbyte(out, flags);
+
+	/* fixed fields */
+	pq_sendint(out, subxid, 4);
+}
+
+/*
+ * Write STREAM ABORT to the output stream.
+ */
+void
+spock_write_stream_abort(StringInfo out, SpockOutputData *data,
+						 TransactionId xid, TransactionId subxid)
+{
+	uint8	flags = 0;
+
+	pq_sendbyte(out, 'A');		/* STREAM ABORT */
+
+	/* send the flags field its self */
+	pq_sendbyte(out, flags);
+
+	/* fixed fields */
+	pq_sendint(out, xid, 4);
+	pq_sendint(out, subxid, 4);
+}
+
+/*
+ * Write STREAM COMMIT to the output stream.
+ *
+ * Unlike the plain transactions, the origin of a streamed transaction is
+ * only known at commit time so it's sent as part of this message.
+ */
+void
+spock_write_stream_commit(StringInfo out, SpockOutputData *data,
+						  ReorderBufferTXN *txn, XLogRecPtr commit_lsn,
+						  const char *origin)
+{
+	uint8	flags = 0;
+
+	if (origin != NULL)
+		flags |= STREAM_COMMIT_HAS_ORIGIN;
+
+	pq_sendbyte(out, 'c');		/* STREAM COMMIT */
+
+	/* send the flags field */
+	pq_sendbyte(out, flags);
+
+	/* send fixed fields */
+	pq_sendint(out, txn->xid, 4);
+	pq_sendint64(out, commit_lsn);
+	pq_sendint64(out, txn->end_lsn);
+	pq_sendint64(out, txn->commit_time);
+
+	if (origin != NULL)
+	{
+		uint8	len;
+
+		Assert(strlen(origin) < 255);
+
+		pq_sendint64(out, txn->origin_lsn);
+		len = strlen(origin) + 1;
+		pq_sendbyte(out, len);
+		pq_sendbytes(out, origin, len);
+	}
+}
+
 /*
  * Write INSERT to the output stream.
  */
@@ -238,7 +447,84 @@ spock_write_insert(StringInfo out, SpockOutputData *data,
 	pq_sendint(out, RelationGetRelid(rel), 4);
 
 	pq_sendbyte(out, 'N');		/* new tuple follows */
-	spock_write_tuple(out, data, rel, newtuple, att_list);
+	spock_write_tuple(out, data, rel, newtuple, NULL, att_list);
+}
+
+/*
+ * Write MULTI INSERT to the output stream and empty the batch.
+ *
+ * The rows are sent column by column. Every column has its transfer type,
+ * the width of its values if they are fixed-width values in internal format
+ * or -1, a bitmap of the rows where it's null and the values of the other
+ * rows, each preceded by its length unless the values are fixed-width.
+ *
+ * A single row is sent as a plain INSERT instead, which is cheaper to apply
+ * and lets the parallel apply track it like any other INSERT.
+ */
+void
+spock_write_multi_insert(StringInfo out, SpockOutputData *data,
+						 SpockInsertBatch *batch)
+{
+	uint8		flags = 0;
+	bool		single = (batch->nrows == 1);
+	int			i;
+
+	Assert(batch->nrows > 0);
+
+	pq_sendbyte(out, single ? 'I' : 'M');	/* action (MULTI) INSERT */
+
+	/* send the flags field */
+	pq_sendbyte(out, flags);
+
+	/* use Oid as relation identifier */
+	pq_sendint(out, batch->relid, 4);
+
+	if (single)
+	{
+		pq_sendbyte(out, 'N');		/* new tuple follows */
+		pq_sendbyte(out, 'T');		/* sending TUPLE */
+	}
+	else
+		pq_sendint(out, batch->nrows, 4);
+	pq_sendint(out, batch->ncols, 2);
+
+	enlargeStringInfo(out, batch->size +
+					  batch->ncols * (1 + 4 + (batch->nrows + 7) / 8));
+
+	for (i = 0; i < batch->ncols; i++)
+	{
+		SpockInsertBatchColumn *bc = &batch->cols[i];
+
+		if (!single)
+		{
+			pq_sendbyte(out, bc->transfer_type);
+			pq_sendint(out, bc->width, 4);
+			appendBinaryStringInfo(out, bc->nulls.data, bc->nulls.len);
+			appendBinaryStringInfo(out, bc->values.data, bc->values.len);
+		}
+		else if (bc->nulls.data[0] & 1)
+			pq_sendbyte(out, 'n');	/* null column */
+		else
+		{
+			pq_sendbyte(out, bc->transfer_type);
+			if (bc->width > 0)
+				pq_sendint(out, bc->width, 4);	/* length */
+			appendBinaryStringInfo(out, bc->values.data, bc->values.len);
+		}
+
+		/* Don't keep too much memory around after huge values. */
+		if (bc->values.maxlen > 2 * SPOCK_INSERT_BATCH_MAX_SIZE)
+		{
+			MemoryContext	oldctx = MemoryContextSwitchTo(batch->mcxt);
+
+			pfree(bc->values.data);
+			initStringInfo(&bc->values);
+			MemoryContextSwitchTo(oldctx);
+		}
+	}
+
+	batch->nrows = 0;
+	batch->size = 0;
 }
 
 /*
@@ -250,6 +536,7 @@ spock_write_update(StringInfo out, SpockOutputData *data,
 						Bitmapset *att_list)
 {
 	uint8 flags = 0;
+	HeapTuple	cmptuple = NULL;
 
 	pq_sendbyte(out, 'U');		/* action UPDATE */
 
@@ -272,11 +559,20 @@ spock_write_update(StringInfo out, SpockOutputData *data,
 	if (oldtuple != NULL)
 	{
 		pq_sendbyte(out, 'K');	/* old key follows */
-		spock_write_tuple(out, data, rel, oldtuple, att_list);
+		spock_write_tuple(out, data, rel, oldtuple, NULL, att_list);
+
+		/*
+		 * With REPLICA IDENTITY FULL the old key is the whole old row, so
+		 * the columns the update didn't change can be left out of the new
+		 * tuple if the client asked for that.
+		 */
+		if (data->changed_columns_only &&
+			rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+			cmptuple = oldtuple;
 	}
 
 	pq_sendbyte(out, 'N');		/* new tuple follows */
-	spock_write_tuple(out, data, rel, newtuple, att_list);
+	spock_write_tuple(out, data, rel, newtuple, cmptuple, att_list);
 }
 
 /*
@@ -303,7 +599,7 @@ spock_write_delete(StringInfo out, SpockOutputData *data,
 	 * See notes on update for details
 	 */
 	pq_sendbyte(out, 'K');	/* old key follows */
-	spock_write_tuple(out, data, rel, oldtuple, att_list);
+	spock_write_tuple(out, data, rel, oldtuple, NULL, att_list);
 }
 
 /*
@@ -328,55 +624,78 @@ write_startup_message(StringInfo out, List *msg)
 }
 
 /*
- * Write a tuple to the outputstream, in the most efficient format possible.
+ * How each column of a relation is sent, see spock_tuple_encoder_create().
  */
-static void
-spock_write_tuple(StringInfo out, SpockOutputData *data,
-					  Relation rel, HeapTuple tuple, Bitmapset *att_list)
+typedef struct SpockColumnEncoder
 {
-	TupleDesc	desc;
-	Datum		values[MaxTupleAttributeNumber];
-	bool		isnull[MaxTupleAttributeNumber];
-	int			i;
-	uint16		nliveatts = 0;
-
-	desc = RelationGetDescr(rel);
-
-	pq_sendbyte(out, 'T');			/* sending TUPLE */
-
-	for (i = 0; i < desc->natts; i++)
-	{
-		Form_pg_attribute att = TupleDescAttr(desc,i);
-
-		if (att->attisdropped)
-			continue;
-		if (att_list &&
-			!bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
-						   att_list))
-			continue;
-		nliveatts++;
-	}
-	pq_sendint(out, nliveatts, 2);
+	int			attoff;			/* Index into the tuple descriptor */
+	char		transfer_type;	/* 'i', 'b' or 't' */
+	int16		attlen;
+	bool		attbyval;
+	bool		iskey;			/* Part of the replica identity or the
+								 * primary key */
+	FmgrInfo	func;			/* Send or output function */
+} SpockColumnEncoder;
+
+struct SpockTupleEncoder
+{
+	MemoryContext	mcxt;
+	int				natts;		/* Columns in the tuple descriptor */
+	uint16			nliveatts;	/* Columns which are sent */
+	Datum		   *values;
+	bool		   *isnull;
+	Datum		   *oldvalues;	/* Old row an update is compared with */
+	bool		   *oldisnull;
+	SpockColumnEncoder cols[FLEXIBLE_ARRAY_MEMBER];
+};
 
-	/* try to allocate enough memory from the get go */
-	enlargeStringInfo(out, tuple->t_len +
-					  nliveatts * (1 + 4));
+/*
+ * Build the plan for writing the tuples of a relation: the list of columns
+ * which are not dropped nor filtered out, how each one is transferred and
+ * the send or output function it's transferred with. All of that is only
+ * valid until the next relcache invalidation of the relation.
+ */
+SpockTupleEncoder *
+spock_tuple_encoder_create(SpockOutputData *data, Relation rel,
+						   Bitmapset *att_list, MemoryContext mcxt)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	SpockTupleEncoder *enc;
+	MemoryContext encctx;
+	MemoryContext oldctx;
+	Bitmapset  *keyattrs;
+	int			i;
 
 	/*
-	 * XXX: should this prove to be a relevant bottleneck, it might be
-	 * interesting to inline heap_deform_tuple() here, we don't actually need
-	 * the information in the form we get from it.
+	 * The send and output functions may cache things in their own memory
+	 * context, keep all of it together so it goes away with the encoder.
 	 */
-	heap_deform_tuple(tuple, desc, values, isnull);
+	encctx = AllocSetContextCreate(mcxt, "spock tuple encoder",
+								   ALLOCSET_SMALL_SIZES);
+	oldctx = MemoryContextSwitchTo(encctx);
+
+	enc = palloc0(offsetof(SpockTupleEncoder, cols) +
+				  Max(desc->natts, 1) * sizeof(SpockColumnEncoder));
+	enc->mcxt = encctx;
+	enc->natts = desc->natts;
+	enc->values = palloc(Max(desc->natts, 1) * sizeof(Datum));
+	enc->isnull = palloc(Max(desc->natts, 1) * sizeof(bool));
+	enc->oldvalues = palloc(Max(desc->natts, 1) * sizeof(Datum));
+	enc->oldisnull = palloc(Max(desc->natts, 1) * sizeof(bool));
+
+	/* Key columns are always sent, the client finds rows by them. */
+	keyattrs = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_IDENTITY_KEY);
+	keyattrs = bms_join(keyattrs,
+						RelationGetIndexAttrBitmap(rel,
+												   INDEX_ATTR_BITMAP_PRIMARY_KEY));
 
 	for (i = 0; i < desc->natts; i++)
 	{
+		Form_pg_attribute att = TupleDescAttr(desc,i);
+		SpockColumnEncoder *col = &enc->cols[enc->nliveatts];
 		HeapTuple	typtup;
 		Form_pg_type typclass;
-		Form_pg_attribute att = TupleDescAttr(desc,i);
-		char		transfer_type;
 
-		/* skip dropped columns */
 		if (att->attisdropped)
 			continue;
 		if (att_list &&
@@ -384,169 +703,503 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 						   att_list))
 			continue;
 
-		if (isnull[i])
-		{
-			pq_sendbyte(out, 'n');	/* null column */
-			continue;
-		}
-		else if (att->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(values[i]))
-		{
-			pq_sendbyte(out, 'u');	/* unchanged toast column */
-			continue;
-		}
-
 		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
 		if (!HeapTupleIsValid(typtup))
 			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
 		typclass = (Form_pg_type) GETSTRUCT(typtup);
 
-		transfer_type = decide_datum_transfer(att, typclass,
-											  data->allow_internal_basetypes,
-											  data->allow_binary_basetypes);
+		col->attoff = i;
+		col->attlen = att->attlen;
+		col->attbyval = att->attbyval;
+		col->iskey = bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
+								   keyattrs);
+		col->transfer_type = decide_datum_transfer(att, typclass,
+												   data->allow_internal_basetypes,
+												   data->allow_binary_basetypes,
+												   data->send_type_names);
+
+		if (col->transfer_type == 'b')
+			fmgr_info_cxt(typclass->typsend, &col->func, encctx);
+		else if (col->transfer_type == 't')
+			fmgr_info_cxt(typclass->typoutput, &col->func, encctx);
 
-		switch (transfer_type)
-		{
-			case 'i':
-				pq_sendbyte(out, 'i');	/* internal-format binary data follows */
+		ReleaseSysCache(typtup);
 
-				/* pass by value */
-				if (att->attbyval)
-				{
-					pq_sendint(out, att->attlen, 4); /* length */
+		enc->nliveatts++;
+	}
 
-					enlargeStringInfo(out, att->attlen);
-					store_att_byval(out->data + out->len, values[i],
-									att->attlen);
-					out->len += att->attlen;
-					out->data[out->len] = '\0';
-				}
-				/* fixed length non-varlena pass-by-reference type */
-				else if (att->attlen > 0)
-				{
-					pq_sendint(out, att->attlen, 4); /* length */
+	bms_free(keyattrs);
 
-					appendBinaryStringInfo(out, DatumGetPointer(values[i]),
-										   att->attlen);
-				}
-				/* varlena type */
-				else if (att->attlen == -1)
-				{
-					char *data = DatumGetPointer(values[i]);
+	MemoryContextSwitchTo(oldctx);
 
-					/* send indirect datums inline */
-					if (VARATT_IS_EXTERNAL_INDIRECT(values[i]))
-					{
-						struct varatt_indirect redirect;
-						VARATT_EXTERNAL_GET_POINTER(redirect, data);
-						data = (char *) redirect.pointer;
-					}
+	return enc;
+}
 
-					Assert(!VARATT_IS_EXTERNAL(data));
+void
+spock_tuple_encoder_free(SpockTupleEncoder *enc)
+{
+	MemoryContextDelete(enc->mcxt);
+}
 
-					pq_sendint(out, VARSIZE_ANY(data), 4); /* length */
+/*
+ * Append the data of a column value to the message being written. With data
+ * given, large values are sent straight to the client if it supports
+ * partial messages.
+ */
+static inline void
+spock_write_value_data(StringInfo out, SpockOutputData *data,
+					   const char *bytes, int len)
+{
+	if (data != NULL && data->partial_messages &&
+		len >= SPOCK_LARGE_VALUE_SIZE)
+	{
+		Assert(out == data->out);
+		spock_write_large(data, bytes, len);
+	}
+	else
+		appendBinaryStringInfo(out, bytes, len);
+}
 
-					appendBinaryStringInfo(out, data, VARSIZE_ANY(data));
+/*
+ * Write a column value in the column's transfer format: its length and the
+ * data. With packed, fixed-width values in internal format are written
+ * without the length, the reader knows it from the column.
+ *
+ * data is NULL when the value isn't written to the message being sent.
+ */
+static void
+spock_write_datum(StringInfo out, SpockOutputData *data,
+				  SpockColumnEncoder *col, Datum value, bool packed)
+{
+	switch (col->transfer_type)
+	{
+		case 'i':
+			/* pass by value */
+			if (col->attbyval)
+			{
+				if (!packed)
+					pq_sendint(out, col->attlen, 4); /* length */
+
+				enlargeStringInfo(out, col->attlen);
+				store_att_byval(out->data + out->len, value,
+								col->attlen);
+				out->len += col->attlen;
+				out->data[out->len] = '\0';
+			}
+			/* fixed length non-varlena pass-by-reference type */
+			else if (col->attlen > 0)
+			{
+				if (!packed)
+					pq_sendint(out, col->attlen, 4); /* length */
+
+				appendBinaryStringInfo(out, DatumGetPointer(value),
+									   col->attlen);
+			}
+			/* varlena type */
+			else if (col->attlen == -1)
+			{
+				char *ptr = DatumGetPointer(value);
+
+				/* send indirect datums inline */
+				if (VARATT_IS_EXTERNAL_INDIRECT(value))
+				{
+					struct varatt_indirect redirect;
+					VARATT_EXTERNAL_GET_POINTER(redirect, ptr);
+					ptr = (char *) redirect.pointer;
 				}
-				else
-					elog(ERROR, "unsupported tuple type");
 
-				break;
+				Assert(!VARATT_IS_EXTERNAL(ptr));
 
-			case 'b':
-				{
-					bytea	   *outputbytes;
-					int			len;
+				pq_sendint(out, VARSIZE_ANY(ptr), 4); /* length */
 
-					pq_sendbyte(out, 'b');	/* binary send/recv data follows */
+				spock_write_value_data(out, data, ptr, VARSIZE_ANY(ptr));
+			}
+			else
+				elog(ERROR, "unsupported tuple type");
 
-					outputbytes = OidSendFunctionCall(typclass->typsend,
-													  values[i]);
+			break;
 
-					len = VARSIZE(outputbytes) - VARHDRSZ;
-					pq_sendint(out, len, 4); /* length */
-					pq_sendbytes(out, VARDATA(outputbytes), len); /* data */
-					pfree(outputbytes);
-				}
-				break;
+		case 'b':
+			{
+				bytea	   *outputbytes;
+				int			len;
 
-			default:
-				{
-					char   	   *outputstr;
-					int			len;
+				outputbytes = SendFunctionCall(&col->func, value);
 
-					pq_sendbyte(out, 't');	/* 'text' data follows */
+				len = VARSIZE(outputbytes) - VARHDRSZ;
+				pq_sendint(out, len, 4); /* length */
+				spock_write_value_data(out, data, VARDATA(outputbytes),
+									   len); /* data */
+				pfree(outputbytes);
+			}
+			break;
 
-					outputstr =	OidOutputFunctionCall(typclass->typoutput,
-													  values[i]);
-					len = strlen(outputstr) + 1;
-					pq_sendint(out, len, 4); /* length */
-					appendBinaryStringInfo(out, outputstr, len); /* data */
-					pfree(outputstr);
-				}
-		}
+		default:
+			{
+				char   	   *outputstr;
+				int			len;
 
-		ReleaseSysCache(typtup);
+				outputstr =	OutputFunctionCall(&col->func, value);
+				len = strlen(outputstr) + 1;
+				pq_sendint(out, len, 4); /* length */
+				spock_write_value_data(out, data, outputstr, len); /* data */
+				pfree(outputstr);
+			}
 	}
 }
 
 /*
- * Make the executive decision about which protocol to use.
+ * Is the new value of an updated column binary equal to the old one?
+ *
+ * Values which are equal but stored differently, compressed in one tuple and
+ * not in the other for example, count as changed.
  */
-static char
-decide_datum_transfer(Form_pg_attribute att, Form_pg_type typclass,
-					  bool allow_internal_basetypes,
-					  bool allow_binary_basetypes)
+static inline bool
+spock_datum_unchanged(SpockColumnEncoder *col, Datum oldvalue, Datum value)
 {
-	/*
-	 * Use the binary protocol, if allowed, for builtin & plain datatypes.
-	 */
-	if (allow_internal_basetypes &&
-		typclass->typtype == 'b' &&
-		att->atttypid < FirstNormalObjectId &&
-		typclass->typelem == InvalidOid)
-	{
-		return 'i';
-	}
-	/*
-	 * Use send/recv, if allowed, if the type is plain or builtin.
-	 *
-	 * XXX: we can't use send/recv for array or composite types for now due to
-	 * the embedded oids.
-	 */
-	else if (allow_binary_basetypes &&
-			 OidIsValid(typclass->typreceive) &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typtype != 'c') &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typelem == InvalidOid))
-	{
-		return 'b';
-	}
+	if (col->attlen == -1 &&
+		(VARATT_IS_EXTERNAL(DatumGetPointer(oldvalue)) ||
+		 VARATT_IS_EXTERNAL(DatumGetPointer(value))))
+		return false;
 
-	return 't';
+	return datumIsEqual(oldvalue, value, col->attbyval, col->attlen);
 }
 
-
 /*
- * Read functions.
- */
-
-/*
- * Read transaction BEGIN from the stream.
+ * Write a tuple to the outputstream, in the most efficient format possible.
+ *
+ * Uses the encoder the output plugin cached for the relation, if any.
+ *
+ * If oldtuple is given, the columns which have the same value in it are sent
+ * as unchanged, except for key columns.
  */
-void
-spock_read_begin(StringInfo in, XLogRecPtr *remote_lsn,
-					  TimestampTz *committime, TransactionId *remote_xid)
+static void
+spock_write_tuple(StringInfo out, SpockOutputData *data,
+					  Relation rel, HeapTuple tuple, HeapTuple oldtuple,
+					  Bitmapset *att_list)
 {
-	/* read flags */
-	uint8	flags = pq_getmsgbyte(in);
-	Assert(flags == 0);
-	(void) flags; /* unused */
+	SpockTupleEncoder *enc = data->tuple_encoder;
+	bool		free_enc = false;
+	Datum	   *values;
+	bool	   *isnull;
+	int			i;
 
-	/* read fields */
-	*remote_lsn = pq_getmsgint64(in);
-	Assert(*remote_lsn != InvalidXLogRecPtr);
-	*committime = pq_getmsgint64(in);
-	*remote_xid = pq_getmsgint(in, 4);
-}
+	if (enc == NULL)
+	{
+		enc = spock_tuple_encoder_create(data, rel, att_list,
+										 CurrentMemoryContext);
+		free_enc = true;
+	}
+	Assert(enc->natts == RelationGetDescr(rel)->natts);
+
+	values = enc->values;
+	isnull = enc->isnull;
+
+	pq_sendbyte(out, 'T');			/* sending TUPLE */
+
+	pq_sendint(out, enc->nliveatts, 2);
+
+	/* try to allocate enough memory from the get go */
+	enlargeStringInfo(out, tuple->t_len +
+					  enc->nliveatts * (1 + 4));
+
+	/*
+	 * XXX: should this prove to be a relevant bottleneck, it might be
+	 * interesting to inline heap_deform_tuple() here, we don't actually need
+	 * the information in the form we get from it.
+	 */
+	heap_deform_tuple(tuple, RelationGetDescr(rel), values, isnull);
+	if (oldtuple != NULL)
+		heap_deform_tuple(oldtuple, RelationGetDescr(rel), enc->oldvalues,
+						  enc->oldisnull);
+
+	for (i = 0; i < enc->nliveatts; i++)
+	{
+		SpockColumnEncoder *col = &enc->cols[i];
+		Datum		value = values[col->attoff];
+
+		if (isnull[col->attoff])
+		{
+			pq_sendbyte(out, 'n');	/* null column */
+			continue;
+		}
+		else if (col->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(value))
+		{
+			pq_sendbyte(out, 'u');	/* unchanged toast column */
+			continue;
+		}
+		else if (oldtuple != NULL && !col->iskey &&
+				 !enc->oldisnull[col->attoff] &&
+				 spock_datum_unchanged(col, enc->oldvalues[col->attoff],
+									   value))
+		{
+			pq_sendbyte(out, 'u');	/* unchanged column */
+			continue;
+		}
+
+		pq_sendbyte(out, col->transfer_type);
+		spock_write_datum(out, data, col, value, false);
+	}
+
+	if (free_enc)
+		spock_tuple_encoder_free(enc);
+}
+
+SpockInsertBatch *
+spock_insert_batch_create(MemoryContext mcxt)
+{
+	SpockInsertBatch *batch;
+
+	batch = MemoryContextAllocZero(mcxt, sizeof(SpockInsertBatch));
+	batch->mcxt = mcxt;
+
+	return batch;
+}
+
+/*
+ * Add the row inserted by tuple to the batch, encoded with the encoder of
+ * the relation the output plugin set up. The batch must be empty or hold
+ * rows of the same relation encoded with the same encoder.
+ *
+ * Returns false, leaving the batch unchanged, if the row can't be sent in a
+ * MULTI INSERT message.
+ */
+bool
+spock_insert_batch_add(SpockInsertBatch *batch, SpockOutputData *data,
+					   Relation rel, HeapTuple tuple)
+{
+	SpockTupleEncoder *enc = data->tuple_encoder;
+	Datum	   *values;
+	bool	   *isnull;
+	int			i;
+
+	Assert(enc != NULL);
+	Assert(enc->natts == RelationGetDescr(rel)->natts);
+	Assert(batch->nrows == 0 || batch->relid == RelationGetRelid(rel));
+
+	values = enc->values;
+	isnull = enc->isnull;
+
+	heap_deform_tuple(tuple, RelationGetDescr(rel), values, isnull);
+
+	/*
+	 * There's no way to say a value is an unchanged toast value, and large
+	 * values are better sent in pieces of an INSERT of their own.
+	 */
+	for (i = 0; i < enc->nliveatts; i++)
+	{
+		SpockColumnEncoder *col = &enc->cols[i];
+		Datum		value = values[col->attoff];
+
+		if (isnull[col->attoff] || col->attlen != -1)
+			continue;
+
+		if (VARATT_IS_EXTERNAL_ONDISK(value))
+			return false;
+		if (data->partial_messages &&
+			toast_raw_datum_size(value) >= SPOCK_LARGE_VALUE_SIZE)
+			return false;
+	}
+
+	if (batch->nrows == 0)
+	{
+		if (batch->maxcols < enc->nliveatts)
+		{
+			MemoryContext	oldctx = MemoryContextSwitchTo(batch->mcxt);
+			SpockInsertBatchColumn *cols;
+
+			cols = palloc(enc->nliveatts * sizeof(SpockInsertBatchColumn));
+			if (batch->maxcols > 0)
+			{
+				memcpy(cols, batch->cols,
+					   batch->maxcols * sizeof(SpockInsertBatchColumn));
+				pfree(batch->cols);
+			}
+			for (i = batch->maxcols; i < enc->nliveatts; i++)
+			{
+				initStringInfo(&cols[i].nulls);
+				initStringInfo(&cols[i].values);
+			}
+
+			batch->cols = cols;
+			batch->maxcols = enc->nliveatts;
+			MemoryContextSwitchTo(oldctx);
+		}
+
+		batch->relid = RelationGetRelid(rel);
+		batch->ncols = enc->nliveatts;
+		batch->size = 0;
+
+		for (i = 0; i < batch->ncols; i++)
+		{
+			SpockColumnEncoder *col = &enc->cols[i];
+			SpockInsertBatchColumn *bc = &batch->cols[i];
+
+			bc->transfer_type = col->transfer_type;
+			bc->width = (col->transfer_type == 'i' && col->attlen > 0) ?
+				col->attlen : -1;
+			resetStringInfo(&bc->nulls);
+			resetStringInfo(&bc->values);
+		}
+	}
+
+	for (i = 0; i < batch->ncols; i++)
+	{
+		SpockColumnEncoder *col = &enc->cols[i];
+		SpockInsertBatchColumn *bc = &batch->cols[i];
+		int			len = bc->values.len;
+
+		if (batch->nrows % 8 == 0)
+			appendStringInfoCharMacro(&bc->nulls, 0);
+
+		if (isnull[col->attoff])
+			bc->nulls.data[bc->nulls.len - 1] |= 1 << (batch->nrows % 8);
+		else
+			spock_write_datum(&bc->values, NULL, col, values[col->attoff],
+							  bc->width > 0);
+
+		batch->size += bc->values.len - len;
+	}
+
+	batch->nrows++;
+
+	return true;
+}
+
+/*
+ * Make the executive decision about which protocol to use.
+ */
+static char
+decide_datum_transfer(Form_pg_attribute att, Form_pg_type typclass,
+					  bool allow_internal_basetypes,
+					  bool allow_binary_basetypes,
+					  bool send_type_names)
+{
+	List	   *typids = NIL;
+	bool		embedded_ok;
+
+	/*
+	 * Use the binary protocol, if allowed, for builtin & plain datatypes.
+	 */
+	if (allow_internal_basetypes &&
+		typclass->typtype == 'b' &&
+		att->atttypid < FirstNormalObjectId &&
+		typclass->typelem == InvalidOid)
+	{
+		return 'i';
+	}
+	/*
+	 * Use send/recv, if allowed, if the type is plain or builtin.
+	 *
+	 * Array and composite types embed the oids of their element and column
+	 * types, which only match between nodes for builtin types.
+	 */
+	else if (allow_binary_basetypes &&
+			 OidIsValid(typclass->typreceive) &&
+			 (att->atttypid < FirstNormalObjectId || typclass->typtype != 'c') &&
+			 (att->atttypid < FirstNormalObjectId || typclass->typelem == InvalidOid))
+	{
+		return 'b';
+	}
+
+	/*
+	 * Other types with embedded oids can use send/recv too if the client is
+	 * told the names of the embedded types, see spock_write_attrs().
+	 */
+	if (!allow_binary_basetypes || !send_type_names ||
+		!OidIsValid(typclass->typreceive))
+		return 't';
+
+	embedded_ok = collect_embedded_types(att->atttypid, &typids);
+	list_free(typids);
+
+	return embedded_ok ? 'b' : 't';
+}
+
+/*
+ * Add the types whose oids are embedded in the send/recv format of type
+ * typid to typids: the element type of arrays and the column types of
+ * composites, recursively.
+ *
+ * Returns false if a value of the type can't be sent in binary, because some
+ * of the types lack send or receive functions or have a format we don't
+ * know.
+ */
+static bool
+collect_embedded_types(Oid typid, List **typids)
+{
+	HeapTuple	typtup;
+	Form_pg_type typclass;
+	bool		result = true;
+
+	check_stack_depth();
+
+	typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+	if (!HeapTupleIsValid(typtup))
+		elog(ERROR, "cache lookup failed for type %u", typid);
+	typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+	if (!OidIsValid(typclass->typsend) || !OidIsValid(typclass->typreceive))
+		result = false;
+	else if (typclass->typtype == TYPTYPE_DOMAIN)
+		result = collect_embedded_types(typclass->typbasetype, typids);
+	else if (IsTrueArrayType(typclass))
+	{
+		if (!list_member_oid(*typids, typclass->typelem))
+		{
+			*typids = lappend_oid(*typids, typclass->typelem);
+			result = collect_embedded_types(typclass->typelem, typids);
+		}
+	}
+	else if (typclass->typtype == TYPTYPE_COMPOSITE)
+	{
+		TupleDesc	desc = lookup_rowtype_tupdesc(typid, -1);
+		int			i;
+
+		for (i = 0; i < desc->natts && result; i++)
+		{
+			Form_pg_attribute att = TupleDescAttr(desc, i);
+
+			if (att->attisdropped || list_member_oid(*typids, att->atttypid))
+				continue;
+
+			*typids = lappend_oid(*typids, att->atttypid);
+			result = collect_embedded_types(att->atttypid, typids);
+		}
+
+		ReleaseTupleDesc(desc);
+	}
+	else if (OidIsValid(typclass->typelem) && typid >= FirstNormalObjectId)
+		result = false;
+
+	ReleaseSysCache(typtup);
+
+	return result;
+}
+
+
+/*
+ * Read functions.
+ */
+
+/*
+ * Read transaction BEGIN from the stream.
+ */
+void
+spock_read_begin(StringInfo in, XLogRecPtr *remote_lsn,
+					  TimestampTz *committime, TransactionId *remote_xid)
+{
+	/* read flags */
+	uint8	flags = pq_getmsgbyte(in);
+	Assert(flags == 0);
+	(void) flags; /* unused */
+
+	/* read fields */
+	*remote_lsn = pq_getmsgint64(in);
+	Assert(*remote_lsn != InvalidXLogRecPtr);
+	*committime = pq_getmsgint64(in);
+	*remote_xid = pq_getmsgint(in, 4);
+}
 
 /*
  * Read transaction COMMIT from the stream.
@@ -588,6 +1241,97 @@ spock_read_origin(StringInfo in, XLogRecPtr *origin_lsn)
 	return pnstrdup(pq_getmsgbytes(in, len), len);
 }
 
+/*
+ * Read STREAM START from the stream.
+ */
+TransactionId
+spock_read_stream_start(StringInfo in, bool *first_segment)
+{
+	TransactionId	xid;
+	uint8	flags;
+
+	/* read the flags */
+	flags = pq_getmsgbyte(in);
+	Assert(flags == 0);
+	(void) flags; /* unused */
+
+	/* fixed fields */
+	xid = pq_getmsgint(in, 4);
+	*first_segment = (pq_getmsgbyte(in) == 1);
+
+	return xid;
+}
+
+/*
+ * Read STREAM SUBXACT from the stream.
+ */
+TransactionId
+spock_read_stream_subxact(StringInfo in)
+{
+	uint8	flags;
+
+	/* read the flags */
+	flags = pq_getmsgbyte(in);
+	Assert(flags == 0);
+	(void) flags; /* unused */
+
+	return pq_getmsgint(in, 4);
+}
+
+/*
+ * Read STREAM ABORT from the stream.
+ */
+void
+spock_read_stream_abort(StringInfo in, TransactionId *xid,
+						TransactionId *subxid)
+{
+	uint8	flags;
+
+	/* read the flags */
+	flags = pq_getmsgbyte(in);
+	Assert(flags == 0);
+	(void) flags; /* unused */
+
+	/* fixed fields */
+	*xid = pq_getmsgint(in, 4);
+	*subxid = pq_getmsgint(in, 4);
+}
+
+/*
+ * Read STREAM COMMIT from the stream.
+ *
+ * Returns the origin name of the transaction or NULL if it originated on
+ * the upstream.
+ */
+char *
+spock_read_stream_commit(StringInfo in, TransactionId *xid,
+						 XLogRecPtr *commit_lsn, XLogRecPtr *end_lsn,
+						 TimestampTz *committime, XLogRecPtr *origin_lsn)
+{
+	uint8	flags;
+	uint8	len;
+
+	/* read the flags */
+	flags = pq_getmsgbyte(in);
+
+	/* fixed fields */
+	*xid = pq_getmsgint(in, 4);
+	*commit_lsn = pq_getmsgint64(in);
+	*end_lsn = pq_getmsgint64(in);
+	*committime = pq_getmsgint64(in);
+
+	if ((flags & STREAM_COMMIT_HAS_ORIGIN) == 0)
+	{
+		*origin_lsn = InvalidXLogRecPtr;
+		return NULL;
+	}
+
+	/* origin */
+	*origin_lsn = pq_getmsgint64(in);
+	len = pq_getmsgbyte(in);
+	return pnstrdup(pq_getmsgbytes(in, len), len);
+}
+
 
 /*
  * Read INSERT from stream.
@@ -618,7 +1362,131 @@ spock_read_insert(StringInfo in, LOCKMODE lockmode,
 
 	rel = spock_relation_open(relid, lockmode);
 
-	spock_read_tuple(in, rel, newtup);
+	spock_read_tuple(in, rel, 1, newtup);
+
+	return rel;
+}
+
+/*
+ * Read MULTI INSERT from stream.
+ *
+ * The rows are decoded a column at a time into arrays allocated in the
+ * current memory context.
+ */
+SpockRelation *
+spock_read_multi_insert(StringInfo in, LOCKMODE lockmode,
+						SpockMultiInsertData *rows)
+{
+	uint32		relid;
+	uint8		flags;
+	int			nrows;
+	int			natts;
+	int			tupnatts;
+	int			i;
+	SpockRelation *rel;
+	TupleDesc	desc;
+	instr_time	start;
+
+	/* read the flags */
+	flags = pq_getmsgbyte(in);
+	Assert(flags == 0);
+	(void) flags; /* unused */
+
+	/* read the relation id */
+	relid = pq_getmsgint(in, 4);
+
+	nrows = pq_getmsgint(in, 4);
+	natts = pq_getmsgint(in, 2);
+	if (nrows <= 0 || nrows > MaxAllocSize / sizeof(Datum))
+		elog(ERROR, "invalid number of rows %d in MULTI INSERT", nrows);
+
+	rel = spock_relation_open(relid, lockmode);
+
+	SPOCK_APPLY_TIMING_START(start);
+
+	if (rel->natts != natts)
+		elog(ERROR, "tuple natts mismatch between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->natts, natts);
+
+	desc = RelationGetDescr(rel->rel);
+	tupnatts = rel->tupnatts;
+	Assert(tupnatts == desc->natts);
+
+	rows->nrows = nrows;
+	rows->natts = tupnatts;
+	rows->values = palloc_extended((Size) nrows * tupnatts * sizeof(Datum),
+								   MCXT_ALLOC_HUGE);
+	rows->nulls = palloc_extended((Size) nrows * tupnatts * sizeof(bool),
+								  MCXT_ALLOC_HUGE);
+	rows->changed = palloc_extended((Size) nrows * tupnatts * sizeof(bool),
+									MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	memset(rows->nulls, 1, (Size) nrows * tupnatts * sizeof(bool));
+
+	for (i = 0; i < natts; i++)
+	{
+		int			attid = rel->attmap[i];
+		Form_pg_attribute att = TupleDescAttr(desc, attid);
+		char		kind = pq_getmsgbyte(in);
+		int			width = pq_getmsgint(in, 4);
+		const char *nullmap = pq_getmsgbytes(in, (nrows + 7) / 8);
+		Datum	   *values = rows->values + attid;
+		bool	   *nulls = rows->nulls + attid;
+		bool	   *changed = rows->changed + attid;
+		int			r;
+
+		if (kind != 'i' && kind != 'b' && kind != 't')
+			elog(ERROR, "unknown data representation type '%c'", kind);
+		if (width > 0 && kind != 'i')
+			elog(ERROR, "unexpected fixed width %d of '%c' column",
+				 width, kind);
+
+		/* Fixed-width values by value, the common case for narrow tables. */
+		if (width > 0 && att->attbyval)
+		{
+			if (width != att->attlen)
+				elog(ERROR, "width %d of column \"%s\" doesn't match its local length %d",
+					 width, NameStr(att->attname), att->attlen);
+
+			for (r = 0; r < nrows; r++)
+			{
+				int			off = r * tupnatts;
+
+				changed[off] = true;
+				if (nullmap[r / 8] & (1 << (r % 8)))
+				{
+					values[off] = 0xdeadbeef;
+					continue;
+				}
+
+				nulls[off] = false;
+				values[off] = fetch_att(pq_getmsgbytes(in, width), true,
+										width);
+			}
+			continue;
+		}
+
+		for (r = 0; r < nrows; r++)
+		{
+			int			off = r * tupnatts;
+			const char *data;
+			int			len;
+
+			changed[off] = true;
+			if (nullmap[r / 8] & (1 << (r % 8)))
+			{
+				/* already marked as null */
+				values[off] = 0xdeadbeef;
+				continue;
+			}
+
+			len = width > 0 ? width : pq_getmsgint(in, 4);
+			data = pq_getmsgbytes(in, len);
+
+			nulls[off] = false;
+			values[off] = spock_decode_datum(rel, i, att, kind, data, len);
+		}
+	}
+
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_DECODE, start);
 
 	return rel;
 }
@@ -654,7 +1522,7 @@ spock_read_update(StringInfo in, LOCKMODE lockmode, bool *hasoldtup,
 	/* check for old tuple */
 	if (action == 'K' || action == 'O')
 	{
-		spock_read_tuple(in, rel, oldtup);
+		spock_read_tuple(in, rel, 0, oldtup);
 		*hasoldtup = true;
 		action = pq_getmsgbyte(in);
 	}
@@ -666,7 +1534,7 @@ spock_read_update(StringInfo in, LOCKMODE lockmode, bool *hasoldtup,
 		elog(ERROR, "expected action 'N', got %c",
 			 action);
 
-	spock_read_tuple(in, rel, newtup);
+	spock_read_tuple(in, rel, 1, newtup);
 
 	return rel;
 }
@@ -700,39 +1568,527 @@ spock_read_delete(StringInfo in, LOCKMODE lockmode,
 
 	rel = spock_relation_open(relid, lockmode);
 
-	spock_read_tuple(in, rel, oldtup);
+	spock_read_tuple(in, rel, 0, oldtup);
 
 	return rel;
 }
 
 
+/*
+ * Hash the replica identity columns of a tuple as they appear on the wire.
+ *
+ * Returns false if some of the identity columns can't be hashed, which
+ * currently only happens for unchanged toasted values.
+ */
+static bool
+spock_hash_tuple_key(StringInfo in, SpockRelation *rel, uint32 *hash)
+{
+	int			i;
+	int			natts;
+	char		action;
+	bool		hashable = true;
+
+	action = pq_getmsgbyte(in);
+	if (action != 'T')
+		elog(ERROR, "expected TUPLE, got %c", action);
+
+	natts = pq_getmsgint(in, 2);
+	if (rel->natts != natts)
+		elog(ERROR, "tuple natts mismatch between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->natts, natts);
+
+	*hash = rel->remoteid;
+
+	for (i = 0; i < natts; i++)
+	{
+		char		kind = pq_getmsgbyte(in);
+		const char *data = NULL;
+		int			len = 0;
+
+		switch (kind)
+		{
+			case 'n': /* null */
+				break;
+			case 'u': /* unchanged column */
+				if (rel->attidkey[i])
+					hashable = false;
+				break;
+			case 'i': /* internal binary format */
+			case 'b': /* binary send/recv format */
+			case 't': /* text format */
+				len = pq_getmsgint(in, 4);
+				data = pq_getmsgbytes(in, len);
+				break;
+			default:
+				elog(ERROR, "unknown data representation type '%c'", kind);
+		}
+
+		if (rel->attidkey[i])
+		{
+			*hash = hash_combine(*hash, (uint32) kind);
+			if (data)
+				*hash = hash_combine(*hash,
+									 hash_bytes((const unsigned char *) data,
+												len));
+		}
+	}
+
+	return hashable;
+}
+
+/*
+ * Hash the replica identity of every row of a MULTI INSERT, the same way
+ * spock_hash_tuple_key() hashes the row of an INSERT.
+ */
+static uint32 *
+spock_hash_multi_insert_keys(StringInfo in, SpockRelation *rel, int *nkeys)
+{
+	int			nrows;
+	int			natts;
+	uint32	   *hashes;
+	int			i;
+	int			r;
+
+	nrows = pq_getmsgint(in, 4);
+	natts = pq_getmsgint(in, 2);
+	if (nrows <= 0 || nrows > MaxAllocSize / sizeof(uint32))
+		elog(ERROR, "invalid number of rows %d in MULTI INSERT", nrows);
+	if (rel->natts != natts)
+		elog(ERROR, "tuple natts mismatch between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->natts, natts);
+
+	hashes = palloc(nrows * sizeof(uint32));
+	for (r = 0; r < nrows; r++)
+		hashes[r] = rel->remoteid;
+
+	for (i = 0; i < natts; i++)
+	{
+		char		kind = pq_getmsgbyte(in);
+		int			width = pq_getmsgint(in, 4);
+		const char *nullmap = pq_getmsgbytes(in, (nrows + 7) / 8);
+
+		for (r = 0; r < nrows; r++)
+		{
+			const char *data;
+			int			len;
+
+			if (nullmap[r / 8] & (1 << (r % 8)))
+			{
+				if (rel->attidkey[i])
+					hashes[r] = hash_combine(hashes[r], (uint32) 'n');
+				continue;
+			}
+
+			len = width > 0 ? width : pq_getmsgint(in, 4);
+			data = pq_getmsgbytes(in, len);
+
+			if (rel->attidkey[i])
+			{
+				hashes[r] = hash_combine(hashes[r], (uint32) kind);
+				hashes[r] = hash_combine(hashes[r],
+										 hash_bytes((const unsigned char *) data,
+													len));
+			}
+		}
+	}
+
+	*nkeys = nrows;
+	return hashes;
+}
+
+/*
+ * Read the dependency keys of INSERT, MULTI INSERT, UPDATE or DELETE without
+ * decoding the tuple data.
+ *
+ * This is used by the parallel apply leader which only needs to know which
+ * rows the change touches. The keys are returned in a palloc'd array: the
+ * key of every row of a MULTI INSERT, up to two keys otherwise (the old and
+ * the new replica identity of an UPDATE). Returns false when the change can
+ * only be tracked at the relation level, i.e. the relation has no replica
+ * identity columns or some of them were not sent.
+ */
+bool
+spock_read_change_keys(StringInfo in, char action, SpockRelation **rel,
+					   uint32 **keys, int *nkeys)
+{
+	uint32		relid;
+	char		tupaction;
+	bool		haskey = false;
+	int			i;
+
+	/* read the flags */
+	(void) pq_getmsgbyte(in);
+
+	/* read the relation id */
+	relid = pq_getmsgint(in, 4);
+	*rel = spock_relation_lookup(relid);
+	*nkeys = 0;
+
+	for (i = 0; i < (*rel)->natts; i++)
+		haskey |= (*rel)->attidkey[i];
+
+	if (action == 'M')
+	{
+		*keys = spock_hash_multi_insert_keys(in, *rel, nkeys);
+		return haskey;
+	}
+
+	*keys = palloc(2 * sizeof(uint32));
+
+	tupaction = pq_getmsgbyte(in);
+	if (action == 'U' && (tupaction == 'K' || tupaction == 'O'))
+	{
+		if (!spock_hash_tuple_key(in, *rel, &(*keys)[(*nkeys)++]))
+			haskey = false;
+		tupaction = pq_getmsgbyte(in);
+	}
+
+	if (tupaction != 'N' && tupaction != 'K' && tupaction != 'O')
+		elog(ERROR, "expected action 'N', 'O' or 'K', got %c", tupaction);
+
+	if (!spock_hash_tuple_key(in, *rel, &(*keys)[*nkeys]))
+		haskey = false;
+
+	/* An UPDATE that doesn't change the identity has only one key. */
+	if (*nkeys == 0 || (*keys)[0] != (*keys)[1])
+		(*nkeys)++;
+
+	return haskey;
+}
+
+
+/*
+ * Find the local types named like the types embedded in the values of the
+ * remote column remote_attno.
+ */
+static void
+spock_map_remote_types(SpockRelation *rel, int remote_attno,
+					   SpockColumnDecode *dec)
+{
+	List	   *types = rel->atttypes[remote_attno];
+	ListCell   *lc;
+
+	dec->ntypemap = 0;
+	dec->typemap = MemoryContextAlloc(CacheMemoryContext,
+									  2 * list_length(types) * sizeof(Oid));
+
+	foreach (lc, types)
+	{
+		SpockRemoteType *remotetype = lfirst(lc);
+		Oid			nspoid;
+		Oid			localid = InvalidOid;
+
+		nspoid = get_namespace_oid(remotetype->nspname, true);
+		if (OidIsValid(nspoid))
+			localid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+									  CStringGetDatum(remotetype->typname),
+									  ObjectIdGetDatum(nspoid));
+		if (!OidIsValid(localid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("type \"%s.%s\" used by column \"%s\" of remote relation \"%s.%s\" does not exist",
+							remotetype->nspname, remotetype->typname,
+							rel->attnames[remote_attno], rel->nspname,
+							rel->relname)));
+
+		dec->typemap[2 * dec->ntypemap] = remotetype->remoteid;
+		dec->typemap[2 * dec->ntypemap + 1] = localid;
+		dec->ntypemap++;
+	}
+}
+
+/*
+ * If values of type typid embed type oids in their send/recv format, return
+ * the type cache entry of the array or composite type, of the base type for
+ * domains. Return NULL otherwise.
+ */
+static TypeCacheEntry *
+embedding_type(Oid typid)
+{
+	TypeCacheEntry *typentry;
+
+	typentry = lookup_type_cache(typid, TYPECACHE_DOMAIN_BASE_INFO);
+	if (typentry->typtype == TYPTYPE_DOMAIN)
+		typentry = lookup_type_cache(typentry->domainBaseType, 0);
+
+	if (typentry->typtype == TYPTYPE_COMPOSITE ||
+		(OidIsValid(typentry->typelem) &&
+		 typentry->typsubscript == F_ARRAY_SUBSCRIPT_HANDLER))
+		return typentry;
+
+	return NULL;
+}
+
+static uint32
+patch_getint(char *data, int len, int *pos)
+{
+	uint32		n;
+
+	if (len - *pos < 4)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("incorrect binary data format")));
+
+	memcpy(&n, data + *pos, 4);
+	*pos += 4;
+
+	return pg_ntoh32(n);
+}
+
+/*
+ * Replace the embedded type oid at *pos by the local one, return the latter.
+ */
+static Oid
+patch_type_oid(SpockColumnDecode *dec, char *data, int len, int *pos)
+{
+	Oid			typid = patch_getint(data, len, pos);
+	int			i;
+
+	for (i = 0; i < dec->ntypemap; i++)
+	{
+		if (dec->typemap[2 * i] == typid)
+		{
+			uint32		n;
+
+			typid = dec->typemap[2 * i + 1];
+			n = pg_hton32(typid);
+			memcpy(data + *pos - 4, &n, 4);
+			break;
+		}
+	}
+
+	return typid;
+}
+
+/*
+ * Skip the length word of an element or column value at *pos, return the
+ * length of the value, -1 for null.
+ */
+static int32
+patch_getlen(char *data, int len, int *pos)
+{
+	int32		vallen = (int32) patch_getint(data, len, pos);
+
+	if (vallen < -1 || vallen > len - *pos)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("incorrect binary data format")));
+
+	return vallen;
+}
+
+/*
+ * Replace the remote type oids embedded in a send/recv format value of an
+ * array or composite type by the local ones, in place.
+ *
+ * The format is walked by the local types, which the receive function checks
+ * the embedded oids against.
+ */
+static void
+spock_patch_type_oids(SpockColumnDecode *dec, TypeCacheEntry *typentry,
+					  char *data, int len)
+{
+	int			pos = 0;
+
+	check_stack_depth();
+
+	if (typentry == NULL)
+		return;
+
+	if (typentry->typtype == TYPTYPE_COMPOSITE)
+	{
+		int32		ncols = (int32) patch_getint(data, len, &pos);
+
+		/* see record_send() */
+		while (ncols-- > 0)
+		{
+			Oid			coltypid = patch_type_oid(dec, data, len, &pos);
+			int32		collen = patch_getlen(data, len, &pos);
+
+			if (collen < 0)
+				continue;
+
+			spock_patch_type_oids(dec, embedding_type(coltypid),
+								  data + pos, collen);
+			pos += collen;
+		}
+	}
+	else
+	{
+		int32		ndim;
+		Oid			elemtypid;
+		TypeCacheEntry *elementry;
+		int64		nitems = 1;
+		int			i;
+
+		/* see array_send() */
+		ndim = (int32) patch_getint(data, len, &pos);
+		(void) patch_getint(data, len, &pos);	/* flags */
+		elemtypid = patch_type_oid(dec, data, len, &pos);
+
+		if (ndim < 0 || ndim > MAXDIM)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("incorrect binary data format")));
+		if (ndim == 0)
+			return;
+
+		for (i = 0; i < ndim; i++)
+		{
+			int32		dim = (int32) patch_getint(data, len, &pos);
+
+			(void) patch_getint(data, len, &pos);	/* lower bound */
+			if (dim < 0 || dim > MaxArraySize)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("incorrect binary data format")));
+			nitems *= dim;
+			if (nitems > MaxArraySize)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("incorrect binary data format")));
+		}
+
+		/* Elements of base types have nothing to patch. */
+		elementry = embedding_type(elemtypid);
+		if (elementry == NULL)
+			return;
+
+		while (nitems-- > 0)
+		{
+			int32		itemlen = patch_getlen(data, len, &pos);
+
+			if (itemlen < 0)
+				continue;
+
+			spock_patch_type_oids(dec, elementry, data + pos, itemlen);
+			pos += itemlen;
+		}
+	}
+}
+
+/*
+ * Convert a value of the remote column remote_attno, as sent in the given
+ * transfer format, to a datum of the local column att.
+ *
+ * Values in internal format point into the message.
+ */
+static Datum
+spock_decode_datum(SpockRelation *rel, int remote_attno,
+				   Form_pg_attribute att, char kind, const char *data,
+				   int len)
+{
+	SpockColumnDecode *dec = &rel->coldecode[remote_attno];
+
+	switch (kind)
+	{
+		case 'i': /* internal binary format */
+			if (att->attbyval)
+				return fetch_att(data, true, len);
+			return PointerGetDatum(data);
+
+		case 'b': /* binary send/recv format */
+			{
+				StringInfoData buf;
+				Datum		value;
+
+				if (!dec->have_receive)
+				{
+					Oid typreceive;
+
+					getTypeBinaryInputInfo(att->atttypid,
+										   &typreceive, &dec->typioparam);
+					fmgr_info_cxt(typreceive, &dec->receive,
+								  CacheMemoryContext);
+					dec->typmod = att->atttypmod;
+					if (rel->atttypes != NULL &&
+						rel->atttypes[remote_attno] != NIL)
+						spock_map_remote_types(rel, remote_attno, dec);
+					dec->have_receive = true;
+				}
+
+				/* create StringInfo pointing into the bigger buffer */
+				buf.data = (char *) data;
+				if (dec->ntypemap > 0)
+				{
+					/* The message may be read again, patch a copy. */
+					buf.data = palloc(len + 1);
+					memcpy(buf.data, data, len);
+					buf.data[len] = '\0';
+					spock_patch_type_oids(dec, embedding_type(att->atttypid),
+										  buf.data, len);
+				}
+				buf.len = len;
+				buf.maxlen = len;
+				buf.cursor = 0;
+				value = ReceiveFunctionCall(&dec->receive, &buf,
+											dec->typioparam, dec->typmod);
+
+				if (buf.len != buf.cursor)
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 errmsg("incorrect binary data format")));
+				return value;
+			}
+
+		case 't': /* text format */
+			if (!dec->have_input)
+			{
+				Oid typinput;
+
+				getTypeInputInfo(att->atttypid, &typinput,
+								 &dec->typioparam);
+				fmgr_info_cxt(typinput, &dec->input,
+							  CacheMemoryContext);
+				dec->typmod = att->atttypmod;
+				dec->have_input = true;
+			}
+
+			return InputFunctionCall(&dec->input, (char *) data,
+									 dec->typioparam, dec->typmod);
+
+		default:
+			elog(ERROR, "unknown data representation type '%c'", kind);
+	}
+
+	return (Datum) 0;			/* keep compiler quiet */
+}
+
 /*
  * Read tuple in remote format from stream.
  *
- * The returned tuple is converted to the local relation tuple format.
+ * The returned tuple is converted to the local relation tuple format and
+ * stored in the relation's buffer 'tupbuf' (0 for old, 1 for new tuple).
  */
 static void
-spock_read_tuple(StringInfo in, SpockRelation *rel,
+spock_read_tuple(StringInfo in, SpockRelation *rel, int tupbuf,
 					  SpockTupleData *tuple)
 {
 	int			i;
 	int			natts;
 	char		action;
 	TupleDesc	desc;
+	instr_time	start;
+
+	SPOCK_APPLY_TIMING_START(start);
 
 	action = pq_getmsgbyte(in);
 	if (action != 'T')
 		elog(ERROR, "expected TUPLE, got %c", action);
 
-	memset(tuple->nulls, 1, sizeof(tuple->nulls));
-	memset(tuple->changed, 0, sizeof(tuple->changed));
+	desc = RelationGetDescr(rel->rel);
+	Assert(rel->tupnatts == desc->natts);
+
+	tuple->natts = rel->tupnatts;
+	tuple->values = rel->tupvalues + tupbuf * rel->tupnatts;
+	tuple->nulls = rel->tupnulls + tupbuf * rel->tupnatts;
+	tuple->changed = rel->tupchanged + tupbuf * rel->tupnatts;
+
+	memset(tuple->nulls, 1, tuple->natts * sizeof(bool));
+	memset(tuple->changed, 0, tuple->natts * sizeof(bool));
 
 	natts = pq_getmsgint(in, 2);
 	if (rel->natts != natts)
 		elog(ERROR, "tuple natts mismatch between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->natts, natts);
 
-	desc = RelationGetDescr(rel->rel);
-
 	/* Read the data */
 	for (i = 0; i < natts; i++)
 	{
@@ -753,67 +2109,22 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 				tuple->values[attid] = 0xfbadbeef; /* make bad usage more obvious */
 				break;
 			case 'i': /* internal binary format */
+			case 'b': /* binary send/recv format */
+			case 't': /* text format */
 				tuple->nulls[attid] = false;
 				tuple->changed[attid] = true;
 
 				len = pq_getmsgint(in, 4); /* read length */
 				data = pq_getmsgbytes(in, len);
-
-				/* and data */
-				if (att->attbyval)
-					tuple->values[attid] = fetch_att(data, true, len);
-				else
-					tuple->values[attid] = PointerGetDatum(data);
-				break;
-			case 'b': /* binary send/recv format */
-				{
-					Oid typreceive;
-					Oid typioparam;
-					StringInfoData buf;
-
-					tuple->nulls[attid] = false;
-					tuple->changed[attid] = true;
-
-					len = pq_getmsgint(in, 4); /* read length */
-
-					getTypeBinaryInputInfo(att->atttypid,
-										   &typreceive, &typioparam);
-
-					/* create StringInfo pointing into the bigger buffer */
-					initStringInfo(&buf);
-					/* and data */
-					buf.data = (char *) pq_getmsgbytes(in, len);
-					buf.len = len;
-					tuple->values[attid] = OidReceiveFunctionCall(
-						typreceive, &buf, typioparam, att->atttypmod);
-
-					if (buf.len != buf.cursor)
-						ereport(ERROR,
-								(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-								 errmsg("incorrect binary data format")));
-					break;
-				}
-			case 't': /* text format */
-				{
-					Oid typinput;
-					Oid typioparam;
-
-					tuple->nulls[attid] = false;
-					tuple->changed[attid] = true;
-
-					len = pq_getmsgint(in, 4); /* read length */
-
-					getTypeInputInfo(att->atttypid, &typinput, &typioparam);
-					/* and data */
-					data = (char *) pq_getmsgbytes(in, len);
-					tuple->values[attid] = OidInputFunctionCall(
-						typinput, (char *) data, typioparam, att->atttypmod);
-				}
+				tuple->values[attid] = spock_decode_datum(rel, i, att, kind,
+														  data, len);
 				break;
 			default:
 				elog(ERROR, "unknown data representation type '%c'", kind);
 		}
 	}
+
+	SPOCK_APPLY_TIMING_END(SPOCK_APPLY_PHASE_DECODE, start);
 }
 
 /*
@@ -830,6 +2141,8 @@ spock_read_rel(StringInfo in)
 	char	   *relname;
 	int			natts;
 	char	  **attrnames;
+	bool	   *attidkey;
+	List	  **atttypes;
 
 	/* read the flags */
 	flags = pq_getmsgbyte(in);
@@ -846,24 +2159,26 @@ spock_read_rel(StringInfo in)
 	relname = (char *) pq_getmsgbytes(in, len);
 
 	/* Get attribute description */
-	spock_read_attrs(in, &attrnames, &natts);
+	spock_read_attrs(in, &attrnames, &attidkey, &atttypes, &natts);
 
-	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames);
+	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames,
+								attidkey, atttypes);
 
 	return relid;
 }
 
 /*
  * Read relation attributes from the outputstream.
- *
- * TODO handle flags.
  */
 static void
-spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
+spock_read_attrs(StringInfo in, char ***attrnames, bool **attidkey,
+				 List ***atttypes, int *nattrnames)
 {
 	int			i;
 	uint16		nattrs;
 	char	  **attrs;
+	bool	   *idkey;
+	List	  **types = NULL;
 	char		blocktype;
 
 	blocktype = pq_getmsgbyte(in);
@@ -872,17 +2187,20 @@ spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
 
 	nattrs = pq_getmsgint(in, 2);
 	attrs = palloc(nattrs * sizeof(char *));
+	idkey = palloc(nattrs * sizeof(bool));
 
 	/* read the attributes */
 	for (i = 0; i < nattrs; i++)
 	{
 		uint16			len;
+		uint8			flags;
 
 		blocktype = pq_getmsgbyte(in);		/* column definition follows */
 		if (blocktype != 'C')
 			elog(ERROR, "expected COLUMN, got %c", blocktype);
-		/* read flags (we ignore them so far) */
-		(void) pq_getmsgbyte(in);
+
+		flags = pq_getmsgbyte(in);
+		idkey[i] = (flags & IS_REPLICA_IDENTITY) != 0;
 
 		blocktype = pq_getmsgbyte(in);		/* column name block follows */
 		if (blocktype != 'N')
@@ -892,8 +2210,36 @@ spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
 		len = pq_getmsgint(in, 2);
 		/* the string is NULL terminated */
 		attrs[i] = (char *) pq_getmsgbytes(in, len);
+
+		/* embedded types, if any */
+		if (in->cursor < in->len && in->data[in->cursor] == 'T')
+		{
+			int			blockend;
+
+			(void) pq_getmsgbyte(in);
+			len = pq_getmsgint(in, 2);
+			blockend = in->cursor + len;
+
+			if (types == NULL)
+				types = palloc0(nattrs * sizeof(List *));
+
+			while (in->cursor < blockend)
+			{
+				SpockRemoteType *remotetype = palloc(sizeof(SpockRemoteType));
+
+				remotetype->remoteid = pq_getmsgint(in, 4);
+				len = pq_getmsgbyte(in);
+				remotetype->nspname = (char *) pq_getmsgbytes(in, len);
+				len = pq_getmsgbyte(in);
+				remotetype->typname = (char *) pq_getmsgbytes(in, len);
+
+				types[i] = lappend(types[i], remotetype);
+			}
+		}
 	}
 
 	*attrnames = attrs;
+	*attidkey = idkey;
+	*atttypes = types;
 	*nattrnames = nattrs;
 }
@@ -20,13 +20,74 @@
 #include "spock_output_proto.h"
 #include "spock_relcache.h"
 
+/*
+ * Tuple read from the stream. The arrays are indexed by the attribute number
+ * of the local relation and point into the buffers of the SpockRelation, so
+ * they are only valid until the next tuple is read for the relation.
+ */
 typedef struct SpockTupleData
 {
-	Datum	values[MaxTupleAttributeNumber];
-	bool	nulls[MaxTupleAttributeNumber];
-	bool	changed[MaxTupleAttributeNumber];
+	int		natts;
+	Datum  *values;
+	bool   *nulls;
+	bool   *changed;
 } SpockTupleData;
 
+/*
+ * Rows of a MULTI INSERT message. The arrays hold nrows tuples of natts
+ * entries each, laid out like SpockTupleData.
+ */
+typedef struct SpockMultiInsertData
+{
+	int		nrows;
+	int		natts;
+	Datum  *values;
+	bool   *nulls;
+	bool   *changed;
+} SpockMultiInsertData;
+
+typedef struct SpockTupleEncoder SpockTupleEncoder;
+
+/*
+ * Consecutive inserts into one relation collected column by column, to be
+ * sent in a single MULTI INSERT message, see spock_insert_batch_add().
+ */
+typedef struct SpockInsertBatch
+{
+	MemoryContext	mcxt;
+	Oid				relid;
+	uint32			nrows;
+	Size			size;		/* Bytes of column data collected */
+	uint16			ncols;
+	int				maxcols;	/* Allocated entries of cols */
+	struct SpockInsertBatchColumn *cols;
+} SpockInsertBatch;
+
+/* When the output plugin sends the inserts collected in a batch. */
+#define SPOCK_INSERT_BATCH_MAX_ROWS		1000
+#define SPOCK_INSERT_BATCH_MAX_SIZE		(256 * 1024)
+
+/*
+ * Column values of at least SPOCK_LARGE_VALUE_SIZE bytes are sent straight
+ * from where they are, in pieces of a partial message ('P' frames) of about
+ * SPOCK_PARTIAL_FRAME_SIZE, when the client supports it. The last piece of
+ * a message has the SPOCK_PARTIAL_LAST flag.
+ */
+#define SPOCK_LARGE_VALUE_SIZE			(1024 * 1024)
+#define SPOCK_PARTIAL_FRAME_SIZE		(256 * 1024)
+#define SPOCK_PARTIAL_LAST				0x01
+
+extern SpockTupleEncoder *spock_tuple_encoder_create(SpockOutputData *data,
+													 Relation rel,
+													 Bitmapset *att_list,
+													 MemoryContext mcxt);
+extern void spock_tuple_encoder_free(SpockTupleEncoder *enc);
+
+extern SpockInsertBatch *spock_insert_batch_create(MemoryContext mcxt);
+extern bool spock_insert_batch_add(SpockInsertBatch *batch,
+								   SpockOutputData *data, Relation rel,
+								   HeapTuple tuple);
+
 extern void spock_write_rel(StringInfo out, SpockOutputData *data,
 		Relation rel, Bitmapset *att_list);
 extern void spock_write_begin(StringInfo out, SpockOutputData *data,
@@ -37,11 +98,22 @@ extern void spock_write_origin(StringInfo out, const char *origin,
 		XLogRecPtr origin_lsn);
 extern void spock_write_insert(StringInfo out, SpockOutputData *data,
 		Relation rel, HeapTuple newtuple, Bitmapset *att_list);
+extern void spock_write_multi_insert(StringInfo out, SpockOutputData *data,
+		SpockInsertBatch *batch);
 extern void spock_write_update(StringInfo out, SpockOutputData *data,
 		Relation rel, HeapTuple oldtuple, HeapTuple newtuple,
 		Bitmapset *att_list);
 extern void spock_write_delete(StringInfo out, SpockOutputData *data,
 		Relation rel, HeapTuple oldtuple, Bitmapset *att_list);
+extern void spock_write_stream_start(StringInfo out, SpockOutputData *data,
+		TransactionId xid, bool first_segment);
+extern void spock_write_stream_stop(StringInfo out, SpockOutputData *data);
+extern void spock_write_stream_subxact(StringInfo out, SpockOutputData *data,
+		TransactionId subxid);
+extern void spock_write_stream_abort(StringInfo out, SpockOutputData *data,
+		TransactionId xid, TransactionId subxid);
+extern void spock_write_stream_commit(StringInfo out, SpockOutputData *data,
+		ReorderBufferTXN *txn, XLogRecPtr commit_lsn, const char *origin);
 extern void write_startup_message(StringInfo out, List *msg);
 
 extern void spock_read_begin(StringInfo in, XLogRecPtr *remote_lsn,
@@ -49,11 +121,24 @@ extern void spock_read_begin(StringInfo in, XLogRecPtr *remote_lsn,
 extern void spock_read_commit(StringInfo in, XLogRecPtr *commit_lsn,
 					   XLogRecPtr *end_lsn, TimestampTz *committime);
 extern char *spock_read_origin(StringInfo in, XLogRecPtr *origin_lsn);
+extern TransactionId spock_read_stream_start(StringInfo in,
+					  bool *first_segment);
+extern TransactionId spock_read_stream_subxact(StringInfo in);
+extern void spock_read_stream_abort(StringInfo in, TransactionId *xid,
+					  TransactionId *subxid);
+extern char *spock_read_stream_commit(StringInfo in, TransactionId *xid,
+					  XLogRecPtr *commit_lsn, XLogRecPtr *end_lsn,
+					  TimestampTz *committime, XLogRecPtr *origin_lsn);
 extern uint32 spock_read_rel(StringInfo in);
 extern SpockRelation *spock_read_insert(StringInfo in, LOCKMODE lockmode,
 					   SpockTupleData *newtup);
+extern SpockRelation *spock_read_multi_insert(StringInfo in, LOCKMODE lockmode,
+					   SpockMultiInsertData *rows);
 extern SpockRelation *spock_read_update(StringInfo in, LOCKMODE lockmode, bool *hasoldtup,
 					   SpockTupleData *oldtup, SpockTupleData *newtup);
 extern SpockRelation *spock_read_delete(StringInfo in, LOCKMODE lockmode,
 												 SpockTupleData *oldtup);
+extern bool spock_read_change_keys(StringInfo in, char action,
+								   SpockRelation **rel, uint32 **keys,
+								   int *nkeys);
 #endif /* SPOCK_PROTO_NATIVE_H */
@@ -34,6 +34,42 @@ static HTAB *SpockRelationHash = NULL;
 static void spock_relcache_init(void);
 static int tupdesc_get_att_by_name(TupleDesc desc, const char *attname);
 
+static void
+relcache_free_scankeys(SpockRelation *entry)
+{
+	list_free_deep(entry->idxscankeys);
+	entry->idxscankeys = NIL;
+}
+
+static void
+relcache_free_tuple_info(SpockRelation *entry)
+{
+	if (entry->tupvalues != NULL)
+	{
+		pfree(entry->tupvalues);
+		pfree(entry->tupnulls);
+		pfree(entry->tupchanged);
+	}
+
+	entry->tupnatts = 0;
+	entry->tupvalues = NULL;
+	entry->tupnulls = NULL;
+	entry->tupchanged = NULL;
+
+	if (entry->coldecode != NULL)
+	{
+		int		i;
+
+		for (i = 0; i < entry->natts; i++)
+		{
+			if (entry->coldecode[i].typemap != NULL)
+				pfree(entry->coldecode[i].typemap);
+		}
+		pfree(entry->coldecode);
+	}
+	entry->coldecode = NULL;
+}
+
 static void
 relcache_free_entry(SpockRelation *entry)
 {
@@ -48,16 +84,62 @@ relcache_free_entry(SpockRelation *entry)
 			pfree(entry->attnames[i]);
 
 		pfree(entry->attnames);
+		pfree(entry->attidkey);
+	}
+
+	if (entry->atttypes != NULL)
+	{
+		int	i;
+
+		for (i = 0; i < entry->natts; i++)
+		{
+			ListCell   *lc;
+
+			foreach (lc, entry->atttypes[i])
+			{
+				SpockRemoteType *remotetype = lfirst(lc);
+
+				pfree(remotetype->nspname);
+				pfree(remotetype->typname);
+			}
+			list_free_deep(entry->atttypes[i]);
+		}
+		pfree(entry->atttypes);
+		entry->atttypes = NULL;
 	}
 
 	if (entry->attmap)
 		pfree(entry->attmap);
 
+	relcache_free_scankeys(entry);
+	relcache_free_tuple_info(entry);
+
 	entry->natts = 0;
 	entry->reloid = InvalidOid;
 	entry->rel = NULL;
 }
 
+/*
+ * Find the cache entry for remote relation without opening it.
+ */
+SpockRelation *
+spock_relation_lookup(uint32 remoteid)
+{
+	SpockRelation *entry;
+	bool		found;
+
+	if (SpockRelationHash == NULL)
+		spock_relcache_init();
+
+	entry = hash_search(SpockRelationHash, (void *) &remoteid,
+						HASH_FIND, &found);
+
+	if (!found)
+		elog(ERROR, "cache lookup failed for remote relation %u",
+			 remoteid);
+
+	return entry;
+}
 
 SpockRelation *
 spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
@@ -93,6 +175,23 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 
 		entry->reloid = RelationGetRelid(entry->rel);
 
+		/* The indexes and the number of columns may have changed too. */
+		relcache_free_scankeys(entry);
+		relcache_free_tuple_info(entry);
+
+		/* One set of arrays for the old tuple and one for the new one. */
+		entry->tupvalues = MemoryContextAlloc(CacheMemoryContext,
+											  2 * desc->natts * sizeof(Datum));
+		entry->tupnulls = MemoryContextAlloc(CacheMemoryContext,
+											 2 * desc->natts * sizeof(bool));
+		entry->tupchanged = MemoryContextAlloc(CacheMemoryContext,
+											   2 * desc->natts * sizeof(bool));
+		entry->tupnatts = desc->natts;
+
+		/* Column decoding is set up as the columns arrive. */
+		entry->coldecode = MemoryContextAllocZero(CacheMemoryContext,
+												  Max(entry->natts, 1) * sizeof(SpockColumnDecode));
+
 		/* Cache trigger info. */
 		entry->hasTriggers = false;
 		if (entry->rel->trigdesc != NULL)
@@ -123,7 +222,8 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 
 void
 spock_relation_cache_update(uint32 remoteid, char *schemaname,
-								 char *relname, int natts, char **attnames)
+								 char *relname, int natts, char **attnames,
+								 bool *attidkey, List **atttypes)
 {
 	MemoryContext		oldcontext;
 	SpockRelation  *entry;
@@ -148,14 +248,44 @@ spock_relation_cache_update(uint32 remoteid, char *schemaname,
 	entry->relname = pstrdup(relname);
 	entry->natts = natts;
 	entry->attnames = palloc(natts * sizeof(char *));
+	entry->attidkey = palloc0(natts * sizeof(bool));
 	for (i = 0; i < natts; i++)
+	{
 		entry->attnames[i] = pstrdup(attnames[i]);
+		if (attidkey)
+			entry->attidkey[i] = attidkey[i];
+	}
+	entry->atttypes = NULL;
+	if (atttypes)
+	{
+		entry->atttypes = palloc0(natts * sizeof(List *));
+		for (i = 0; i < natts; i++)
+		{
+			ListCell   *lc;
+
+			foreach (lc, atttypes[i])
+			{
+				SpockRemoteType *src = lfirst(lc);
+				SpockRemoteType *remotetype = palloc(sizeof(SpockRemoteType));
+
+				remotetype->remoteid = src->remoteid;
+				remotetype->nspname = pstrdup(src->nspname);
+				remotetype->typname = pstrdup(src->typname);
+				entry->atttypes[i] = lappend(entry->atttypes[i], remotetype);
+			}
+		}
+	}
 	entry->attmap = palloc(natts * sizeof(int));
 	MemoryContextSwitchTo(oldcontext);
 
 	/* XXX Should we validate the relation against local schema here? */
 
 	entry->reloid = InvalidOid;
+	entry->parallel_mode = SPOCK_PARALLEL_UNKNOWN;
+	entry->idxscankeys = NIL;
+	entry->tupnatts = 0;
+	entry->tupvalues = NULL;
+	entry->coldecode = NULL;
 }
 
 void
@@ -184,14 +314,21 @@ spock_relation_cache_updater(SpockRemoteRel *remoterel)
 	entry->relname = pstrdup(remoterel->relname);
 	entry->natts = remoterel->natts;
 	entry->attnames = palloc(remoterel->natts * sizeof(char *));
+	entry->attidkey = palloc0(remoterel->natts * sizeof(bool));
 	for (i = 0; i < remoterel->natts; i++)
 		entry->attnames[i] = pstrdup(remoterel->attnames[i]);
+	entry->atttypes = NULL;
 	entry->attmap = palloc(remoterel->natts * sizeof(int));
 	MemoryContextSwitchTo(oldcontext);
 
 	/* XXX Should we validate the relation against local schema here? */
 
 	entry->reloid = InvalidOid;
+	entry->parallel_mode = SPOCK_PARALLEL_UNKNOWN;
+	entry->idxscankeys = NIL;
+	entry->tupnatts = 0;
+	entry->tupvalues = NULL;
+	entry->coldecode = NULL;
 }
 
 void
@@ -12,6 +12,10 @@
 #ifndef SPOCK_RELCACHE_H
 #define SPOCK_RELCACHE_H
 
+#include "fmgr.h"
+
+#include "nodes/pg_list.h"
+
 #include "storage/lock.h"
 
 typedef struct SpockRemoteRel
@@ -26,6 +30,64 @@ typedef struct SpockRemoteRel
 	bool		hasRowFilter;
 } SpockRemoteRel;
 
+/*
+ * How the parallel apply leader tracks dependencies of changes to a relation,
+ * see spock_apply_parallel.c.
+ */
+typedef enum SpockRelParallelMode
+{
+	SPOCK_PARALLEL_UNKNOWN = 0,	/* Not computed yet. */
+	SPOCK_PARALLEL_KEY,			/* Changes depend on replica identity value. */
+	SPOCK_PARALLEL_RELATION,	/* Changes depend on the whole relation. */
+	SPOCK_PARALLEL_BARRIER		/* Changes depend on everything before them. */
+} SpockRelParallelMode;
+
+/*
+ * Scan key template for looking up tuples in one of the relation's indexes,
+ * only the datums have to be filled in.
+ */
+typedef struct SpockIndexScanKey
+{
+	Oid			indexoid;
+	int			nkeys;
+	AttrNumber	attnums[INDEX_MAX_KEYS];	/* Heap attribute of each key. */
+	Oid			collations[INDEX_MAX_KEYS];
+	FmgrInfo	eqfuncs[INDEX_MAX_KEYS];	/* Equality operator procedures. */
+} SpockIndexScanKey;
+
+/*
+ * A non-builtin type whose oid is embedded in the send/recv format of the
+ * values of a remote column, as element type of an array or column type of
+ * a composite.
+ */
+typedef struct SpockRemoteType
+{
+	Oid			remoteid;
+	char	   *nspname;
+	char	   *typname;
+} SpockRemoteType;
+
+/*
+ * How to decode a column received in text or send/recv format, the function
+ * of each format is looked up the first time it's needed.
+ */
+typedef struct SpockColumnDecode
+{
+	Oid			typioparam;
+	int32		typmod;
+	bool		have_input;
+	bool		have_receive;
+	FmgrInfo	input;
+	FmgrInfo	receive;
+
+	/*
+	 * Remote and local oid of each embedded type, pairs in one array, to
+	 * patch the send/recv format values with.
+	 */
+	int			ntypemap;
+	Oid		   *typemap;
+} SpockColumnDecode;
+
 typedef struct SpockRelation
 {
 	/* Info coming from the remote side. */
@@ -34,6 +96,9 @@ typedef struct SpockRelation
 	char	   *relname;
 	int			natts;
 	char	  **attnames;
+	bool	   *attidkey;		/* Is the column part of replica identity? */
+	List	  **atttypes;		/* SpockRemoteTypes embedded in the values of
+								 * each column, NULL if there are none */
 
 	/* Mapping to local relation, filled as needed. */
 	Oid			reloid;
@@ -42,13 +107,26 @@ typedef struct SpockRelation
 
 	/* Additional cache, only valid as long as relation mapping is. */
 	bool		hasTriggers;
+	SpockRelParallelMode parallel_mode;
+	List	   *idxscankeys;	/* List of SpockIndexScanKey */
+
+	/* Buffers of the old and the new tuple read from the stream. */
+	int			tupnatts;
+	Datum	   *tupvalues;
+	bool	   *tupnulls;
+	bool	   *tupchanged;
+
+	/* Decoding of the remote columns, indexed like attnames. */
+	SpockColumnDecode *coldecode;
 } SpockRelation;
 
 extern void spock_relation_cache_update(uint32 remoteid,
 											 char *schemaname, char *relname,
-											 int natts, char **attnames);
+											 int natts, char **attnames,
+											 bool *attidkey, List **atttypes);
 extern void spock_relation_cache_updater(SpockRemoteRel *remoterel);
 
+extern SpockRelation *spock_relation_lookup(uint32 remoteid);
 extern SpockRelation *spock_relation_open(uint32 remoteid,
 												   LOCKMODE lockmode);
 extern void spock_relation_close(SpockRelation * rel,
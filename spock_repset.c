@@ -28,6 +28,7 @@
 #include "catalog/objectaddress.h"
 #include "catalog/pg_type.h"
 
+#include "executor/executor.h"
 #include "executor/spi.h"
 
 #include "nodes/makefuncs.h"
@@ -404,6 +405,16 @@ get_table_replication_info(Oid nodeid, Relation table,
 	if (found && entry->isvalid)
 		return entry;
 
+	/*
+	 * The executor state may still be in use when the invalidation arrives
+	 * so it's only freed here.
+	 */
+	if (found && entry->rf_estate != NULL)
+		FreeExecutorState(entry->rf_estate);
+	entry->rf_estate = NULL;
+	entry->rf_econtext = NULL;
+	entry->rf_exprstate = NULL;
+
 	/* Fill the entry */
 	entry->reloid = reloid;
 	entry->replicate_insert = false;
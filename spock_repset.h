@@ -12,6 +12,8 @@
 #ifndef SPOCK_REPSET_H
 #define SPOCK_REPSET_H
 
+#include "nodes/execnodes.h"
+
 #include "replication/reorderbuffer.h"
 
 typedef struct SpockRepSet
@@ -45,6 +47,11 @@ typedef struct SpockTableRepInfo
 										   otherwise each replicated column
 										   is a member */
 	List		   *row_filter;			/* compiled row_filter nodes */
+
+	/* Executor state for evaluating the row_filter, built on first use. */
+	EState		   *rf_estate;
+	ExprContext	   *rf_econtext;
+	ExprState	   *rf_exprstate;		/* all row_filters ANDed */
 } SpockTableRepInfo;
 
 extern SpockRepSet *get_replication_set(Oid setid);
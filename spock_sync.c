@@ -61,6 +61,7 @@
 #include "utils/rel.h"
 #include "utils/resowner.h"
 
+#include "spock_apply_parallel.h"
 #include "spock_relcache.h"
 #include "spock_repset.h"
 #include "spock_rpc.h"
@@ -926,6 +927,9 @@ spock_sync_subscription(SpockSubscription *sub)
 								   true);
 				table_close(replorigin_rel, RowExclusiveLock);
 
+				/* Progress of the parallel apply workers is no longer valid. */
+				spock_apply_parallel_drop_origins(sub->slot_name);
+
 				CommitTransactionCommand();
 
 				if (SyncKindStructure(sync->kind))
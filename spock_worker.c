@@ -19,6 +19,8 @@
 
 #include "commands/dbcommands.h"
 
+#include "port/pg_bitutils.h"
+
 #include "storage/ipc.h"
 #include "storage/proc.h"
 #include "storage/procsignal.h"
@@ -96,6 +98,48 @@ find_empty_worker_slot(Oid dboid)
 	return -1;
 }
 
+/*
+ * Find the slot of an apply worker which exited with an error and which the
+ * given worker is going to replace.
+ *
+ * The caller is responsible for locking.
+ */
+static SpockWorker *
+find_crashed_apply_worker(SpockWorker *worker)
+{
+	int	i;
+
+	Assert(LWLockHeldByMe(SpockCtx->lock));
+
+	if (worker->worker_type == SPOCK_WORKER_MANAGER)
+		return NULL;
+
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker *w = &SpockCtx->workers[i];
+
+		if (w->crashed_at == 0 || w->worker_type != worker->worker_type ||
+			w->dboid != worker->dboid ||
+			w->worker.apply.subid != worker->worker.apply.subid)
+			continue;
+
+		if (w->worker_type == SPOCK_WORKER_SYNC &&
+			(namestrcmp(&w->worker.sync.nspname,
+						NameStr(worker->worker.sync.nspname)) != 0 ||
+			 namestrcmp(&w->worker.sync.relname,
+						NameStr(worker->worker.sync.relname)) != 0))
+			continue;
+
+		if (w->worker_type == SPOCK_WORKER_APPLY_PARALLEL &&
+			w->worker.parallel.index != worker->worker.parallel.index)
+			continue;
+
+		return w;
+	}
+
+	return NULL;
+}
+
 /*
  * Register the spock worker proccess.
  *
@@ -109,11 +153,33 @@ spock_worker_register(SpockWorker *worker)
 	BackgroundWorkerHandle *bgw_handle;
 	int					slot;
 	int					next_generation;
+	SpockWorker		*crashed;
 
 	Assert(worker->worker_type != SPOCK_WORKER_NONE);
 
 	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
 
+	/*
+	 * A worker restarted after an error keeps the statistics of its
+	 * predecessor, so that the errors and what was applied before them are
+	 * not lost.
+	 */
+	crashed = find_crashed_apply_worker(worker);
+	if (crashed != NULL)
+	{
+		spock_apply_stats_read(&crashed->worker.apply,
+							   &worker->worker.apply.stats);
+		memcpy(worker->worker.apply.timing_reset,
+			   crashed->worker.apply.timing_reset,
+			   sizeof(worker->worker.apply.timing_reset));
+	}
+	else if (worker->worker_type != SPOCK_WORKER_MANAGER)
+	{
+		memset(&worker->worker.apply.stats, 0, sizeof(SpockApplyStats));
+		memset(worker->worker.apply.timing_reset, 0,
+			   sizeof(worker->worker.apply.timing_reset));
+	}
+
 	slot = find_empty_worker_slot(worker->dboid);
 	if (slot == -1)
 	{
@@ -162,6 +228,15 @@ spock_worker_register(SpockWorker *worker)
 				 shorten_hash(NameStr(worker->worker.sync.relname), NAMEDATALEN - 37),
 				 worker->dboid, worker->worker.sync.apply.subid);
 	}
+	else if (worker->worker_type == SPOCK_WORKER_APPLY_PARALLEL)
+	{
+		snprintf(bgw.bgw_function_name, BGW_MAXLEN,
+				 "spock_apply_parallel_main");
+		snprintf(bgw.bgw_name, BGW_MAXLEN,
+				 "spock apply %u:%u parallel %d", worker->dboid,
+				 worker->worker.parallel.apply.subid,
+				 worker->worker.parallel.index);
+	}
 	else
 	{
 		snprintf(bgw.bgw_function_name, BGW_MAXLEN,
@@ -406,6 +481,15 @@ spock_worker_detach(bool crash)
 	{
 		MySpockWorker->crashed_at = GetCurrentTimestamp();
 
+		if (MySpockWorker->worker_type != SPOCK_WORKER_MANAGER)
+		{
+			SpockApplyStats *stats = &MySpockWorker->worker.apply.stats;
+
+			SPOCK_APPLY_STATS_BEGIN_WRITE(stats);
+			stats->n_error++;
+			SPOCK_APPLY_STATS_END_WRITE(stats);
+		}
+
 		/* Manager crash, make sure supervisor notices. */
 		if (MySpockWorker->worker_type == SPOCK_WORKER_MANAGER)
 			SpockCtx->subscriptions_changed = true;
@@ -727,6 +811,80 @@ spock_worker_type_name(SpockWorkerType type)
 		case SPOCK_WORKER_MANAGER: return "manager";
 		case SPOCK_WORKER_APPLY: return "apply";
 		case SPOCK_WORKER_SYNC: return "sync";
+		case SPOCK_WORKER_APPLY_PARALLEL: return "parallel apply";
+		default: Assert(false); return NULL;
+	}
+}
+
+/*
+ * Copy the statistics of an apply worker.
+ *
+ * The worker updates them without locking, so retry until the copy was not
+ * torn by a concurrent update.
+ */
+void
+spock_apply_stats_read(SpockApplyWorker *apply, SpockApplyStats *stats)
+{
+	volatile SpockApplyStats *src = &apply->stats;
+
+	for (;;)
+	{
+		uint32		before = src->changecount;
+
+		pg_read_barrier();
+		memcpy(stats, (SpockApplyStats *) src, sizeof(SpockApplyStats));
+		pg_read_barrier();
+
+		if ((before & 1) == 0 && before == src->changecount)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Add the time since start to the histogram of the phase.
+ */
+void
+spock_apply_timing_record(SpockApplyPhase phase, instr_time start)
+{
+	SpockApplyStats *stats;
+	instr_time	duration;
+	uint64		us;
+	int			bucket;
+
+	if (MyApplyWorker == NULL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	us = INSTR_TIME_GET_MICROSEC(duration);
+
+	if (us == 0)
+		bucket = 0;
+	else
+		bucket = Min(pg_leftmost_one_pos64(us) + 1,
+					 SPOCK_APPLY_TIMING_BUCKETS - 1);
+
+	stats = MyApplyStats;
+	SPOCK_APPLY_STATS_BEGIN_WRITE(stats);
+	stats->timing[phase].count++;
+	stats->timing[phase].total_us += us;
+	stats->timing[phase].buckets[bucket]++;
+	SPOCK_APPLY_STATS_END_WRITE(stats);
+}
+
+const char *
+spock_apply_phase_name(SpockApplyPhase phase)
+{
+	switch (phase)
+	{
+		case SPOCK_APPLY_PHASE_DECODE: return "decode";
+		case SPOCK_APPLY_PHASE_INDEX_LOOKUP: return "index lookup";
+		case SPOCK_APPLY_PHASE_LOCK_WAIT: return "lock wait";
+		case SPOCK_APPLY_PHASE_INDEX_UPDATE: return "index update";
+		case SPOCK_APPLY_PHASE_TRIGGERS: return "triggers";
+		case SPOCK_APPLY_PHASE_COMMIT: return "commit";
 		default: Assert(false); return NULL;
 	}
 }
@@ -12,6 +12,10 @@
 #ifndef SPOCK_WORKER_H
 #define SPOCK_WORKER_H
 
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+
+#include "storage/dsm.h"
 #include "storage/lock.h"
 
 #include "spock.h"
@@ -20,15 +24,79 @@ typedef enum {
 	SPOCK_WORKER_NONE,		/* Unused slot. */
 	SPOCK_WORKER_MANAGER,	/* Manager. */
 	SPOCK_WORKER_APPLY,		/* Apply. */
-	SPOCK_WORKER_SYNC		/* Special type of Apply that synchronizes
+	SPOCK_WORKER_SYNC,		/* Special type of Apply that synchronizes
 								 * one table. */
+	SPOCK_WORKER_APPLY_PARALLEL	/* Helper of the Apply worker which applies
+								 * part of its transactions. */
 } SpockWorkerType;
 
+/* Phases of apply timed when spock.track_apply_timing is on. */
+typedef enum SpockApplyPhase
+{
+	SPOCK_APPLY_PHASE_DECODE,		/* Reading tuples from the protocol. */
+	SPOCK_APPLY_PHASE_INDEX_LOOKUP,	/* Looking up the local tuple. */
+	SPOCK_APPLY_PHASE_LOCK_WAIT,	/* Waiting for concurrent transactions. */
+	SPOCK_APPLY_PHASE_INDEX_UPDATE,	/* Inserting index entries. */
+	SPOCK_APPLY_PHASE_TRIGGERS,		/* Firing triggers. */
+	SPOCK_APPLY_PHASE_COMMIT		/* Committing the local transaction. */
+} SpockApplyPhase;
+
+#define SPOCK_APPLY_NUM_PHASES (SPOCK_APPLY_PHASE_COMMIT + 1)
+
+/*
+ * Bucket 0 counts durations below 1us, bucket n durations from 2^(n-1)us up
+ * to 2^n us, the last bucket everything longer.
+ */
+#define SPOCK_APPLY_TIMING_BUCKETS 32
+
+typedef struct SpockApplyPhaseTiming
+{
+	int64		count;
+	int64		total_us;
+	int64		buckets[SPOCK_APPLY_TIMING_BUCKETS];
+} SpockApplyPhaseTiming;
+
+/*
+ * Statistics of an apply worker.
+ *
+ * Only the worker itself updates them, without taking any lock. changecount
+ * is odd while an update is in progress, readers copy the struct with
+ * spock_apply_stats_read() which retries until it got a consistent copy.
+ */
+typedef struct SpockApplyStats
+{
+	uint32		changecount;
+
+	int64		n_insert;			/* INSERTs applied. */
+	int64		n_update;			/* UPDATEs applied. */
+	int64		n_delete;			/* DELETEs applied. */
+	int64		n_commit;			/* Remote transactions applied. */
+	int64		bytes_received;		/* Replication stream data received. */
+	int64		n_multi_insert_flush;	/* Multi-insert buffer flushes. */
+	int64		n_conflict;			/* Conflicts detected. */
+	int64		n_error;			/* Exits with an error. */
+	int64		n_batch_frame;		/* Frames of batched messages. */
+	int64		n_compressed_frame;	/* Frames of compressed messages. */
+	int64		n_multi_insert_msg;	/* MULTI INSERT messages applied. */
+	int64		n_update_unchanged;	/* UPDATEs without all new columns. */
+	int64		n_partial_message;	/* Messages received in pieces. */
+	TimestampTz	last_commit_time;	/* Local time of the last commit. */
+	TimestampTz	last_remote_commit_time;	/* Its upstream commit time. */
+	SpockApplyPhaseTiming timing[SPOCK_APPLY_NUM_PHASES];
+} SpockApplyStats;
+
 typedef struct SpockApplyWorker
 {
 	Oid			subid;				/* Subscription id for apply worker. */
 	bool		sync_pending;		/* Is there new synchronization info pending?. */
 	XLogRecPtr	replay_stop_lsn;	/* Replay should stop here if defined. */
+	SpockApplyStats	stats;			/* Statistics, see SpockApplyStats. */
+
+	/*
+	 * stats.timing as of the last spock.reset_apply_timing(), protected by
+	 * SpockCtx->lock.
+	 */
+	SpockApplyPhaseTiming timing_reset[SPOCK_APPLY_NUM_PHASES];
 } SpockApplyWorker;
 
 typedef struct SpockSyncWorker
@@ -38,6 +106,13 @@ typedef struct SpockSyncWorker
 	NameData	relname;	/* Name of the table to copy if any. */
 } SpockSyncWorker;
 
+typedef struct SpockParallelApplyWorker
+{
+	SpockApplyWorker	apply; /* Apply worker info, must be first. */
+	dsm_handle	dsm;		/* Segment shared with the leader apply worker. */
+	int			index;		/* Index of this worker within the segment. */
+} SpockParallelApplyWorker;
+
 typedef struct SpockWorker {
 	SpockWorkerType	worker_type;
 
@@ -58,6 +133,7 @@ typedef struct SpockWorker {
 	{
 		SpockApplyWorker apply;
 		SpockSyncWorker sync;
+		SpockParallelApplyWorker parallel;
 	} worker;
 
 } SpockWorker;
@@ -84,6 +160,54 @@ extern SpockSubscription   *MySubscription;
 
 extern volatile sig_atomic_t got_SIGTERM;
 
+#define SPOCK_APPLY_STATS_BEGIN_WRITE(stats) \
+	do { \
+		(stats)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define SPOCK_APPLY_STATS_END_WRITE(stats) \
+	do { \
+		pg_write_barrier(); \
+		(stats)->changecount++; \
+		Assert(((stats)->changecount & 1) == 0); \
+	} while (0)
+
+/*
+ * Statistics of this apply worker. They are kept in its own slot rather than
+ * in MyApplyWorker, which parallel apply workers share with their leader.
+ */
+#define MyApplyStats (&MySpockWorker->worker.apply.stats)
+
+/* Add n to a counter of the statistics of this apply worker. */
+#define SPOCK_APPLY_STATS_ADD(field, n) \
+	do { \
+		if (MyApplyWorker != NULL) \
+		{ \
+			SPOCK_APPLY_STATS_BEGIN_WRITE(MyApplyStats); \
+			MyApplyStats->field += (n); \
+			SPOCK_APPLY_STATS_END_WRITE(MyApplyStats); \
+		} \
+	} while (0)
+
+/*
+ * Time a phase of apply. The clock is only read when spock.track_apply_timing
+ * is on.
+ */
+#define SPOCK_APPLY_TIMING_START(start) \
+	do { \
+		if (spock_track_apply_timing) \
+			INSTR_TIME_SET_CURRENT(start); \
+		else \
+			INSTR_TIME_SET_ZERO(start); \
+	} while (0)
+
+#define SPOCK_APPLY_TIMING_END(phase, start) \
+	do { \
+		if (!INSTR_TIME_IS_ZERO(start)) \
+			spock_apply_timing_record((phase), (start)); \
+	} while (0)
+
 extern void handle_sigterm(SIGNAL_ARGS);
 
 extern void spock_subscription_changed(Oid subid, bool kill);
@@ -106,5 +230,9 @@ extern bool spock_worker_running(SpockWorker *w);
 extern void spock_worker_kill(SpockWorker *worker);
 
 extern const char * spock_worker_type_name(SpockWorkerType type);
+extern void spock_apply_stats_read(SpockApplyWorker *apply,
+								   SpockApplyStats *stats);
+extern void spock_apply_timing_record(SpockApplyPhase phase, instr_time start);
+extern const char *spock_apply_phase_name(SpockApplyPhase phase);
 
 #endif /* SPOCK_WORKER_H */
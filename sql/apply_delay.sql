@@ -80,6 +80,25 @@ SELECT round (EXTRACT(EPOCH FROM (SELECT ts from timestamps where id = 'ts2')) -
 SELECT round (EXTRACT(EPOCH FROM (SELECT ts from timestamps where id = 'ts3')) -
        EXTRACT(EPOCH FROM (SELECT ts from timestamps where id = 'ts2'))) :: integer >= 2 as inserts_replication_delayed;
 
+-- back-to-back transactions are held back together, not one after another
+INSERT INTO timestamps VALUES ('ts4', CURRENT_TIMESTAMP);
+
+DO $$
+BEGIN
+	FOR i IN 1..5 LOOP
+		UPDATE basic_dml1 SET other = other * 10 WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+INSERT INTO timestamps VALUES ('ts5', CURRENT_TIMESTAMP);
+
+SELECT round (EXTRACT(EPOCH FROM (SELECT ts from timestamps where id = 'ts5')) -
+       EXTRACT(EPOCH FROM (SELECT ts from timestamps where id = 'ts4'))) :: integer BETWEEN 2 AND 9 as updates_replication_delayed_together;
+
 \c :subscriber_dsn
 
 SELECT * FROM basic_dml1;
@@ -0,0 +1,87 @@
+-- apply statistics and timing of the subscription workers
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.st_data (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'st_data');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+INSERT INTO st_data VALUES (1000, -1);
+
+-- the counters start over with the worker
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO st_data SELECT g, 0 FROM generate_series(1, 10) g;
+DO $$
+BEGIN
+	FOR i IN 1..5 LOOP
+		UPDATE st_data SET n = i WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+DELETE FROM st_data WHERE id > 7;
+INSERT INTO st_data VALUES (1000, 1000);
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT worker_type, inserts, updates, deletes, transactions >= 8 AS transactions,
+       bytes_received > 0 AS received, conflicts, errors,
+       last_remote_commit_time <= last_commit_time AS committed
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription';
+SELECT * FROM st_data WHERE id = 1000;
+
+-- time spent in each phase of the apply
+ALTER SYSTEM SET spock.track_apply_timing = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 11..15 LOOP
+		INSERT INTO st_data VALUES (i, 0);
+		COMMIT;
+		UPDATE st_data SET n = i WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT phase, calls > 0 AS called, total_time >= 0 AS timed,
+       (SELECT sum(h) FROM unnest(histogram) h) = calls AS histogram
+  FROM spock.get_apply_timing() a
+  JOIN spock.subscription s ON s.sub_id = a.sub_id
+ WHERE s.sub_name = 'test_subscription' AND a.worker_type = 'apply'
+   AND phase IN ('commit', 'decode', 'index lookup', 'index update')
+ ORDER BY phase;
+SELECT spock.reset_apply_timing();
+SELECT count(*)
+  FROM spock.get_apply_timing() a
+  JOIN spock.subscription s ON s.sub_id = a.sub_id
+ WHERE s.sub_name = 'test_subscription';
+ALTER SYSTEM RESET spock.track_apply_timing;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.st_data CASCADE;
+$$);
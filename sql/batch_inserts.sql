@@ -0,0 +1,90 @@
+-- batched inserts that run into rows the subscriber has already
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.bi_data (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.bi_other (
+		id integer PRIMARY KEY,
+		data text
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'bi_data');
+SELECT * FROM spock.replication_set_add_table('default', 'bi_other');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+INSERT INTO bi_data VALUES (3, 'local'), (10, 'local'), (40, 'local');
+
+-- the remote rows win with the default apply_remote resolution
+\c :provider_dsn
+INSERT INTO bi_data SELECT g, 'remote' FROM generate_series(1, 50) g;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'local') AS local,
+       min(id), max(id)
+  FROM bi_data;
+
+-- the local rows win with keep_local
+INSERT INTO bi_data VALUES (53, 'local'), (60, 'local'), (99, 'local');
+ALTER SYSTEM SET spock.conflict_resolution = 'keep_local';
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO bi_data SELECT g, 'remote' FROM generate_series(51, 100) g;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'local') AS local,
+       min(id), max(id)
+  FROM bi_data;
+SELECT id FROM bi_data WHERE data = 'local' ORDER BY id;
+ALTER SYSTEM RESET spock.conflict_resolution;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+-- inserts into two tables taking turns in one transaction
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 1..100 LOOP
+		INSERT INTO bi_other VALUES (i, 'other');
+		UPDATE bi_data SET data = 'again' WHERE id = i;
+		INSERT INTO bi_data VALUES (100 + i, 'remote');
+	END LOOP;
+END;
+$$;
+BEGIN;
+INSERT INTO bi_data SELECT g, 'remote' FROM generate_series(201, 210) g;
+INSERT INTO bi_other SELECT g, 'other' FROM generate_series(101, 110) g;
+INSERT INTO bi_data SELECT g, 'remote' FROM generate_series(211, 220) g;
+DELETE FROM bi_other WHERE id = 105;
+INSERT INTO bi_other VALUES (105, 'again');
+COMMIT;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT (SELECT count(*) FROM bi_data) AS data,
+       (SELECT count(*) FROM bi_data WHERE data = 'again') AS data_again,
+       (SELECT count(*) FROM bi_other) AS other,
+       (SELECT data FROM bi_other WHERE id = 105) AS other_105;
+\c :subscriber_dsn
+SELECT (SELECT count(*) FROM bi_data) AS data,
+       (SELECT count(*) FROM bi_data WHERE data = 'again') AS data_again,
+       (SELECT count(*) FROM bi_other) AS other,
+       (SELECT data FROM bi_other WHERE id = 105) AS other_105;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.bi_data CASCADE;
+	DROP TABLE public.bi_other CASCADE;
+$$);
@@ -0,0 +1,72 @@
+-- runs of updates and deletes applied in replica identity order
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.bu_data (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+	CREATE TABLE public.bu_unique (
+		id integer PRIMARY KEY,
+		u integer NOT NULL UNIQUE
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'bu_data');
+SELECT * FROM spock.replication_set_add_table('default', 'bu_unique');
+INSERT INTO bu_data SELECT g, 0 FROM generate_series(1, 1000) g;
+INSERT INTO bu_unique SELECT g, g FROM generate_series(1, 10) g;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.batch_updates = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+-- updates and deletes of the same rows out of key order
+BEGIN;
+UPDATE bu_data SET n = n + 1 WHERE id % 7 = 3;
+UPDATE bu_data SET n = n + 10 WHERE id % 2 = 0;
+DELETE FROM bu_data WHERE id % 5 = 0;
+UPDATE bu_data SET n = n + 100 WHERE id > 900;
+COMMIT;
+
+DO $$
+BEGIN
+	FOR i IN REVERSE 500..401 LOOP
+		UPDATE bu_data SET n = -i WHERE id = i;
+	END LOOP;
+	DELETE FROM bu_data WHERE id BETWEEN 451 AND 460;
+	INSERT INTO bu_data VALUES (455, 455);
+	UPDATE bu_data SET id = id + 1000 WHERE id BETWEEN 1 AND 10;
+END;
+$$;
+
+-- a unique secondary index makes the order matter
+BEGIN;
+UPDATE bu_unique SET u = u + 100;
+UPDATE bu_unique SET u = 11 - id;
+DELETE FROM bu_unique WHERE id = 5;
+COMMIT;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT count(*), sum(n) AS n, sum(id) AS id FROM bu_data;
+SELECT * FROM bu_unique ORDER BY id;
+\c :subscriber_dsn
+SELECT count(*), sum(n) AS n, sum(id) AS id FROM bu_data;
+SELECT * FROM bu_unique ORDER BY id;
+ALTER SYSTEM RESET spock.batch_updates;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.bu_data CASCADE;
+	DROP TABLE public.bu_unique CASCADE;
+$$);
@@ -0,0 +1,79 @@
+-- many small remote transactions applied in one local transaction
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.gc_data (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'gc_data');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.group_commit_size = 20;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 1..50 LOOP
+		INSERT INTO gc_data VALUES (i, 0);
+		COMMIT;
+		UPDATE gc_data SET n = n + 1 WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+-- queued SQL in the middle of the grouped transactions
+SELECT spock.replicate_ddl_command($$
+	ALTER TABLE public.gc_data ADD COLUMN c integer;
+$$);
+
+DO $$
+BEGIN
+	FOR i IN 51..100 LOOP
+		INSERT INTO gc_data VALUES (i, 1, i);
+		COMMIT;
+		DELETE FROM gc_data WHERE id = i - 50;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT count(*), sum(n) AS n, count(c) AS c, min(id), max(id) FROM gc_data;
+\c :subscriber_dsn
+SELECT count(*), sum(n) AS n, count(c) AS c, min(id), max(id) FROM gc_data;
+
+-- and one at a time again
+ALTER SYSTEM RESET spock.group_commit_size;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 1..10 LOOP
+		UPDATE gc_data SET n = n + 1 WHERE id = 50 + i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), sum(n) AS n, count(c) AS c, min(id), max(id) FROM gc_data;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.gc_data CASCADE;
+$$);
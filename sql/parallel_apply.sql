@@ -0,0 +1,130 @@
+-- parallel apply of the transactions of a subscription
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.pa_counter (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+	CREATE TABLE public.pa_unique (
+		id integer PRIMARY KEY,
+		u integer NOT NULL UNIQUE
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'pa_counter');
+SELECT * FROM spock.replication_set_add_table('default', 'pa_unique');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.apply_parallel_workers = 2;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO pa_counter SELECT g, 0 FROM generate_series(1, 5) g;
+INSERT INTO pa_unique SELECT g, g FROM generate_series(1, 3) g;
+
+-- every transaction overwrites a row an earlier one wrote
+DO $$
+BEGIN
+	FOR i IN 1..100 LOOP
+		UPDATE pa_counter SET n = n + 1 WHERE id = i % 5 + 1;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+-- the same key deleted and inserted again
+DO $$
+BEGIN
+	FOR i IN 1..20 LOOP
+		DELETE FROM pa_counter WHERE id = 5;
+		COMMIT;
+		INSERT INTO pa_counter VALUES (5, i);
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+-- keys moved away and taken again by the next transaction
+DO $$
+BEGIN
+	FOR i IN 1..4 LOOP
+		UPDATE pa_counter SET id = 100 + i WHERE id = i;
+		COMMIT;
+		INSERT INTO pa_counter VALUES (i, -i);
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+-- values of a unique column passed from row to row, the rows differ but
+-- the transactions still depend on each other
+DO $$
+DECLARE
+	free integer := 4;
+	old integer;
+BEGIN
+	FOR i IN 1..30 LOOP
+		SELECT u INTO old FROM pa_unique WHERE id = i % 3 + 1;
+		UPDATE pa_unique SET u = free WHERE id = i % 3 + 1;
+		free := old;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT id, n FROM pa_counter ORDER BY id;
+SELECT id, u FROM pa_unique ORDER BY id;
+
+\c :subscriber_dsn
+SELECT id, n FROM pa_counter ORDER BY id;
+SELECT id, u FROM pa_unique ORDER BY id;
+
+SELECT worker_type, count(*) FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription'
+ GROUP BY worker_type ORDER BY worker_type;
+SELECT sum(inserts) AS inserts, sum(updates) AS updates, sum(deletes) AS deletes
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription';
+
+-- the same without parallel apply workers
+ALTER SYSTEM RESET spock.apply_parallel_workers;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 1..50 LOOP
+		UPDATE pa_counter SET n = n + 1 WHERE id = i % 5 + 1;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT id, n FROM pa_counter ORDER BY id;
+SELECT id, u FROM pa_unique ORDER BY id;
+
+\c :subscriber_dsn
+SELECT id, n FROM pa_counter ORDER BY id;
+SELECT id, u FROM pa_unique ORDER BY id;
+
+SELECT count(*) FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'parallel apply';
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.pa_counter CASCADE;
+	DROP TABLE public.pa_unique CASCADE;
+$$);
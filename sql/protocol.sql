@@ -0,0 +1,233 @@
+-- startup options of the native protocol, each asked for and not
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.proto_stream (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.proto_batch (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.proto_compress (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.proto_multi (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.proto_changed (
+		id integer PRIMARY KEY,
+		a integer,
+		b text
+	);
+	CREATE TYPE public.proto_mood AS ENUM ('sad', 'ok', 'happy');
+	CREATE TABLE public.proto_types (
+		id integer PRIMARY KEY,
+		moods public.proto_mood[]
+	);
+	CREATE TABLE public.proto_partial (
+		id integer PRIMARY KEY,
+		data text
+	);
+	ALTER TABLE public.proto_partial ALTER COLUMN data SET STORAGE EXTERNAL;
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'proto_stream');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_batch');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_compress');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_multi');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_changed');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_types');
+SELECT * FROM spock.replication_set_add_table('default', 'proto_partial');
+-- the old rows in full from the provider, the subscriber finds them by key
+ALTER TABLE proto_changed REPLICA IDENTITY FULL;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+-- Split the batch frames into the messages they carry.
+CREATE FUNCTION frame_messages(frame bytea) RETURNS SETOF bytea
+LANGUAGE plpgsql AS $$
+DECLARE
+	nmsgs integer;
+	len integer;
+	off integer := 5;
+BEGIN
+	IF get_byte(frame, 0) <> ascii('G') THEN
+		RETURN NEXT frame;
+		RETURN;
+	END IF;
+	nmsgs := (get_byte(frame, 1) << 24) | (get_byte(frame, 2) << 16) |
+		(get_byte(frame, 3) << 8) | get_byte(frame, 4);
+	FOR i IN 1..nmsgs LOOP
+		len := (get_byte(frame, off) << 24) | (get_byte(frame, off + 1) << 16) |
+			(get_byte(frame, off + 2) << 8) | get_byte(frame, off + 3);
+		RETURN NEXT substr(frame, off + 5, len);
+		off := off + 4 + len;
+	END LOOP;
+END;
+$$;
+
+-- The frames and messages the test slot has for a client passing options.
+CREATE FUNCTION peek_messages(VARIADIC options text[] DEFAULT '{}')
+RETURNS TABLE (frametype text, msgtype text, msg bytea)
+LANGUAGE sql AS $$
+	SELECT chr(get_byte(c.data, 0)), chr(get_byte(m.msg, 0)), m.msg
+	  FROM pg_logical_slot_peek_binary_changes('spock_proto_test', NULL, NULL,
+			VARIADIC ARRAY['min_proto_version', '1', 'max_proto_version', '1',
+						   'startup_params_format', '1',
+						   'spock.replication_set_names', 'default'] || options) c,
+		   frame_messages(c.data) m(msg)
+$$;
+
+-- The value of a parameter of the startup message.
+CREATE FUNCTION startup_param(msg bytea, param text) RETURNS text
+LANGUAGE sql AS $$
+	SELECT kv[i + 1]
+	  FROM (SELECT string_to_array(encode(substr(msg, 3), 'escape'), '\000')) s(kv),
+		   generate_series(1, array_length(kv, 1) - 1, 2) i
+	 WHERE kv[i] = param
+$$;
+
+-- streaming of large transactions before they commit
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+SET logical_decoding_work_mem = '64kB';
+INSERT INTO proto_stream SELECT g, repeat('x', 100) FROM generate_series(1, 5000) g;
+BEGIN;
+INSERT INTO proto_stream SELECT g, repeat('x', 100) FROM generate_series(5001, 10000) g;
+ROLLBACK;
+SELECT startup_param(msg, 'streaming') AS streaming FROM peek_messages('spock.streaming', 't') WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE msgtype = 's') > 0 AS stream_start,
+       count(*) FILTER (WHERE msgtype = 'c') AS stream_commit,
+       count(*) FILTER (WHERE msgtype = 'A') AS stream_abort
+  FROM peek_messages('spock.streaming', 't');
+SELECT startup_param(msg, 'streaming') AS streaming FROM peek_messages() WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE msgtype = 's') AS stream_start,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages();
+RESET logical_decoding_work_mem;
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- small messages sent together in batch frames
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_batch SELECT g, 'row ' || g FROM generate_series(1, 100) g;
+UPDATE proto_batch SET data = 'changed' WHERE id <= 10;
+SELECT startup_param(msg, 'batch_size') AS batch_size FROM peek_messages('spock.batch_size', '1024') WHERE msgtype = 'S';
+SELECT bool_and(frametype = 'G') AS batched,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts,
+       count(*) FILTER (WHERE msgtype = 'U') AS updates
+  FROM peek_messages('spock.batch_size', '1024');
+SELECT startup_param(msg, 'batch_size') AS batch_size FROM peek_messages() WHERE msgtype = 'S';
+SELECT bool_or(frametype = 'G') AS batched,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts,
+       count(*) FILTER (WHERE msgtype = 'U') AS updates
+  FROM peek_messages();
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- compressed batches, with whatever method the server was built with
+SELECT coalesce(min(m), 'none') AS method
+  FROM pg_settings, unnest(enumvals) m
+ WHERE name = 'spock.compression' AND m <> 'none'
+\gset
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_compress SELECT g, repeat('compress me ', 20) FROM generate_series(1, 1000) g;
+-- the startup message is compressed along with the rest
+SELECT coalesce(bool_and(get_byte(msg, 1) = array_position(ARRAY['lz4', 'zstd'], :'method')),
+                :'method' = 'none') AS compressed
+  FROM peek_messages('spock.compression', :'method') WHERE frametype = 'Z';
+SELECT startup_param(msg, 'compression') AS compression FROM peek_messages('spock.compression', 'bogus') WHERE msgtype = 'S';
+SELECT startup_param(msg, 'compression') AS compression FROM peek_messages() WHERE msgtype = 'S';
+SELECT bool_or(frametype IN ('G', 'Z')) AS batched,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages();
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- consecutive inserts sent as one MULTI INSERT message, a single row as INSERT
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_multi SELECT g, 'row ' || g FROM generate_series(1, 10) g;
+INSERT INTO proto_multi VALUES (11, NULL);
+INSERT INTO proto_multi SELECT g, NULL FROM generate_series(101, 2600) g;
+SELECT startup_param(msg, 'multi_insert') AS multi_insert FROM peek_messages('spock.multi_insert', 't') WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE msgtype = 'M') AS multi_inserts,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages('spock.multi_insert', 't');
+SELECT startup_param(msg, 'multi_insert') AS multi_insert FROM peek_messages() WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE msgtype = 'M') AS multi_inserts,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages();
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- updates sending only the columns they change
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_changed VALUES (1, 1, repeat('b', 1000));
+UPDATE proto_changed SET a = 2;
+SELECT startup_param(msg, 'changed_columns_only') AS changed_columns_only FROM peek_messages('spock.changed_columns_only', 't') WHERE msgtype = 'S';
+SELECT length(msg) < 1500 AS changed_only
+  FROM peek_messages('spock.changed_columns_only', 't') WHERE msgtype = 'U';
+SELECT startup_param(msg, 'changed_columns_only') AS changed_columns_only FROM peek_messages() WHERE msgtype = 'S';
+SELECT length(msg) < 1500 AS changed_only
+  FROM peek_messages() WHERE msgtype = 'U';
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- the names of the types embedded in binary arrays and composites
+SELECT current_setting('server_version_num')::integer / 100 AS major
+\gset
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_types VALUES (1, '{sad,happy}');
+SELECT startup_param(msg, 'type_names') AS type_names FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major', 'spock.type_names', 't') WHERE msgtype = 'S';
+SELECT position(convert_to('proto_mood', 'UTF8') in msg) > 0 AS type_named
+  FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major', 'spock.type_names', 't') WHERE msgtype = 'R';
+SELECT position(convert_to('{sad,happy}', 'UTF8') in msg) > 0 AS as_text
+  FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major', 'spock.type_names', 't') WHERE msgtype = 'I';
+-- not without binary transfer
+SELECT startup_param(msg, 'type_names') AS type_names FROM peek_messages('spock.type_names', 't') WHERE msgtype = 'S';
+SELECT position(convert_to('proto_mood', 'UTF8') in msg) > 0 AS type_named
+  FROM peek_messages('spock.type_names', 't') WHERE msgtype = 'R';
+SELECT position(convert_to('{sad,happy}', 'UTF8') in msg) > 0 AS as_text
+  FROM peek_messages('spock.type_names', 't') WHERE msgtype = 'I';
+SELECT startup_param(msg, 'type_names') AS type_names FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major') WHERE msgtype = 'S';
+SELECT position(convert_to('proto_mood', 'UTF8') in msg) > 0 AS type_named
+  FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major') WHERE msgtype = 'R';
+SELECT position(convert_to('{sad,happy}', 'UTF8') in msg) > 0 AS as_text
+  FROM peek_messages('binary.want_binary_basetypes', '1', 'binary.basetypes_major_version', :'major') WHERE msgtype = 'I';
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+-- large values sent in pieces of a partial message
+SELECT 'init' FROM pg_create_logical_replication_slot('spock_proto_test', 'spock_output');
+INSERT INTO proto_partial VALUES (1, repeat('x', 3000000));
+SELECT startup_param(msg, 'partial_messages') AS partial_messages FROM peek_messages('spock.partial_messages', 't') WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE frametype = 'P') AS pieces,
+       sum(length(msg)) FILTER (WHERE frametype = 'P') > 3000000 AS complete,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages('spock.partial_messages', 't');
+-- the batched messages before it are sent first
+SELECT count(*) FILTER (WHERE frametype = 'P') AS pieces,
+       bool_or(frametype = 'G') AS batched
+  FROM peek_messages('spock.partial_messages', 't', 'spock.batch_size', '8192');
+SELECT startup_param(msg, 'partial_messages') AS partial_messages FROM peek_messages() WHERE msgtype = 'S';
+SELECT count(*) FILTER (WHERE frametype = 'P') AS pieces,
+       sum(length(msg)) FILTER (WHERE frametype = 'P') > 3000000 AS complete,
+       count(*) FILTER (WHERE msgtype = 'I') AS inserts
+  FROM peek_messages();
+SELECT pg_drop_replication_slot('spock_proto_test');
+
+DROP FUNCTION peek_messages(text[]);
+DROP FUNCTION frame_messages(bytea);
+DROP FUNCTION startup_param(bytea, text);
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.proto_stream CASCADE;
+	DROP TABLE public.proto_batch CASCADE;
+	DROP TABLE public.proto_compress CASCADE;
+	DROP TABLE public.proto_multi CASCADE;
+	DROP TABLE public.proto_changed CASCADE;
+	DROP TABLE public.proto_types CASCADE;
+	DROP TABLE public.proto_partial CASCADE;
+	DROP TYPE public.proto_mood;
+$$);
@@ -0,0 +1,365 @@
+-- end to end runs of the startup options, each asked for by the subscriber and not
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.apply_stream (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.apply_batch (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+	CREATE TABLE public.apply_compress (
+		id integer PRIMARY KEY,
+		data text
+	);
+	CREATE TABLE public.apply_multi (
+		id integer PRIMARY KEY,
+		n integer
+	);
+	CREATE TABLE public.apply_changed (
+		id integer PRIMARY KEY,
+		a integer,
+		b text
+	);
+	CREATE TABLE public.apply_partial (
+		id integer PRIMARY KEY,
+		n integer,
+		data text
+	);
+	ALTER TABLE public.apply_partial ALTER COLUMN data SET STORAGE EXTERNAL;
+	CREATE TYPE public.apply_mood AS ENUM ('sad', 'ok', 'happy');
+	CREATE TYPE public.apply_pair AS (mood public.apply_mood, n integer);
+	CREATE TABLE public.apply_types (
+		id integer PRIMARY KEY,
+		moods public.apply_mood[],
+		pair public.apply_pair
+	);
+	CREATE TABLE public.apply_types_text (
+		id integer PRIMARY KEY,
+		moods public.apply_mood[],
+		pair public.apply_pair
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'apply_stream');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_batch');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_compress');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_multi');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_changed');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_partial');
+SELECT * FROM spock.replication_set_add_table('default', 'apply_types');
+-- the old rows in full from the provider, the subscriber finds them by key
+ALTER TABLE apply_changed REPLICA IDENTITY FULL;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+-- large transactions streamed before they commit, rolled back and not
+\c :subscriber_dsn
+ALTER SYSTEM SET logical_decoding_work_mem = '64kB';
+ALTER SYSTEM SET spock.stream_transactions = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_stream SELECT g, repeat('x', 100) FROM generate_series(1, 5000) g;
+BEGIN;
+INSERT INTO apply_stream SELECT g, repeat('x', 100) FROM generate_series(5001, 10000) g;
+ROLLBACK;
+BEGIN;
+INSERT INTO apply_stream SELECT g, repeat('y', 100) FROM generate_series(10001, 12000) g;
+SAVEPOINT s1;
+INSERT INTO apply_stream SELECT g, repeat('y', 100) FROM generate_series(12001, 14000) g;
+ROLLBACK TO SAVEPOINT s1;
+UPDATE apply_stream SET data = 'updated' WHERE id % 1000 = 0;
+DELETE FROM apply_stream WHERE id % 1000 = 1;
+COMMIT;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'updated') AS updated,
+       min(id), max(id)
+  FROM apply_stream;
+
+-- the same without streaming
+ALTER SYSTEM RESET spock.stream_transactions;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_stream SELECT g, repeat('x', 100) FROM generate_series(20001, 25000) g;
+BEGIN;
+INSERT INTO apply_stream SELECT g, repeat('x', 100) FROM generate_series(25001, 30000) g;
+ROLLBACK;
+BEGIN;
+INSERT INTO apply_stream SELECT g, repeat('y', 100) FROM generate_series(30001, 32000) g;
+SAVEPOINT s1;
+INSERT INTO apply_stream SELECT g, repeat('y', 100) FROM generate_series(32001, 34000) g;
+ROLLBACK TO SAVEPOINT s1;
+UPDATE apply_stream SET data = 'updated' WHERE id % 1000 = 0;
+DELETE FROM apply_stream WHERE id % 1000 = 1;
+COMMIT;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'updated') AS updated,
+       min(id), max(id)
+  FROM apply_stream;
+ALTER SYSTEM RESET logical_decoding_work_mem;
+SELECT pg_reload_conf();
+
+-- small transactions sent in batch frames
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.message_batch_size = '8kB';
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DO $$
+BEGIN
+	FOR i IN 1..100 LOOP
+		INSERT INTO apply_batch VALUES (i, 0);
+		COMMIT;
+		UPDATE apply_batch SET n = n + 1 WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+INSERT INTO apply_batch SELECT g, 1 FROM generate_series(101, 1000) g;
+DELETE FROM apply_batch WHERE id % 10 = 0;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), sum(n) AS n, max(id) FROM apply_batch;
+SELECT batch_frames > 0 AS batched
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'apply';
+ALTER SYSTEM RESET spock.message_batch_size;
+SELECT pg_reload_conf();
+
+-- compressed batches, with whatever method the server was built with
+SELECT coalesce(min(m), 'none') AS method
+  FROM pg_settings, unnest(enumvals) m
+ WHERE name = 'spock.compression' AND m <> 'none'
+\gset
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.compression = :'method';
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_compress SELECT g, repeat('compress me ', 20) FROM generate_series(1, 2000) g;
+UPDATE apply_compress SET data = 'short' WHERE id % 100 = 0;
+DO $$
+BEGIN
+	FOR i IN 1..10 LOOP
+		DELETE FROM apply_compress WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'short') AS short, sum(length(data)) AS length FROM apply_compress;
+SELECT compressed_frames > 0 OR :'method' = 'none' AS compressed
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'apply';
+ALTER SYSTEM RESET spock.compression;
+SELECT pg_reload_conf();
+
+-- inserts of many rows in MULTI INSERT messages, applied in parallel
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.apply_parallel_workers = 2;
+ALTER SYSTEM SET spock.multi_insert_messages = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_multi SELECT g, g FROM generate_series(1, 2500) g;
+DO $$
+BEGIN
+	FOR i IN 0..19 LOOP
+		INSERT INTO apply_multi SELECT g, NULL FROM generate_series(2501 + i * 10, 2510 + i * 10) g;
+		COMMIT;
+		UPDATE apply_multi SET n = -n WHERE id = 1 + i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(n) AS n, sum(n) AS sum FROM apply_multi;
+SELECT sum(multi_insert_messages) > 0 AS multi_inserted
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription';
+ALTER SYSTEM RESET spock.multi_insert_messages;
+ALTER SYSTEM RESET spock.apply_parallel_workers;
+SELECT pg_reload_conf();
+
+-- updates of some of the columns, one of them in conflict with a local update
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.changed_columns_only = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_changed VALUES (1, 1, 'orig'), (2, 1, 'orig');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+UPDATE apply_changed SET b = 'local' WHERE id = 1;
+
+\c :provider_dsn
+UPDATE apply_changed SET a = a + 1 WHERE id >= 1;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT * FROM apply_changed ORDER BY id;
+SELECT partial_updates > 0 AS changed_only
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'apply';
+ALTER SYSTEM RESET spock.changed_columns_only;
+SELECT pg_reload_conf();
+
+-- large values received in pieces
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.partial_messages = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_partial VALUES (1, 0, repeat('x', 3000000)),
+	(2, 0, repeat('y', 1048576));
+UPDATE apply_partial SET n = n + 1 WHERE id >= 1;
+UPDATE apply_partial SET data = data || 'z' WHERE id = 1;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT id, n, length(data),
+       md5(data) = md5(repeat(left(data, 1), length(data) - 1) || right(data, 1)) AS intact
+  FROM apply_partial WHERE id >= 1 ORDER BY id;
+SELECT partial_messages > 0 AS pieces
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'apply';
+
+-- and in pieces between batches
+ALTER SYSTEM SET spock.message_batch_size = '8kB';
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_partial VALUES (3, 0, repeat('x', 3000000)),
+	(4, 0, repeat('y', 1048576));
+UPDATE apply_partial SET n = n + 1 WHERE id >= 3;
+UPDATE apply_partial SET data = data || 'z' WHERE id = 3;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT id, n, length(data),
+       md5(data) = md5(repeat(left(data, 1), length(data) - 1) || right(data, 1)) AS intact
+  FROM apply_partial WHERE id >= 3 ORDER BY id;
+SELECT partial_messages > 0 AS pieces, batch_frames > 0 AS batched
+  FROM spock.stat_subscription
+ WHERE sub_name = 'test_subscription' AND worker_type = 'apply';
+ALTER SYSTEM RESET spock.partial_messages;
+ALTER SYSTEM RESET spock.message_batch_size;
+SELECT pg_reload_conf();
+
+-- arrays and composites of types the nodes know by name only
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.type_names = on;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_types VALUES (1, '{sad}', '(ok,1)'), (2, '{}', '(,2)'),
+	(3, '{happy,NULL}', NULL);
+UPDATE apply_types SET moods = moods || 'happy'::apply_mood WHERE id = 1;
+UPDATE apply_types SET pair = ROW('happy', NULL) WHERE id = 3;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT * FROM apply_types ORDER BY id;
+
+-- the same sent as text by a subscription that forces it
+\c :provider_dsn
+SELECT spock.create_replication_set('types_text') IS NOT NULL AS created;
+SELECT * FROM spock.replication_set_add_table('types_text', 'apply_types_text');
+
+\c :subscriber_dsn
+SELECT spock.create_subscription(
+	subscription_name := 'test_subscription_text',
+	provider_dsn := (SELECT provider_dsn FROM spock_regress_variables()) || ' user=super',
+	replication_sets := '{types_text}',
+	forward_origins := '{}',
+	synchronize_structure := false,
+	synchronize_data := false,
+	force_text_transfer := true
+) IS NOT NULL AS created;
+
+BEGIN;
+SET LOCAL statement_timeout = '30s';
+SELECT spock.wait_for_subscription_sync_complete('test_subscription_text');
+COMMIT;
+
+\c :provider_dsn
+INSERT INTO apply_types_text VALUES (1, '{sad}', '(ok,1)'), (2, '{}', '(,2)'),
+	(3, '{happy,NULL}', NULL);
+UPDATE apply_types_text SET moods = moods || 'happy'::apply_mood WHERE id = 1;
+UPDATE apply_types_text SET pair = ROW('happy', NULL) WHERE id = 3;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT * FROM apply_types_text ORDER BY id;
+SELECT spock.drop_subscription('test_subscription_text');
+
+\c :provider_dsn
+SELECT * FROM spock.drop_replication_set('types_text');
+
+-- the same as text without spock.type_names
+\c :subscriber_dsn
+ALTER SYSTEM RESET spock.type_names;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+INSERT INTO apply_types VALUES (4, '{sad}', '(ok,1)'), (5, '{}', '(,2)'),
+	(6, '{happy,NULL}', NULL);
+UPDATE apply_types SET moods = moods || 'happy'::apply_mood WHERE id = 4;
+UPDATE apply_types SET pair = ROW('happy', NULL) WHERE id = 6;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT t.id, t.moods IS NOT DISTINCT FROM b.moods AS moods,
+       t.pair IS NOT DISTINCT FROM b.pair AS pair
+  FROM apply_types t JOIN apply_types b ON b.id = t.id - 3
+ ORDER BY t.id;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.apply_stream CASCADE;
+	DROP TABLE public.apply_batch CASCADE;
+	DROP TABLE public.apply_compress CASCADE;
+	DROP TABLE public.apply_multi CASCADE;
+	DROP TABLE public.apply_changed CASCADE;
+	DROP TABLE public.apply_partial CASCADE;
+	DROP TABLE public.apply_types CASCADE;
+	DROP TABLE public.apply_types_text;
+	DROP TYPE public.apply_pair;
+	DROP TYPE public.apply_mood;
+$$);
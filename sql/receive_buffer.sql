@@ -0,0 +1,65 @@
+-- changes received while the apply worker is busy, held in memory and spilled
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.rb_data (
+		id integer PRIMARY KEY,
+		data text
+	);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'rb_data');
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.receive_buffer_size = '64kB';
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+-- one transaction much larger than the buffer
+INSERT INTO rb_data SELECT g, repeat('x', 200) FROM generate_series(1, 10000) g;
+
+-- followed by many small ones
+DO $$
+BEGIN
+	FOR i IN 1..200 LOOP
+		UPDATE rb_data SET data = 'u' || i WHERE id = i;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT count(*), count(*) FILTER (WHERE data LIKE 'u%') AS updated,
+       sum(length(data)) AS length
+  FROM rb_data;
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data LIKE 'u%') AS updated,
+       sum(length(data)) AS length
+  FROM rb_data;
+
+-- and again with the default buffer
+ALTER SYSTEM RESET spock.receive_buffer_size;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+DELETE FROM rb_data WHERE id > 5000;
+UPDATE rb_data SET data = 'v' WHERE id <= 200;
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*), count(*) FILTER (WHERE data = 'v') AS updated,
+       sum(length(data)) AS length
+  FROM rb_data;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.rb_data CASCADE;
+$$);
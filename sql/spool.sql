@@ -0,0 +1,135 @@
+-- changes spooled on the subscriber and applied from there after a restart
+SELECT * FROM spock_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.create_replication_set('spool') IS NOT NULL AS created;
+SELECT spock.replicate_ddl_command($$
+	CREATE TABLE public.sp_data (
+		id integer PRIMARY KEY,
+		n integer NOT NULL
+	);
+	CREATE TABLE public.sp_large (
+		id integer PRIMARY KEY,
+		data text
+	);
+	ALTER TABLE public.sp_large ALTER COLUMN data SET STORAGE EXTERNAL;
+$$);
+
+SELECT * FROM spock.replication_set_add_table('spool', 'sp_data');
+SELECT * FROM spock.replication_set_add_table('spool', 'sp_large');
+
+\c :subscriber_dsn
+ALTER SYSTEM SET spock.spool_received_changes = on;
+ALTER SYSTEM SET spock.partial_messages = on;
+SELECT pg_reload_conf();
+-- held back long enough for the changes to wait in the spool
+SELECT spock.create_subscription(
+	subscription_name := 'test_subscription_spool',
+	provider_dsn := (SELECT provider_dsn FROM spock_regress_variables()) || ' user=super',
+	replication_sets := '{spool}',
+	forward_origins := '{}',
+	synchronize_structure := false,
+	synchronize_data := false,
+	apply_delay := '5 seconds'
+) IS NOT NULL AS created;
+
+BEGIN;
+SET LOCAL statement_timeout = '30s';
+SELECT spock.wait_for_subscription_sync_complete('test_subscription_spool');
+COMMIT;
+
+\c :provider_dsn
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+INSERT INTO sp_data SELECT g, 0 FROM generate_series(1, 1000) g;
+DO $$
+BEGIN
+	FOR i IN 1..20 LOOP
+		UPDATE sp_data SET n = i WHERE id = i * 10;
+		COMMIT;
+	END LOOP;
+END;
+$$;
+
+-- confirmed to the provider once spooled, before they are applied
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT count(*) FROM sp_data;
+
+-- applied from the spool by the restarted worker
+SELECT spock.alter_subscription_disable('test_subscription_spool', true);
+SELECT spock.alter_subscription_enable('test_subscription_spool', true);
+
+DO $$
+BEGIN
+	FOR i IN 1..300 LOOP
+		EXIT WHEN (SELECT count(*) FROM sp_data WHERE n > 0) = 20;
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END;
+$$;
+
+SELECT count(*), sum(n) AS n, sum(id) FILTER (WHERE n > 0) AS updated FROM sp_data;
+
+-- and what comes after them from the provider
+\c :provider_dsn
+DELETE FROM sp_data WHERE n = 0;
+
+\c :subscriber_dsn
+DO $$
+BEGIN
+	FOR i IN 1..300 LOOP
+		EXIT WHEN (SELECT count(*) FROM sp_data) = 20;
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END;
+$$;
+
+SELECT count(*), sum(n) AS n, sum(id) FILTER (WHERE n > 0) AS updated FROM sp_data;
+
+-- a value sent in pieces, skipped when replayed from the spool once applied
+\c :provider_dsn
+INSERT INTO sp_large VALUES (1, repeat('x', 3000000));
+
+\c :subscriber_dsn
+DO $$
+BEGIN
+	FOR i IN 1..300 LOOP
+		EXIT WHEN EXISTS (SELECT 1 FROM sp_large);
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END;
+$$;
+
+SELECT spock.alter_subscription_disable('test_subscription_spool', true);
+SELECT spock.alter_subscription_enable('test_subscription_spool', true);
+
+\c :provider_dsn
+INSERT INTO sp_large VALUES (2, repeat('y', 3000000));
+
+\c :subscriber_dsn
+DO $$
+BEGIN
+	FOR i IN 1..300 LOOP
+		EXIT WHEN (SELECT count(*) FROM sp_large) = 2;
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END;
+$$;
+
+SELECT id, length(data) FROM sp_large ORDER BY id;
+
+SELECT spock.drop_subscription('test_subscription_spool');
+ALTER SYSTEM RESET spock.spool_received_changes;
+ALTER SYSTEM RESET spock.partial_messages;
+SELECT pg_reload_conf();
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT * FROM spock.drop_replication_set('spool');
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.sp_data CASCADE;
+	DROP TABLE public.sp_large CASCADE;
+$$);